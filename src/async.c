@@ -0,0 +1,218 @@
+/* miniloop - Messages to an event loop from other threads
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The ring is a bounded multi-producer queue where each cell carries a
+ * sequence number, telling producers and the consumer whose turn it is.
+ * The eventfd of the underlying ml_event watcher is only written by the
+ * producer that flips @armed from zero, i.e., the first message since
+ * the loop last woke up.  The loop clears @armed before draining, so a
+ * message queued after that posts a new wakeup and nothing is missed.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "miniloop.h"
+
+static int empty(ml_async_t *a)
+{
+	ml_async_cell_t *cell = &a->cells[a->head & a->mask];
+
+	return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != a->head + 1;
+}
+
+static void async_cb(ml_t *w, void *arg, int events)
+{
+	ml_async_t *a = arg;
+
+	__atomic_exchange_n(&a->armed, 0, __ATOMIC_SEQ_CST);
+
+	if (a->cb)
+		a->cb(a, a->arg);
+
+	/* Callback stopped the watcher, or left messages for later */
+	if (!ml_async_active(a) || empty(a))
+		return;
+
+	if (!__atomic_exchange_n(&a->armed, 1, __ATOMIC_SEQ_CST))
+		ml_event_post(&a->w);
+}
+
+/**
+ * Create an async watcher
+ * @param ctx   A valid miniloop context
+ * @param a     Pointer to an ml_async_t watcher
+ * @param cb    Callback when messages have been queued
+ * @param arg   Optional callback argument
+ * @param size  Max. number of queued messages, rounded up to a power of two
+ *
+ * Any thread may queue messages, pointers, to the event loop with
+ * ml_async_send().  The first message queued since the loop last ran
+ * the callback costs one eventfd write, the rest none.  The callback
+ * should drain the queue with ml_async_recv(), if it leaves messages
+ * it is called again on the next loop iteration.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_async_init(ml_ctx_t *ctx, ml_async_t *a, ml_async_cb_t *cb, void *arg, size_t size)
+{
+	size_t i, n = 2;
+
+	if (!ctx || !a || !size || size > ((size_t)-1 >> 2)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (n < size)
+		n <<= 1;
+
+	a->cells = malloc(n * sizeof(ml_async_cell_t));
+	if (!a->cells)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		a->cells[i].seq = i;
+	a->mask  = n - 1;
+	a->head  = 0;
+	a->tail  = 0;
+	a->armed = 0;
+	a->ctx   = ctx;
+	a->cb    = cb;
+	a->arg   = arg;
+
+	if (ml_event_init(ctx, &a->w, async_cb, a)) {
+		free(a->cells);
+		a->cells = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Queue a message to an async watcher
+ * @param a    A valid async watcher
+ * @param ptr  Message, any non-NULL pointer
+ *
+ * Safe to call from any thread, lock-free.  Messages queued by one
+ * thread are received in the same order.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error,
+ * %EAGAIN when the queue is full.
+ */
+int ml_async_send(ml_async_t *a, void *ptr)
+{
+	ml_async_cell_t *cell;
+	size_t pos;
+
+	if (!a || !a->cells || !ptr) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pos = __atomic_load_n(&a->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		intptr_t diff;
+		size_t seq;
+
+		cell = &a->cells[pos & a->mask];
+		seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&a->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			errno = EAGAIN;
+			return -1;
+		} else {
+			pos = __atomic_load_n(&a->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	cell->ptr = ptr;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Loop already has a wakeup pending, it will see this message */
+	if (__atomic_exchange_n(&a->armed, 1, __ATOMIC_SEQ_CST))
+		return 0;
+
+	return ml_event_post(&a->w);
+}
+
+/**
+ * Get the next message from an async watcher
+ * @param a  A valid async watcher
+ *
+ * Must only be called from the event loop thread, usually in the
+ * watcher's callback.
+ *
+ * @return The oldest queued message, or %NULL if there is none.
+ */
+void *ml_async_recv(ml_async_t *a)
+{
+	ml_async_cell_t *cell;
+	void *ptr;
+
+	if (!a || !a->cells || empty(a))
+		return NULL;
+
+	cell = &a->cells[a->head & a->mask];
+	ptr  = cell->ptr;
+	__atomic_store_n(&cell->seq, a->head + a->mask + 1, __ATOMIC_RELEASE);
+	a->head++;
+
+	return ptr;
+}
+
+/**
+ * Stop an async watcher and release its queue
+ * @param a  Watcher to stop
+ *
+ * Messages not yet received are dropped.  No thread may send to the
+ * watcher after this, also call it after ml_exit() to free the queue.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_async_stop(ml_async_t *a)
+{
+	if (!a) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ml_event_stop(&a->w))
+		return -1;
+
+	free(a->cells);
+	a->cells = NULL;
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
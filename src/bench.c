@@ -34,16 +34,15 @@
  *
  *     Adaptations for libuEv, no libev/libevent API wrappers available.
  *     Reindent to Linux coding style
+ *
+ *     Ported to the miniloop API.  Added socketpair, timer, event and
+ *     watcher churn modes, repeated runs with percentiles, and CSV or
+ *     JSON output for comparing backends.
  */
 
-#ifdef HAVE_CONFIG_H
-#include "config.h"
-#else
-#define USE_PIPES
-#endif
-
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,7 +54,23 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "uev.h"
+#include "miniloop.h"
+
+typedef enum {
+	MODE_CHAIN,		/* Provos/Libenzi chain of pipes or sockets */
+	MODE_TIMER,		/* Re-arm timers, e.g. idle timeouts */
+	MODE_EVENT,		/* Chain of ml_event_post() */
+	MODE_CHURN,		/* Create and destroy I/O watchers */
+} bench_mode_t;
+
+typedef enum {
+	OUT_TEXT,
+	OUT_CSV,
+	OUT_JSON,
+} output_t;
+
+static const char *modes[] = { "chain", "timer", "event", "churn" };
+static const char *outputs[] = { "text", "csv", "json" };
 
 typedef struct {
 	int index;
@@ -63,12 +78,14 @@ typedef struct {
 
 static int num_pipes, num_active, num_writes;
 static int timers, count, writes, fired;
+static int use_sockets, mode, output;
 static myarg_t *args;
 static int *pipes;
-static uev_t *evio;
-static uev_t *evto;
+static ml_t *evio;
+static ml_t *evto;
+static ml_t *evev;
 
-static void read_cb(uev_t *w, void *arg, int events)
+static void read_cb(ml_t *w, void *arg, int events)
 {
 	int idx, widx;
 	u_char ch;
@@ -77,7 +94,7 @@ static void read_cb(uev_t *w, void *arg, int events)
 	idx  = m->index;
 	widx = idx + 1;
 	if (timers)
-		uev_timer_set(&evto[idx], 10000 + drand48() * 1000, 0);
+		ml_timer_set(&evto[idx], 10000 + drand48() * 1000, 0);
 
 	count += read(w->fd, &ch, sizeof(ch));
 	if (writes) {
@@ -94,136 +111,341 @@ static void read_cb(uev_t *w, void *arg, int events)
 	}
 }
 
-static void timer_cb(uev_t *w, void *arg, int events)
+static void event_cb(ml_t *w, void *arg, int events)
+{
+	myarg_t *m = arg;
+	int widx = m->index + 1;
+
+	count++;
+	if (writes) {
+		if (widx >= num_pipes)
+			widx -= num_pipes;
+
+		if (ml_event_post(&evev[widx])) {
+			perror("ml_event_post()");
+			abort();
+		}
+
+		writes--;
+		fired++;
+	}
+}
+
+static void timer_cb(ml_t *w, void *arg, int events)
 {
 	/* nop */
 }
 
-static struct timeval *run_once(uev_ctx_t *ctx)
+static long usec(struct timeval *tv)
+{
+	return tv->tv_sec * 1000000L + tv->tv_usec;
+}
+
+/* Returns time in usec for the measured part of one run */
+static long run_once(ml_ctx_t *ctx)
 {
 	int *cp, i, space;
-	static struct timeval ta, ts, te;
+	struct timeval ta, ts, te;
 
 	gettimeofday(&ta, NULL);
-	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
-		uev_io_set(&evio[i], cp[0], UEV_READ);
+	if (mode == MODE_CHAIN) {
+		for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
+			ml_io_set(&evio[i], cp[0], MINILOOP_READ);
 
-		if (timers)
-			uev_timer_set(&evto[i], 10000 + drand48() * 1000, 0);
+			if (timers)
+				ml_timer_set(&evto[i], 10000 + drand48() * 1000, 0);
+		}
 	}
 
-	uev_run(ctx, UEV_ONCE | UEV_NONBLOCK);
+	ml_run(ctx, MINILOOP_ONCE | MINILOOP_NONBLOCK);
+
+	gettimeofday(&ts, NULL);
+	switch (mode) {
+	case MODE_CHAIN:
+	case MODE_EVENT:
+		fired = 0;
+		space = num_pipes / num_active;
+		space = space * 2;
+		for (i = 0; i < num_active; i++, fired++) {
+			if (mode == MODE_EVENT) {
+				ml_event_post(&evev[i * space / 2]);
+				continue;
+			}
+
+			if (write(pipes[i * space + 1], "e", 1) < 0) {
+				perror("write()");
+				abort();
+			}
+		}
 
-	fired = 0;
-	space = num_pipes / num_active;
-	space = space * 2;
-	for (i = 0; i < num_active; i++, fired++) {
-		if (write(pipes[i * space + 1], "e", 1) < 0) {
-			perror("write()");
-			abort();
+		count = 0;
+		writes = num_writes;
+		{
+			int xcount = 0;
+
+			do {
+				ml_run(ctx, MINILOOP_ONCE | MINILOOP_NONBLOCK);
+				xcount++;
+			} while (count != fired);
+
+			if (output == OUT_TEXT && xcount != count)
+				fprintf(stderr, "Xcount: %d, Rcount: %d\n", xcount, count);
 		}
+		break;
+
+	case MODE_TIMER:
+		for (i = 0; i < num_writes; i++)
+			ml_timer_set(&evto[i % num_pipes], 10000 + drand48() * 1000, 0);
+		ml_run(ctx, MINILOOP_ONCE | MINILOOP_NONBLOCK);
+		break;
+
+	case MODE_CHURN:
+		for (i = 0; i < num_writes; i++) {
+			ml_t *w = ml_alloc(ctx);
+
+			if (!w || ml_io_init(ctx, w, read_cb, &args[i % num_pipes],
+					     pipes[2 * (i % num_pipes)], MINILOOP_READ)) {
+				perror("ml_io_init()");
+				abort();
+			}
+			ml_free(w);
+
+			/* Let the loop reclaim freed watchers */
+			if (i % 64 == 63)
+				ml_run(ctx, MINILOOP_ONCE | MINILOOP_NONBLOCK);
+		}
+		break;
 	}
+	gettimeofday(&te, NULL);
 
-	count = 0;
-	writes = num_writes;
-	{
-		int xcount = 0;
+	timersub(&te, &ta, &ta);
+	timersub(&te, &ts, &ts);
+	if (output == OUT_TEXT)
+		fprintf(stdout, "%8ld %8ld\n", usec(&ta), usec(&ts));
 
-		gettimeofday(&ts, NULL);
+	return usec(&ts);
+}
 
-		do {
-			uev_run(ctx, UEV_ONCE | UEV_NONBLOCK);
-			xcount++;
-		} while (count != fired);
+static int cmp(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
 
-		gettimeofday(&te, NULL);
+	return x < y ? -1 : x > y;
+}
 
-		if (xcount != count)
-			fprintf(stderr, "Xcount: %d, Rcount: %d\n", xcount, count);
+/* Nearest-rank percentile of sorted samples */
+static long pct(long *v, int n, double p)
+{
+	int rank = (int)ceil(p / 100.0 * n);
+
+	if (rank < 1)
+		rank = 1;
+
+	return v[rank - 1];
+}
+
+static void report(long *v, int n, int flags)
+{
+	const char *backend = (flags & MINILOOP_IO_URING) ? "io_uring" : "epoll";
+	const char *engine  = (flags & MINILOOP_TIMER_HEAP) ? "heap" : "timerfd";
+	const char *transport = use_sockets ? "socketpair" : "pipe";
+	double mean = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		mean += v[i];
+	mean /= n;
+	if (mode == MODE_EVENT)
+		transport = "eventfd";
+	qsort(v, n, sizeof(long), cmp);
+
+	switch (output) {
+	case OUT_CSV:
+		printf("mode,transport,backend,timers,pipes,active,writes,runs,"
+		       "min_us,p50_us,p90_us,p99_us,max_us,mean_us\n");
+		printf("%s,%s,%s,%s,%d,%d,%d,%d,%ld,%ld,%ld,%ld,%ld,%.1f\n",
+		       modes[mode], transport, backend, engine,
+		       num_pipes, num_active, num_writes, n,
+		       v[0], pct(v, n, 50), pct(v, n, 90), pct(v, n, 99), v[n - 1], mean);
+		break;
+
+	case OUT_JSON:
+		printf("{\"mode\": \"%s\", \"transport\": \"%s\", \"backend\": \"%s\", "
+		       "\"timers\": \"%s\", \"pipes\": %d, \"active\": %d, \"writes\": %d, "
+		       "\"runs\": %d, \"min_us\": %ld, \"p50_us\": %ld, \"p90_us\": %ld, "
+		       "\"p99_us\": %ld, \"max_us\": %ld, \"mean_us\": %.1f}\n",
+		       modes[mode], transport, backend, engine,
+		       num_pipes, num_active, num_writes, n,
+		       v[0], pct(v, n, 50), pct(v, n, 90), pct(v, n, 99), v[n - 1], mean);
+		break;
+
+	default:
+		break;
 	}
+}
 
-	timersub(&te, &ta, &ta);
-	timersub(&te, &ts, &ts);
-	fprintf(stdout, "%8ld %8ld\n",
-		ta.tv_sec * 1000000L + ta.tv_usec,
-		ts.tv_sec * 1000000L + ts.tv_usec);
+static int lookup(const char *arg, const char **list, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (!strcmp(arg, list[i]))
+			return i;
+	}
 
-	return &te;
+	fprintf(stderr, "Unknown argument \"%s\"\n", arg);
+	exit(1);
+}
+
+static int usage(int rc)
+{
+	fprintf(stderr,
+		"Usage: bench [-hHstu] [-a NUM] [-m MODE] [-n NUM] [-o FMT] [-r RUNS] [-w NUM]\n"
+		"  -a NUM   Active chains, default 1\n"
+		"  -H       Userspace timer heap, MINILOOP_TIMER_HEAP\n"
+		"  -m MODE  chain (default), timer, event, or churn\n"
+		"  -n NUM   Number of pipes, timers or watchers, default 100\n"
+		"  -o FMT   Output: text (default), csv, or json\n"
+		"  -r RUNS  Measured runs, default 2, one warm-up run is added for csv/json\n"
+		"  -s       Use socketpairs instead of pipes\n"
+		"  -t       Re-arm a timer per pipe on each read, chain mode\n"
+		"  -u       io_uring backend, MINILOOP_IO_URING\n"
+		"  -w NUM   Writes, re-arms, or watchers per run, default -n\n");
+
+	return rc;
 }
 
 int main(int argc, char **argv)
 {
 	struct rlimit rl;
-	int i, c;
+	int i, c, flags = 0, runs = 2;
 	int *cp;
-	uev_ctx_t ctx;
+	long *samples;
+	ml_ctx_t ctx;
 	extern char *optarg;
 
 	num_pipes = 100;
 	num_active = 1;
-	num_writes = num_pipes;
-	while ((c = getopt(argc, argv, "a:n:tw:")) != -1) {
+	num_writes = -1;
+	while ((c = getopt(argc, argv, "a:hHm:n:o:r:stuw:")) != -1) {
 		switch (c) {
 		case 'a':
 			num_active = atoi(optarg);
 			break;
 
+		case 'h':
+			return usage(0);
+
+		case 'H':
+			flags |= MINILOOP_TIMER_HEAP;
+			break;
+
+		case 'm':
+			mode = lookup(optarg, modes, sizeof(modes) / sizeof(modes[0]));
+			break;
+
 		case 'n':
 			num_pipes = atoi(optarg);
 			break;
 
+		case 'o':
+			output = lookup(optarg, outputs, sizeof(outputs) / sizeof(outputs[0]));
+			break;
+
+		case 'r':
+			runs = atoi(optarg);
+			break;
+
+		case 's':
+			use_sockets = 1;
+			break;
+
 		case 't':
 			timers = 1;
 			break;
 
+		case 'u':
+			flags |= MINILOOP_IO_URING;
+			break;
+
 		case 'w':
 			num_writes = atoi(optarg);
 			break;
 
 		default:
-			fprintf(stderr, "Illegal argument \"%c\"\n", c);
-			return 1;
+			return usage(1);
 		}
 	}
 
+	if (num_writes < 0)
+		num_writes = num_pipes;
+	if (num_pipes < 1 || num_active < 1 || num_active > num_pipes || runs < 1)
+		return usage(1);
+	if (mode == MODE_TIMER)
+		timers = 1;
+
 	rl.rlim_cur = rl.rlim_max = num_pipes * 3 + 50;
 	if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
 		perror("setrlimit");
 		return 1;
 	}
 
-	args   = calloc(num_pipes, sizeof(myarg_t));
-	evio   = calloc(num_pipes, sizeof(uev_t));
-	evto   = calloc(num_pipes, sizeof(uev_t));
-	pipes  = calloc(num_pipes * 2, sizeof(int));
-	if (!args || !evio || !evto || !pipes) {
+	args    = calloc(num_pipes, sizeof(myarg_t));
+	evio    = calloc(num_pipes, sizeof(ml_t));
+	evto    = calloc(num_pipes, sizeof(ml_t));
+	evev    = calloc(num_pipes, sizeof(ml_t));
+	pipes   = calloc(num_pipes * 2, sizeof(int));
+	samples = calloc(runs, sizeof(long));
+	if (!args || !evio || !evto || !evev || !pipes || !samples) {
 		perror("calloc");
 		return 1;
 	}
 
-	uev_init(&ctx);
+	if (ml_init1(&ctx, num_pipes < MINILOOP_MAX_EVENTS ? num_pipes : MINILOOP_MAX_EVENTS, flags)) {
+		perror("ml_init1");
+		return 1;
+	}
 
 	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
 		if (timers)
-			uev_timer_init(&ctx, &evto[i], timer_cb, NULL, 0, 0);
+			ml_timer_init(&ctx, &evto[i], timer_cb, NULL, 0, 0);
 		args[i].index = i;
 
-#ifdef USE_PIPES
-		if (pipe2(cp, O_NONBLOCK) == -1) {
-#else
-		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, cp) == -1) {
-#endif
+		if (mode == MODE_EVENT) {
+			if (ml_event_init(&ctx, &evev[i], event_cb, &args[i])) {
+				perror("ml_event_init");
+				exit(1);
+			}
+			continue;
+		}
+
+		if (use_sockets)
+			c = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, cp);
+		else
+			c = pipe2(cp, O_NONBLOCK);
+		if (c == -1) {
 			perror("pipe");
 			exit(1);
 		}
 
-		uev_io_init(&ctx, &evio[i], read_cb, &args[i], cp[0], UEV_READ);
+		if (mode == MODE_CHAIN)
+			ml_io_init(&ctx, &evio[i], read_cb, &args[i], cp[0], MINILOOP_READ);
 	}
 
-	for (i = 0; i < 2; i++)
+	/* Keeps ml_run() iterating, and reclaiming watchers, in churn mode */
+	if (mode == MODE_CHURN)
+		ml_event_init(&ctx, &evev[0], timer_cb, NULL);
+
+	/* Warm up caches and the kernel before the samples we report */
+	if (output != OUT_TEXT)
 		run_once(&ctx);
 
-	return 0;
+	for (i = 0; i < runs; i++)
+		samples[i] = run_once(&ctx);
+
+	report(samples, runs, ctx.flags);
+
+	return ml_exit(&ctx);
 }
 
 /**
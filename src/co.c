@@ -0,0 +1,643 @@
+/* miniloop - Stackful coroutines on I/O, timer and event watchers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * A coroutine runs on its own stack until it has to wait, then it is
+ * parked on one of its watchers and switches back to whoever resumed
+ * it, ml_co_init() or the watcher callback in ml_run().  On x86-64 the
+ * switch only saves the callee-saved registers and swaps the stack
+ * pointer, elsewhere it is swapcontext(), which also costs a system
+ * call for the signal mask.  Nothing is allocated per wait.
+ *
+ * Stacks are mmap()ed with a guard page below them and, at the default
+ * size, kept on a free list in the context when a coroutine ends.
+ *
+ * A descriptor stays registered with %MINILOOP_ONESHOT between waits,
+ * so waiting on it again is one rearm instead of an add and a delete,
+ * and no event is reported while the coroutine does something else.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>		/* CLOCK_MONOTONIC */
+#include <unistd.h>
+
+#include "miniloop.h"
+
+#ifndef __x86_64__
+#include <ucontext.h>
+#endif
+
+/* Free stack, the link is kept at its top */
+struct stack {
+	struct stack   *next;
+	void           *base;
+};
+
+static size_t page_size(void)
+{
+	static size_t page;
+
+	if (!page)
+		page = sysconf(_SC_PAGESIZE);
+
+	return page;
+}
+
+/* Top of the usable stack, the guard page is at co->stack */
+static char *stack_top(ml_co_t *co)
+{
+	return (char *)co->stack + co->size;
+}
+
+static int stack_get(ml_ctx_t *ctx, ml_co_t *co, size_t size)
+{
+	struct stack *s = ctx->co_stacks;
+	size_t page = page_size();
+	void *base;
+
+	if (size == MINILOOP_CO_STACK && s) {
+		ctx->co_stacks = s->next;
+		ctx->co_nstacks--;
+		co->stack = s->base;
+		co->size  = page + size;
+		return 0;
+	}
+
+	size = (size + page - 1) / page * page;
+	base = mmap(NULL, page + size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (base == MAP_FAILED)
+		return -1;
+
+	/* Overflow faults instead of trashing the heap */
+	if (mprotect(base, page, PROT_NONE)) {
+		munmap(base, page + size);
+		return -1;
+	}
+
+	co->stack = base;
+	co->size  = page + size;
+
+	return 0;
+}
+
+static void stack_put(ml_ctx_t *ctx, ml_co_t *co)
+{
+	struct stack *s;
+
+	if (co->size != page_size() + MINILOOP_CO_STACK || ctx->co_nstacks >= MINILOOP_CO_POOL) {
+		munmap(co->stack, co->size);
+	} else {
+		s = (struct stack *)stack_top(co) - 1;
+		s->base = co->stack;
+		s->next = ctx->co_stacks;
+		ctx->co_stacks = s;
+		ctx->co_nstacks++;
+	}
+
+	co->stack = NULL;
+	co->size  = 0;
+}
+
+static void co_entry(ml_co_t *co);
+
+#ifdef __x86_64__
+/*
+ * Save the callee-saved registers of the System V ABI on the current
+ * stack, store its pointer in *save, and continue on the stack in
+ * *load, i.e., return from its switch, or enter the coroutine.
+ */
+void _ml_co_switch(void **save, void **load) __attribute__ ((visibility("hidden")));
+void _ml_co_start(void) __attribute__ ((visibility("hidden")));
+void _ml_co_entry(ml_co_t *co) __attribute__ ((visibility("hidden"), used));
+
+__asm__(
+	"	.text\n"
+	"	.globl	_ml_co_switch\n"
+	"	.hidden	_ml_co_switch\n"
+	"	.type	_ml_co_switch, @function\n"
+	"_ml_co_switch:\n"
+	"	pushq	%rbp\n"
+	"	pushq	%rbx\n"
+	"	pushq	%r12\n"
+	"	pushq	%r13\n"
+	"	pushq	%r14\n"
+	"	pushq	%r15\n"
+	"	movq	%rsp, (%rdi)\n"
+	"	movq	(%rsi), %rsp\n"
+	"	popq	%r15\n"
+	"	popq	%r14\n"
+	"	popq	%r13\n"
+	"	popq	%r12\n"
+	"	popq	%rbx\n"
+	"	popq	%rbp\n"
+	"	ret\n"
+	"	.size	_ml_co_switch, .-_ml_co_switch\n"
+	"\n"
+	/* First switch to a coroutine returns here, with it in %rbx */
+	"	.globl	_ml_co_start\n"
+	"	.hidden	_ml_co_start\n"
+	"	.type	_ml_co_start, @function\n"
+	"_ml_co_start:\n"
+	"	movq	%rbx, %rdi\n"
+	"	call	_ml_co_entry\n"
+	"	ud2\n"
+	"	.size	_ml_co_start, .-_ml_co_start\n");
+
+void _ml_co_entry(ml_co_t *co)
+{
+	co_entry(co);
+}
+
+static void co_switch(void **save, void **load)
+{
+	_ml_co_switch(save, load);
+}
+
+/* A frame for _ml_co_switch() to pop, returning to _ml_co_start() */
+static void co_prepare(ml_co_t *co)
+{
+	uintptr_t top = (uintptr_t)stack_top(co) & ~(uintptr_t)15;
+	void **sp = (void **)top;
+
+	*--sp = (void *)_ml_co_start;
+	*--sp = NULL;		/* %rbp */
+	*--sp = co;		/* %rbx */
+	*--sp = NULL;		/* %r12 */
+	*--sp = NULL;		/* %r13 */
+	*--sp = NULL;		/* %r14 */
+	*--sp = NULL;		/* %r15 */
+
+	co->sp   = sp;
+	co->back = NULL;
+}
+#else
+/* Both contexts are kept at the top of the coroutine's stack */
+static __thread ml_co_t *starting;
+
+static void uc_entry(void)
+{
+	co_entry(starting);
+}
+
+static void co_switch(void **save, void **load)
+{
+	swapcontext(*save, *load);
+}
+
+static void co_prepare(ml_co_t *co)
+{
+	ucontext_t *uc = (ucontext_t *)stack_top(co) - 2;
+
+	getcontext(uc);
+	uc->uc_stack.ss_sp   = (char *)co->stack + page_size();
+	uc->uc_stack.ss_size = (char *)uc - (char *)uc->uc_stack.ss_sp;
+	uc->uc_link          = NULL;
+	makecontext(uc, uc_entry, 0);
+
+	co->sp   = uc;
+	co->back = uc + 1;
+	starting = co;
+}
+#endif
+
+/* No longer waiting on the event watcher, give it back its callback */
+static void unevent(ml_co_t *co)
+{
+	if (!co->event)
+		return;
+
+	co->event->cb  = co->event_cb;
+	co->event->arg = co->event_arg;
+	co->event = NULL;
+}
+
+/* Stop the watchers and release the stack of an ended coroutine */
+static void release(ml_co_t *co)
+{
+	ml_ctx_t *ctx = co->ctx;
+
+	unevent(co);
+	ml_io_stop(&co->io);
+	ml_timer_stop(&co->timer);
+	stack_put(ctx, co);
+
+	if (co->prev)
+		co->prev->next = co->next;
+	else
+		ctx->co = co->next;
+	if (co->next)
+		co->next->prev = co->prev;
+	co->next = co->prev = NULL;
+}
+
+static void co_entry(ml_co_t *co)
+{
+	co->fn(co, co->arg);
+	co->done = 1;
+
+	/* Never resumed again, the stack is released by resume() */
+	co_switch(&co->sp, &co->back);
+}
+
+static void resume(ml_co_t *co)
+{
+	ml_ctx_t *ctx = co->ctx;
+	ml_co_t *prev = ctx->co_current;
+
+	ctx->co_current = co;
+	co->running = 1;
+	co_switch(&co->back, &co->sp);
+	co->running = 0;
+	ctx->co_current = prev;
+
+	if (co->done)
+		release(co);
+}
+
+/* Back to whoever resumed us, until a watcher resumes us again */
+static int park(ml_co_t *co, ml_t *w)
+{
+	co->wait    = w;
+	co->revents = 0;
+	co_switch(&co->sp, &co->back);
+	co->wait    = NULL;
+
+	return co->revents;
+}
+
+static void wake_cb(ml_t *w, void *arg, int events)
+{
+	ml_co_t *co = arg;
+
+	/* Not what the coroutine waits for, e.g. an event left in the batch */
+	if (co->wait != w)
+		return;
+
+	co->revents = events;
+	co->error   = errno;
+	resume(co);
+}
+
+static void event_cb(ml_t *w, void *arg, int events)
+{
+	ml_co_t *co = arg;
+
+	unevent(co);
+	wake_cb(w, arg, events);
+}
+
+static int current(ml_co_t *co)
+{
+	if (!co || !co->ctx || co->ctx->co_current != co) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Park on the I/O watcher, registered for @fd one-shot */
+static int wait_io(ml_co_t *co, int fd, int events)
+{
+	ml_t *w = &co->io;
+
+	events |= MINILOOP_ONESHOT;
+	if (ml_io_active(w) && w->fd == fd) {
+		if (ml_io_set(w, fd, events))
+			return -1;
+	} else {
+		ml_io_stop(w);
+		if (ml_io_init(co->ctx, w, wake_cb, co, fd, events))
+			return -1;
+	}
+
+	/* Never registered, e.g. %EEXIST from the ADD deferred in a callback */
+	if ((park(co, w) & MINILOOP_ERROR) && !ml_io_active(w)) {
+		errno = co->error ? co->error : EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Create and start a coroutine
+ * @param ctx    A valid miniloop context
+ * @param co     Pointer to an ml_co_t
+ * @param fn     Body of the coroutine
+ * @param arg    Optional argument for @param fn
+ * @param stack  Stack size in bytes, zero for %MINILOOP_CO_STACK
+ *
+ * Calls @param fn on a stack of its own, right away, until it waits in
+ * ml_co_read(), ml_co_write(), ml_co_sleep() or ml_co_wait_event().
+ * It is then resumed from ml_run() when its watcher has an event, and
+ * reads like sequential code with no thread of its own.  A coroutine
+ * may start others, they run until they wait, then it continues.
+ *
+ * The stack has a guard page, an overflow is a segfault.  Stacks of
+ * the default size are reused after a coroutine ends, up to
+ * %MINILOOP_CO_POOL of them per context.
+ *
+ * When @param fn returns, ml_co_active() is false and @param co may be
+ * reused or freed, only not from @param fn itself.  Coroutines still
+ * waiting when the context is ml_exit()ed are cancelled.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_co_init(ml_ctx_t *ctx, ml_co_t *co, ml_co_fn_t *fn, void *arg, size_t stack)
+{
+	if (!ctx || !co || !fn) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!stack)
+		stack = MINILOOP_CO_STACK;
+
+	memset(co, 0, sizeof(*co));
+	co->io.fd    = -1;
+	co->timer.fd = -1;
+	co->ctx      = ctx;
+	co->fn       = fn;
+	co->arg      = arg;
+
+	if (stack_get(ctx, co, stack))
+		return -1;
+	co_prepare(co);
+
+	co->next = ctx->co;
+	if (co->next)
+		co->next->prev = co;
+	ctx->co = co;
+
+	resume(co);
+
+	return 0;
+}
+
+/**
+ * Cancel a waiting coroutine
+ * @param co  Coroutine to cancel
+ *
+ * The coroutine is never resumed, its watchers are stopped and its
+ * stack released.  Anything @param co allocated, or descriptors it
+ * opened, are not cleaned up, it is left like a thread that is killed.
+ * A coroutine cannot cancel itself, or one that resumed it, it returns
+ * from its body instead.  Does nothing for an ended coroutine.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_co_cancel(ml_co_t *co)
+{
+	if (!co || !co->ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ml_co_active(co))
+		return 0;
+
+	if (co->running) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	release(co);
+
+	return 0;
+}
+
+/**
+ * Read from a descriptor, from a coroutine
+ * @param co   The calling coroutine
+ * @param fd   Non-blocking descriptor to read from
+ * @param buf  Buffer to read into
+ * @param len  Size of @param buf
+ *
+ * Like read(), but instead of %EAGAIN the coroutine waits until @param
+ * fd is readable.  Returns as soon as there is any data, zero on end of
+ * file.  When done with @param fd, close it with ml_co_close().  A
+ * descriptor can be registered only once per context, for a reader
+ * and a writer coroutine on the same socket give one of them a dup().
+ *
+ * @return Bytes read, or -1 with @param errno set on error.
+ */
+ssize_t ml_co_read(ml_co_t *co, int fd, void *buf, size_t len)
+{
+	ssize_t num;
+
+	if (!current(co))
+		return -1;
+
+	while (1) {
+		num = read(fd, buf, len);
+		if (num >= 0)
+			return num;
+
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		if (wait_io(co, fd, MINILOOP_READ))
+			return -1;
+	}
+}
+
+/**
+ * Write to a descriptor, from a coroutine
+ * @param co   The calling coroutine
+ * @param fd   Non-blocking descriptor to write to
+ * @param buf  Data to write
+ * @param len  Number of bytes in @param buf
+ *
+ * Like write(), but the coroutine waits while @param fd is full, until
+ * all of @param buf is written.  When done with @param fd, close it
+ * with ml_co_close(), see also ml_co_read().
+ *
+ * @return @param len, or -1 with @param errno set on error, in which
+ * case an unknown part of @param buf may have been written.
+ */
+ssize_t ml_co_write(ml_co_t *co, int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+	size_t left = len;
+
+	if (!current(co))
+		return -1;
+
+	while (left) {
+		ssize_t num;
+
+		num = write(fd, ptr, left);
+		if (num >= 0) {
+			ptr  += num;
+			left -= num;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+
+		if (wait_io(co, fd, MINILOOP_WRITE))
+			return -1;
+	}
+
+	return len;
+}
+
+/**
+ * Close a descriptor used by a coroutine
+ * @param co  Coroutine that read from, or wrote to, @param fd
+ * @param fd  Descriptor to close
+ *
+ * Between waits a descriptor stays registered with the kernel, for
+ * the next ml_co_read() or ml_co_write() on it.  Close it with this
+ * instead of close(), so that the registration is not taken over by a
+ * new descriptor with the same number.  Any coroutine, or the code
+ * outside of one, may close it.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_co_close(ml_co_t *co, int fd)
+{
+	if (!co || !co->ctx || fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ml_io_active(&co->io) && co->io.fd == fd)
+		ml_io_stop(&co->io);
+
+	return close(fd);
+}
+
+/**
+ * Sleep, from a coroutine
+ * @param co    The calling coroutine
+ * @param msec  Milliseconds to sleep, zero to only let the loop run
+ *
+ * The time counts from when the loop woke up, see ml_now().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_co_sleep(ml_co_t *co, int msec)
+{
+	uint64_t ns = msec ? msec * 1000000ULL : 1;
+	int rc;
+
+	if (!current(co))
+		return -1;
+
+	if (msec < 0) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	if (co->timer.ctx)
+		rc = ml_timer_set_ns(&co->timer, ns, 0, 0);
+	else
+		rc = ml_timer_init_ns(co->ctx, &co->timer, wake_cb, co, CLOCK_MONOTONIC, ns, 0, 0);
+	if (rc)
+		return -1;
+
+	if (park(co, &co->timer) & MINILOOP_ERROR) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Wait for an event, from a coroutine
+ * @param co  The calling coroutine
+ * @param w   A started event watcher, see ml_event_init()
+ *
+ * Waits until ml_event_post() is called for @param w.  Meanwhile
+ * @param w is taken over, the event wakes up the coroutine instead of
+ * calling the watcher's callback, which is restored when it does.  One
+ * coroutine at a time can wait on a watcher.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_co_wait_event(ml_co_t *co, ml_t *w)
+{
+	if (!current(co))
+		return -1;
+
+	if (!w || w->type != MINILOOP_EVENT_TYPE || !ml_event_active(w)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (w->cb == event_cb) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	co->event     = w;
+	co->event_cb  = (ml_cb_t *)w->cb;
+	co->event_arg = w->arg;
+	w->cb         = event_cb;
+	w->arg        = co;
+
+	if (park(co, w) & MINILOOP_HUP) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Private to miniloop, do not use directly!  Cancel coroutines, free stacks */
+void _ml_co_exit(ml_ctx_t *ctx)
+{
+	ml_co_t *co, *next;
+
+	/* Those that are running end when we return to them */
+	for (co = ctx->co; co; co = next) {
+		next = co->next;
+		if (!co->running)
+			release(co);
+	}
+
+	while (ctx->co_stacks) {
+		struct stack *s = ctx->co_stacks;
+
+		ctx->co_stacks = s->next;
+		munmap(s->base, page_size() + MINILOOP_CO_STACK);
+	}
+	ctx->co_nstacks = 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,296 @@
+/* miniloop - Reading files in large chunks
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * By default the reader is a plain I/O watcher, a regular file is on
+ * the always ready list and gets one read() per loop iteration, a pipe
+ * or a terminal one per wakeup.  With read-ahead, regular files only,
+ * there are two buffers: when a pread() on a worker of the ml_fs_*()
+ * pool completes, the next one is submitted into the other buffer
+ * before the callback is called with the first, so the disk is busy
+ * while the callback works.  Only one request is in flight at a time,
+ * the buffers are not freed until it has completed.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "miniloop.h"
+
+static void deliver(ml_file_t *f, const char *buf, ssize_t len)
+{
+	/* End of file, or an error, nothing more to read */
+	if (len <= 0)
+		ml_file_stop(f);
+
+	if (f->cb)
+		f->cb(f, f->arg, buf, len);
+}
+
+static void finish(ml_file_t *f)
+{
+	free(f->buf[0]);
+	free(f->buf[1]);
+	f->buf[0] = f->buf[1] = NULL;
+	f->closing = 0;
+
+	ml_close(&f->w, f->close_cb);
+}
+
+static void ahead_cb(ml_fs_t *req);
+
+static int submit(ml_file_t *f)
+{
+	if (ml_fs_read(f->ctx, &f->req, f->w.fd, f->buf[f->cur], f->size, f->off, ahead_cb, f))
+		return -1;
+	f->inflight = 1;
+
+	return 0;
+}
+
+static void ahead_cb(ml_fs_t *req)
+{
+	ml_file_t *f = req->arg;
+	char *buf = f->buf[f->cur];
+	ssize_t len = req->result;
+	int err = 0;
+
+	f->inflight = 0;
+	if (f->closing) {
+		finish(f);
+		return;
+	}
+
+	/* Stopped meanwhile, read again at the same offset when started */
+	if (!f->reading)
+		return;
+
+	if (len < 0) {
+		errno = req->error;
+	} else if (len > 0) {
+		f->off += len;
+		f->cur ^= 1;
+		if (submit(f))
+			err = errno;
+	}
+
+	deliver(f, buf, len);
+	if (err && f->reading) {
+		errno = err;
+		deliver(f, NULL, -1);
+	}
+}
+
+static void file_cb(ml_t *w, void *arg, int events)
+{
+	ml_file_t *f = arg;
+	ssize_t len;
+
+	do {
+		do
+			len = read(w->fd, f->buf[0], f->size);
+		while (len < 0 && errno == EINTR);
+
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		deliver(f, f->buf[0], len);
+
+		/* After a hang-up the watcher is stopped, read what is left */
+	} while ((events & MINILOOP_HUP) && len > 0 && f->reading);
+}
+
+/**
+ * Create a file reader
+ * @param ctx    A valid miniloop context
+ * @param f      Pointer to an ml_file_t
+ * @param cb     Callback with each chunk read, end of file and errors
+ * @param arg    Optional callback argument
+ * @param fd     Descriptor to read, e.g. %STDIN_FILENO
+ * @param size   Bytes per read, zero for %MINILOOP_FILE_CHUNK
+ * @param flags  %MINILOOP_FILE_READAHEAD, or zero
+ *
+ * Reads @param fd from its current position until end of file, calling
+ * @param cb with up to @param size bytes at a time.  Works with any
+ * descriptor, a regular file is read once per loop iteration, without
+ * blocking the other watchers, a pipe whenever it has data.  For batch
+ * jobs like `application < file.txt` a large @param size keeps the
+ * number of system calls and callbacks down.
+ *
+ * With %MINILOOP_FILE_READAHEAD a regular file is read with pread() by
+ * the worker threads of ml_fs_read(), the next chunk while @param cb
+ * handles the current one, the file position is not moved.  Ignored
+ * for other descriptors.
+ *
+ * The reader is stopped at end of file, or on error.  @param fd is not
+ * closed by miniloop, the buffers are released with ml_file_close().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_file_init(ml_ctx_t *ctx, ml_file_t *f, ml_file_cb_t *cb, void *arg, int fd, size_t size, int flags)
+{
+	struct stat st;
+
+	if (!ctx || !f || !cb || fd < 0 || (flags & ~MINILOOP_FILE_READAHEAD)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!size)
+		size = MINILOOP_FILE_CHUNK;
+
+	f->ctx      = ctx;
+	f->cb       = cb;
+	f->arg      = arg;
+	f->size     = size;
+	f->cur      = 0;
+	f->off      = -1;
+	f->reading  = 1;
+	f->inflight = 0;
+	f->closing  = 0;
+	f->close_cb = NULL;
+	f->buf[1]   = NULL;
+
+	if ((flags & MINILOOP_FILE_READAHEAD) && !fstat(fd, &st) && S_ISREG(st.st_mode))
+		f->off = lseek(fd, 0, SEEK_CUR);
+
+	f->buf[0] = malloc(size);
+	if (f->off >= 0)
+		f->buf[1] = malloc(size);
+	if (!f->buf[0] || (f->off >= 0 && !f->buf[1]))
+		goto fail;
+
+	if (f->off < 0) {
+		if (ml_io_init(ctx, &f->w, file_cb, f, fd, MINILOOP_READ))
+			goto fail;
+		return 0;
+	}
+
+	/* Never started, only for ml_close() */
+	if (_ml_watcher_init(ctx, &f->w, MINILOOP_IO_TYPE, file_cb, f, fd, MINILOOP_READ))
+		goto fail;
+	f->w.u.e.track  = 0;
+	f->w.u.e.always = 0;
+	f->w.u.e.pprev  = NULL;
+
+	if (submit(f))
+		goto fail;
+
+	return 0;
+fail:
+	free(f->buf[0]);
+	free(f->buf[1]);
+	f->buf[0] = f->buf[1] = NULL;
+	f->reading = 0;
+
+	return -1;
+}
+
+/**
+ * Resume a stopped file reader
+ * @param f  Reader to start
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_file_start(ml_file_t *f)
+{
+	if (!f || !f->buf[0] || f->closing) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (f->reading)
+		return 0;
+	f->reading = 1;
+
+	if (f->off < 0)
+		return ml_io_start(&f->w);
+
+	/* The read in flight is delivered when it completes */
+	if (f->inflight)
+		return 0;
+
+	return submit(f);
+}
+
+/**
+ * Stop a file reader
+ * @param f  Reader to stop
+ *
+ * Nothing is lost, the next chunk is read when the reader is started
+ * again, also with a read-ahead in flight.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_file_stop(ml_file_t *f)
+{
+	if (!f || !f->buf[0]) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	f->reading = 0;
+	if (f->off < 0)
+		return ml_io_stop(&f->w);
+
+	return 0;
+}
+
+/**
+ * Stop a file reader, release its buffers, and free it later
+ * @param f   Reader to close
+ * @param cb  Called when @param f may be freed, with &f->w, or %NULL
+ *
+ * Like ml_close(), but with a read-ahead in flight the buffers are
+ * released, and @param cb is called, once it has completed.  Requests
+ * in flight are dropped by ml_exit(), call this again after it.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_file_close(ml_file_t *f, ml_close_cb_t *cb)
+{
+	if (!f || !f->buf[0]) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ml_file_stop(f);
+	f->close_cb = cb;
+
+	/* The worker still writes to a buffer, unless ml_exit() dropped it */
+	if (f->inflight && f->ctx->fs) {
+		f->closing = 1;
+		return 0;
+	}
+
+	finish(f);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
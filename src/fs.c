@@ -0,0 +1,1208 @@
+/* miniloop - Asynchronous file system requests
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Requests are queued to a fixed pool of worker threads, created when
+ * the first request is submitted.  Workers put finished requests on a
+ * completion list and only signal the context's eventfd when the list
+ * was empty, so one wakeup of the event loop runs the callbacks of all
+ * requests completed since the last one.  The eventfd watcher is only
+ * active while requests are in flight, it does not keep ml_run() alive.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>		/* PATH_MAX */
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "miniloop.h"
+
+struct ml_fs_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	int             stop;
+
+	/* Queued requests, and requests completed by workers */
+	ml_fs_t        *head, **tail;
+	ml_fs_t        *done, **done_tail;
+
+	/* Submitted, but callback not yet called */
+	int             inflight;
+
+	pthread_t       threads[MINILOOP_FS_THREADS];
+	int             nthreads;
+
+	/* Completion eventfd */
+	ml_t            w;
+};
+
+/*
+ * Move up to @len bytes in the kernel, from a file with sendfile(2),
+ * or from a pipe with splice(2).  Returns 0 at end of file.  On the
+ * worker pool, @nonblock is zero and a splice(2) waits for the pipe.
+ */
+static ssize_t fs_transfer(ml_fs_t *req, size_t len, int nonblock)
+{
+	off_t *off = req->off < 0 ? NULL : &req->off;
+
+	if (req->splice)
+		return splice(req->fd, NULL, req->out_fd, NULL, len,
+			      SPLICE_F_MOVE | (nonblock ? SPLICE_F_NONBLOCK : 0));
+
+	return sendfile(req->out_fd, req->fd, off, len);
+}
+
+/* Bytes left to send, with len zero meaning until end of file */
+static size_t fs_remaining(ml_fs_t *req)
+{
+	if (!req->len)
+		return MINILOOP_SENDFILE_CHUNK;
+
+	return req->len - req->result;
+}
+
+/* Blocking copy between two files, on a worker thread */
+static ssize_t fs_copy(int in, int out, size_t len)
+{
+	ssize_t total = 0;
+	int fallback = 0;
+
+	while ((size_t)total < len) {
+		ssize_t n;
+
+		if (!fallback) {
+			n = copy_file_range(in, NULL, out, NULL, len - total, 0);
+			if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+				      errno == EOPNOTSUPP)) {
+				fallback = 1;
+				continue;
+			}
+		} else {
+			n = sendfile(out, in, NULL, len - total);
+		}
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+
+		total += n;
+	}
+
+	return total;
+}
+
+static ssize_t fs_copyfile(ml_fs_t *req)
+{
+	struct stat st;
+	int in, out, flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	ssize_t rc;
+
+	in = open(req->path, O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return -1;
+
+	if (fstat(in, &st)) {
+		rc = -1;
+		goto done;
+	}
+
+	if (req->flags & ML_FS_COPYFILE_EXCL)
+		flags |= O_EXCL;
+
+	out = open(req->new_path, flags, st.st_mode & 07777);
+	if (out < 0) {
+		rc = -1;
+		goto done;
+	}
+
+	rc = fs_copy(in, out, st.st_size);
+	if (rc >= 0 && fchmod(out, st.st_mode & 07777))
+		rc = -1;
+
+	if (close(out) && rc >= 0)
+		rc = -1;
+done:
+	if (rc < 0) {
+		int err = errno;
+
+		close(in);
+		errno = err;
+		return -1;
+	}
+	close(in);
+
+	return rc;
+}
+
+static void fs_run(ml_fs_t *req)
+{
+	struct timespec ts[2];
+	ssize_t rc = 0;
+
+	switch (req->type) {
+	case ML_FS_CUSTOM:
+		req->work(req);
+		return;
+
+	case ML_FS_OPEN:
+		rc = open(req->path, req->flags | O_CLOEXEC, req->mode);
+		break;
+
+	case ML_FS_CLOSE:
+		rc = close(req->fd);
+		break;
+
+	case ML_FS_READ:
+		if (req->off < 0)
+			rc = read(req->fd, req->buf, req->len);
+		else
+			rc = pread(req->fd, req->buf, req->len, req->off);
+		break;
+
+	case ML_FS_WRITE:
+		if (req->off < 0)
+			rc = write(req->fd, req->buf, req->len);
+		else
+			rc = pwrite(req->fd, req->buf, req->len, req->off);
+		break;
+
+	case ML_FS_STAT:
+		rc = stat(req->path, &req->statbuf);
+		break;
+
+	case ML_FS_LSTAT:
+		rc = lstat(req->path, &req->statbuf);
+		break;
+
+	case ML_FS_FSTAT:
+		rc = fstat(req->fd, &req->statbuf);
+		break;
+
+	case ML_FS_FTRUNCATE:
+		rc = ftruncate(req->fd, req->off);
+		break;
+
+	case ML_FS_UTIME:
+	case ML_FS_FUTIME:
+		ts[0].tv_sec  = (time_t)req->atime;
+		ts[0].tv_nsec = (long)((req->atime - ts[0].tv_sec) * 1e9);
+		ts[1].tv_sec  = (time_t)req->mtime;
+		ts[1].tv_nsec = (long)((req->mtime - ts[1].tv_sec) * 1e9);
+		if (req->type == ML_FS_UTIME)
+			rc = utimensat(AT_FDCWD, req->path, ts, 0);
+		else
+			rc = futimens(req->fd, ts);
+		break;
+
+	case ML_FS_ACCESS:
+		rc = access(req->path, req->mode);
+		break;
+
+	case ML_FS_CHMOD:
+		rc = chmod(req->path, req->mode);
+		break;
+
+	case ML_FS_FCHMOD:
+		rc = fchmod(req->fd, req->mode);
+		break;
+
+	case ML_FS_FSYNC:
+		rc = fsync(req->fd);
+		break;
+
+	case ML_FS_FDATASYNC:
+		rc = fdatasync(req->fd);
+		break;
+
+	case ML_FS_UNLINK:
+		rc = unlink(req->path);
+		break;
+
+	case ML_FS_RMDIR:
+		rc = rmdir(req->path);
+		break;
+
+	case ML_FS_MKDIR:
+		rc = mkdir(req->path, req->mode);
+		break;
+
+	case ML_FS_MKDTEMP:
+		rc = mkdtemp(req->path) ? 0 : -1;
+		break;
+
+	case ML_FS_MKSTEMP:
+		rc = mkostemp(req->path, O_CLOEXEC);
+		break;
+
+	case ML_FS_RENAME:
+		rc = rename(req->path, req->new_path);
+		break;
+
+	case ML_FS_SCANDIR:
+		rc = scandir(req->path, (struct dirent ***)&req->ptr, NULL, alphasort);
+		break;
+
+	case ML_FS_LINK:
+		rc = link(req->path, req->new_path);
+		break;
+
+	case ML_FS_SYMLINK:
+		rc = symlink(req->path, req->new_path);
+		break;
+
+	case ML_FS_READLINK:
+		req->ptr = malloc(PATH_MAX);
+		if (!req->ptr) {
+			rc = -1;
+			break;
+		}
+
+		rc = readlink(req->path, req->ptr, PATH_MAX - 1);
+		if (rc >= 0)
+			((char *)req->ptr)[rc] = 0;
+		break;
+
+	case ML_FS_REALPATH:
+		req->ptr = realpath(req->path, NULL);
+		rc = req->ptr ? 0 : -1;
+		break;
+
+	case ML_FS_CHOWN:
+		rc = chown(req->path, req->uid, req->gid);
+		break;
+
+	case ML_FS_FCHOWN:
+		rc = fchown(req->fd, req->uid, req->gid);
+		break;
+
+	case ML_FS_LCHOWN:
+		rc = lchown(req->path, req->uid, req->gid);
+		break;
+
+	case ML_FS_OPENDIR:
+		req->ptr = opendir(req->path);
+		rc = req->ptr ? 0 : -1;
+		break;
+
+	case ML_FS_READDIR:
+		errno = 0;
+		req->ptr = readdir(req->dir);
+		if (req->ptr)
+			rc = 1;
+		else
+			rc = errno ? -1 : 0;
+		break;
+
+	case ML_FS_CLOSEDIR:
+		rc = closedir(req->dir);
+		break;
+
+	case ML_FS_SENDFILE:
+		/* Destination is a regular file, may block */
+		req->result = 0;
+		while (1) {
+			rc = fs_transfer(req, fs_remaining(req), 0);
+			if (rc < 0 && errno == EINTR)
+				continue;
+
+			/* A non-blocking pipe as source, wait for the writer */
+			if (rc < 0 && req->splice && errno == EAGAIN) {
+				struct pollfd pfd = { .fd = req->fd, .events = POLLIN };
+
+				if (poll(&pfd, 1, -1) >= 0 || errno == EINTR)
+					continue;
+				break;
+			}
+			if (rc <= 0)
+				break;
+
+			req->result += rc;
+			if (req->len && (size_t)req->result == req->len)
+				break;
+		}
+		if (rc >= 0)
+			rc = req->result;
+		break;
+
+	case ML_FS_COPYFILE:
+		rc = fs_copyfile(req);
+		break;
+
+	default:
+		errno = ENOSYS;
+		rc = -1;
+		break;
+	}
+
+	req->result = rc;
+	req->error  = rc < 0 ? errno : 0;
+}
+
+static void *fs_worker(void *arg)
+{
+	struct ml_fs_pool *pool = arg;
+	uint64_t val = 1;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		ml_fs_t *req = pool->head;
+		int wakeup;
+
+		if (!req) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		pool->head = req->next;
+		if (!pool->head)
+			pool->tail = &pool->head;
+		pthread_mutex_unlock(&pool->lock);
+
+		fs_run(req);
+
+		pthread_mutex_lock(&pool->lock);
+		req->next = NULL;
+		wakeup = !pool->done;
+		*pool->done_tail = req;
+		pool->done_tail = &req->next;
+
+		/* Only the first completion since the loop last drained */
+		if (wakeup) {
+			if (write(pool->w.fd, &val, sizeof(val)) != sizeof(val)) {
+				/* Counter saturated, loop is already woken up */
+			}
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* Runs on the event loop, the eventfd has already been read by ml_run() */
+static void fs_done_cb(ml_t *w, void *arg, int events)
+{
+	struct ml_fs_pool *pool = arg;
+	ml_ctx_t *ctx = w->ctx;
+	ml_fs_t *req;
+
+	pthread_mutex_lock(&pool->lock);
+	req = pool->done;
+	pool->done = NULL;
+	pool->done_tail = &pool->done;
+	pthread_mutex_unlock(&pool->lock);
+
+	while (req) {
+		ml_fs_t *next = req->next;
+
+		pool->inflight--;
+
+		/* The callback may resubmit, or free, the request */
+		if (req->cb)
+			req->cb(req);
+
+		/* Callback called ml_exit() */
+		if (ctx->fs != pool)
+			return;
+
+		req = next;
+	}
+
+	/* Let ml_run() terminate when no more requests are pending */
+	if (!pool->inflight)
+		_ml_watcher_stop(&pool->w);
+}
+
+static struct ml_fs_pool *fs_pool(ml_ctx_t *ctx)
+{
+	struct ml_fs_pool *pool;
+	sigset_t all, old;
+	int fd, i, rc = 0;
+
+	if (ctx->fs)
+		return ctx->fs;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		goto fail;
+
+	if (_ml_watcher_init(ctx, &pool->w, MINILOOP_FS_TYPE, fs_done_cb, pool, fd, MINILOOP_READ))
+		goto fail_fd;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->tail      = &pool->head;
+	pool->done_tail = &pool->done;
+
+	/* Signals must be delivered to the loop's signalfd, never here */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i = 0; i < MINILOOP_FS_THREADS; i++) {
+		rc = pthread_create(&pool->threads[i], NULL, fs_worker, pool);
+		if (rc)
+			break;
+		pool->nthreads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (!pool->nthreads) {
+		pthread_cond_destroy(&pool->cond);
+		pthread_mutex_destroy(&pool->lock);
+		errno = rc;
+		goto fail_fd;
+	}
+
+	ctx->fs = pool;
+
+	return pool;
+fail_fd:
+	close(fd);
+fail:
+	free(pool);
+
+	return NULL;
+}
+
+/* Private to miniloop, do not use directly! */
+int _ml_fs_exit(ml_ctx_t *ctx)
+{
+	struct ml_fs_pool *pool = ctx->fs;
+	int i;
+
+	if (!pool)
+		return 0;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	_ml_watcher_stop(&pool->w);
+	close(pool->w.fd);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	ctx->fs = NULL;
+
+	return 0;
+}
+
+static int fs_init(ml_ctx_t *ctx, ml_fs_t *req, ml_fs_type type, ml_fs_cb_t *cb, void *arg)
+{
+	if (!ctx || !req) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(req, 0, sizeof(*req));
+	req->ctx  = ctx;
+	req->type = type;
+	req->cb   = cb;
+	req->arg  = arg;
+	req->fd   = -1;
+	req->off  = -1;
+
+	return 0;
+}
+
+static int fs_path(ml_fs_t *req, const char *path, const char *new_path)
+{
+	if (!path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	req->path = strdup(path);
+	if (!req->path)
+		return -1;
+
+	if (new_path) {
+		req->new_path = strdup(new_path);
+		if (!req->new_path) {
+			free(req->path);
+			req->path = NULL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Submit a file system request
+ * @param req  Request set up with the arguments for its @param req->type
+ *
+ * This is what all the ml_fs_*() functions below use, it is exposed for
+ * resubmitting a request from its own callback, e.g. the next pread()
+ * of a file.  Do not modify @param req until its callback is called.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fs_submit(ml_fs_t *req)
+{
+	struct ml_fs_pool *pool;
+
+	if (!req || !req->ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pool = fs_pool(req->ctx);
+	if (!pool)
+		return -1;
+
+	if (pool->inflight++ == 0 && _ml_watcher_start(&pool->w)) {
+		pool->inflight--;
+		return -1;
+	}
+
+	req->next = NULL;
+	pthread_mutex_lock(&pool->lock);
+	*pool->tail = req;
+	pool->tail  = &req->next;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/**
+ * Free any memory associated with a completed request
+ * @param req  Request, after its callback has been called
+ *
+ * Releases the copies of path names made at submit, and any result
+ * allocated by the request, i.e., @param req->ptr for %ML_FS_READLINK,
+ * %ML_FS_REALPATH and %ML_FS_SCANDIR.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fs_cleanup(ml_fs_t *req)
+{
+	if (!req) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (req->type == ML_FS_SCANDIR && req->ptr) {
+		struct dirent **list = req->ptr;
+		ssize_t i;
+
+		for (i = 0; i < req->result; i++)
+			free(list[i]);
+	}
+
+	switch (req->type) {
+	case ML_FS_READLINK:
+	case ML_FS_REALPATH:
+	case ML_FS_SCANDIR:
+		free(req->ptr);
+		req->ptr = NULL;
+		break;
+
+	default:
+		break;
+	}
+
+	free(req->path);
+	free(req->new_path);
+	req->path = req->new_path = NULL;
+
+	return 0;
+}
+
+/**
+ * Run a custom function on the worker pool
+ * @param ctx   A valid miniloop context
+ * @param req   Pointer to an ml_fs_t request
+ * @param work  Function to call in a worker thread
+ * @param cb    Callback, on the event loop, when @param work has returned
+ * @param arg   Optional callback argument
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fs_custom(ml_ctx_t *ctx, ml_fs_t *req, void (*work)(ml_fs_t *), ml_fs_cb_t *cb, void *arg)
+{
+	if (!work || fs_init(ctx, req, ML_FS_CUSTOM, cb, arg)) {
+		errno = EINVAL;
+		return -1;
+	}
+	req->work = work;
+
+	return ml_fs_submit(req);
+}
+
+/* Requests operating on a path name */
+static int fs_path_req(ml_ctx_t *ctx, ml_fs_t *req, ml_fs_type type, const char *path,
+		       const char *new_path, mode_t mode, ml_fs_cb_t *cb, void *arg)
+{
+	if (fs_init(ctx, req, type, cb, arg) || fs_path(req, path, new_path))
+		return -1;
+	req->mode = mode;
+
+	if (ml_fs_submit(req)) {
+		ml_fs_cleanup(req);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Requests operating on a file descriptor */
+static int fs_fd_req(ml_ctx_t *ctx, ml_fs_t *req, ml_fs_type type, int fd,
+		     ml_fs_cb_t *cb, void *arg)
+{
+	if (fs_init(ctx, req, type, cb, arg))
+		return -1;
+	req->fd = fd;
+
+	return ml_fs_submit(req);
+}
+
+/**
+ * Open a file, see open(2)
+ * @param ctx    A valid miniloop context
+ * @param req    Pointer to an ml_fs_t request
+ * @param path   File to open
+ * @param flags  Flags to open(2), O_CLOEXEC is always set
+ * @param mode   Permissions when creating a file
+ * @param cb     Callback, @param req->result holds the new descriptor
+ * @param arg    Optional callback argument
+ *
+ * All requests in this family complete with @param req->result holding
+ * the return value of the system call and @param req->error its errno.
+ * Path names are copied, and must be released with ml_fs_cleanup().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fs_open(ml_ctx_t *ctx, ml_fs_t *req, const char *path, int flags, mode_t mode, ml_fs_cb_t *cb, void *arg)
+{
+	if (fs_init(ctx, req, ML_FS_OPEN, cb, arg) || fs_path(req, path, NULL))
+		return -1;
+	req->flags = flags;
+	req->mode  = mode;
+
+	if (ml_fs_submit(req)) {
+		ml_fs_cleanup(req);
+		return -1;
+	}
+
+	return 0;
+}
+
+int ml_fs_close(ml_ctx_t *ctx, ml_fs_t *req, int fd, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_fd_req(ctx, req, ML_FS_CLOSE, fd, cb, arg);
+}
+
+/**
+ * Read from, or write to, a file, see pread(2) and pwrite(2)
+ * @param ctx  A valid miniloop context
+ * @param req  Pointer to an ml_fs_t request
+ * @param fd   File descriptor
+ * @param buf  Buffer, must be valid until @param cb is called
+ * @param len  Number of bytes to read or write
+ * @param off  File offset, or -1 to use, and update, the current offset
+ * @param cb   Callback, @param req->result holds the number of bytes
+ * @param arg  Optional callback argument
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fs_read(ml_ctx_t *ctx, ml_fs_t *req, int fd, void *buf, size_t len, off_t off, ml_fs_cb_t *cb, void *arg)
+{
+	if (fs_init(ctx, req, ML_FS_READ, cb, arg))
+		return -1;
+	req->fd  = fd;
+	req->buf = buf;
+	req->len = len;
+	req->off = off;
+
+	return ml_fs_submit(req);
+}
+
+int ml_fs_write(ml_ctx_t *ctx, ml_fs_t *req, int fd, const void *buf, size_t len, off_t off, ml_fs_cb_t *cb, void *arg)
+{
+	if (fs_init(ctx, req, ML_FS_WRITE, cb, arg))
+		return -1;
+	req->fd  = fd;
+	req->buf = (void *)buf;
+	req->len = len;
+	req->off = off;
+
+	return ml_fs_submit(req);
+}
+
+/*
+ * The stat family completes with the result in @param req->statbuf
+ */
+int ml_fs_stat(ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_STAT, path, NULL, 0, cb, arg);
+}
+
+int ml_fs_lstat(ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_LSTAT, path, NULL, 0, cb, arg);
+}
+
+int ml_fs_fstat(ml_ctx_t *ctx, ml_fs_t *req, int fd, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_fd_req(ctx, req, ML_FS_FSTAT, fd, cb, arg);
+}
+
+int ml_fs_ftruncate(ml_ctx_t *ctx, ml_fs_t *req, int fd, off_t len, ml_fs_cb_t *cb, void *arg)
+{
+	if (fs_init(ctx, req, ML_FS_FTRUNCATE, cb, arg))
+		return -1;
+	req->fd  = fd;
+	req->off = len;
+
+	return ml_fs_submit(req);
+}
+
+/*
+ * Times are in seconds since the Epoch, with sub-second precision
+ */
+int ml_fs_utime(ml_ctx_t *ctx, ml_fs_t *req, const char *path, double atime, double mtime, ml_fs_cb_t *cb, void *arg)
+{
+	if (fs_init(ctx, req, ML_FS_UTIME, cb, arg) || fs_path(req, path, NULL))
+		return -1;
+	req->atime = atime;
+	req->mtime = mtime;
+
+	if (ml_fs_submit(req)) {
+		ml_fs_cleanup(req);
+		return -1;
+	}
+
+	return 0;
+}
+
+int ml_fs_futime(ml_ctx_t *ctx, ml_fs_t *req, int fd, double atime, double mtime, ml_fs_cb_t *cb, void *arg)
+{
+	if (fs_init(ctx, req, ML_FS_FUTIME, cb, arg))
+		return -1;
+	req->fd    = fd;
+	req->atime = atime;
+	req->mtime = mtime;
+
+	return ml_fs_submit(req);
+}
+
+int ml_fs_access(ml_ctx_t *ctx, ml_fs_t *req, const char *path, int mode, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_ACCESS, path, NULL, mode, cb, arg);
+}
+
+int ml_fs_chmod(ml_ctx_t *ctx, ml_fs_t *req, const char *path, mode_t mode, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_CHMOD, path, NULL, mode, cb, arg);
+}
+
+int ml_fs_fchmod(ml_ctx_t *ctx, ml_fs_t *req, int fd, mode_t mode, ml_fs_cb_t *cb, void *arg)
+{
+	if (fs_init(ctx, req, ML_FS_FCHMOD, cb, arg))
+		return -1;
+	req->fd   = fd;
+	req->mode = mode;
+
+	return ml_fs_submit(req);
+}
+
+int ml_fs_fsync(ml_ctx_t *ctx, ml_fs_t *req, int fd, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_fd_req(ctx, req, ML_FS_FSYNC, fd, cb, arg);
+}
+
+int ml_fs_fdatasync(ml_ctx_t *ctx, ml_fs_t *req, int fd, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_fd_req(ctx, req, ML_FS_FDATASYNC, fd, cb, arg);
+}
+
+int ml_fs_unlink(ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_UNLINK, path, NULL, 0, cb, arg);
+}
+
+int ml_fs_rmdir(ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_RMDIR, path, NULL, 0, cb, arg);
+}
+
+int ml_fs_mkdir(ml_ctx_t *ctx, ml_fs_t *req, const char *path, mode_t mode, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_MKDIR, path, NULL, mode, cb, arg);
+}
+
+/*
+ * The template, ending in XXXXXX, is copied and the copy in
+ * @param req->path holds the name of the new directory, or file.
+ */
+int ml_fs_mkdtemp(ml_ctx_t *ctx, ml_fs_t *req, const char *tpl, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_MKDTEMP, tpl, NULL, 0, cb, arg);
+}
+
+int ml_fs_mkstemp(ml_ctx_t *ctx, ml_fs_t *req, const char *tpl, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_MKSTEMP, tpl, NULL, 0, cb, arg);
+}
+
+int ml_fs_rename(ml_ctx_t *ctx, ml_fs_t *req, const char *path, const char *new_path, ml_fs_cb_t *cb, void *arg)
+{
+	if (!new_path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return fs_path_req(ctx, req, ML_FS_RENAME, path, new_path, 0, cb, arg);
+}
+
+/*
+ * Completes with an alphabetically sorted array of @param req->result
+ * struct dirent pointers in @param req->ptr, see scandir(3).
+ */
+int ml_fs_scandir(ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_SCANDIR, path, NULL, 0, cb, arg);
+}
+
+int ml_fs_link(ml_ctx_t *ctx, ml_fs_t *req, const char *path, const char *new_path, ml_fs_cb_t *cb, void *arg)
+{
+	if (!new_path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return fs_path_req(ctx, req, ML_FS_LINK, path, new_path, 0, cb, arg);
+}
+
+int ml_fs_symlink(ml_ctx_t *ctx, ml_fs_t *req, const char *path, const char *new_path, ml_fs_cb_t *cb, void *arg)
+{
+	if (!new_path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return fs_path_req(ctx, req, ML_FS_SYMLINK, path, new_path, 0, cb, arg);
+}
+
+/*
+ * Both complete with the resulting path name in @param req->ptr
+ */
+int ml_fs_readlink(ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_READLINK, path, NULL, 0, cb, arg);
+}
+
+int ml_fs_realpath(ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_REALPATH, path, NULL, 0, cb, arg);
+}
+
+static int fs_chown(ml_ctx_t *ctx, ml_fs_t *req, ml_fs_type type, const char *path, int fd,
+		    uid_t uid, gid_t gid, ml_fs_cb_t *cb, void *arg)
+{
+	if (fs_init(ctx, req, type, cb, arg))
+		return -1;
+	if (path && fs_path(req, path, NULL))
+		return -1;
+	req->fd  = fd;
+	req->uid = uid;
+	req->gid = gid;
+
+	if (ml_fs_submit(req)) {
+		ml_fs_cleanup(req);
+		return -1;
+	}
+
+	return 0;
+}
+
+int ml_fs_chown(ml_ctx_t *ctx, ml_fs_t *req, const char *path, uid_t uid, gid_t gid, ml_fs_cb_t *cb, void *arg)
+{
+	if (!path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return fs_chown(ctx, req, ML_FS_CHOWN, path, -1, uid, gid, cb, arg);
+}
+
+int ml_fs_fchown(ml_ctx_t *ctx, ml_fs_t *req, int fd, uid_t uid, gid_t gid, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_chown(ctx, req, ML_FS_FCHOWN, NULL, fd, uid, gid, cb, arg);
+}
+
+int ml_fs_lchown(ml_ctx_t *ctx, ml_fs_t *req, const char *path, uid_t uid, gid_t gid, ml_fs_cb_t *cb, void *arg)
+{
+	if (!path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return fs_chown(ctx, req, ML_FS_LCHOWN, path, -1, uid, gid, cb, arg);
+}
+
+/*
+ * Directory streams: ml_fs_opendir() completes with the DIR pointer in
+ * @param req->ptr, ml_fs_readdir() with 1 and the next struct dirent in
+ * @param req->ptr, or 0 at the end of the directory.  The entry is only
+ * valid until the next request on the same stream.
+ */
+int ml_fs_opendir(ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg)
+{
+	return fs_path_req(ctx, req, ML_FS_OPENDIR, path, NULL, 0, cb, arg);
+}
+
+int ml_fs_readdir(ml_ctx_t *ctx, ml_fs_t *req, DIR *dir, ml_fs_cb_t *cb, void *arg)
+{
+	if (!dir || fs_init(ctx, req, ML_FS_READDIR, cb, arg)) {
+		errno = EINVAL;
+		return -1;
+	}
+	req->dir = dir;
+
+	return ml_fs_submit(req);
+}
+
+int ml_fs_closedir(ml_ctx_t *ctx, ml_fs_t *req, DIR *dir, ml_fs_cb_t *cb, void *arg)
+{
+	if (!dir || fs_init(ctx, req, ML_FS_CLOSEDIR, cb, arg)) {
+		errno = EINVAL;
+		return -1;
+	}
+	req->dir = dir;
+
+	return ml_fs_submit(req);
+}
+
+static void fs_sendfile_done(ml_fs_t *req, int error)
+{
+	ml_io_stop(&req->w);
+	close(req->out_fd);
+	if (req->src_fd >= 0)
+		close(req->src_fd);
+
+	req->error = error;
+	if (error)
+		req->result = -1;
+
+	/* The callback may resubmit, or free, the request */
+	if (req->cb)
+		req->cb(req);
+}
+
+/* A pipe as source with nothing in it, or a full destination */
+static int fs_source_empty(ml_fs_t *req)
+{
+	struct pollfd pfd = { .fd = req->fd, .events = POLLIN };
+
+	return req->splice && poll(&pfd, 1, 0) == 0;
+}
+
+/* Destination is writable, move as much as it takes without blocking */
+static void fs_sendfile_cb(ml_t *w, void *arg, int events)
+{
+	ml_fs_t *req = arg;
+	size_t sent = 0;
+
+	/* Not registered with the kernel, e.g. a bad descriptor */
+	if ((events & MINILOOP_ERROR) && !ml_io_active(w)) {
+		fs_sendfile_done(req, errno ? errno : EIO);
+		return;
+	}
+
+	/* Was waiting for the source, watch the destination again */
+	if (w->fd == req->src_fd && ml_io_set(w, req->out_fd, MINILOOP_WRITE)) {
+		fs_sendfile_done(req, errno);
+		return;
+	}
+
+	while (sent < MINILOOP_SENDFILE_CHUNK) {
+		size_t len = fs_remaining(req);
+		ssize_t n;
+
+		if (len > MINILOOP_SENDFILE_CHUNK - sent)
+			len = MINILOOP_SENDFILE_CHUNK - sent;
+
+		n = fs_transfer(req, len, 1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				/* Either end, wait for the source to fill or the socket to drain */
+				if (fs_source_empty(req) && ml_io_set(w, req->src_fd, MINILOOP_READ))
+					fs_sendfile_done(req, errno);
+				return;
+			}
+
+			fs_sendfile_done(req, errno);
+			return;
+		}
+
+		req->result += n;
+		sent += n;
+		if (!n || (req->len && (size_t)req->result == req->len)) {
+			fs_sendfile_done(req, 0);
+			return;
+		}
+	}
+
+	/* Level triggered, we are called again after other watchers */
+}
+
+/**
+ * Send a file, or part of it, to a socket or pipe without copying
+ * @param ctx     A valid miniloop context
+ * @param req     Pointer to an ml_fs_t request
+ * @param out_fd  Destination, a non-blocking socket or pipe, or a file
+ * @param in_fd   Source, a file or a pipe
+ * @param off     Offset in @param in_fd, or -1 for its current offset
+ * @param len     Number of bytes to send, or zero for all of the file
+ * @param cb      Callback, @param req->result holds the bytes sent
+ * @param arg     Optional callback argument
+ *
+ * Data is moved in the kernel with sendfile(2), or splice(2) when the
+ * source is a pipe, whenever @param out_fd is writable.  Partial writes
+ * and EAGAIN are handled internally, at most %MINILOOP_SENDFILE_CHUNK
+ * bytes are moved per wakeup to be fair to other watchers, and @param
+ * cb is only called once, when done or on error.  If the destination
+ * is a regular file the request runs on the worker pool instead.
+ *
+ * A socket may already have an I/O watcher in the same context, so
+ * the request watches a dup(2) of @param out_fd, and of a pipe as
+ * source, which it waits for when the pipe is empty.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fs_sendfile(ml_ctx_t *ctx, ml_fs_t *req, int out_fd, int in_fd, off_t off, size_t len, ml_fs_cb_t *cb, void *arg)
+{
+	struct stat st;
+	int err;
+
+	if (out_fd < 0 || in_fd < 0 || fs_init(ctx, req, ML_FS_SENDFILE, cb, arg)) {
+		errno = EINVAL;
+		return -1;
+	}
+	req->fd     = in_fd;
+	req->out_fd = out_fd;
+	req->off    = off;
+	req->len    = len;
+
+	if (fstat(in_fd, &st))
+		return -1;
+	if (S_ISFIFO(st.st_mode)) {
+		req->splice = 1;
+		req->off    = -1;
+	}
+
+	if (fstat(out_fd, &st))
+		return -1;
+	if (S_ISREG(st.st_mode)) {
+		/* splice(2) needs a pipe at either end, the source may be one */
+		return ml_fs_submit(req);
+	}
+
+	/* Own descriptors, never already registered, also from a callback */
+	req->src_fd = -1;
+	req->out_fd = fcntl(out_fd, F_DUPFD_CLOEXEC, 0);
+	if (req->out_fd < 0)
+		return -1;
+	if (req->splice) {
+		req->src_fd = fcntl(in_fd, F_DUPFD_CLOEXEC, 0);
+		if (req->src_fd < 0)
+			goto fail;
+	}
+
+	if (ml_io_init(ctx, &req->w, fs_sendfile_cb, req, req->out_fd, MINILOOP_WRITE))
+		goto fail;
+
+	return 0;
+fail:
+	err = errno;
+	close(req->out_fd);
+	if (req->src_fd >= 0)
+		close(req->src_fd);
+	errno = err;
+
+	return -1;
+}
+
+/**
+ * Copy a file
+ * @param ctx       A valid miniloop context
+ * @param req       Pointer to an ml_fs_t request
+ * @param path      Source file
+ * @param new_path  Destination file, created or truncated
+ * @param flags     %ML_FS_COPYFILE_EXCL, or zero
+ * @param cb        Callback, @param req->result holds the bytes copied
+ * @param arg       Optional callback argument
+ *
+ * Runs on the worker pool and uses copy_file_range(2), which lets the
+ * file system share extents, or do the copy on the server side, and
+ * falls back to sendfile(2) across file systems.  The destination gets
+ * the permissions of the source.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fs_copyfile(ml_ctx_t *ctx, ml_fs_t *req, const char *path, const char *new_path, int flags, ml_fs_cb_t *cb, void *arg)
+{
+	if (!new_path) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fs_init(ctx, req, ML_FS_COPYFILE, cb, arg) || fs_path(req, path, new_path))
+		return -1;
+	req->flags = flags;
+
+	if (ml_fs_submit(req)) {
+		ml_fs_cleanup(req);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,421 @@
+/* miniloop - File system change watchers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * All file watchers of a context share its inotify descriptor, which
+ * is registered as a single I/O watcher while any file watcher is
+ * active.  Watchers are found by their watch descriptor in a chained
+ * hash table.  Events read in one wakeup are OR:ed into each watcher's
+ * pending mask, and every watcher with a non-zero mask gets one call
+ * once the inotify queue is drained, so a burst of IN_MODIFY from a
+ * large write is a single callback.  The mask to watch for is kept in
+ * w->events, the pending mask in u.f.revents with the PENDING bit set,
+ * which is cleared just before the callback.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "miniloop.h"
+
+/* Never in an event from the kernel, on the pending list */
+#define PENDING IN_ONESHOT
+
+struct ml_fswatch_tab {
+	/* Reader for ctx->inotify_fd */
+	ml_t            w;
+
+	/* Active watchers by watch descriptor, nbuckets is a power of two */
+	ml_t          **buckets;
+	unsigned int    nbuckets;
+	unsigned int    count;
+
+	/* Watchers with events to deliver, in arrival order */
+	ml_t           *pending, **pending_tail;
+};
+
+static ml_t **bucket(struct ml_fswatch_tab *tab, int wd)
+{
+	return &tab->buckets[(unsigned int)wd & (tab->nbuckets - 1)];
+}
+
+static int hash_grow(struct ml_fswatch_tab *tab)
+{
+	unsigned int i, old = tab->nbuckets;
+	ml_t **buckets = tab->buckets;
+
+	tab->buckets = calloc(old * 2, sizeof(ml_t *));
+	if (!tab->buckets) {
+		tab->buckets = buckets;
+		return -1;
+	}
+	tab->nbuckets = old * 2;
+
+	for (i = 0; i < old; i++) {
+		ml_t *w, *next;
+
+		for (w = buckets[i]; w; w = next) {
+			ml_t **b = bucket(tab, w->u.f.wd);
+
+			next = w->u.f.hnext;
+			w->u.f.hnext = *b;
+			*b = w;
+		}
+	}
+	free(buckets);
+
+	return 0;
+}
+
+static void hash_remove(struct ml_fswatch_tab *tab, ml_t *w)
+{
+	ml_t **pp;
+
+	for (pp = bucket(tab, w->u.f.wd); *pp; pp = &(*pp)->u.f.hnext) {
+		if (*pp == w) {
+			*pp = w->u.f.hnext;
+			w->u.f.hnext = NULL;
+			tab->count--;
+			return;
+		}
+	}
+}
+
+/* Is any watcher, other than @w, using watch descriptor @wd? */
+static int hash_used(struct ml_fswatch_tab *tab, int wd, ml_t *w)
+{
+	ml_t *iter;
+
+	for (iter = *bucket(tab, wd); iter; iter = iter->u.f.hnext) {
+		if (iter != w && iter->u.f.wd == wd)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void mark(struct ml_fswatch_tab *tab, ml_t *w, uint32_t mask)
+{
+	/* Watch removal, and overflow, are always reported */
+	mask &= (uint32_t)w->events | IN_IGNORED | IN_Q_OVERFLOW;
+	if (!mask)
+		return;
+
+	if (!(w->u.f.revents & PENDING)) {
+		w->u.f.revents = PENDING;
+		w->u.f.pnext = NULL;
+		*tab->pending_tail = w;
+		tab->pending_tail = &w->u.f.pnext;
+	}
+	w->u.f.revents |= mask;
+}
+
+static void unmark(struct ml_fswatch_tab *tab, ml_t *w)
+{
+	ml_t **pp;
+
+	if (!(w->u.f.revents & PENDING))
+		return;
+
+	for (pp = &tab->pending; *pp; pp = &(*pp)->u.f.pnext) {
+		if (*pp == w) {
+			*pp = w->u.f.pnext;
+			if (tab->pending_tail == &w->u.f.pnext)
+				tab->pending_tail = pp;
+			break;
+		}
+	}
+	w->u.f.revents = 0;
+}
+
+/* Drain the inotify queue, then call each watcher with events once */
+static void fswatch_cb(ml_t *r, void *arg, int events)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct ml_fswatch_tab *tab = arg;
+	ml_ctx_t *ctx = r->ctx;
+	ssize_t len;
+
+	while ((len = read(r->fd, buf, sizeof(buf))) > 0) {
+		char *ptr;
+
+		for (ptr = buf; ptr < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)ptr;
+			ml_t *w;
+
+			ptr += sizeof(*ev) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				unsigned int i;
+
+				/* Events were lost, everyone has to take a look */
+				for (i = 0; i < tab->nbuckets; i++) {
+					for (w = tab->buckets[i]; w; w = w->u.f.hnext)
+						mark(tab, w, IN_Q_OVERFLOW);
+				}
+				continue;
+			}
+
+			for (w = *bucket(tab, ev->wd); w; w = w->u.f.hnext) {
+				if (w->u.f.wd == ev->wd)
+					mark(tab, w, ev->mask);
+			}
+		}
+	}
+
+	while (ctx->fswatch == tab && tab->pending) {
+		ml_t *w = tab->pending;
+
+		tab->pending = w->u.f.pnext;
+		if (!tab->pending)
+			tab->pending_tail = &tab->pending;
+
+		w->u.f.revents &= ~PENDING;
+
+		/* The kernel has dropped the watch, file deleted or unmounted */
+		if (w->u.f.revents & IN_IGNORED) {
+			hash_remove(tab, w);
+			w->u.f.wd = -1;
+			ml_fswatch_stop(w);
+		}
+
+		/* Callback may stop, or restart, any file watcher */
+		if (w->cb)
+			_ML_CALL(w, MINILOOP_READ);
+	}
+}
+
+static struct ml_fswatch_tab *fswatch_tab(ml_ctx_t *ctx)
+{
+	struct ml_fswatch_tab *tab = ctx->fswatch;
+
+	if (tab)
+		return tab;
+
+	tab = calloc(1, sizeof(*tab));
+	if (!tab)
+		return NULL;
+
+	tab->nbuckets = 16;
+	tab->buckets  = calloc(tab->nbuckets, sizeof(ml_t *));
+	if (!tab->buckets) {
+		free(tab);
+		return NULL;
+	}
+	tab->pending_tail = &tab->pending;
+
+	/* Started with the first file watcher */
+	if (_ml_watcher_init(ctx, &tab->w, MINILOOP_IO_TYPE, fswatch_cb, tab, ctx->inotify_fd, MINILOOP_READ)) {
+		free(tab->buckets);
+		free(tab);
+		return NULL;
+	}
+
+	ctx->fswatch = tab;
+
+	return tab;
+}
+
+/* Private to miniloop, do not use directly!  Called by ml_exit() */
+int _ml_fswatch_exit(ml_ctx_t *ctx)
+{
+	struct ml_fswatch_tab *tab = ctx->fswatch;
+
+	if (!tab)
+		return 0;
+
+	/* Watches go away with the inotify descriptor */
+	ctx->fswatch = NULL;
+	_ml_watcher_stop(&tab->w);
+	free(tab->buckets);
+	free(tab);
+
+	return 0;
+}
+
+/**
+ * Create a file system watcher
+ * @param ctx   A valid miniloop context
+ * @param w     Pointer to an ml_t watcher
+ * @param cb    Callback when the file or directory changes
+ * @param arg   Optional callback argument
+ * @param path  File or directory to watch, must remain valid while in use
+ * @param mask  inotify(7) events to watch for, e.g. IN_MODIFY | IN_ATTRIB
+ *
+ * All file watchers in a context share a single inotify descriptor,
+ * so watching thousands of files costs no more descriptors than one.
+ * All events for @param path that arrive in the same wakeup of the
+ * event loop are merged into a single callback, with @param events
+ * set to %MINILOOP_READ.  Use ml_fswatch_mask() in the callback to get
+ * what happened, a mask of the inotify(7) events seen since the last
+ * callback.  File names of events in a watched directory are not
+ * reported.
+ *
+ * When the watched file is deleted, or its file system unmounted, the
+ * callback gets IN_IGNORED in the mask and the watcher is stopped.
+ * IN_Q_OVERFLOW means events were lost, for all watchers.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fswatch_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, const char *path, uint32_t mask)
+{
+	if (!path || !mask) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (_ml_watcher_init(ctx, w, MINILOOP_FSWATCH_TYPE, cb, arg, -1, (int)mask))
+		return -1;
+
+	w->u.f.path    = path;
+	w->u.f.wd      = -1;
+	w->u.f.revents = 0;
+	w->u.f.hnext   = NULL;
+	w->u.f.pnext   = NULL;
+
+	return ml_fswatch_start(w);
+}
+
+/**
+ * Reset a file system watcher
+ * @param w     Pointer to an ml_t watcher
+ * @param path  New file or directory to watch
+ * @param mask  New inotify(7) events to watch for
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fswatch_set(ml_t *w, const char *path, uint32_t mask)
+{
+	int prio, rc;
+
+	if (!w) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Ignore any errors, only to clean up anything lingering ... */
+	ml_fswatch_stop(w);
+
+	prio = w->prio;
+	rc = ml_fswatch_init(w->ctx, w, (ml_cb_t *)w->cb, w->arg, path, mask);
+	w->prio = prio;
+
+	return rc;
+}
+
+/**
+ * Start a file system watcher
+ * @param w  Watcher to start (again)
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fswatch_start(ml_t *w)
+{
+	struct ml_fswatch_tab *tab;
+	ml_ctx_t *ctx;
+	ml_t **b;
+	int wd;
+
+	if (!w || !w->ctx || w->type != MINILOOP_FSWATCH_TYPE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (_ml_watcher_active(w))
+		return 0;
+
+	ctx = w->ctx;
+	if (ctx->inotify_fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	tab = fswatch_tab(ctx);
+	if (!tab)
+		return -1;
+
+	if (tab->count >= tab->nbuckets && hash_grow(tab))
+		return -1;
+
+	/* Same inode as another watcher gives the same wd, keep its events */
+	wd = inotify_add_watch(ctx->inotify_fd, w->u.f.path, (uint32_t)w->events | IN_MASK_ADD);
+	if (wd < 0)
+		return -1;
+
+	if (!tab->count && _ml_watcher_start(&tab->w)) {
+		if (!hash_used(tab, wd, NULL))
+			inotify_rm_watch(ctx->inotify_fd, wd);
+		return -1;
+	}
+
+	w->u.f.wd      = wd;
+	b = bucket(tab, wd);
+	w->u.f.hnext = *b;
+	*b = w;
+	tab->count++;
+
+	return _ml_watcher_attach(w);
+}
+
+/**
+ * Stop a file system watcher
+ * @param w  Watcher to stop
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_fswatch_stop(ml_t *w)
+{
+	struct ml_fswatch_tab *tab;
+
+	if (!w || !w->ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!_ml_watcher_active(w))
+		return 0;
+
+	tab = w->ctx->fswatch;
+	if (tab) {
+		unmark(tab, w);
+
+		if (w->u.f.wd >= 0) {
+			hash_remove(tab, w);
+			if (!hash_used(tab, w->u.f.wd, w))
+				inotify_rm_watch(w->ctx->inotify_fd, w->u.f.wd);
+			w->u.f.wd = -1;
+		}
+
+		if (!tab->count)
+			_ml_watcher_stop(&tab->w);
+	}
+
+	return _ml_watcher_detach(w);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
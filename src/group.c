@@ -0,0 +1,442 @@
+/* miniloop - Group of event loops, one thread per CPU
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Each loop of a group is an ordinary context run by its own thread.
+ * Messages to a loop are pushed on a lock-free stack, only the push
+ * that finds the stack empty posts the loop's event watcher, so many
+ * messages sent while the loop is busy cost a single eventfd write.
+ * The loop takes the whole stack at once and runs it oldest first.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "miniloop.h"
+
+struct ml_listener {
+	struct ml_listener *next;
+	ml_t                w;
+	int                 owner;	/* Close fd on exit */
+};
+
+struct ml_loop {
+	ml_ctx_t            ctx;
+	ml_group_t         *group;
+	int                 id;
+	int                 cpu;
+	pthread_t           thread;
+
+	/* Incoming messages, newest first */
+	ml_msg_t           *head;
+	ml_t                ev;
+	ml_msg_t            stop;
+
+	struct ml_listener *listeners;
+};
+
+static void msg_cb(ml_t *w, void *arg, int events)
+{
+	struct ml_loop *loop = arg;
+	ml_msg_t *msg, *fifo = NULL;
+
+	msg = __atomic_exchange_n(&loop->head, NULL, __ATOMIC_ACQUIRE);
+	while (msg) {
+		ml_msg_t *next = msg->next;
+
+		msg->next = fifo;
+		fifo = msg;
+		msg = next;
+	}
+
+	while (fifo) {
+		msg = fifo;
+		fifo = msg->next;
+
+		/* Callback may free, or resend, the message */
+		msg->cb(&loop->ctx, msg);
+	}
+}
+
+static void stop_cb(ml_ctx_t *ctx, ml_msg_t *msg)
+{
+	ctx->running = 0;
+}
+
+static void *loop_thread(void *arg)
+{
+	struct ml_loop *loop = arg;
+
+	ml_run(&loop->ctx, 0);
+
+	return NULL;
+}
+
+/* The n:th CPU this process may run on, or -1 */
+static int nth_cpu(cpu_set_t *set, int n)
+{
+	int cpu, count = CPU_COUNT(set);
+
+	if (count < 1)
+		return -1;
+
+	n %= count;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, set) && n-- == 0)
+			return cpu;
+	}
+
+	return -1;
+}
+
+static int listen_one(const struct sockaddr *sa, socklen_t len, int reuseport)
+{
+	int fd, on = 1;
+
+	fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)))
+		goto fail;
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+		goto fail;
+	if (bind(fd, sa, len) || listen(fd, SOMAXCONN))
+		goto fail;
+
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+static int add_listener(struct ml_loop *loop, int fd, int owner, int events, ml_cb_t *cb, void *arg)
+{
+	struct ml_listener *l;
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return -1;
+
+	if (ml_io_init(&loop->ctx, &l->w, cb, arg, fd, events)) {
+		free(l);
+		return -1;
+	}
+	l->owner = owner;
+	l->next = loop->listeners;
+	loop->listeners = l;
+
+	return 0;
+}
+
+/**
+ * Create a group of event loops
+ * @param g          Pointer to an ml_group_t to be initialized
+ * @param nloops     Number of loops, or zero for one per available CPU
+ * @param maxevents  Maximum number of events in each loop's event cache
+ * @param flags      Init flags for each loop, see ml_init1()
+ *
+ * Each loop is a separate context, run by its own thread after
+ * ml_group_start(), pinned to a CPU in the affinity mask of the
+ * process.  Before the group is started, watchers can be added to the
+ * context of any loop, see ml_group_ctx().  After that each context
+ * may only be used from its own thread, other threads talk to a loop
+ * with ml_group_send().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_group_init(ml_group_t *g, int nloops, int maxevents, int flags)
+{
+	cpu_set_t set;
+	int i;
+
+	if (!g || nloops < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set))
+		CPU_ZERO(&set);
+	if (!nloops)
+		nloops = CPU_COUNT(&set) > 0 ? CPU_COUNT(&set) : 1;
+
+	memset(g, 0, sizeof(*g));
+	g->loops = calloc(nloops, sizeof(struct ml_loop));
+	if (!g->loops)
+		return -1;
+
+	for (i = 0; i < nloops; i++) {
+		struct ml_loop *loop = &g->loops[i];
+
+		loop->group   = g;
+		loop->id      = i;
+		loop->cpu     = nth_cpu(&set, i);
+		loop->stop.cb = stop_cb;
+
+		if (ml_init1(&loop->ctx, maxevents, flags))
+			goto fail;
+		g->nloops++;
+
+		if (ml_event_init(&loop->ctx, &loop->ev, msg_cb, loop))
+			goto fail;
+	}
+
+	return 0;
+fail:
+	i = errno;
+	ml_group_exit(g);
+	errno = i;
+
+	return -1;
+}
+
+/**
+ * Get the context of a loop in a group
+ * @param g   A valid loop group
+ * @param id  Loop number, 0 .. nloops - 1
+ *
+ * @return The loop's context, or %NULL with @param errno set on error.
+ */
+ml_ctx_t *ml_group_ctx(ml_group_t *g, int id)
+{
+	if (!g || id < 0 || id >= g->nloops) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return &g->loops[id].ctx;
+}
+
+/**
+ * Listen for TCP connections on all loops in a group
+ * @param g    A valid loop group, not yet started
+ * @param sa   Address to listen on
+ * @param len  Length of @param sa
+ * @param cb   Callback when a connection can be accepted from w->fd
+ * @param arg  Optional callback argument
+ *
+ * Each loop gets its own listening socket with %SO_REUSEPORT, so the
+ * kernel spreads new connections across the loops.  Without support
+ * for that, all loops share one socket and watch it using
+ * %EPOLLEXCLUSIVE, waking up one loop per connection.  Port zero in
+ * @param sa means the same ephemeral port for all loops.  The sockets
+ * are closed by ml_group_exit().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_group_listen(ml_group_t *g, const struct sockaddr *sa, socklen_t len, ml_cb_t *cb, void *arg)
+{
+	struct sockaddr_storage ss;
+	int i, fd, reuseport = 1;
+
+	if (!g || !sa || len > sizeof(ss)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (g->started) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	memcpy(&ss, sa, len);
+	fd = listen_one(sa, len, reuseport);
+	if (fd < 0) {
+		if (errno != ENOPROTOOPT)
+			return -1;
+		reuseport = 0;
+		fd = listen_one(sa, len, reuseport);
+		if (fd < 0)
+			return -1;
+	}
+
+	/* Bind the rest to the port we got, in case it was ephemeral */
+	if (getsockname(fd, (struct sockaddr *)&ss, &len)) {
+		close(fd);
+		return -1;
+	}
+
+	if (add_listener(&g->loops[0], fd, 1, MINILOOP_READ | (reuseport ? 0 : MINILOOP_EXCLUSIVE), cb, arg)) {
+		close(fd);
+		return -1;
+	}
+
+	for (i = 1; i < g->nloops; i++) {
+		struct ml_loop *loop = &g->loops[i];
+
+		if (!reuseport) {
+			if (add_listener(loop, fd, 0, MINILOOP_READ | MINILOOP_EXCLUSIVE, cb, arg))
+				return -1;
+			continue;
+		}
+
+		fd = listen_one((struct sockaddr *)&ss, len, reuseport);
+		if (fd < 0)
+			return -1;
+
+		if (add_listener(loop, fd, 1, MINILOOP_READ, cb, arg)) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Start all loops in a group
+ * @param g  A valid loop group
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_group_start(ml_group_t *g)
+{
+	int i;
+
+	if (!g) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (g->started) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	for (i = 0; i < g->nloops; i++) {
+		struct ml_loop *loop = &g->loops[i];
+		pthread_attr_t attr;
+		int rc;
+
+		pthread_attr_init(&attr);
+		if (loop->cpu >= 0) {
+			cpu_set_t set;
+
+			CPU_ZERO(&set);
+			CPU_SET(loop->cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+
+		rc = pthread_create(&loop->thread, &attr, loop_thread, loop);
+		pthread_attr_destroy(&attr);
+		if (rc) {
+			errno = rc;
+			return -1;
+		}
+		g->started++;
+	}
+
+	return 0;
+}
+
+/**
+ * Send a message to a loop in a group
+ * @param g    A valid loop group
+ * @param id   Loop number, 0 .. nloops - 1
+ * @param msg  Message, with its callback set
+ *
+ * Safe to call from any thread, without locks.  The callback of @param
+ * msg is called by the receiving loop's thread, with that loop's context,
+ * e.g. to start a watcher on a descriptor accepted by another loop.  The
+ * message must remain valid until then, the callback may free it.
+ * Messages from one thread are run in the order they were sent.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_group_send(ml_group_t *g, int id, ml_msg_t *msg)
+{
+	struct ml_loop *loop;
+	ml_msg_t *head;
+
+	if (!g || id < 0 || id >= g->nloops || !msg || !msg->cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	loop = &g->loops[id];
+	head = __atomic_load_n(&loop->head, __ATOMIC_RELAXED);
+	do {
+		msg->next = head;
+	} while (!__atomic_compare_exchange_n(&loop->head, &head, msg, 1,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* Loop already has a wakeup pending for earlier messages */
+	if (head)
+		return 0;
+
+	return ml_event_post(&loop->ev);
+}
+
+/**
+ * Stop all loops in a group and release its resources
+ * @param g  A valid loop group
+ *
+ * Waits for all loop threads to return from their current callback.
+ * Messages not yet run are dropped, no other thread may send new ones.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_group_exit(ml_group_t *g)
+{
+	int i;
+
+	if (!g) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < g->started; i++)
+		ml_group_send(g, i, &g->loops[i].stop);
+	for (i = 0; i < g->started; i++)
+		pthread_join(g->loops[i].thread, NULL);
+
+	for (i = 0; i < g->nloops; i++) {
+		struct ml_loop *loop = &g->loops[i];
+
+		ml_exit(&loop->ctx);
+		while (loop->listeners) {
+			struct ml_listener *l = loop->listeners;
+
+			loop->listeners = l->next;
+			if (l->owner)
+				close(l->w.fd);
+			free(l);
+		}
+	}
+
+	free(g->loops);
+	g->loops   = NULL;
+	g->nloops  = 0;
+	g->started = 0;
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,260 @@
+/* miniloop - Prepare, check and idle watchers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Hooks into each iteration of ml_run(), in userspace only, no fd.
+ * Each type has its own list in the context, newest first.  Between
+ * callbacks the next watcher to run is kept in the context, so a
+ * callback may stop, or free, any hook watcher of the same type.
+ */
+
+#include <errno.h>
+
+#include "miniloop.h"
+
+static ml_t **hook_list(ml_t *w)
+{
+	switch (w->type) {
+	case MINILOOP_PREPARE_TYPE:
+		return &w->ctx->prepare;
+
+	case MINILOOP_CHECK_TYPE:
+		return &w->ctx->check;
+
+	case MINILOOP_IDLE_TYPE:
+		return &w->ctx->idle;
+
+	default:
+		return NULL;
+	}
+}
+
+static int hook_init(ml_ctx_t *ctx, ml_t *w, ml_type_t type, ml_cb_t *cb, void *arg)
+{
+	if (!ctx || !w || !cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (_ml_watcher_init(ctx, w, type, cb, arg, -1, MINILOOP_READ))
+		return -1;
+	w->u.h.next = NULL;
+	w->u.h.prev = NULL;
+
+	return 0;
+}
+
+static int hook_start(ml_t *w, ml_type_t type)
+{
+	ml_t **list;
+
+	if (!w || !w->ctx || w->type != type) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (_ml_watcher_active(w))
+		return 0;
+
+	list = hook_list(w);
+	w->u.h.prev = NULL;
+	w->u.h.next = *list;
+	if (*list)
+		(*list)->u.h.prev = w;
+	*list = w;
+
+	return _ml_watcher_attach(w);
+}
+
+static int hook_stop(ml_t *w, ml_type_t type)
+{
+	ml_ctx_t *ctx;
+
+	if (!w || !w->ctx || w->type != type) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!_ml_watcher_active(w))
+		return 0;
+
+	ctx = w->ctx;
+	if (ctx->hook_next == w)
+		ctx->hook_next = w->u.h.next;
+
+	if (w->u.h.prev)
+		w->u.h.prev->u.h.next = w->u.h.next;
+	else
+		*hook_list(w) = w->u.h.next;
+	if (w->u.h.next)
+		w->u.h.next->u.h.prev = w->u.h.prev;
+	w->u.h.next = NULL;
+	w->u.h.prev = NULL;
+
+	return _ml_watcher_detach(w);
+}
+
+/* Private to miniloop, do not use directly!  Run all watchers on @list */
+void _ml_hook_run(ml_ctx_t *ctx, ml_t *list)
+{
+	ml_t *w;
+
+	for (w = list; w && ctx->running; w = ctx->hook_next) {
+		ctx->hook_next = w->u.h.next;
+		_ML_CALL(w, MINILOOP_READ);
+	}
+	ctx->hook_next = NULL;
+}
+
+/**
+ * Create a prepare watcher
+ * @param ctx  A valid miniloop context
+ * @param w    Pointer to an ml_t watcher
+ * @param cb   Called every loop iteration, before waiting for events
+ * @param arg  Optional callback argument
+ *
+ * Changes to other watchers from the callback are sent to the kernel
+ * with the same wait, so this is the place to flush output buffered
+ * by the callbacks of the last iteration, e.g. with one writev().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_prepare_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg)
+{
+	if (hook_init(ctx, w, MINILOOP_PREPARE_TYPE, cb, arg))
+		return -1;
+
+	return ml_prepare_start(w);
+}
+
+/**
+ * Start a prepare watcher
+ * @param w  Watcher to start (again)
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_prepare_start(ml_t *w)
+{
+	return hook_start(w, MINILOOP_PREPARE_TYPE);
+}
+
+/**
+ * Stop a prepare watcher
+ * @param w  Watcher to stop
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_prepare_stop(ml_t *w)
+{
+	return hook_stop(w, MINILOOP_PREPARE_TYPE);
+}
+
+/**
+ * Create a check watcher
+ * @param ctx  A valid miniloop context
+ * @param w    Pointer to an ml_t watcher
+ * @param cb   Called every loop iteration, after events and timers
+ * @param arg  Optional callback argument
+ *
+ * Runs after all callbacks of the iteration, before the close
+ * callbacks of ml_close().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_check_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg)
+{
+	if (hook_init(ctx, w, MINILOOP_CHECK_TYPE, cb, arg))
+		return -1;
+
+	return ml_check_start(w);
+}
+
+/**
+ * Start a check watcher
+ * @param w  Watcher to start (again)
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_check_start(ml_t *w)
+{
+	return hook_start(w, MINILOOP_CHECK_TYPE);
+}
+
+/**
+ * Stop a check watcher
+ * @param w  Watcher to stop
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_check_stop(ml_t *w)
+{
+	return hook_stop(w, MINILOOP_CHECK_TYPE);
+}
+
+/**
+ * Create an idle watcher
+ * @param ctx  A valid miniloop context
+ * @param w    Pointer to an ml_t watcher
+ * @param cb   Called every loop iteration, before the prepare watchers
+ * @param arg  Optional callback argument
+ *
+ * While an idle watcher is active the loop does not block, it polls
+ * for events with a zero timeout, like %MINILOOP_NONBLOCK, so stop
+ * the watcher when there is no more work for it.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_idle_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg)
+{
+	if (hook_init(ctx, w, MINILOOP_IDLE_TYPE, cb, arg))
+		return -1;
+
+	return ml_idle_start(w);
+}
+
+/**
+ * Start an idle watcher
+ * @param w  Watcher to start (again)
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_idle_start(ml_t *w)
+{
+	return hook_start(w, MINILOOP_IDLE_TYPE);
+}
+
+/**
+ * Stop an idle watcher
+ * @param w  Watcher to stop
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_idle_stop(ml_t *w)
+{
+	return hook_stop(w, MINILOOP_IDLE_TYPE);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -23,9 +23,182 @@
  * THE SOFTWARE.
  */
 
+/*
+ * Edge tracked watchers are registered once for READ|WRITE|EDGE and
+ * never touched in the kernel again until stopped.  Each edge reported
+ * by epoll sets bits in @ready, which stay set until the user reports
+ * EAGAIN with ml_io_clear(), or ml_io_read() and ml_io_write() do it.
+ * The callback gets the ready events it is interested in, so changing
+ * interest is free.  When interest is widened to an event that is
+ * already ready, the kernel will not report another edge, so the
+ * watcher is put on the context's pending list, run after the events
+ * of the current iteration.  The io_uring backend only has one-shot,
+ * level-triggered polls, there the interest is polled for instead.
+ *
+ * Regular files are always readable and writable, epoll refuses them
+ * with %EPERM.  Plain watchers on such descriptors are put on the
+ * context's always ready list instead, called once per iteration after
+ * the events from the kernel, with the loop not blocking meanwhile.
+ */
+
 #include <errno.h>
+#include <unistd.h>
+
 #include "miniloop.h"
 
+#define EDGE_EVENTS (MINILOOP_READ | MINILOOP_WRITE)
+
+static void unqueue(ml_t *w)
+{
+	if (!w->u.e.pprev)
+		return;
+
+	*w->u.e.pprev = w->u.e.pnext;
+	if (w->u.e.pnext)
+		w->u.e.pnext->u.e.pprev = w->u.e.pprev;
+	w->u.e.pnext = NULL;
+	w->u.e.pprev = NULL;
+}
+
+static void queue(ml_t *w)
+{
+	ml_ctx_t *ctx = w->ctx;
+
+	if (w->u.e.pprev)
+		return;
+
+	w->u.e.pnext = ctx->io_pending;
+	if (ctx->io_pending)
+		ctx->io_pending->u.e.pprev = &w->u.e.pnext;
+	w->u.e.pprev = &ctx->io_pending;
+	ctx->io_pending = w;
+}
+
+/* Kernel mask for an edge tracked watcher */
+static int edge_mask(ml_t *w)
+{
+	if (w->ctx->ring)
+		return w->u.e.interest;
+
+	return EDGE_EVENTS | MINILOOP_EDGE;
+}
+
+static int edge_set(ml_t *w, int events)
+{
+	uint32_t old = w->u.e.interest;
+
+	w->u.e.interest = events & EDGE_EVENTS;
+	if (w->u.e.ready & w->u.e.interest & ~old)
+		queue(w);
+
+	if (!w->ctx->ring || w->u.e.interest == old)
+		return 0;
+
+	w->events = edge_mask(w);
+
+	return _ml_watcher_rearm(w);
+}
+
+/*
+ * Private to miniloop, do not use directly!  Update the readiness of an
+ * edge tracked watcher, returns the events for its callback, if any.
+ */
+uint32_t _ml_io_ready(ml_t *w, uint32_t events)
+{
+	w->u.e.ready |= events & (EDGE_EVENTS | MINILOOP_RDHUP);
+	events &= MINILOOP_ERROR | MINILOOP_HUP;
+
+	if (w->u.e.ready & w->u.e.interest)
+		events |= w->u.e.ready & (w->u.e.interest | MINILOOP_RDHUP);
+
+	return events;
+}
+
+/*
+ * Private to miniloop, do not use directly!  Call an edge tracked
+ * watcher again after this batch of events, e.g., when it stopped
+ * reading before %EAGAIN to be fair to other watchers.
+ */
+void _ml_io_again(ml_t *w)
+{
+	if (w->u.e.track && _ml_watcher_active(w))
+		queue(w);
+}
+
+/* Private to miniloop, do not use directly!  An fd epoll refuses */
+void _ml_io_always(ml_t *w)
+{
+	ml_ctx_t *ctx = w->ctx;
+
+	w->u.e.always = 1;
+	w->u.e.pnext  = ctx->io_always;
+	if (ctx->io_always)
+		ctx->io_always->u.e.pprev = &w->u.e.pnext;
+	w->u.e.pprev  = &ctx->io_always;
+	ctx->io_always = w;
+}
+
+static void unalways(ml_t *w)
+{
+	if (w->ctx->io_next == w)
+		w->ctx->io_next = w->u.e.pnext;
+
+	unqueue(w);
+	w->u.e.always = 0;
+}
+
+/*
+ * Private to miniloop, do not use directly!  Call the always ready
+ * watchers, any of them may be stopped by the callbacks.
+ */
+void _ml_io_always_run(ml_ctx_t *ctx)
+{
+	ml_t *w;
+
+	for (w = ctx->io_always; w && ctx->running; w = ctx->io_next) {
+		uint32_t events = w->events & EDGE_EVENTS;
+
+		ctx->io_next = w->u.e.pnext;
+		if (!events || !w->cb)
+			continue;
+
+		{
+			_ML_STATS_NOW(t);
+			_ML_CALL(w, events);
+			_ML_STATS_ALWAYS(ctx, t);
+		}
+	}
+	ctx->io_next = NULL;
+}
+
+/*
+ * Private to miniloop, do not use directly!  Run edge tracked watchers
+ * with ready events they were not called for.  Watchers queued by the
+ * callbacks are run on the next iteration.
+ */
+void _ml_io_run(ml_ctx_t *ctx)
+{
+	ml_t *list = ctx->io_pending;
+
+	if (!list)
+		return;
+
+	ctx->io_pending = NULL;
+	list->u.e.pprev = &list;
+
+	while (list) {
+		ml_t *w = list;
+		uint32_t events;
+
+		unqueue(w);
+		events = _ml_io_ready(w, 0);
+		if (!_ml_watcher_active(w) || !events || !w->cb)
+			continue;
+
+		_ML_CALL(w, events);
+	}
+}
+
 /**
  * Create an I/O watcher
  * @param ctx     A valid miniloop context
@@ -35,6 +208,10 @@
  * @param fd      File descriptor to watch, or -1 to register an empty watcher
  * @param events  Events to watch for: %MINILOOP_READ, %MINILOOP_WRITE, %MINILOOP_EDGE, %MINILOOP_ONESHOT
  *
+ * A regular file, which cannot be polled, is always ready.  Its
+ * callback is called on every loop iteration, until stopped, e.g. at
+ * end of file.  See ml_file_init() for reading files in large chunks.
+ *
  * @return POSIX OK(0) or non-zero with @param errno set on error.
  */
 int ml_io_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int fd, int events)
@@ -46,6 +223,50 @@ int ml_io_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int fd, int event
 
 	if (_ml_watcher_init(ctx, w, MINILOOP_IO_TYPE, cb, arg, fd, events))
 		return -1;
+	w->u.e.track  = 0;
+	w->u.e.always = 0;
+	w->u.e.pprev  = NULL;
+
+	return _ml_watcher_start(w);
+}
+
+/**
+ * Create an edge tracked I/O watcher
+ * @param ctx     A valid miniloop context
+ * @param w       Pointer to an ml_t watcher
+ * @param cb      I/O callback
+ * @param arg     Optional callback argument
+ * @param fd      Non-blocking file descriptor to watch
+ * @param events  Events to call back for, a mask of %MINILOOP_READ and %MINILOOP_WRITE
+ *
+ * The descriptor is registered once, edge-triggered for both reading
+ * and writing, and readiness is tracked by miniloop.  Changing @param
+ * events with ml_io_set() costs no system call, e.g., for enabling
+ * %MINILOOP_WRITE only while there is output queued up.
+ *
+ * An event stays ready until the callback reports that it has been
+ * exhausted, by calling ml_io_clear() on %EAGAIN, or by using
+ * ml_io_read() and ml_io_write() which do so.  A callback that stops
+ * before %EAGAIN, e.g., to be fair to other connections, is not called
+ * again until the next edge, or until the event is enabled again.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_io_edge_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int fd, int events)
+{
+	if (fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (_ml_watcher_init(ctx, w, MINILOOP_IO_TYPE, cb, arg, fd, 0))
+		return -1;
+	w->u.e.track    = 1;
+	w->u.e.always   = 0;
+	w->u.e.interest = events & EDGE_EVENTS;
+	w->u.e.ready    = 0;
+	w->u.e.pprev    = NULL;
+	w->events       = edge_mask(w);
 
 	return _ml_watcher_start(w);
 }
@@ -56,17 +277,62 @@ int ml_io_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int fd, int event
  * @param fd      New file descriptor to monitor
  * @param events  Requested events to watch for, a mask of %MINILOOP_READ and %MINILOOP_WRITE
  *
+ * An active watcher keeping its descriptor is changed in place, with a
+ * single %EPOLL_CTL_MOD, or none at all if @param events is unchanged.
+ * For edge tracked watchers only the interest mask is updated.
+ *
  * @return POSIX OK(0) or non-zero with @param errno set on error.
  */
 int ml_io_set(ml_t *w, int fd, int events)
 {
-	if ((events & MINILOOP_ONESHOT) && _ml_watcher_active(w))
-		return _ml_watcher_rearm(w);
+	int prio, rc;
+
+	if (!w) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (_ml_watcher_active(w) && fd == w->fd) {
+		if (w->u.e.track)
+			return edge_set(w, events);
+
+		/* Not in the kernel, only the mask for the callback */
+		if (w->u.e.always) {
+			w->events = events;
+			return 0;
+		}
+
+		/* A fired one-shot watcher must be rearmed, even if unchanged */
+		if (events == w->events && !(events & MINILOOP_ONESHOT))
+			return 0;
+
+		/* Exclusive wakeups cannot be modified, only re-added */
+		if (!((events | w->events) & MINILOOP_EXCLUSIVE)) {
+			int old = w->events;
+
+			w->events = events;
+			if (!_ml_watcher_rearm(w))
+				return 0;
+			w->events = old;
+
+			/* Closed and reopened behind our back, re-add below */
+			if (errno != ENOENT)
+				return -1;
+		}
+	}
 
 	/* Ignore any errors, only to clean up anything lingering ... */
 	ml_io_stop(w);
 
-	return ml_io_init(w->ctx, w, (ml_cb_t *)w->cb, w->arg, fd, events);
+	/* Same watcher, keeps its priority */
+	prio = w->prio;
+	if (w->u.e.track)
+		rc = ml_io_edge_init(w->ctx, w, (ml_cb_t *)w->cb, w->arg, fd, events);
+	else
+		rc = ml_io_init(w->ctx, w, (ml_cb_t *)w->cb, w->arg, fd, events);
+	w->prio = prio;
+
+	return rc;
 }
 
 /**
@@ -77,6 +343,9 @@ int ml_io_set(ml_t *w, int fd, int events)
  */
 int ml_io_start(ml_t *w)
 {
+	if (w && w->u.e.track)
+		return ml_io_set(w, w->fd, w->u.e.interest);
+
 	return ml_io_set(w, w->fd, w->events);
 }
 
@@ -88,9 +357,93 @@ int ml_io_start(ml_t *w)
  */
 int ml_io_stop(ml_t *w)
 {
+	if (w && w->u.e.track) {
+		unqueue(w);
+		w->u.e.ready = 0;
+	}
+
+	if (w && w->u.e.always) {
+		unalways(w);
+		return _ml_watcher_detach(w);
+	}
+
 	return _ml_watcher_stop(w);
 }
 
+/**
+ * Mark events of an edge tracked watcher as exhausted
+ * @param w       An I/O watcher from ml_io_edge_init()
+ * @param events  Events that returned %EAGAIN, %MINILOOP_READ and/or %MINILOOP_WRITE
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_io_clear(ml_t *w, int events)
+{
+	if (!w || w->type != MINILOOP_IO_TYPE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (w->u.e.track)
+		w->u.e.ready &= ~(events & EDGE_EVENTS);
+
+	return 0;
+}
+
+/**
+ * Read from an I/O watcher's descriptor
+ * @param w    An I/O watcher
+ * @param buf  Buffer to read into
+ * @param len  Size of @param buf
+ *
+ * Like read(2), but on %EAGAIN clears %MINILOOP_READ readiness of an
+ * edge tracked watcher.
+ *
+ * @return Number of bytes read, or -1 with @param errno set on error.
+ */
+ssize_t ml_io_read(ml_t *w, void *buf, size_t len)
+{
+	ssize_t num;
+
+	if (!w) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	num = read(w->fd, buf, len);
+	if (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		ml_io_clear(w, MINILOOP_READ);
+
+	return num;
+}
+
+/**
+ * Write to an I/O watcher's descriptor
+ * @param w    An I/O watcher
+ * @param buf  Data to write
+ * @param len  Length of @param buf
+ *
+ * Like write(2), but on %EAGAIN clears %MINILOOP_WRITE readiness of an
+ * edge tracked watcher.
+ *
+ * @return Number of bytes written, or -1 with @param errno set on error.
+ */
+ssize_t ml_io_write(ml_t *w, const void *buf, size_t len)
+{
+	ssize_t num;
+
+	if (!w) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	num = write(w->fd, buf, len);
+	if (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		ml_io_clear(w, MINILOOP_WRITE);
+
+	return num;
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
@@ -0,0 +1,207 @@
+/* miniloop - Listening sockets with batched accept
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The listening socket is a level-triggered watcher, each wakeup runs
+ * accept4() until %EAGAIN or %MINILOOP_LISTEN_BATCH connections, what
+ * is left is reported again by the next wait, after the other watchers
+ * have had their turn.  New sockets are non-blocking from accept4(),
+ * no fcntl(), and their watchers come from the context's pool.  Since
+ * the accept callback runs inside ml_run(), the registrations of a
+ * whole batch go to the kernel together, right before the next wait.
+ */
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "miniloop.h"
+
+static void error(ml_listen_t *l)
+{
+	l->cb(l, l->arg, NULL, NULL, 0);
+}
+
+/* Connection is gone, or a network error the next one may not have */
+static int transient(int err)
+{
+	switch (err) {
+	case EINTR:
+	case ECONNABORTED:
+	case EPROTO:
+	case ENETDOWN:
+	case ENOPROTOOPT:
+	case EHOSTDOWN:
+	case ENONET:
+	case EHOSTUNREACH:
+	case EOPNOTSUPP:
+	case ENETUNREACH:
+	case EPERM:		/* Firewall rules */
+		return 1;
+	}
+
+	return 0;
+}
+
+static void listen_cb(ml_t *w, void *arg, int events)
+{
+	ml_listen_t *l = arg;
+	unsigned int i;
+
+	/* Stopped by ml_run() */
+	if (events & (MINILOOP_ERROR | MINILOOP_HUP)) {
+		socklen_t len = sizeof(int);
+		int err = 0;
+
+		if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len) || !err)
+			err = EIO;
+		errno = err;
+		error(l);
+		return;
+	}
+
+	for (i = 0; i < MINILOOP_LISTEN_BATCH && ml_listen_active(l); i++) {
+		struct sockaddr_storage ss;
+		socklen_t len = sizeof(ss);
+		ml_t *c;
+		int sd, err;
+
+		sd = accept4(w->fd, (struct sockaddr *)&ss, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (transient(errno))
+				continue;
+
+			/* E.g. EMFILE, the rest of the backlog must wait */
+			error(l);
+			return;
+		}
+
+		c = ml_alloc(l->ctx);
+		if (!c || ml_io_init(l->ctx, c, l->io_cb, l->arg, sd, l->events)) {
+			err = errno;
+			if (c)
+				ml_free(c);
+			close(sd);
+			errno = err;
+			error(l);
+			return;
+		}
+
+		l->cb(l, l->arg, c, (struct sockaddr *)&ss, len);
+	}
+}
+
+/**
+ * Create a listening socket watcher
+ * @param ctx     A valid miniloop context
+ * @param l       Pointer to an ml_listen_t
+ * @param cb      Called for each new connection, and errors
+ * @param arg     Optional callback argument, also given to @param io_cb
+ * @param fd      Listening socket, non-blocking
+ * @param io_cb   Callback of the watchers for new connections
+ * @param events  Events for the new connections: %MINILOOP_READ, %MINILOOP_WRITE, ...
+ * @param flags   %MINILOOP_LISTEN_SHARED, or zero
+ *
+ * Each wakeup accepts up to %MINILOOP_LISTEN_BATCH connections.  For
+ * each one a watcher is taken from the pool, see ml_alloc(), started
+ * as an I/O watcher on the new non-blocking socket with @param io_cb
+ * and @param events, and handed to @param cb.  The callback owns the
+ * watcher, it may set its @arg to the connection's state, and releases
+ * it with close(w->fd) and ml_free(w).
+ *
+ * When accept4() fails, e.g. with %EMFILE, @param cb is called with a
+ * %NULL watcher and errno set.  The listener stays active, so it is
+ * called again on the next iteration, stop it to back off.  After a
+ * socket error the listener is stopped.
+ *
+ * With %MINILOOP_LISTEN_SHARED the socket is registered with
+ * %MINILOOP_EXCLUSIVE, for a socket shared by many contexts, e.g. one
+ * per thread, so that a new connection wakes up one of them instead of
+ * all.  Ignored by the io_uring backend.  The socket is not closed by
+ * miniloop.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_listen_init(ml_ctx_t *ctx, ml_listen_t *l, ml_accept_cb_t *cb, void *arg, int fd,
+		   ml_cb_t *io_cb, int events, int flags)
+{
+	int mask = MINILOOP_READ;
+
+	if (!ctx || !l || !cb || !io_cb || fd < 0 || (flags & ~MINILOOP_LISTEN_SHARED)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (flags & MINILOOP_LISTEN_SHARED)
+		mask |= MINILOOP_EXCLUSIVE;
+
+	l->ctx    = ctx;
+	l->cb     = cb;
+	l->arg    = arg;
+	l->io_cb  = io_cb;
+	l->events = events;
+
+	return ml_io_init(ctx, &l->w, listen_cb, l, fd, mask);
+}
+
+/**
+ * Start a listening socket watcher (again)
+ * @param l  Watcher to start
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_listen_start(ml_listen_t *l)
+{
+	if (!l || !l->cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return ml_io_start(&l->w);
+}
+
+/**
+ * Stop a listening socket watcher
+ * @param l  Watcher to stop
+ *
+ * Connections are left in the backlog of the socket, accepted when
+ * the watcher is started again.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_listen_stop(ml_listen_t *l)
+{
+	if (!l || !l->cb) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return ml_io_stop(&l->w);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
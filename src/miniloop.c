@@ -25,23 +25,49 @@
 
 #include <errno.h>
 #include <fcntl.h>		/* O_CLOEXEC */
+#include <stddef.h>		/* offsetof() */
+#include <stdlib.h>		/* free() */
 #include <string.h>		/* memset() */
 #include <sys/epoll.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>		/* for select() workaround */
-#include <sys/signalfd.h>	/* struct signalfd_siginfo */
+#include <time.h>		/* clock_gettime() */
 #include <unistd.h>		/* close(), read() */
 
 #include "miniloop.h"
 
+/* Busy poll parameters of an epoll instance, Linux 6.9 */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t  prefer_busy_poll;
+	uint8_t  __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+#define BUSYPOLL_BUDGET 8	/* Packets per NAPI poll, the kernel default */
+
+/*
+ * Watchers are allocated by the hundred thousand, keep them small, and
+ * what ml_run() reads for each event in the first cache line of pool
+ * watchers, which are 64-byte aligned, see ml_private_t.  No larger than
+ * it has always been, the bookkeeping is in the context, see ml_node_t.
+ */
+_Static_assert(sizeof(ml_t) <= 80, "ml_t has grown");
+_Static_assert(offsetof(ml_t, u.e.track) + sizeof(int) <= 64, "Dispatch fields of ml_t span cache lines");
+
 
 static int _init(ml_ctx_t *ctx, int close_old)
 {
 	int fd;
 	int inotify_fd;
 
-	fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->flags & MINILOOP_IO_URING)
+		fd = _ml_uring_init(ctx);
+	else
+		fd = epoll_create1(EPOLL_CLOEXEC);
   inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
   /* 
@@ -50,6 +76,14 @@ static int _init(ml_ctx_t *ctx, int close_old)
    * */
 
   if (fd < 0 || inotify_fd < 0) {
+		if (inotify_fd > -1)
+			close(inotify_fd);
+		if (fd > -1) {
+			if (ctx->ring)
+				_ml_uring_exit(ctx);
+			else
+				close(fd);
+		}
 		return -1;
   }
 
@@ -64,18 +98,409 @@ static int _init(ml_ctx_t *ctx, int close_old)
 	return 0;
 }
 
-/* Used by file i/o workaround when epoll => EPERM */
-static int has_data(int fd)
+/*
+ * Double the event cache when epoll_wait() filled it, up to
+ * %MINILOOP_MAX_EVENTS, or maxevents if that is larger.  A cache of
+ * one is kept that way, for callers that want one event per wakeup.
+ */
+static void grow(ml_ctx_t *ctx)
+{
+	struct epoll_event *events;
+	int maxevents;
+
+	if (ctx->maxevents < 2 || ctx->maxevents >= MINILOOP_MAX_EVENTS)
+		return;
+
+	maxevents = ctx->maxevents * 2;
+	if (maxevents > MINILOOP_MAX_EVENTS)
+		maxevents = MINILOOP_MAX_EVENTS;
+
+	/* Not fatal, keep using the old cache */
+	events = realloc(ctx->events, maxevents * sizeof(*events));
+	if (!events)
+		return;
+
+	ctx->events    = events;
+	ctx->maxevents = maxevents;
+}
+
+/* Wait for events from the kernel, same semantics as epoll_wait() */
+static int wait_events(ml_ctx_t *ctx, struct epoll_event *ee, int maxevents, int timeout)
+{
+	if (ctx->ring)
+		return _ml_uring_wait(ctx, ee, maxevents, timeout);
+
+	return epoll_wait(ctx->fd, ee, maxevents, timeout);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * With %MINILOOP_BUSYPOLL, poll without blocking for up to spin_ns, or
+ * until the timeout if that is sooner, then block for the rest of it.
+ */
+static int busy_wait(ml_ctx_t *ctx, struct epoll_event *ee, int maxevents, int timeout)
+{
+	uint64_t start, spin, elapsed;
+	int nfds;
+
+	if (!timeout || !ctx->spin_ns)
+		return wait_events(ctx, ee, maxevents, timeout);
+
+	spin = ctx->spin_ns;
+	if (timeout > 0 && (uint64_t)timeout * 1000000 < spin)
+		spin = (uint64_t)timeout * 1000000;
+
+	start = now_ns();
+	do {
+		nfds = wait_events(ctx, ee, maxevents, 0);
+		if (nfds) {
+			if (nfds > 0)
+				_ML_STATS_SPIN(ctx, start, nfds);
+			return nfds;
+		}
+
+		elapsed = now_ns() - start;
+	} while (elapsed < spin);
+	_ML_STATS_SPIN(ctx, start, 0);
+
+	if (timeout > 0) {
+		timeout -= elapsed / 1000000;
+		if (timeout <= 0)
+			return 0;
+	}
+
+	return wait_events(ctx, ee, maxevents, timeout);
+}
+
+/*
+ * Called when a watcher is stopped, maybe by a callback in ml_run(),
+ * forget its event in the current batch, or in the backlog.  The
+ * watcher may be freed, or restarted with another fd, before it is
+ * served.  A watcher has one event at most, found by w->epos, which is
+ * left over from an earlier batch unless the entry still points to it.
+ */
+static void drop_events(ml_t *w)
+{
+	ml_ctx_t *ctx = w->ctx;
+	int pos = w->epos;
+
+	if (pos > 0 && pos <= ctx->enfds && ctx->ebatch[pos - 1].data.ptr == w)
+		ctx->ebatch[pos - 1].data.ptr = NULL;
+	else if (pos < 0)
+		ctx->backlog[-pos - 1].data.ptr = NULL;
+
+	w->epos = 0;
+}
+
+/* Bucket for a priority, zero is the highest */
+#define PRIO_BUCKETS (MINILOOP_PRIO_MAX - MINILOOP_PRIO_MIN + 1)
+#define PRIO_BUCKET(w) (MINILOOP_PRIO_MAX - (w)->prio)
+
+/*
+ * Order a batch by priority, highest first.  Events held back by the
+ * budget in the last iteration go first within their priority, a
+ * watcher with new events as well is dispatched once, with both.
+ */
+static struct epoll_event *sort_events(ml_ctx_t *ctx, struct epoll_event *ee, int *nfds)
+{
+	int count[PRIO_BUCKETS] = { 0 }, pos[PRIO_BUCKETS];
+	int i, max = *nfds + ctx->nbacklog;
+	struct epoll_event *sorted;
+	ml_t *w;
+
+	/* First the merge, no watcher is both in the batch and the backlog */
+	for (i = 0; i < *nfds; i++) {
+		w = ee[i].data.ptr;
+		if (!w)
+			continue;
+
+		if (w->epos < 0) {
+			ctx->backlog[-w->epos - 1].events |= ee[i].events;
+			ee[i].data.ptr = NULL;
+			continue;
+		}
+		count[PRIO_BUCKET(w)]++;
+	}
+
+	if (max > ctx->sorted_max) {
+		sorted = realloc(ctx->sorted, max * sizeof(*sorted));
+		if (!sorted)
+			return ee; /* Not fatal, unsorted and the backlog waits */
+
+		ctx->sorted     = sorted;
+		ctx->sorted_max = max;
+	}
+	sorted = ctx->sorted;
+	for (i = 0; i < ctx->nbacklog; i++) {
+		w = ctx->backlog[i].data.ptr;
+		if (w)
+			count[PRIO_BUCKET(w)]++;
+	}
+
+	for (i = 0, max = 0; i < PRIO_BUCKETS; i++) {
+		pos[i] = max;
+		max += count[i];
+	}
+
+	for (i = 0; i < ctx->nbacklog; i++) {
+		w = ctx->backlog[i].data.ptr;
+		if (!w)
+			continue;
+
+		w->epos = 0;
+		sorted[pos[PRIO_BUCKET(w)]++] = ctx->backlog[i];
+	}
+	ctx->nbacklog = 0;
+
+	for (i = 0; i < *nfds; i++) {
+		w = ee[i].data.ptr;
+		if (w)
+			sorted[pos[PRIO_BUCKET(w)]++] = ee[i];
+	}
+
+	*nfds = max;
+
+	return sorted;
+}
+
+/* Hold back an event over the budget until the next iteration */
+static int defer(ml_ctx_t *ctx, struct epoll_event *ev)
+{
+	ml_t *w = ev->data.ptr;
+
+	if (ctx->nbacklog == ctx->backlog_max) {
+		int max = ctx->backlog_max ? 2 * ctx->backlog_max : 64;
+		struct epoll_event *backlog;
+
+		backlog = realloc(ctx->backlog, max * sizeof(*backlog));
+		if (!backlog)
+			return -1;
+
+		ctx->backlog     = backlog;
+		ctx->backlog_max = max;
+	}
+
+	ctx->backlog[ctx->nbacklog++] = *ev;
+	w->epos = -ctx->nbacklog;
+
+	return 0;
+}
+
+/* Take a node for a watcher being started, or closed, see ml_node_t */
+static int node_get(ml_t *w)
 {
-	struct timeval timeout = { 0, 0 };
-	fd_set fds;
-	int n = 0;
+	ml_ctx_t *ctx = w->ctx;
+	ml_node_t *n;
+	int i;
+
+	if (ctx->nodes_free) {
+		i = ctx->nodes_free - 1;
+		ctx->nodes_free = ctx->nodes[i].link;
+	} else {
+		if (ctx->nnodes == ctx->nodes_max) {
+			int max = ctx->nodes_max ? 2 * ctx->nodes_max : 64;
+			ml_node_t *nodes;
 
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
+			nodes = realloc(ctx->nodes, max * sizeof(*nodes));
+			if (!nodes)
+				return -1;
 
-	if (select(1, &fds, NULL, NULL, &timeout) > 0)
-		return ioctl(0, FIONREAD, &n) == 0 && n > 0;
+			ctx->nodes     = nodes;
+			ctx->nodes_max = max;
+		}
+		i = ctx->nnodes++;
+	}
+
+	n = &ctx->nodes[i];
+	n->w      = w;
+	n->slot   = NULL;
+	n->change = 0;
+	n->link   = 0;
+	w->node   = i + 1;
+
+	return 0;
+}
+
+/* Put back a node, by index + 1, the watcher may have been restarted */
+static void node_put(ml_ctx_t *ctx, int node)
+{
+	ml_node_t *n = &ctx->nodes[node - 1];
+
+	if (n->w->node == node)
+		n->w->node = 0;
+	n->w    = NULL;
+	n->link = ctx->nodes_free;
+	ctx->nodes_free = node;
+}
+
+/*
+ * Queue a watcher's ADD or MOD for the changelist, sent to the kernel
+ * by flush() just before the next wait.  Slot is index + 1 in @change.
+ */
+static int change(ml_t *w)
+{
+	ml_ctx_t *ctx = w->ctx;
+
+	if (_ML_NODE(w)->change)
+		return 0;
+
+	if (ctx->nchanges == ctx->changes_max) {
+		int max = ctx->changes_max ? 2 * ctx->changes_max : 64;
+		ml_t **changes;
+
+		changes = realloc(ctx->changes, max * sizeof(*changes));
+		if (!changes)
+			return -1;
+
+		ctx->changes     = changes;
+		ctx->changes_max = max;
+	}
+
+	ctx->changes[ctx->nchanges++] = w;
+	_ML_NODE(w)->change = ctx->nchanges;
+
+	return 0;
+}
+
+/* Drop a watcher's queued change, the last one takes its slot */
+static void unchange(ml_t *w)
+{
+	ml_ctx_t *ctx = w->ctx;
+	ml_node_t *n = _ML_NODE(w);
+	ml_t *last;
+
+	if (!n->change)
+		return;
+
+	last = ctx->changes[--ctx->nchanges];
+	ctx->changes[n->change - 1] = last;
+	_ML_NODE(last)->change = n->change;
+	n->change = 0;
+}
+
+static int ctl(ml_t *w, int op)
+{
+	struct epoll_event ev;
+
+	/* Exclusive wakeups refuse EPOLLRDHUP, EINVAL */
+	ev.events   = w->events;
+	if (!(w->events & EPOLLEXCLUSIVE))
+		ev.events |= EPOLLRDHUP;
+	ev.data.ptr = w;
+
+	return epoll_ctl(w->ctx->fd, op, w->fd, &ev);
+}
+
+/* Register with epoll, sets @active */
+static int add(ml_t *w)
+{
+	_ML_STATS_CTL(w, MINILOOP_STATS_ADD);
+	if (ctl(w, EPOLL_CTL_ADD) < 0) {
+		if (errno != EPERM)
+			return -1;
+
+		/* Regular files cannot be polled, e.g. `application < file.txt` */
+		if (w->type != MINILOOP_IO_TYPE || w->u.e.track)
+			return -1;
+
+		_ml_io_always(w);
+	}
+	w->active = 1;
+
+	return 0;
+}
+
+/*
+ * Send the changelist to the kernel, right before waiting for events.
+ * A watcher started and stopped since the last wait never got here,
+ * and any number of rearms are one EPOLL_CTL_MOD with the final mask.
+ * A watcher the kernel refuses, e.g., its fd has been closed, is
+ * stopped and its callback gets %MINILOOP_ERROR, like ml_io_start()
+ * would have returned outside of ml_run().
+ */
+static void flush(ml_ctx_t *ctx)
+{
+	while (ctx->nchanges) {
+		ml_t *w = ctx->changes[--ctx->nchanges];
+		int rc;
+
+		_ML_NODE(w)->change = 0;
+		if (w->active == MINILOOP_ADD_PENDING) {
+			rc = add(w);
+		} else {
+			_ML_STATS_CTL(w, MINILOOP_STATS_MOD);
+			rc = ctl(w, EPOLL_CTL_MOD);
+
+			/* Closed and reopened behind our back */
+			if (rc && errno == ENOENT)
+				rc = add(w);
+		}
+
+		if (!rc)
+			continue;
+
+		/* The callback gets the errno of the failed change */
+		rc = errno;
+		_ml_watcher_close(w);
+		errno = rc;
+		if (w->cb)
+			_ML_CALL(w, MINILOOP_ERROR);
+	}
+}
+
+/* Call close callbacks of watchers given to ml_close() */
+static void run_closing(ml_ctx_t *ctx)
+{
+	while (ctx->closing) {
+		int node = ctx->closing;
+		ml_node_t *n = &ctx->nodes[node - 1];
+		ml_close_cb_t *cb = n->close;
+		ml_t *w = n->w;
+
+		ctx->closing = n->link;
+		node_put(ctx, node);
+		w->active = 0;
+		if (cb)
+			cb(w, w->arg);
+	}
+}
+
+/*
+ * Arm timers set up before the loop was started.  Only once, calling
+ * ml_run() again, e.g. with %MINILOOP_ONCE, must not push them out.
+ */
+static void start(ml_ctx_t *ctx)
+{
+	int i;
+
+	if (ctx->running)
+		return;
+
+	ctx->running = 1;
+	for (i = 0; i < ctx->nnodes; i++) {
+		ml_t *w = ctx->nodes[i].w;
+
+		if (w && MINILOOP_TIMER_TYPE == w->type && _ml_watcher_active(w))
+			ml_timer_set_ns(w, w->u.t.timeout, w->u.t.period, w->u.t.flags);
+	}
+}
+
+/* Send watcher changes made by callbacks, when not followed by a wait */
+static int submit(ml_ctx_t *ctx)
+{
+	if (ctx->ring)
+		return _ml_uring_submit(ctx);
+
+	if (ctx->nchanges)
+		flush(ctx);
 
 	return 0;
 }
@@ -91,10 +516,13 @@ int _ml_watcher_init(ml_ctx_t *ctx, ml_t *w, ml_type_t type, ml_cb_t *cb, void *
 	w->ctx    = ctx;
 	w->type   = type;
 	w->active = 0;
+	w->node   = 0;
 	w->fd     = fd;
 	w->cb     = cb;
 	w->arg    = arg;
 	w->events = events;
+	w->prio   = 0;
+	w->epos   = 0;
 
 	return 0;
 }
@@ -102,8 +530,6 @@ int _ml_watcher_init(ml_ctx_t *ctx, ml_t *w, ml_type_t type, ml_cb_t *cb, void *
 /* Private to miniloop, do not use directly! */
 int _ml_watcher_start(ml_t *w)
 {
-	struct epoll_event ev;
-
 	if (!w || w->fd < 0 || !w->ctx) {
 		errno = EINVAL;
 		return -1;
@@ -111,36 +537,44 @@ int _ml_watcher_start(ml_t *w)
 
 	if (_ml_watcher_active(w))
 		return 0;
+	_ML_TRACE_WATCHER(watcher__start, w);
 
-	ev.events   = w->events | EPOLLRDHUP;
-	ev.data.ptr = w;
-	if (epoll_ctl(w->ctx->fd, EPOLL_CTL_ADD, w->fd, &ev) < 0) {
-		if (errno != EPERM)
-			return -1;
-
-		/* Handle special case: `application < file.txt` */
-		if (w->type != MINILOOP_IO_TYPE || w->events != MINILOOP_READ)
-			return -1;
-
-		/* Only allow this special handling for stdin */
-		if (w->fd != STDIN_FILENO)
-			return -1;
+	/* For bookkeeping, see ml_node_t */
+	if (node_get(w))
+		return -1;
 
-		w->ctx->workaround = 1;
-		w->active = -1;
-	} else {
+	if (w->ctx->ring) {
+		_ML_STATS_CTL(w, MINILOOP_STATS_ADD);
+		if (_ml_uring_start(w))
+			goto fail;
 		w->active = 1;
+		goto done;
+	}
+
+	/* From a callback, wait for the rest of the iteration's changes */
+	if (w->ctx->batch && !change(w)) {
+		w->active = MINILOOP_ADD_PENDING;
+		goto done;
 	}
 
-	/* Add to internal list for bookkeeping */
-	_MINILOOP_INSERT(w, w->ctx->watchers);
+	if (add(w))
+		goto fail;
+
+done:
+	w->ctx->nwatchers++;
 
 	return 0;
+fail:
+	node_put(w->ctx, w->node);
+
+	return -1;
 }
 
 /* Private to miniloop, do not use directly! */
 int _ml_watcher_stop(ml_t *w)
 {
+	int pending, rc = 0;
+
 	if (!w) {
 		errno = EINVAL;
 		return -1;
@@ -148,42 +582,232 @@ int _ml_watcher_stop(ml_t *w)
 
 	if (!_ml_watcher_active(w))
 		return 0;
+	_ML_TRACE_WATCHER(watcher__stop, w);
 
+	pending = w->active == MINILOOP_ADD_PENDING;
 	w->active = 0;
+	w->ctx->nwatchers--;
+	drop_events(w);
+
+	if (w->ctx->ring) {
+		_ML_STATS_CTL(w, MINILOOP_STATS_DEL);
+		rc = _ml_uring_stop(w);
+	} else {
+		/* Never got to the kernel, nothing to undo */
+		unchange(w);
+
+		/* Remove from kernel now, the fd may be closed after we return */
+		if (!pending) {
+			_ML_STATS_CTL(w, MINILOOP_STATS_DEL);
+			rc = epoll_ctl(w->ctx->fd, EPOLL_CTL_DEL, w->fd, NULL) < 0 ? -1 : 0;
+		}
+	}
+	node_put(w->ctx, w->node);
+
+	return rc;
+}
+
+/* Private to miniloop, do not use directly! */
+int _ml_watcher_rearm(ml_t *w)
+{
+	if (!w || w->fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	/* Remove from internal list */
-	_MINILOOP_REMOVE(w, w->ctx->watchers);
+	/* Not started, same as EPOLL_CTL_MOD would say */
+	if (!w->node) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (w->ctx->ring) {
+		_ML_STATS_CTL(w, MINILOOP_STATS_MOD);
+		return _ml_uring_rearm(w);
+	}
 
-	/* Remove from kernel */
-	if (epoll_ctl(w->ctx->fd, EPOLL_CTL_DEL, w->fd, NULL) < 0)
+	/* Already queued, the ADD or MOD is sent with the new mask */
+	if (_ML_NODE(w)->change || (w->ctx->batch && !change(w)))
+		return 0;
+
+	_ML_STATS_CTL(w, MINILOOP_STATS_MOD);
+	if (ctl(w, EPOLL_CTL_MOD) < 0)
 		return -1;
 
 	return 0;
 }
 
-/* Private to miniloop, do not use directly! */
-int _ml_watcher_active(ml_t *w)
+/* Private to miniloop, do not use directly!  For watchers without an fd */
+int _ml_watcher_attach(ml_t *w)
 {
-	if (!w)
+	if (!w || !w->ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (_ml_watcher_active(w))
 		return 0;
 
-	return w->active > 0;
+	if (node_get(w))
+		return -1;
+	w->active = 1;
+	w->ctx->nwatchers++;
+
+	return 0;
 }
 
-/* Private to miniloop, do not use directly! */
-int _ml_watcher_rearm(ml_t *w)
+/* Private to miniloop, do not use directly!  For watchers without an fd */
+int _ml_watcher_detach(ml_t *w)
 {
-	struct epoll_event ev;
+	if (!w) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	if (!w || w->fd < 0) {
+	if (!_ml_watcher_active(w))
+		return 0;
+
+	w->active = 0;
+	w->ctx->nwatchers--;
+	node_put(w->ctx, w->node);
+
+	return 0;
+}
+
+/* Private to miniloop, do not use directly!  Stop any type of watcher */
+int _ml_watcher_close(ml_t *w)
+{
+	if (!w) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	ev.events   = w->events | EPOLLRDHUP;
-	ev.data.ptr = w;
-	if (epoll_ctl(w->ctx->fd, EPOLL_CTL_MOD, w->fd, &ev) < 0)
+	switch (w->type) {
+	case MINILOOP_TIMER_TYPE:
+		return ml_timer_stop(w);
+
+	case MINILOOP_IO_TYPE:
+		return ml_io_stop(w);
+
+	case MINILOOP_SIGNAL_TYPE:
+		return ml_signal_stop(w);
+
+	case MINILOOP_FS_TYPE:
+		return _ml_watcher_stop(w);
+
+	case MINILOOP_EVENT_TYPE:
+		return ml_event_stop(w);
+
+	case MINILOOP_FSWATCH_TYPE:
+		return ml_fswatch_stop(w);
+
+	case MINILOOP_PREPARE_TYPE:
+		return ml_prepare_stop(w);
+
+	case MINILOOP_CHECK_TYPE:
+		return ml_check_stop(w);
+
+	case MINILOOP_IDLE_TYPE:
+		return ml_idle_stop(w);
+	}
+
+	return 0;
+}
+
+/**
+ * Stop a watcher and release it at the end of the loop iteration
+ * @param w   Watcher to close, of any type
+ * @param cb  Called when @param w is no longer referenced, or %NULL
+ *
+ * Stops @param w, like its ml_*_stop() function, and calls @param cb
+ * with the watcher's callback argument once ml_run() is done with the
+ * events of the current iteration, or from ml_exit().  It is the safe
+ * place to free the memory of the watcher, or what @param w is part
+ * of, e.g. a connection.  Outside of ml_run() @param cb is called
+ * before this function returns.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_close(ml_t *w, ml_close_cb_t *cb)
+{
+	ml_ctx_t *ctx;
+
+	if (!w || !w->ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Already closing */
+	if (w->active == -2)
+		return 0;
+
+	ctx = w->ctx;
+	_ml_watcher_close(w);
+
+	/* Reuses the node it had, if it was active */
+	if (node_get(w))
+		return -1;
+	_ML_NODE(w)->close = cb;
+	_ML_NODE(w)->link  = ctx->closing;
+	ctx->closing = w->node;
+	w->active = -2;
+
+	if (!ctx->batch)
+		run_closing(ctx);
+
+	return 0;
+}
+
+/**
+ * Set the dispatch priority of a watcher
+ * @param w     An initialized watcher
+ * @param prio  %MINILOOP_PRIO_MIN to %MINILOOP_PRIO_MAX, default zero
+ *
+ * Each batch of events from the kernel is dispatched highest priority
+ * first, so control traffic is not queued behind a flood of events for
+ * busy data sockets.  Together with ml_budget() watchers below zero can
+ * also be held back to the next iteration.  Re-initializing a watcher
+ * resets its priority, set it after ml_*_init().
+ *
+ * The priority of a signal watcher has no effect, the shared signalfd
+ * all signal watchers are called from has the highest priority.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_priority_set(ml_t *w, int prio)
+{
+	if (!w || !w->ctx || prio < MINILOOP_PRIO_MIN || prio > MINILOOP_PRIO_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	w->prio = prio;
+	if (prio)
+		w->ctx->prio = 1;
+
+	return 0;
+}
+
+/**
+ * Limit low priority callbacks per loop iteration
+ * @param ctx  A valid miniloop context
+ * @param num  Max. callbacks for watchers with priority below zero, zero for no limit
+ *
+ * Events for low priority watchers over the budget are held back, and
+ * dispatched first among their priority in the next iteration, which
+ * then does not block.  Nothing is lost, also not edge triggered or
+ * one-shot events.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_budget(ml_ctx_t *ctx, int num)
+{
+	if (!ctx || num < 0) {
+		errno = EINVAL;
 		return -1;
+	}
+
+	ctx->budget = num;
 
 	return 0;
 }
@@ -197,29 +821,137 @@ int _ml_watcher_rearm(ml_t *w)
  * @param maxevents argument, which controls the number of events
  * in the event cache returned to the main loop.
  *
- * In cases where you have multiple events pending in the cache and some
- * event may cause later ones, already sent by the kernel to userspace,
- * to be deleted the pointer returned to the event loop for this later
- * event may be deleted.
+ * The event cache is allocated per context.  Whenever a wakeup fills
+ * it, it is doubled, up to %MINILOOP_MAX_EVENTS, so that a busy loop
+ * drains many ready descriptors per call to epoll_wait().  With
+ * @param maxevents set to 1 it never grows.
  *
- * There are two ways around this (accessing deleted memory); 1) use
- * this function to initialize your event loop and set @param maxevents
- * to 1, 2) use a free list in you application that you garbage collect
- * at intervals relevant to your application.
+ * In cases where you have multiple events pending in the cache and some
+ * callback stops a watcher that has a later event in the cache, that
+ * event is dropped.  So a callback may stop, and free, any watcher.
+ * To free a watcher without knowing its type, or running from it, use
+ * ml_close(), or allocate watchers from the context with ml_alloc()
+ * and release them with ml_free().  Both defer reuse of the memory
+ * until the event cache has been processed.
  *
  * @return POSIX OK(0) on success, or non-zero on error.
  */
 int ml_init(ml_ctx_t *ctx, int maxevents)
+{
+	return ml_init1(ctx, maxevents, 0);
+}
+
+/**
+ * Create an event loop context with optional features
+ * @param ctx       Pointer to an ml_ctx_t context to be initialized
+ * @param maxevents Maximum number of events in event cache
+ * @param flags     A mask of %MINILOOP_TIMER_HEAP and %MINILOOP_IO_URING, or zero
+ *
+ * This function is the same as @func ml_init() except for the @param
+ * flags argument.  With %MINILOOP_TIMER_HEAP all timer watchers in this
+ * context are kept in a userspace 4-ary heap instead of each having its
+ * own timerfd.  The heap drives the epoll_wait() timeout in ml_run(),
+ * so arming a timer costs no system calls and no file descriptors.
+ * Pushing the deadline of an armed timer further out, e.g. an idle
+ * timeout reset on every read, is O(1).
+ *
+ * With %MINILOOP_IO_URING the context uses io_uring instead of epoll,
+ * which implies %MINILOOP_TIMER_HEAP.  Watchers are armed and disarmed
+ * by queueing requests on the ring, all changes made by callbacks are
+ * submitted together with the wait for new events, i.e., a single
+ * system call per ml_run() iteration.  Fails with the errno from
+ * io_uring_setup(2) if the kernel does not support it.
+ *
+ * @return POSIX OK(0) on success, or non-zero on error.
+ */
+int ml_init1(ml_ctx_t *ctx, int maxevents, int flags)
 {
 	if (!ctx || maxevents < 1) {
 		errno = EINVAL;
 		return -1;
 	}
 
+	/* The ring replaces timerfds with its own timeout */
+	if (flags & MINILOOP_IO_URING)
+		flags |= MINILOOP_TIMER_HEAP;
+
 	memset(ctx, 0, sizeof(*ctx));
 	ctx->maxevents = maxevents;
+	ctx->flags     = flags;
+	ctx->spin_ns   = MINILOOP_BUSYPOLL_US * 1000ULL;
+	ml_now_update(ctx);
 
-	return _init(ctx, 0);
+	ctx->events = calloc(maxevents, sizeof(struct epoll_event));
+	if (!ctx->events)
+		return -1;
+
+	if (_init(ctx, 0)) {
+		free(ctx->events);
+		ctx->events = NULL;
+		return -1;
+	}
+
+	if (_ML_STATS_INIT(ctx)) {
+		ml_exit(ctx);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Set up busy polling, for ml_run() with %MINILOOP_BUSYPOLL
+ * @param ctx        A valid miniloop context
+ * @param spin_us    Time to poll for events before blocking, in microseconds
+ * @param kernel_us  Time for the kernel to busy poll the device queues, or zero
+ *
+ * Each wait in ml_run() with %MINILOOP_BUSYPOLL first polls for events
+ * without blocking, for @param spin_us, default %MINILOOP_BUSYPOLL_US,
+ * or until the next timer if that is sooner.  Only when nothing comes
+ * in does it block.  This saves the wakeup of a sleeping thread, at
+ * the cost of a CPU running while idle.  With statistics, spins ending
+ * with events and with blocking are counted, see ml_stats_get(), to
+ * tune @param spin_us against the latency it buys.
+ *
+ * With @param kernel_us the epoll instance itself busy polls the
+ * network device queues of its sockets, skipping interrupts, Linux 6.9
+ * and later.  For this the system needs napi_defer_hard_irqs and
+ * gro_flush_timeout set, see the kernel's busy poll documentation.
+ * Sockets may also set SO_BUSY_POLL for the same in blocking reads.
+ * Not supported by the io_uring backend.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_busypoll(ml_ctx_t *ctx, unsigned int spin_us, unsigned int kernel_us)
+{
+	struct epoll_params params = {
+		.busy_poll_usecs  = kernel_us,
+		.busy_poll_budget = kernel_us ? BUSYPOLL_BUDGET : 0,
+	};
+
+	if (!ctx || ctx->fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ctx->spin_ns = spin_us * 1000ULL;
+
+	if (ctx->ring) {
+		if (!kernel_us)
+			return 0;
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (ioctl(ctx->fd, EPIOCSPARAMS, &params)) {
+		if (!kernel_us)
+			return 0;
+		if (errno == ENOTTY)
+			errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	return 0;
 }
 
 /**
@@ -231,61 +963,101 @@ int ml_init(ml_ctx_t *ctx, int maxevents)
 int ml_exit(ml_ctx_t *ctx)
 {
 	ml_t *w;
+	int i;
 
 	if (!ctx) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	_MINILOOP_FOREACH(w, ctx->watchers) {
-		/* Remove from internal list */
-		_MINILOOP_REMOVE(w, ctx->watchers);
+	/* Parked coroutines are dropped, their watchers stopped */
+	_ml_co_exit(ctx);
 
-		if (!_ml_watcher_active(w))
+	for (i = 0; i < ctx->nnodes; i++) {
+		w = ctx->nodes[i].w;
+		if (!w || !_ml_watcher_active(w))
 			continue;
 
-		switch (w->type) {
-    case MINILOOP_TIMER_TYPE:
-			ml_timer_stop(w);
-			break;
-
-		case MINILOOP_IO_TYPE:
-			ml_io_stop(w);
-			break;
-
-		case MINILOOP_SIGNAL_TYPE:
-			ml_signal_stop(w);
-			break;
-
-    case MINILOOP_FS_TYPE:
-      // FIXME
-      break;
-
-		case MINILOOP_EVENT_TYPE:
-			ml_event_stop(w);
-			break;
-		}
+		/* Watches are dropped with the inotify fd, signals with the signalfd */
+		if (w->type == MINILOOP_FSWATCH_TYPE || w->type == MINILOOP_SIGNAL_TYPE)
+			_ml_watcher_detach(w);
+		else
+			_ml_watcher_close(w);
 	}
 
-	ctx->watchers = NULL;
+	/* Last chance to free closed watchers */
+	ctx->enfds = 0;
+	run_closing(ctx);
+
+	/* Joins worker threads, pending requests are dropped */
+	_ml_fs_exit(ctx);
+	_ml_fswatch_exit(ctx);
+	_ml_signal_exit(ctx);
+	_ml_pool_exit(ctx);
+	_ml_buf_exit(ctx);
+
+	free(ctx->nodes);
+	ctx->nodes = NULL;
+	ctx->nnodes = ctx->nodes_max = ctx->nodes_free = 0;
+	ctx->nwatchers = 0;
 	ctx->running = 0;
-	if (ctx->fd > -1)
+	ctx->batch   = 0;
+
+	free(ctx->events);
+	ctx->events = NULL;
+
+	free(ctx->timers);
+	ctx->timers = NULL;
+	free(ctx->changes);
+	ctx->changes = NULL;
+	ctx->nchanges = ctx->changes_max = 0;
+	free(ctx->sorted);
+	ctx->sorted = NULL;
+	ctx->sorted_max = 0;
+	for (i = 0; i < ctx->nbacklog; i++) {
+		w = ctx->backlog[i].data.ptr;
+		if (w)
+			w->epos = 0;
+	}
+	free(ctx->backlog);
+	ctx->backlog = NULL;
+	ctx->nbacklog = ctx->backlog_max = 0;
+	_ML_STATS_EXIT(ctx);
+	ml_trace_init(ctx, 0);
+	ctx->ntimers = ctx->timers_max = 0;
+
+	if (ctx->ring)
+		_ml_uring_exit(ctx);
+	else if (ctx->fd > -1)
 		close(ctx->fd);
 	ctx->fd = -1;
 
+	if (ctx->inotify_fd > -1)
+		close(ctx->inotify_fd);
+	ctx->inotify_fd = -1;
+
 	return 0;
 }
 
 /**
  * Start the event loop
  * @param ctx    A valid miniloop context
- * @param flags  A mask of %MINILOOP_ONCE and %MINILOOP_NONBLOCK, or zero
+ * @param flags  A mask of %MINILOOP_ONCE, %MINILOOP_NONBLOCK and %MINILOOP_BUSYPOLL, or zero
  *
  * With @flags set to %MINILOOP_ONCE the event loop returns after the first
  * event has been served, useful for instance to set a timeout on a file
  * descriptor.  If @flags also has the %MINILOOP_NONBLOCK flag set the event
  * loop will return immediately if no event is pending, useful when run
- * inside another event loop.
+ * inside another event loop, see ml_fd() and ml_dispatch().  With %MINILOOP_BUSYPOLL each wait first
+ * spins, see ml_busypoll(), for lower wakeup latency at the cost of CPU.
+ *
+ * While the loop runs, watchers started or changed are not registered
+ * with the kernel at once, the net changes are sent right before the
+ * next wait.  Starting and stopping a watcher in the same iteration
+ * costs no system call.  Since errors then come too late for the
+ * ml_*_start() call, a watcher the kernel refuses is stopped and its
+ * callback is called with %MINILOOP_ERROR.  Stopping is immediate, so
+ * the descriptor may be closed right away.
  *
  * @return POSIX OK(0) upon successful termination of the event loop, or
  * non-zero on error.
@@ -304,39 +1076,35 @@ int ml_run(ml_ctx_t *ctx, int flags)
 		timeout = 0;
 
 	/* Start the event loop */
-	ctx->running = 1;
-
-	/* Start all dormant timers */
-	_MINILOOP_FOREACH(w, ctx->watchers) {
-		if (MINILOOP_TIMER_TYPE == w->type)
-			ml_timer_set(w, w->u.t.timeout, w->u.t.period);
-	}
-
-	while (ctx->running && ctx->watchers) {
-		struct epoll_event ee[MINILOOP_MAX_EVENTS];
-		int i, nfds, rerun = 0;
-
-		/* Handle special case: `application < file.txt` */
-		if (ctx->workaround) {
-			_MINILOOP_FOREACH(w, ctx->watchers) {
-				if (w->active != -1 || !w->cb)
-					continue;
+	start(ctx);
+	ctx->batch = 1;
+
+	while (ctx->running && ctx->nwatchers) {
+		struct epoll_event *ee = ctx->events;
+		int i, nfds, num, tmo, low = 0;
+
+		/* Last chance before waiting, changes go with the wait */
+		if (ctx->idle)
+			_ml_hook_run(ctx, ctx->idle);
+		if (ctx->prepare)
+			_ml_hook_run(ctx, ctx->prepare);
+
+		/* Net watcher changes since the last wait */
+		if (ctx->nchanges)
+			flush(ctx);
+		if (!ctx->running || !ctx->nwatchers)
+			break;
 
-				if (!has_data(w->fd)) {
-					w->active = 0;
-					_MINILOOP_REMOVE(w, ctx->watchers);
-				}
+		/* Sleep no longer than until the first timer in the heap */
+		tmo = ctx->io_pending || ctx->io_always || ctx->idle || ctx->nbacklog ? 0 : timeout;
+		if (tmo && ctx->ntimers)
+			tmo = _ml_timer_timeout(ctx);
 
-				rerun++;
-				w->cb(w, w->arg, MINILOOP_READ);
-			}
-		}
-
-		if (rerun)
-			continue;
-		ctx->workaround = 0;
-
-		while ((nfds = epoll_wait(ctx->fd, ee, ctx->maxevents, timeout)) < 0) {
+		_ML_STATS_NOW(t0);
+		_ML_TRACE_WAIT_ENTER(ctx, tmo);
+		while ((nfds = (flags & MINILOOP_BUSYPOLL)
+			? busy_wait(ctx, ee, ctx->maxevents, tmo)
+			: wait_events(ctx, ee, ctx->maxevents, tmo)) < 0) {
 			if (!ctx->running)
 				break;
 
@@ -349,50 +1117,83 @@ int ml_run(ml_ctx_t *ctx, int flags)
 			return -2;
 		}
 
-		for (i = 0; ctx->running && i < nfds; i++) {
-			struct signalfd_siginfo fdsi;
+		_ML_TRACE_WAIT_EXIT(ctx, tmo, nfds);
+
+		/* One clock read for all callbacks and timers of this batch */
+		ml_now_update(ctx);
+
+		_ML_STATS_WAIT(ctx, t0, nfds);
+		_ML_STATS_NOW(t1);
+
+		/* Highest priority first, with what was held back */
+		num = nfds;
+		if (ctx->prio && nfds >= 0)
+			ee = sort_events(ctx, ee, &num);
+
+		/* Callbacks stopping a watcher drop its later events */
+		ctx->ebatch = ee;
+		ctx->enfds  = num;
+		for (i = 0; i < num; i++) {
+			w = ee[i].data.ptr;
+			if (w)
+				w->epos = i + 1;
+		}
+		for (i = 0; ctx->running && i < num; i++) {
 			uint32_t events;
 			uint64_t exp;
-			ssize_t sz = sizeof(fdsi);
 
+			ctx->ecur = i;
 			w = (ml_t *)ee[i].data.ptr;
 			events = ee[i].events;
 
+			/* Stopped, or freed by ml_free(), in an earlier callback */
+			if (!w || !w->type)
+				continue;
+
+			/* Over budget, held back for the next iteration */
+			if (w->prio < 0 && ctx->budget && ++low > ctx->budget && !defer(ctx, &ee[i]))
+				continue;
+
 			switch (w->type) {
 			case MINILOOP_IO_TYPE:
+				if (w->u.e.track)
+					events = _ml_io_ready(w, events);
 				if (events & (EPOLLHUP | EPOLLERR))
 					ml_io_stop(w);
+				else if (!events)
+					continue; /* Edge it is not interested in */
 				break;
 
 			case MINILOOP_SIGNAL_TYPE:
-				if (read(w->fd, &fdsi, sz) != sz) {
-					if (ml_signal_start(w)) {
-						ml_signal_stop(w);
-						events = MINILOOP_ERROR;
-					}
-				}
+				/* Not in the kernel, called by the signalfd reader */
 				break;
 
 			case MINILOOP_TIMER_TYPE:
-				if (read(w->fd, &exp, sizeof(exp)) != sizeof(exp)) {
-					ml_timer_stop(w);
-					events = MINILOOP_ERROR;
-				}
-
-				if (!w->u.t.period)
-					w->u.t.timeout = 0;
-				if (!w->u.t.timeout)
-					ml_timer_stop(w);
+				events = _ml_timer_expired(w);
+				if (!events)
+					continue;
 				break;
 
-      case MINILOOP_FS_TYPE:
-        // FIXME
-        break;
+			case MINILOOP_FS_TYPE:
+				/* Callback runs all completed requests */
+				if (read(w->fd, &exp, sizeof(exp)) != sizeof(exp))
+					events = MINILOOP_ERROR;
+				break;
 
 			case MINILOOP_EVENT_TYPE:
 				if (read(w->fd, &exp, sizeof(exp)) != sizeof(exp))
 					events = MINILOOP_HUP;
 				break;
+
+			case MINILOOP_FSWATCH_TYPE:
+				/* Not in the kernel, called by the inotify reader */
+				break;
+
+			case MINILOOP_PREPARE_TYPE:
+			case MINILOOP_CHECK_TYPE:
+			case MINILOOP_IDLE_TYPE:
+				/* Not in the kernel, called by ml_run() */
+				break;
 			}
 
 			/*
@@ -400,16 +1201,135 @@ int ml_run(ml_ctx_t *ctx, int flags)
 			 *       callback may delete itself.
 			 */
 			if (w->cb)
-				w->cb(w, w->arg, events & MINILOOP_EVENT_MASK);
+				_ML_CALL(w, events & MINILOOP_EVENT_MASK);
 		}
 
+		ctx->enfds = 0;
+
+		if (ctx->running && ctx->io_pending)
+			_ml_io_run(ctx);
+
+		if (ctx->running && ctx->io_always)
+			_ml_io_always_run(ctx);
+
+		if (ctx->running && ctx->ntimers)
+			_ml_timer_run(ctx);
+
+		if (ctx->running && ctx->check)
+			_ml_hook_run(ctx, ctx->check);
+
+		if (ctx->closing)
+			run_closing(ctx);
+
+		/* Slots freed by callbacks can now be reused */
+		if (ctx->pool)
+			_ml_pool_reap(ctx);
+
+		if (ctx->running && nfds == ctx->maxevents)
+			grow(ctx);
+
+		_ML_STATS_DISPATCH(ctx, t1);
+
 		if (flags & MINILOOP_ONCE)
 			break;
 	}
+	ctx->batch = 0;
+
+	return 0;
+}
+
+/**
+ * Descriptor for running a context from another event loop
+ * @param ctx  A valid miniloop context
+ *
+ * The epoll, or io_uring, descriptor of @param ctx is readable when any
+ * of its watchers has an event.  Register it for reading, level
+ * triggered, in another loop, e.g. as an ml_io watcher in a second
+ * context, or with a GUI toolkit, and call ml_dispatch() when it is
+ * readable or when the ml_timeout() it was last given expires.  This
+ * way a context is only run when it has work, no polling, and is
+ * blocked on by one thread along with other contexts.
+ *
+ * @return The descriptor, or -1 with @param errno set on error.
+ */
+int ml_fd(ml_ctx_t *ctx)
+{
+	if (!ctx || ctx->fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	start(ctx);
+
+	return ctx->fd;
+}
+
+/**
+ * Time until a context must be run, from another event loop
+ * @param ctx   A valid miniloop context
+ * @param msec  Set to milliseconds until the next timer in the heap,
+ *              zero if there is work to be done already, or -1 for none
+ *
+ * Call right before the other loop waits, and wait no longer than
+ * @param msec for ml_fd() to be readable.  Watchers of @param ctx
+ * started or changed from outside ml_dispatch(), e.g. by a callback in
+ * the other loop, are sent to the kernel here, which the io_uring
+ * backend otherwise does only with its next wait.  Timers with a timerfd, i.e.,
+ * contexts without %MINILOOP_TIMER_HEAP, signals and all other watchers
+ * make ml_fd() readable on their own.  Zero is also given for idle
+ * watchers, watchers on regular files, watchers with a partly drained
+ * edge and for events held back by ml_budget().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_timeout(ml_ctx_t *ctx, int *msec)
+{
+	if (!ctx || ctx->fd < 0 || !msec) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	start(ctx);
+	if (submit(ctx))
+		return -1;
+
+	if (ctx->io_pending || ctx->io_always || ctx->idle || ctx->nbacklog || ctx->closing)
+		*msec = 0;
+	else
+		*msec = _ml_timer_timeout(ctx);
 
 	return 0;
 }
 
+/**
+ * Run the ready events of a context, from another event loop
+ * @param ctx  A valid miniloop context
+ *
+ * One iteration of ml_run() with %MINILOOP_ONCE and %MINILOOP_NONBLOCK,
+ * i.e., prepare and check watchers run as usual, after which all
+ * watcher changes made by the callbacks are sent to the kernel, since
+ * no wait follows that would take them along.  Call when ml_fd() is
+ * readable, or ml_timeout() has expired.  Calling it when there is
+ * nothing to do is harmless, but never call it from a callback of
+ * @param ctx itself.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_dispatch(ml_ctx_t *ctx)
+{
+	int rc;
+
+	rc = ml_run(ctx, MINILOOP_ONCE | MINILOOP_NONBLOCK);
+	if (rc)
+		return rc;
+
+	/* Not run by ml_run() when the last watcher was closed */
+	if (ctx->closing)
+		run_closing(ctx);
+
+	return submit(ctx);
+}
+
 /**
  * Local Variables:
  *  indent-tabs-mode: t
@@ -26,10 +26,15 @@
 #ifndef MINILOOP_H_
 #define MINILOOP_H_
 
+#include <dirent.h>		/* DIR */
+#include <sys/socket.h>		/* struct sockaddr */
+#include <sys/stat.h>		/* struct stat */
+#include <sys/types.h>
+
 #include "private.h"
 
-/* Max. number of simulateneous events */
-#define MINILOOP_MAX_EVENTS  10
+/* Max. number of simultaneous events the event cache grows to on its own */
+#define MINILOOP_MAX_EVENTS  1024
 
 /* I/O events, signal and timer revents are always MINILOOP_READ */
 #define MINILOOP_NONE        0
@@ -41,16 +46,69 @@
 #define MINILOOP_RDHUP       EPOLLRDHUP
 #define MINILOOP_EDGE        EPOLLET
 #define MINILOOP_ONESHOT     EPOLLONESHOT
+#define MINILOOP_EXCLUSIVE   EPOLLEXCLUSIVE
 
 /* Run flags */
 #define MINILOOP_ONCE        1
 #define MINILOOP_NONBLOCK    2
+#define MINILOOP_BUSYPOLL    4	/* Spin before blocking, see ml_busypoll() */
+
+/* Default time to spin for events with %MINILOOP_BUSYPOLL, in microseconds */
+#ifndef MINILOOP_BUSYPOLL_US
+#define MINILOOP_BUSYPOLL_US 50
+#endif
+
+/* Number of worker threads for ml_fs_*() requests, per context */
+#ifndef MINILOOP_FS_THREADS
+#define MINILOOP_FS_THREADS  4
+#endif
+
+/* Max. bytes ml_fs_sendfile() moves per wakeup, for fairness to other watchers */
+#ifndef MINILOOP_SENDFILE_CHUNK
+#define MINILOOP_SENDFILE_CHUNK (1024 * 1024)
+#endif
+
+/* Flags for ml_fs_copyfile() */
+#define ML_FS_COPYFILE_EXCL  1	/* Fail if the destination exists */
+
+/* Init flags, for ml_init1() */
+#define MINILOOP_TIMER_HEAP  1	/* Userspace timers, no timerfd per watcher */
+#define MINILOOP_IO_URING    2	/* io_uring backend instead of epoll */
+
+/* Watcher priorities, for ml_priority_set(), higher is dispatched first */
+#define MINILOOP_PRIO_MIN    -2
+#define MINILOOP_PRIO_MAX     2
+
+/* Timer flags, for ml_timer_init_ns() and ml_timer_set_ns() */
+#define MINILOOP_TIMER_ABSTIME 1 /* Timeout is a deadline on the timer's clock */
 
 /* Macros */
 #define ml_io_active(w)     _ml_watcher_active(w)
 #define ml_signal_active(w) _ml_watcher_active(w)
 #define ml_timer_active(w)  _ml_watcher_active(w)
 #define ml_event_active(w)  _ml_watcher_active(w)
+#define ml_fswatch_active(w) _ml_watcher_active(w)
+#define ml_async_active(a)  _ml_watcher_active(&(a)->w)
+#define ml_stream_active(s) _ml_watcher_active(&(s)->w)
+#define ml_udp_active(u)    _ml_watcher_active(&(u)->w)
+#define ml_listen_active(l) _ml_watcher_active(&(l)->w)
+#define ml_file_active(f)   ((f)->reading)
+#define ml_co_active(co)    ((co)->stack != NULL)
+#define ml_prepare_active(w) _ml_watcher_active(w)
+#define ml_check_active(w)  _ml_watcher_active(w)
+#define ml_idle_active(w)   _ml_watcher_active(w)
+
+/* Dispatch priority of a watcher */
+#define ml_priority(w)      ((w)->prio)
+
+/* A stream is writable until its queued output reaches the high watermark */
+#define ml_stream_writable(s) ((s)->queued < (s)->high)
+
+/* In a signal watcher callback, number of signals since the last call */
+#define ml_signal_count(w)  ((w)->u.s.count)
+
+/* In a file watcher callback, the inotify(7) events since the last call */
+#define ml_fswatch_mask(w)  ((w)->u.f.revents)
 
 /* Event watcher */
 typedef struct ml {
@@ -58,14 +116,22 @@ typedef struct ml {
 	ml_private_t   type;
 
 	/* Public data for users to reference  */
-	int             signo;
 	int             fd;
+	int             signo;
 	ml_ctx_t      *ctx;
+
+	/* Private data, watcher arguments and bookkeeping */
+	ml_private_cold_t epos;
 } ml_t;
 
-typedef struct ml_fs {
-  int to_be_done;
-} ml_fs_t;
+/* Private to miniloop, do not use directly!  Inlined, see ml_io_active() */
+static inline int _ml_watcher_active(ml_t *w)
+{
+	if (!w)
+		return 0;
+
+	return w->active > 0;
+}
 
 typedef enum {
   ML_FS_UNKNOWN = -1,
@@ -106,6 +172,192 @@ typedef enum {
   ML_FS_MKSTEMP
 } ml_fs_type;
 
+struct ml_fs;
+
+/* Completion callback for file system requests, called on the event loop */
+typedef void (ml_fs_cb_t)(struct ml_fs *req);
+
+/* File system request, run by a worker thread */
+typedef struct ml_fs {
+	/* Private data for miniloop internal engine */
+	struct ml_fs   *next;
+	void          (*work)(struct ml_fs *);
+	ml_t            w;	/* For ML_FS_SENDFILE to a socket or pipe */
+	int             splice;
+	int             src_fd;	/* Watched while a pipe as source is empty */
+
+	/* Public data for users to reference  */
+	ml_ctx_t       *ctx;
+	ml_fs_type      type;
+	ml_fs_cb_t     *cb;
+	void           *arg;
+
+	/* Return value of the system call, and its errno */
+	ssize_t         result;
+	int             error;
+
+	/* Arguments, only those used by the request type are set */
+	char           *path;
+	char           *new_path;
+	int             fd;
+	int             out_fd;
+	int             flags;
+	mode_t          mode;
+	void           *buf;
+	size_t          len;
+	off_t           off;
+	uid_t           uid;
+	gid_t           gid;
+	double          atime;
+	double          mtime;
+	DIR            *dir;
+
+	/* Results, other than @result */
+	struct stat     statbuf;
+	void           *ptr;
+} ml_fs_t;
+
+/* Generation counted reference to a watcher from ml_alloc() */
+typedef uint64_t ml_handle_t;
+
+struct ml_async;
+
+/* Async callback, called on the event loop when messages are queued */
+typedef void (ml_async_cb_t)(struct ml_async *a, void *arg);
+
+/* Slot in the ring of an async watcher */
+typedef struct {
+	size_t          seq;
+	void           *ptr;
+} ml_async_cell_t;
+
+/* Bounded queue of pointers to an event loop, from any thread */
+typedef struct ml_async {
+	/* Private data for miniloop internal engine */
+	ml_t            w;
+	ml_async_cell_t *cells;
+	size_t          mask;
+	size_t          head;	/* Consumer, the event loop */
+	size_t          tail  __attribute__ ((aligned(64)));	/* Producers */
+	int             armed __attribute__ ((aligned(64)));	/* Wakeup posted */
+
+	/* Public data for users to reference  */
+	ml_ctx_t       *ctx;
+	ml_async_cb_t  *cb;
+	void           *arg;
+} ml_async_t;
+
+/* Size of each buffer in a context's buffer pool */
+#define MINILOOP_BUF_SIZE    16384
+
+/* Default stream watermarks, for bytes queued to write */
+#define MINILOOP_STREAM_HIGH (256 * 1024)
+#define MINILOOP_STREAM_LOW  (64 * 1024)
+
+/* Pooled buffer, chained in stream reads and writes */
+typedef struct ml_buf {
+	struct ml_buf  *next;
+	size_t          off;	/* Start of data in @data */
+	size_t          len;	/* Length of data */
+	char            data[MINILOOP_BUF_SIZE];
+} ml_buf_t;
+
+struct ml_stream;
+
+/*
+ * Stream read callback, @bufs is a chain of @len bytes owned by the
+ * callback, to be freed with ml_buf_free() or passed on to
+ * ml_stream_write().  A @len of zero is end of file, -1 is an error,
+ * reading or writing, with errno set.
+ */
+typedef void (ml_stream_cb_t)(struct ml_stream *s, void *arg, ml_buf_t *bufs, ssize_t len);
+
+/* Stream drain callback, queued output has dropped below the low watermark */
+typedef void (ml_drain_cb_t)(struct ml_stream *s, void *arg);
+
+/* Buffered stream on a non-blocking descriptor */
+typedef struct ml_stream {
+	/* Private data for miniloop internal engine */
+	ml_t            w;
+	ml_buf_t       *whead, *wtail;
+	size_t          low, high;
+	int             above;	/* Queued past high, call drain_cb below low */
+	int             reading;
+	ml_drain_cb_t  *drain_cb;
+
+	/* Public data for users to reference  */
+	size_t          queued;	/* Bytes waiting to be written */
+	ml_ctx_t       *ctx;
+	ml_stream_cb_t *cb;
+	void           *arg;
+} ml_stream_t;
+
+/* Defaults for ml_udp_init(), datagrams per batch and max. datagram size */
+#define MINILOOP_UDP_SLOTS   32
+#define MINILOOP_UDP_SIZE    2048
+
+/* Flags for ml_udp_init() */
+#define MINILOOP_UDP_GRO     1	/* Let the kernel coalesce received datagrams */
+#define MINILOOP_UDP_GSO     2	/* Send runs of datagrams to one peer as one */
+
+/* Received datagram, valid until the callback returns */
+typedef struct ml_udp_msg {
+	void           *data;
+	size_t          len;
+	struct sockaddr *addr;
+	socklen_t       addrlen;
+} ml_udp_msg_t;
+
+struct ml_udp;
+struct ml_udp_ring;
+
+/*
+ * Datagram callback, with @num datagrams received in one batch.  A
+ * @num of -1 is an error, receiving or sending, with errno set, and
+ * zero that the socket was shut down.
+ */
+typedef void (ml_udp_cb_t)(struct ml_udp *u, void *arg, ml_udp_msg_t *msgs, int num);
+
+/* Batched datagram socket */
+typedef struct ml_udp {
+	/* Private data for miniloop internal engine */
+	ml_t                w;
+	struct ml_udp_ring *rx, *tx;
+	int                 flags;
+
+	/* Public data for users to reference  */
+	ml_ctx_t           *ctx;
+	ml_udp_cb_t        *cb;
+	void               *arg;
+} ml_udp_t;
+
+struct ml_msg;
+struct ml_loop;
+
+/* Message callback, called by the receiving loop with its context */
+typedef void (ml_msg_cb_t)(ml_ctx_t *ctx, struct ml_msg *msg);
+
+/* Message to a loop in a group, usually embedded in a larger struct */
+typedef struct ml_msg {
+	/* Private data for miniloop internal engine */
+	struct ml_msg  *next;
+
+	/* Public data for users to reference  */
+	ml_msg_cb_t    *cb;
+	void           *arg;
+	int             fd;	/* E.g., a descriptor handed to another loop */
+} ml_msg_t;
+
+/* Group of event loops, each run by its own thread */
+typedef struct {
+	/* Private data for miniloop internal engine */
+	struct ml_loop *loops;
+	int             started;
+
+	/* Public data for users to reference  */
+	int             nloops;
+} ml_group_t;
+
 /*
  * Generic callback for watchers, @events holds %MINILOOP_READ and/or %MINILOOP_WRITE
  * with optional %MINILOOP_PRI (priority data available to read) and any of the
@@ -118,20 +370,212 @@ typedef enum {
  */
 typedef void (ml_cb_t)(ml_t *w, void *arg, int events);
 
+/* Called when a watcher given to ml_close() may be freed */
+typedef void (ml_close_cb_t)(ml_t *w, void *arg);
+
+/* Max. connections accepted per wakeup of an ml_listen_t */
+#ifndef MINILOOP_LISTEN_BATCH
+#define MINILOOP_LISTEN_BATCH 64
+#endif
+
+/* Flags for ml_listen_init() */
+#define MINILOOP_LISTEN_SHARED 1 /* Socket shared by contexts, wake up only one */
+
+struct ml_listen;
+
+/*
+ * Accept callback, @w is the started watcher for a new connection, a
+ * pool watcher owned by the callback.  A %NULL @w is an error, with
+ * errno set.
+ */
+typedef void (ml_accept_cb_t)(struct ml_listen *l, void *arg, ml_t *w, const struct sockaddr *addr, socklen_t addrlen);
+
+/* Listening socket */
+typedef struct ml_listen {
+	/* Private data for miniloop internal engine */
+	ml_t            w;
+	ml_cb_t        *io_cb;
+	int             events;
+
+	/* Public data for users to reference  */
+	ml_ctx_t       *ctx;
+	ml_accept_cb_t *cb;
+	void           *arg;
+} ml_listen_t;
+
+/* Default bytes per read of an ml_file_t */
+#define MINILOOP_FILE_CHUNK  (256 * 1024)
+
+/* Flags for ml_file_init() */
+#define MINILOOP_FILE_READAHEAD 1 /* Read the next chunk on an ml_fs_*() worker */
+
+struct ml_file;
+
+/*
+ * File reader callback, @len bytes in @buf, valid until the callback
+ * returns.  A @len of zero is end of file, -1 is an error with errno set.
+ */
+typedef void (ml_file_cb_t)(struct ml_file *f, void *arg, const char *buf, ssize_t len);
+
+/* Chunked reader of a file, or any descriptor */
+typedef struct ml_file {
+	/* Private data for miniloop internal engine */
+	ml_t            w;
+	ml_fs_t         req;	/* With %MINILOOP_FILE_READAHEAD */
+	char           *buf[2];
+	int             cur;	/* Buffer of the read in flight */
+	size_t          size;
+	off_t           off;	/* Of the next read, -1 without read-ahead */
+	int             reading;
+	int             inflight;
+	int             closing;
+	ml_close_cb_t  *close_cb;
+
+	/* Public data for users to reference  */
+	ml_ctx_t       *ctx;
+	ml_file_cb_t   *cb;
+	void           *arg;
+} ml_file_t;
+
+/* Default coroutine stack size, and max. free stacks a context keeps */
+#ifndef MINILOOP_CO_STACK
+#define MINILOOP_CO_STACK    (64 * 1024)
+#endif
+#ifndef MINILOOP_CO_POOL
+#define MINILOOP_CO_POOL     64
+#endif
+
+struct ml_co;
+
+/* Coroutine body, the coroutine ends when it returns */
+typedef void (ml_co_fn_t)(struct ml_co *co, void *arg);
+
+/* Stackful coroutine, parked on its watchers while it waits */
+typedef struct ml_co {
+	/* Private data for miniloop internal engine */
+	struct ml_co   *next, *prev;	/* The context's coroutines */
+	ml_t            io;	/* For ml_co_read() and ml_co_write() */
+	ml_t            timer;	/* For ml_co_sleep() */
+	ml_t           *wait;	/* Watcher parked on, or NULL */
+	int             revents;
+	int             error;		/* errno with %MINILOOP_ERROR */
+	int             running;	/* Resumed, and not parked yet */
+	int             done;
+
+	/* Event watcher of ml_co_wait_event(), and its own callback */
+	ml_t           *event;
+	ml_cb_t        *event_cb;
+	void           *event_arg;
+
+	/* Saved contexts, and the stack mapping with its guard page */
+	void           *sp, *back;
+	void           *stack;
+	size_t          size;
+
+	/* Public data for users to reference  */
+	ml_ctx_t       *ctx;
+	ml_co_fn_t     *fn;
+	void           *arg;
+} ml_co_t;
+
+/* Statistics, only collected when built with -DMINILOOP_STATS */
+#define MINILOOP_STATS_BUCKETS 336	/* Callback durations, up to 2^44 ns */
+#define MINILOOP_STATS_WAKEUPS 16	/* Events per wakeup: 0, 1, 2-3, 4-7, ... */
+#define MINILOOP_STATS_TYPES   8	/* Indexed by watcher type */
+#define MINILOOP_STATS_ADD     0	/* Start, EPOLL_CTL_ADD */
+#define MINILOOP_STATS_DEL     1	/* Stop, EPOLL_CTL_DEL */
+#define MINILOOP_STATS_MOD     2	/* Rearm, EPOLL_CTL_MOD */
+
+typedef struct {
+	uint64_t        iterations;	/* Wakeups of ml_run() */
+	uint64_t        events;		/* Events from the kernel */
+	uint64_t        wakeups[MINILOOP_STATS_WAKEUPS];
+
+	uint64_t        blocked_ns;	/* In epoll_wait() or io_uring_enter() */
+	uint64_t        dispatch_ns;	/* Serving events and timers */
+
+	/* Callback durations, see ml_stats_percentile() */
+	uint64_t        callbacks;
+	uint64_t        slow;		/* Reported to the ml_stats_slow() hook */
+	uint64_t        cb_hist[MINILOOP_STATS_BUCKETS];
+
+	/* Callbacks of always ready watchers, e.g. `application < file.txt` */
+	uint64_t        always_calls;
+	uint64_t        always_ns;
+
+	/* Spins with %MINILOOP_BUSYPOLL, ended by events or by blocking */
+	uint64_t        spin_events;
+	uint64_t        spin_timeouts;
+	uint64_t        spin_ns;
+
+	/* Kernel registrations, by watcher type and MINILOOP_STATS_ADD/DEL/MOD */
+	uint64_t        ctl[MINILOOP_STATS_TYPES][3];
+} ml_stats_t;
+
+/* Called for callbacks slower than the ml_stats_slow() threshold */
+typedef void (ml_slow_cb_t)(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, uint64_t ns, void *arg);
+
+/* Recent dispatches, see ml_trace_init() */
+#define MINILOOP_TRACE_MAX     (1 << 20)
+
+typedef struct {
+	uint64_t        start;		/* CLOCK_MONOTONIC, in nanoseconds */
+	uint64_t        ns;		/* Duration of the callback, or the wait */
+	const void     *w;		/* Watcher, may be freed since, %NULL for a wait */
+	ml_cb_t        *cb;
+	int             fd;		/* Of the watcher, the timeout in ms of a wait */
+	int             events;		/* For the callback, number of events of a wait */
+	int             type;		/* Watcher type, zero for a wait */
+} ml_trace_rec_t;
+
 /* Public interface */
 int ml_init           (ml_ctx_t *ctx, int maxevents);
+int ml_init1          (ml_ctx_t *ctx, int maxevents, int flags);
 int ml_exit           (ml_ctx_t *ctx);
 int ml_run            (ml_ctx_t *ctx, int flags);
+int ml_fd             (ml_ctx_t *ctx);
+int ml_timeout        (ml_ctx_t *ctx, int *msec);
+int ml_dispatch       (ml_ctx_t *ctx);
+int ml_close          (ml_t *w, ml_close_cb_t *cb);
+int ml_busypoll       (ml_ctx_t *ctx, unsigned int spin_us, unsigned int kernel_us);
+int ml_budget         (ml_ctx_t *ctx, int num);
+int ml_priority_set   (ml_t *w, int prio);
+
+uint64_t ml_now       (ml_ctx_t *ctx);
+uint64_t ml_now_ns    (ml_ctx_t *ctx);
+int ml_now_update     (ml_ctx_t *ctx);
+
+int ml_stats_get      (ml_ctx_t *ctx, ml_stats_t *st);
+int ml_stats_reset    (ml_ctx_t *ctx);
+int ml_stats_slow     (ml_ctx_t *ctx, uint64_t ns, ml_slow_cb_t *cb, void *arg);
+uint64_t ml_stats_percentile(const ml_stats_t *st, double p);
+
+int ml_trace_init     (ml_ctx_t *ctx, unsigned int num);
+int ml_trace_read     (ml_ctx_t *ctx, ml_trace_rec_t *rec, unsigned int num);
+int ml_trace_dump     (ml_ctx_t *ctx, FILE *fp);
+int ml_trace_signal   (ml_ctx_t *ctx, ml_t *w, int signo, FILE *fp);
+
+ml_t *ml_alloc       (ml_ctx_t *ctx);
+int ml_free           (ml_t *w);
+ml_handle_t ml_handle (ml_t *w);
+ml_t *ml_lookup       (ml_ctx_t *ctx, ml_handle_t h);
 
 int ml_timer_init     (ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int timeout, int period);
 int ml_timer_set      (ml_t *w, int timeout, int period);
+int ml_timer_init_ns  (ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, clockid_t clock, uint64_t timeout, uint64_t period, int flags);
+int ml_timer_set_ns   (ml_t *w, uint64_t timeout, uint64_t period, int flags);
+int ml_timer_slack    (ml_t *w, uint64_t slack);
 int ml_timer_start    (ml_t *w);
 int ml_timer_stop     (ml_t *w);
 
 int ml_io_init        (ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int fd, int events);
+int ml_io_edge_init   (ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int fd, int events);
 int ml_io_set         (ml_t *w, int fd, int events);
 int ml_io_start       (ml_t *w);
 int ml_io_stop        (ml_t *w);
+int ml_io_clear       (ml_t *w, int events);
+ssize_t ml_io_read    (ml_t *w, void *buf, size_t len);
+ssize_t ml_io_write   (ml_t *w, const void *buf, size_t len);
 
 int ml_signal_init    (ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int signo);
 int ml_signal_set     (ml_t *w, int signo);
@@ -142,6 +586,110 @@ int ml_event_init     (ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg);
 int ml_event_post     (ml_t *w);
 int ml_event_stop     (ml_t *w);
 
+int ml_prepare_init   (ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg);
+int ml_prepare_start  (ml_t *w);
+int ml_prepare_stop   (ml_t *w);
+
+int ml_check_init     (ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg);
+int ml_check_start    (ml_t *w);
+int ml_check_stop     (ml_t *w);
+
+int ml_idle_init      (ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg);
+int ml_idle_start     (ml_t *w);
+int ml_idle_stop      (ml_t *w);
+
+int ml_async_init     (ml_ctx_t *ctx, ml_async_t *a, ml_async_cb_t *cb, void *arg, size_t size);
+int ml_async_send     (ml_async_t *a, void *ptr);
+void *ml_async_recv   (ml_async_t *a);
+int ml_async_stop     (ml_async_t *a);
+
+ml_buf_t *ml_buf_alloc(ml_ctx_t *ctx);
+int ml_buf_free       (ml_ctx_t *ctx, ml_buf_t *bufs);
+
+int ml_stream_init    (ml_ctx_t *ctx, ml_stream_t *s, ml_stream_cb_t *cb, void *arg, int fd);
+int ml_stream_watermark(ml_stream_t *s, size_t low, size_t high, ml_drain_cb_t *cb);
+int ml_stream_write   (ml_stream_t *s, ml_buf_t *bufs);
+int ml_stream_send    (ml_stream_t *s, const void *data, size_t len);
+int ml_stream_pause   (ml_stream_t *s);
+int ml_stream_resume  (ml_stream_t *s);
+int ml_stream_stop    (ml_stream_t *s);
+int ml_stream_close   (ml_stream_t *s, ml_close_cb_t *cb);
+
+int ml_udp_init       (ml_ctx_t *ctx, ml_udp_t *u, ml_udp_cb_t *cb, void *arg, int fd, unsigned int slots, size_t size, int flags);
+int ml_udp_send       (ml_udp_t *u, const void *data, size_t len, const struct sockaddr *addr, socklen_t addrlen);
+int ml_udp_flush      (ml_udp_t *u);
+int ml_udp_start      (ml_udp_t *u);
+int ml_udp_stop       (ml_udp_t *u);
+int ml_udp_close      (ml_udp_t *u, ml_close_cb_t *cb);
+
+int ml_listen_init    (ml_ctx_t *ctx, ml_listen_t *l, ml_accept_cb_t *cb, void *arg, int fd,
+		       ml_cb_t *io_cb, int events, int flags);
+int ml_listen_start   (ml_listen_t *l);
+int ml_listen_stop    (ml_listen_t *l);
+
+int ml_file_init      (ml_ctx_t *ctx, ml_file_t *f, ml_file_cb_t *cb, void *arg, int fd, size_t size, int flags);
+int ml_file_start     (ml_file_t *f);
+int ml_file_stop      (ml_file_t *f);
+int ml_file_close     (ml_file_t *f, ml_close_cb_t *cb);
+
+int ml_co_init        (ml_ctx_t *ctx, ml_co_t *co, ml_co_fn_t *fn, void *arg, size_t stack);
+int ml_co_cancel      (ml_co_t *co);
+ssize_t ml_co_read    (ml_co_t *co, int fd, void *buf, size_t len);
+ssize_t ml_co_write   (ml_co_t *co, int fd, const void *buf, size_t len);
+int ml_co_close       (ml_co_t *co, int fd);
+int ml_co_sleep       (ml_co_t *co, int msec);
+int ml_co_wait_event  (ml_co_t *co, ml_t *w);
+
+int ml_fswatch_init   (ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, const char *path, uint32_t mask);
+int ml_fswatch_set    (ml_t *w, const char *path, uint32_t mask);
+int ml_fswatch_start  (ml_t *w);
+int ml_fswatch_stop   (ml_t *w);
+
+int ml_group_init     (ml_group_t *g, int nloops, int maxevents, int flags);
+int ml_group_exit     (ml_group_t *g);
+int ml_group_start    (ml_group_t *g);
+int ml_group_listen   (ml_group_t *g, const struct sockaddr *sa, socklen_t len, ml_cb_t *cb, void *arg);
+int ml_group_send     (ml_group_t *g, int id, ml_msg_t *msg);
+ml_ctx_t *ml_group_ctx(ml_group_t *g, int id);
+
+int ml_fs_submit      (ml_fs_t *req);
+int ml_fs_cleanup     (ml_fs_t *req);
+int ml_fs_custom      (ml_ctx_t *ctx, ml_fs_t *req, void (*work)(ml_fs_t *), ml_fs_cb_t *cb, void *arg);
+int ml_fs_open        (ml_ctx_t *ctx, ml_fs_t *req, const char *path, int flags, mode_t mode, ml_fs_cb_t *cb, void *arg);
+int ml_fs_close       (ml_ctx_t *ctx, ml_fs_t *req, int fd, ml_fs_cb_t *cb, void *arg);
+int ml_fs_read        (ml_ctx_t *ctx, ml_fs_t *req, int fd, void *buf, size_t len, off_t off, ml_fs_cb_t *cb, void *arg);
+int ml_fs_write       (ml_ctx_t *ctx, ml_fs_t *req, int fd, const void *buf, size_t len, off_t off, ml_fs_cb_t *cb, void *arg);
+int ml_fs_stat        (ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_lstat       (ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_fstat       (ml_ctx_t *ctx, ml_fs_t *req, int fd, ml_fs_cb_t *cb, void *arg);
+int ml_fs_ftruncate   (ml_ctx_t *ctx, ml_fs_t *req, int fd, off_t len, ml_fs_cb_t *cb, void *arg);
+int ml_fs_utime       (ml_ctx_t *ctx, ml_fs_t *req, const char *path, double atime, double mtime, ml_fs_cb_t *cb, void *arg);
+int ml_fs_futime      (ml_ctx_t *ctx, ml_fs_t *req, int fd, double atime, double mtime, ml_fs_cb_t *cb, void *arg);
+int ml_fs_access      (ml_ctx_t *ctx, ml_fs_t *req, const char *path, int mode, ml_fs_cb_t *cb, void *arg);
+int ml_fs_chmod       (ml_ctx_t *ctx, ml_fs_t *req, const char *path, mode_t mode, ml_fs_cb_t *cb, void *arg);
+int ml_fs_fchmod      (ml_ctx_t *ctx, ml_fs_t *req, int fd, mode_t mode, ml_fs_cb_t *cb, void *arg);
+int ml_fs_fsync       (ml_ctx_t *ctx, ml_fs_t *req, int fd, ml_fs_cb_t *cb, void *arg);
+int ml_fs_fdatasync   (ml_ctx_t *ctx, ml_fs_t *req, int fd, ml_fs_cb_t *cb, void *arg);
+int ml_fs_unlink      (ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_rmdir       (ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_mkdir       (ml_ctx_t *ctx, ml_fs_t *req, const char *path, mode_t mode, ml_fs_cb_t *cb, void *arg);
+int ml_fs_mkdtemp     (ml_ctx_t *ctx, ml_fs_t *req, const char *tpl, ml_fs_cb_t *cb, void *arg);
+int ml_fs_mkstemp     (ml_ctx_t *ctx, ml_fs_t *req, const char *tpl, ml_fs_cb_t *cb, void *arg);
+int ml_fs_rename      (ml_ctx_t *ctx, ml_fs_t *req, const char *path, const char *new_path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_scandir     (ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_link        (ml_ctx_t *ctx, ml_fs_t *req, const char *path, const char *new_path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_symlink     (ml_ctx_t *ctx, ml_fs_t *req, const char *path, const char *new_path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_readlink    (ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_realpath    (ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_chown       (ml_ctx_t *ctx, ml_fs_t *req, const char *path, uid_t uid, gid_t gid, ml_fs_cb_t *cb, void *arg);
+int ml_fs_fchown      (ml_ctx_t *ctx, ml_fs_t *req, int fd, uid_t uid, gid_t gid, ml_fs_cb_t *cb, void *arg);
+int ml_fs_lchown      (ml_ctx_t *ctx, ml_fs_t *req, const char *path, uid_t uid, gid_t gid, ml_fs_cb_t *cb, void *arg);
+int ml_fs_opendir     (ml_ctx_t *ctx, ml_fs_t *req, const char *path, ml_fs_cb_t *cb, void *arg);
+int ml_fs_readdir     (ml_ctx_t *ctx, ml_fs_t *req, DIR *dir, ml_fs_cb_t *cb, void *arg);
+int ml_fs_closedir    (ml_ctx_t *ctx, ml_fs_t *req, DIR *dir, ml_fs_cb_t *cb, void *arg);
+int ml_fs_sendfile    (ml_ctx_t *ctx, ml_fs_t *req, int out_fd, int in_fd, off_t off, size_t len, ml_fs_cb_t *cb, void *arg);
+int ml_fs_copyfile    (ml_ctx_t *ctx, ml_fs_t *req, const char *path, const char *new_path, int flags, ml_fs_cb_t *cb, void *arg);
+
 #endif /* MINILOOP_H_ */
 
 /**
@@ -0,0 +1,306 @@
+/* miniloop - Context owned watchers, slab allocated
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Watchers are carved from cache line aligned chunks that are never
+ * returned to the system before ml_exit(), so a pointer to a freed
+ * watcher still in the event cache of ml_run() points to valid memory,
+ * a zeroed watcher which is skipped.  A freed slot is parked on a
+ * limbo list until the current loop iteration is done, only then can
+ * it be handed out again.  Each slot has a generation count, bumped
+ * when freed, which together with the slot index makes up its handle.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miniloop.h"
+
+#define SLOTS_PER_CHUNK 64
+#define SLOT_MAGIC      0x6d6c736c	/* "mlsl" */
+
+struct slot {
+	ml_t            w;	/* Must be first */
+	uint32_t        gen;
+	uint32_t        index;
+	uint32_t        magic;
+	uint32_t        next;	/* Free or limbo list, index + 1 */
+} __attribute__ ((aligned(64)));
+
+/* Two cache lines, with a slot and its watcher's dispatch data in the first */
+_Static_assert(sizeof(struct slot) <= 128, "Pool slots have grown");
+
+struct ml_pool {
+	struct slot   **chunks;
+	uint32_t        nchunks;
+
+	/* Lists of slot index + 1, zero is the end */
+	uint32_t        free;
+	uint32_t        limbo, limbo_tail;
+	uint32_t        used;
+};
+
+static struct slot *slot_at(struct ml_pool *pool, uint32_t index)
+{
+	return &pool->chunks[index / SLOTS_PER_CHUNK][index % SLOTS_PER_CHUNK];
+}
+
+static int pool_grow(struct ml_pool *pool)
+{
+	struct slot **chunks, *chunk;
+	uint32_t i, base;
+
+	if (pool->nchunks >= UINT32_MAX / SLOTS_PER_CHUNK) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	chunks = realloc(pool->chunks, (pool->nchunks + 1) * sizeof(*chunks));
+	if (!chunks)
+		return -1;
+	pool->chunks = chunks;
+
+	chunk = aligned_alloc(64, SLOTS_PER_CHUNK * sizeof(struct slot));
+	if (!chunk)
+		return -1;
+	memset(chunk, 0, SLOTS_PER_CHUNK * sizeof(struct slot));
+
+	base = pool->nchunks * SLOTS_PER_CHUNK;
+	pool->chunks[pool->nchunks++] = chunk;
+
+	/* Lowest index first, keeps new watchers close in memory */
+	for (i = SLOTS_PER_CHUNK; i > 0; i--) {
+		struct slot *s = &chunk[i - 1];
+
+		s->gen   = 1;
+		s->index = base + i - 1;
+		s->next  = pool->free;
+		pool->free = s->index + 1;
+	}
+
+	return 0;
+}
+
+static struct slot *to_slot(ml_t *w)
+{
+	struct slot *s = (struct slot *)w;
+	struct ml_pool *pool;
+
+	if (!w || !w->ctx || !(pool = w->ctx->pool) || s->magic != SLOT_MAGIC)
+		return NULL;
+
+	if (s->index >= pool->nchunks * SLOTS_PER_CHUNK || slot_at(pool, s->index) != s)
+		return NULL;
+
+	return s;
+}
+
+/* Private to miniloop, do not use directly!  End of ml_run() iteration */
+void _ml_pool_reap(ml_ctx_t *ctx)
+{
+	struct ml_pool *pool = ctx->pool;
+
+	if (!pool || !pool->limbo)
+		return;
+
+	slot_at(pool, pool->limbo_tail - 1)->next = pool->free;
+	pool->free  = pool->limbo;
+	pool->limbo = pool->limbo_tail = 0;
+}
+
+/* Private to miniloop, do not use directly!  Called by ml_exit() */
+int _ml_pool_exit(ml_ctx_t *ctx)
+{
+	struct ml_pool *pool = ctx->pool;
+	uint32_t i;
+
+	if (!pool)
+		return 0;
+
+	for (i = 0; i < pool->nchunks; i++)
+		free(pool->chunks[i]);
+	free(pool->chunks);
+	free(pool);
+	ctx->pool = NULL;
+
+	return 0;
+}
+
+/**
+ * Allocate a watcher owned by the context
+ * @param ctx  A valid miniloop context
+ *
+ * Returns a zeroed watcher from a slab owned by @param ctx, to be set
+ * up with any of the ml_*_init() functions, released with ml_free().
+ * Watchers are allocated in cache line aligned chunks of 64, which are
+ * kept until ml_exit(), making connection churn cheap.
+ *
+ * A watcher freed from a callback is not reused until ml_run() is done
+ * with the events of the current iteration, so pool watchers can be
+ * freed at any time, also with many events in the event cache.
+ *
+ * @return A new watcher, or %NULL with @param errno set on error.
+ */
+ml_t *ml_alloc(ml_ctx_t *ctx)
+{
+	struct ml_pool *pool;
+	struct slot *s;
+
+	if (!ctx) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool = ctx->pool;
+	if (!pool) {
+		pool = calloc(1, sizeof(*pool));
+		if (!pool)
+			return NULL;
+		ctx->pool = pool;
+	}
+
+	if (!pool->free && pool_grow(pool))
+		return NULL;
+
+	s = slot_at(pool, pool->free - 1);
+	pool->free = s->next;
+	pool->used++;
+
+	memset(&s->w, 0, sizeof(s->w));
+	s->w.ctx = ctx;
+	s->w.fd  = -1;
+	s->magic = SLOT_MAGIC;
+	s->next  = 0;
+
+	return &s->w;
+}
+
+/**
+ * Stop and free a watcher from ml_alloc()
+ * @param w  Watcher to free
+ *
+ * Any outstanding handle to the watcher is invalidated, ml_lookup()
+ * returns %NULL for it.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_free(ml_t *w)
+{
+	struct ml_pool *pool;
+	struct slot *s;
+	ml_ctx_t *ctx;
+
+	s = to_slot(w);
+	if (!s) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ctx  = w->ctx;
+	pool = ctx->pool;
+	if (w->type)
+		_ml_watcher_close(w);
+
+	/* Zeroed, so ml_run() skips any event still cached for it */
+	memset(&s->w, 0, sizeof(s->w));
+	s->w.fd  = -1;
+	s->magic = 0;
+	if (++s->gen == 0)
+		s->gen = 1;
+	pool->used--;
+
+	s->next = 0;
+	if (!ctx->batch) {
+		s->next = pool->free;
+		pool->free = s->index + 1;
+	} else if (pool->limbo) {
+		slot_at(pool, pool->limbo_tail - 1)->next = s->index + 1;
+		pool->limbo_tail = s->index + 1;
+	} else {
+		pool->limbo = pool->limbo_tail = s->index + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Get a handle for a watcher from ml_alloc()
+ * @param w  A watcher allocated with ml_alloc()
+ *
+ * Handles can be stored in place of pointers, e.g. in other threads'
+ * messages or in timeouts for a connection, and are resolved with
+ * ml_lookup(), which detects if the watcher has been freed since.
+ *
+ * @return A non-zero handle, or zero with @param errno set on error.
+ */
+ml_handle_t ml_handle(ml_t *w)
+{
+	struct slot *s;
+
+	s = to_slot(w);
+	if (!s) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	return (ml_handle_t)s->gen << 32 | s->index;
+}
+
+/**
+ * Get the watcher for a handle
+ * @param ctx  The context that allocated the watcher
+ * @param h    Handle from ml_handle()
+ *
+ * @return The watcher, or %NULL with @param errno set to %ESTALE if
+ * it has been freed.
+ */
+ml_t *ml_lookup(ml_ctx_t *ctx, ml_handle_t h)
+{
+	uint32_t index = h & 0xffffffff;
+	uint32_t gen   = h >> 32;
+	struct slot *s;
+
+	if (!ctx || !gen) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!ctx->pool || index >= ctx->pool->nchunks * SLOTS_PER_CHUNK) {
+		errno = ESTALE;
+		return NULL;
+	}
+
+	s = slot_at(ctx->pool, index);
+	if (s->gen != gen || s->magic != SLOT_MAGIC) {
+		errno = ESTALE;
+		return NULL;
+	}
+
+	return &s->w;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
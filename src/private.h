@@ -26,41 +26,10 @@
 #ifndef LIBMINILOOP_PRIVATE_H_
 #define LIBMINILOOP_PRIVATE_H_
 
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/epoll.h>
 
-/*
- * List functions.
- */
-#define _MINILOOP_FOREACH(node, list)		\
-	for (typeof (node) next, node = list;	\
-	     node && (next = node->next, 1);	\
-	     node = next)
-
-#define _MINILOOP_INSERT(node, list) do {		\
-	typeof (node) next;			\
-	next       = list;			\
-	list       = node;			\
-	if (next)				\
-		next->prev = node;		\
-	node->next = next;			\
-	node->prev = NULL;			\
-} while (0)
-
-#define _MINILOOP_REMOVE(node, list) do {		\
-	typeof (node) prev, next;		\
-	prev = node->prev;			\
-	next = node->next;			\
-	if (prev)				\
-		prev->next = next;		\
-	if (next)				\
-		next->prev = prev;		\
-	node->prev = NULL;			\
-	node->next = NULL;			\
-	if (list == node)			\
-		list = next;			\
-} while (0)
-
 /* I/O, fs, timer, or signal watcher */
 typedef enum {
 	MINILOOP_IO_TYPE = 1,
@@ -68,53 +37,229 @@ typedef enum {
 	MINILOOP_TIMER_TYPE,
   MINILOOP_FS_TYPE,
 	MINILOOP_EVENT_TYPE,
+	MINILOOP_FSWATCH_TYPE,
+	MINILOOP_PREPARE_TYPE,
+	MINILOOP_CHECK_TYPE,
+	MINILOOP_IDLE_TYPE,
 } ml_type_t;
 
+/* Watcher @active while its EPOLL_CTL_ADD is in the changelist */
+#define MINILOOP_ADD_PENDING 2
+
 /* Event mask, used internally only. */
 #define MINILOOP_EVENT_MASK  (MINILOOP_ERROR | MINILOOP_READ | MINILOOP_WRITE | MINILOOP_PRI |	\
 			 MINILOOP_RDHUP | MINILOOP_HUP | MINILOOP_EDGE | MINILOOP_ONESHOT)
 
+/* Forward declare due to dependencies, don't try this at home kids. */
+struct ml;
+struct ml_uring;
+struct ml_fs_pool;
+struct ml_fswatch_tab;
+struct ml_signal_tab;
+struct ml_buf_pool;
+struct ml_pool;
+struct ml_co;
+struct ml_stats_ctx;
+
+/* Node in the userspace timer heap, key is a CLOCK_MONOTONIC deadline in ns */
+typedef struct {
+	uint64_t        key;
+	struct ml      *w;
+} ml_tnode_t;
+
+/*
+ * Bookkeeping of an active, or closing, watcher, in the context's
+ * table of nodes at w->node - 1.  The node is taken when the watcher
+ * is started and put back when it is stopped, or its close callback
+ * has been called, so ml_t only holds what ml_run() needs per event.
+ */
+typedef struct {
+	struct ml      *w;	    /* NULL when free */
+
+	/* Backend private, e.g. io_uring poll request, or the
+	 * ml_close() callback, closing watchers have no slot */
+	union {
+		void   *slot;
+		void  (*close)(struct ml *, void *);
+	};
+
+	/* Index + 1 in the context's changelist, or zero */
+	int             change;
+
+	/* Next node + 1 on the closing, or free, list, or zero */
+	int             link;
+} ml_node_t;
+
+/* Node of an active, or closing, watcher */
+#define _ML_NODE(w) (&(w)->ctx->nodes[(w)->node - 1])
+
 /* Main miniloop context type */
 typedef struct {
 	int             running;
   int             inotify_fd; /* Take a guess what this is for... */
 	int             fd;	        /* For epoll() */
 	int             maxevents;  /* For epoll() */
-	struct ml      *watchers;
-	uint32_t        workaround; /* For workarounds, e.g. redirected stdin */
-} ml_ctx_t;
+	struct epoll_event *events; /* Event cache, maxevents long */
+	int             flags;      /* From ml_init1() */
 
-/* Forward declare due to dependencies, don't try this at home kids. */
-struct ml;
+	/* Active and closing watchers, see ml_node_t */
+	ml_node_t      *nodes;
+	int             nnodes;	    /* Used, free ones are on nodes_free */
+	int             nodes_max;
+	int             nodes_free;
+	int             nwatchers;  /* Active */
 
-/* This is used to hide all private data members in ml_t */
+	/* Time to spin before blocking with %MINILOOP_BUSYPOLL */
+	uint64_t        spin_ns;
+
+	/* CLOCK_MONOTONIC in ns, sampled after each wait, see ml_now_ns() */
+	uint64_t        now;
+
+	/* Batch in ml_run(), stopped watchers' later events are dropped */
+	struct epoll_event *ebatch; /* The event cache, or sorted */
+	int             ecur, enfds;
+
+	/* Batches sorted by priority, low priority events over budget */
+	int             prio;	    /* Set once a watcher has a priority */
+	int             budget;
+	struct epoll_event *sorted;
+	int             sorted_max;
+	struct epoll_event *backlog;
+	int             nbacklog;
+	int             backlog_max;
+
+	/* Watchers given to ml_close(), close callback pending, node + 1 */
+	int             closing;
+
+	/* Prepare, check and idle watchers, next to run from ml_run() */
+	struct ml      *prepare, *check, *idle;
+	struct ml      *hook_next;
+
+	/* Edge tracked I/O watchers with readiness to report, no syscall */
+	struct ml      *io_pending;
+
+	/* I/O watchers on descriptors epoll cannot poll, e.g. regular files */
+	struct ml      *io_always, *io_next;
+
+	/* Queued epoll_ctl() ADD and MOD, flushed before the next wait */
+	int             batch;	    /* Set in ml_run(), else sent at once */
+	struct ml     **changes;
+	int             nchanges;
+	int             changes_max;
+
+	/* Worker threads for ml_fs_*() requests, created on demand */
+	struct ml_fs_pool *fs;
+
+	/* Signal watchers on a shared signalfd, created on demand */
+	struct ml_signal_tab *signal;
+
+	/* File watchers on inotify_fd, created on demand */
+	struct ml_fswatch_tab *fswatch;
+
+	/* Free buffers for ml_buf_alloc(), created on demand */
+	struct ml_buf_pool *bufs;
+
+	/* Watchers from ml_alloc(), created on demand */
+	struct ml_pool *pool;
+
+	/* Coroutines, the one running, and free stacks, see ml_co_init() */
+	struct ml_co   *co, *co_current;
+	void           *co_stacks;
+	int             co_nstacks;
+
+	/* Counters, only with MINILOOP_STATS, see ml_stats_get() */
+	struct ml_stats_ctx *stats;
+
+	/* Ring of recent dispatches, see ml_trace_init() */
+	struct ml_trace *trace;
+
+	/* io_uring backend, with %MINILOOP_IO_URING, fd is the ring */
+	struct ml_uring *ring;
+
+	/* 4-ary min-heap of timers, with %MINILOOP_TIMER_HEAP */
+	ml_tnode_t     *timers;
+	int             ntimers;
+	int             timers_max;
+} ml_ctx_t;
+
+/*
+ * This is used to hide all private data members in ml_t.  The members
+ * ml_run() reads for each event come first, followed by the public fd,
+ * signo and ctx, so that dispatch stays in the first cache line.  The
+ * arguments for different watchers follow, see ml_private_cold_t.
+ * List links, backend slot and changelist index are in the context,
+ * see ml_node_t.
+ */
 #define ml_private_t                                           \
-	struct ml     *next, *prev;				\
-								\
-	int             active;                                 \
-	int             events;                                 \
-								\
 	/* Watcher callback with optional argument */           \
 	void          (*cb)(struct ml *, void *, int);         \
 	void           *arg;                                    \
 								\
+	int             events;                                 \
+	int8_t          active;                                 \
+								\
+	/* See ml_priority_set() */				\
+	int8_t          prio;					\
+								\
+	/* Watcher type, an ml_type_t */				\
+	uint8_t
+
+/* The rest of the private data in ml_t, after the public members */
+#define ml_private_cold_t					\
 	/* Arguments for different watchers */			\
 	union {							\
-		/* Cron watchers */				\
+		/* Timer watchers, time in nanoseconds */	\
 		struct {					\
-			time_t when;				\
-			time_t interval;			\
-		} c;						\
+			uint64_t timeout;			\
+			uint64_t period;			\
+			uint64_t deadline; /* Heap only */	\
+			uint32_t slack;				\
 								\
-		/* Timer watchers, time in milliseconds */	\
-		struct {					\
-			int timeout;				\
-			int period;				\
+			/* Heap index or -1, see HEAP_MAX */	\
+			signed int heap : 24;			\
+			unsigned int clock : 4;			\
+			unsigned int flags : 4;			\
 		} t;						\
+								\
+		/* File watchers, inotify(7) mask in events */	\
+		struct {					\
+			const char *path;			\
+			uint32_t revents; /* Or pending */	\
+			int wd;					\
+			struct ml *hnext; /* wd hash chain */	\
+			struct ml *pnext; /* Pending list */	\
+		} f;						\
+								\
+		/* Prepare, check and idle watchers */		\
+		struct {					\
+			struct ml *next, *prev;			\
+		} h;						\
+								\
+		/* Signal watchers, on the shared signalfd */	\
+		struct {					\
+			uint32_t pending;			\
+			uint32_t count;				\
+			struct ml *snext; /* Same signal */	\
+			struct ml *pnext; /* Pending list */	\
+		} s;						\
+								\
+		/* Edge tracked I/O, see ml_io_edge_init() */	\
+		struct {					\
+			int track;				\
+			int always; /* On io_always */		\
+			uint32_t interest;			\
+			uint32_t ready;				\
+			struct ml *pnext; /* Pending list */	\
+			struct ml **pprev;			\
+		} e;						\
 	} u;							\
 								\
-	/* Watcher type */					\
-	ml_type_t
+	/* Index + 1 in the context's nodes, see ml_node_t */	\
+	int             node;					\
+								\
+	/* Index + 1 of its event in the batch, minus that in	\
+	 * the backlog, or zero */				\
+	int
 
 /* Internal API for dealing with generic watchers */
 int _ml_watcher_init  (ml_ctx_t *ctx, struct ml *w, ml_type_t type,
@@ -122,8 +267,158 @@ int _ml_watcher_init  (ml_ctx_t *ctx, struct ml *w, ml_type_t type,
 			int fd, int events);
 int _ml_watcher_start (struct ml *w);
 int _ml_watcher_stop  (struct ml *w);
-int _ml_watcher_active(struct ml *w);
 int _ml_watcher_rearm (struct ml *w);
+int _ml_watcher_attach(struct ml *w);
+int _ml_watcher_detach(struct ml *w);
+int _ml_watcher_close (struct ml *w);
+
+/* Internal API for edge tracked I/O watchers */
+uint32_t _ml_io_ready (struct ml *w, uint32_t events);
+void _ml_io_run       (ml_ctx_t *ctx);
+void _ml_io_again     (struct ml *w);
+void _ml_io_always    (struct ml *w);
+void _ml_io_always_run(ml_ctx_t *ctx);
+
+/* Internal API for buffers and streams */
+int _ml_buf_exit      (ml_ctx_t *ctx);
+
+/* Internal API for file system requests */
+int _ml_fs_exit       (ml_ctx_t *ctx);
+
+/* Internal API for prepare, check and idle watchers */
+void _ml_hook_run     (ml_ctx_t *ctx, struct ml *list);
+
+/* Internal API for signal watchers */
+int _ml_signal_exit   (ml_ctx_t *ctx);
+
+/* Internal API for file watchers */
+int _ml_fswatch_exit  (ml_ctx_t *ctx);
+
+/* Internal API for coroutines */
+void _ml_co_exit      (ml_ctx_t *ctx);
+
+/* Internal API for the watcher pool */
+void _ml_pool_reap    (ml_ctx_t *ctx);
+int  _ml_pool_exit    (ml_ctx_t *ctx);
+
+/* Internal API for the io_uring backend */
+int _ml_uring_init    (ml_ctx_t *ctx);
+int _ml_uring_exit    (ml_ctx_t *ctx);
+int _ml_uring_start   (struct ml *w);
+int _ml_uring_stop    (struct ml *w);
+int _ml_uring_rearm   (struct ml *w);
+int _ml_uring_wait    (ml_ctx_t *ctx, struct epoll_event *ee, int maxevents, int timeout);
+int _ml_uring_submit  (ml_ctx_t *ctx);
+
+/* Internal API for timers, the userspace heap and timerfd expiry */
+int _ml_timer_timeout (ml_ctx_t *ctx);
+int _ml_timer_run     (ml_ctx_t *ctx);
+uint32_t _ml_timer_expired(struct ml *w);
+
+/* Internal API for statistics, compiled out without MINILOOP_STATS */
+#ifdef MINILOOP_STATS
+uint64_t _ml_stats_now(void);
+int  _ml_stats_init   (ml_ctx_t *ctx);
+void _ml_stats_exit   (ml_ctx_t *ctx);
+void _ml_stats_wait   (ml_ctx_t *ctx, uint64_t t0, int nfds);
+void _ml_stats_dispatch(ml_ctx_t *ctx, uint64_t t0);
+void _ml_stats_cb     (ml_ctx_t *ctx, struct ml *w, void (*cb)(struct ml *, void *, int), uint64_t t0);
+void _ml_stats_always (ml_ctx_t *ctx, uint64_t t0);
+void _ml_stats_spin   (ml_ctx_t *ctx, uint64_t t0, int nfds);
+void _ml_stats_ctl    (struct ml *w, int op);
+
+#define _ML_STATS_NOW(t)          uint64_t t = _ml_stats_now()
+#define _ML_STATS_INIT(ctx)       _ml_stats_init(ctx)
+#define _ML_STATS_EXIT(ctx)       _ml_stats_exit(ctx)
+#define _ML_STATS_WAIT(ctx, t, n) _ml_stats_wait(ctx, t, n)
+#define _ML_STATS_DISPATCH(ctx, t) _ml_stats_dispatch(ctx, t)
+#define _ML_STATS_ALWAYS(ctx, t)  _ml_stats_always(ctx, t)
+#define _ML_STATS_SPIN(ctx, t, n) _ml_stats_spin(ctx, t, n)
+#define _ML_STATS_CTL(w, op)      _ml_stats_ctl(w, op)
+
+/* Run a watcher's callback, which may free the watcher */
+#define _ML_CALL(w, events) do {					\
+	struct ml *w_ = (w);						\
+	void (*cb_)(struct ml *, void *, int) = w_->cb;			\
+	ml_ctx_t *ctx_ = w_->ctx;					\
+	uint64_t t_ = _ml_stats_now();					\
+									\
+	_ML_TRACE_CALL(ctx_, w_, cb_, events);				\
+	_ml_stats_cb(ctx_, w_, cb_, t_);				\
+} while (0)
+#else
+#define _ML_STATS_NOW(t)          do { } while (0)
+#define _ML_STATS_INIT(ctx)       0
+#define _ML_STATS_EXIT(ctx)       do { } while (0)
+#define _ML_STATS_WAIT(ctx, t, n) do { } while (0)
+#define _ML_STATS_DISPATCH(ctx, t) do { } while (0)
+#define _ML_STATS_ALWAYS(ctx, t)  do { } while (0)
+#define _ML_STATS_SPIN(ctx, t, n) do { } while (0)
+#define _ML_STATS_CTL(w, op)      do { } while (0)
+
+#define _ML_CALL(w, events) do {					\
+	struct ml *w_ = (w);						\
+									\
+	_ML_TRACE_CALL(w_->ctx, w_, w_->cb, events);			\
+} while (0)
+#endif
+
+/*
+ * Static probes for SystemTap, bpftrace, perf, ... in provider miniloop:
+ *
+ *   wait__enter(ctx, timeout)     wait__exit(ctx, nfds)
+ *   cb__begin(w, type, events)    cb__end(w, type), @w may be freed
+ *   watcher__start(w, type, fd)   watcher__stop(w, type, fd)
+ *
+ * Each one is a nop, with a note in the binary, when <sys/sdt.h> is
+ * installed, otherwise, or with MINILOOP_NO_USDT, none.
+ */
+#if defined(__has_include) && !defined(MINILOOP_NO_USDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MINILOOP_USDT 1
+#endif
+#endif
+
+#ifdef MINILOOP_USDT
+#define _ML_PROBE2(name, a, b)    DTRACE_PROBE2(miniloop, name, a, b)
+#define _ML_PROBE3(name, a, b, c) DTRACE_PROBE3(miniloop, name, a, b, c)
+#else
+#define _ML_PROBE2(name, a, b)    do { } while (0)
+#define _ML_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+/* Internal API for tracing, the ring is only filled after ml_trace_init() */
+void _ml_trace_wait_enter (ml_ctx_t *ctx);
+void _ml_trace_wait_exit  (ml_ctx_t *ctx, int timeout, int nfds);
+void _ml_trace_cb         (ml_ctx_t *ctx, struct ml *w, int type, void (*cb)(struct ml *, void *, int), int events);
+
+#define _ML_TRACE_WAIT_ENTER(ctx, tmo) do {				\
+	_ML_PROBE2(wait__enter, ctx, tmo);				\
+	if (__builtin_expect((ctx)->trace != NULL, 0))			\
+		_ml_trace_wait_enter(ctx);				\
+} while (0)
+
+#define _ML_TRACE_WAIT_EXIT(ctx, tmo, nfds) do {			\
+	_ML_PROBE2(wait__exit, ctx, nfds);				\
+	if (__builtin_expect((ctx)->trace != NULL, 0))			\
+		_ml_trace_wait_exit(ctx, tmo, nfds);			\
+} while (0)
+
+/* The type is read before, the callback may free the watcher */
+#define _ML_TRACE_CALL(ctx, w, cb, events) do {				\
+	int type_ = (w)->type;						\
+	int ev_ = (events);						\
+									\
+	_ML_PROBE3(cb__begin, w, type_, ev_);				\
+	if (__builtin_expect((ctx)->trace != NULL, 0))			\
+		_ml_trace_cb(ctx, w, type_, cb, ev_);			\
+	else								\
+		(cb)(w, (w)->arg, ev_);					\
+	_ML_PROBE2(cb__end, w, type_);					\
+} while (0)
+
+#define _ML_TRACE_WATCHER(name, w) _ML_PROBE3(name, w, (w)->type, (w)->fd)
 
 #endif /* LIBMINILOOP_PRIVATE_H_ */
 
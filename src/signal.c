@@ -22,13 +22,167 @@
  * THE SOFTWARE.
  */
 
+/*
+ * All signal watchers of a context share one signalfd, registered as a
+ * single I/O watcher while any signal watcher is active.  Its mask is
+ * updated in place when a signal gets its first, or loses its last,
+ * watcher.  Watchers are found in a table indexed by signal number,
+ * chained when several watch the same signal.  Each wakeup drains the
+ * signalfd, many siginfos per read, and counts them per watcher.  Then
+ * every watcher with a non-zero count is called once, so a storm of
+ * SIGCHLD from many children exiting at once is one callback, a single
+ * pass of waitpid() for all of them.
+ */
+
 #include <errno.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <sys/signalfd.h>
 #include <unistd.h>		/* close(), read() */
 
 #include "miniloop.h"
 
+/* Number of siginfos read at a time */
+#define SIGINFO_BATCH 16
+
+struct ml_signal_tab {
+	/* Reader for the signalfd */
+	ml_t            w;
+
+	/* Signals in the signalfd, and their watchers */
+	sigset_t        mask;
+	ml_t           *watchers[_NSIG];
+	unsigned int    count;
+
+	/* Watchers with signals to deliver, in arrival order */
+	ml_t           *pending, **pending_tail;
+};
+
+static void mark(struct ml_signal_tab *tab, ml_t *w)
+{
+	if (!w->u.s.pending) {
+		w->u.s.pnext = NULL;
+		*tab->pending_tail = w;
+		tab->pending_tail = &w->u.s.pnext;
+	}
+	w->u.s.pending++;
+}
+
+static void unmark(struct ml_signal_tab *tab, ml_t *w)
+{
+	ml_t **pp;
+
+	if (!w->u.s.pending)
+		return;
+
+	for (pp = &tab->pending; *pp; pp = &(*pp)->u.s.pnext) {
+		if (*pp == w) {
+			*pp = w->u.s.pnext;
+			if (tab->pending_tail == &w->u.s.pnext)
+				tab->pending_tail = pp;
+			break;
+		}
+	}
+	w->u.s.pending = 0;
+}
+
+/* Drain the signalfd, then call each watcher with signals once */
+static void signal_cb(ml_t *r, void *arg, int events)
+{
+	struct signalfd_siginfo fdsi[SIGINFO_BATCH];
+	struct ml_signal_tab *tab = arg;
+	ml_ctx_t *ctx = r->ctx;
+	ssize_t len;
+
+	while ((len = read(r->fd, fdsi, sizeof(fdsi))) > 0) {
+		size_t i, num = len / sizeof(fdsi[0]);
+
+		for (i = 0; i < num; i++) {
+			int signo = fdsi[i].ssi_signo;
+			ml_t *w;
+
+			if (signo <= 0 || signo >= _NSIG)
+				continue;
+
+			for (w = tab->watchers[signo]; w; w = w->u.s.snext)
+				mark(tab, w);
+		}
+
+		if (num < SIGINFO_BATCH)
+			break;
+	}
+
+	while (ctx->signal == tab && tab->pending) {
+		ml_t *w = tab->pending;
+
+		tab->pending = w->u.s.pnext;
+		if (!tab->pending)
+			tab->pending_tail = &tab->pending;
+
+		w->u.s.count   = w->u.s.pending;
+		w->u.s.pending = 0;
+
+		/* Callback may stop, or restart, any signal watcher */
+		if (w->cb)
+			_ML_CALL(w, MINILOOP_READ);
+	}
+}
+
+static struct ml_signal_tab *signal_tab(ml_ctx_t *ctx)
+{
+	struct ml_signal_tab *tab = ctx->signal;
+	int fd;
+
+	if (tab)
+		return tab;
+
+	tab = calloc(1, sizeof(*tab));
+	if (!tab)
+		return NULL;
+
+	sigemptyset(&tab->mask);
+	fd = signalfd(-1, &tab->mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		free(tab);
+		return NULL;
+	}
+	tab->pending_tail = &tab->pending;
+
+	/* Started with the first signal watcher */
+	if (_ml_watcher_init(ctx, &tab->w, MINILOOP_IO_TYPE, signal_cb, tab, fd, MINILOOP_READ)) {
+		close(fd);
+		free(tab);
+		return NULL;
+	}
+
+	/*
+	 * Control traffic, ahead of everything else, see ml_priority_set().
+	 * Batches are sorted from now on, also if no watcher has a priority.
+	 */
+	tab->w.prio = MINILOOP_PRIO_MAX;
+	ctx->prio   = 1;
+	ctx->signal = tab;
+
+	return tab;
+}
+
+/* Private to miniloop, do not use directly!  Called by ml_exit() */
+int _ml_signal_exit(ml_ctx_t *ctx)
+{
+	struct ml_signal_tab *tab = ctx->signal;
+
+	if (!tab)
+		return 0;
+
+	/* Signals stay blocked, as they always have */
+	ctx->signal = NULL;
+	_ml_watcher_stop(&tab->w);
+	close(tab->w.fd);
+	free(tab);
+
+	return 0;
+}
+
 /**
  * Create a signal watcher
  * @param ctx    A valid miniloop context
@@ -37,35 +191,26 @@
  * @param arg    Optional callback argument
  * @param signo  Signal to watch for
  *
+ * The signal is blocked, for the whole process, and read from a
+ * signalfd shared by all signal watchers in @param ctx.  Signals that
+ * arrive in the same wakeup of the event loop are merged into a single
+ * callback, use ml_signal_count() to get how many there were.  So the
+ * callback for %SIGCHLD should reap all exited children, e.g. calling
+ * waitpid() with %WNOHANG until there are none left.
+ *
  * @return POSIX OK(0) or non-zero with @param errno set on error.
  */
 int ml_signal_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int signo)
 {
-	sigset_t mask;
-	int fd;
-
-	if (!w || !ctx) {
-		errno = EINVAL;
-		return -1;
-	}
-	w->fd = -1;
-
-	sigemptyset(&mask);
-	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
-	if (fd < 0)
+	if (_ml_watcher_init(ctx, w, MINILOOP_SIGNAL_TYPE, cb, arg, -1, MINILOOP_READ))
 		return -1;
 
-	if (_ml_watcher_init(ctx, w, MINILOOP_SIGNAL_TYPE, cb, arg, fd, MINILOOP_READ))
-		goto exit;
-
-	if (ml_signal_set(w, signo)) {
-		_ml_watcher_stop(w);
-	exit:
-		close(fd);
-		return -1;
-	}
+	w->u.s.pending = 0;
+	w->u.s.count   = 0;
+	w->u.s.snext   = NULL;
+	w->u.s.pnext   = NULL;
 
-	return 0;
+	return ml_signal_set(w, signo);
 }
 
 /**
@@ -77,38 +222,26 @@ int ml_signal_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int signo)
  */
 int ml_signal_set(ml_t *w, int signo)
 {
-	sigset_t mask;
-
 	/* Every watcher must be registered to a context */
 	if (!w || !w->ctx) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	/* Remember for callbacks and start/stop */
-	w->signo = signo;
-
-	/* Handle stopped signal watchers */
-	if (w->fd < 0) {
-		if (ml_signal_init(w->ctx, w, (ml_cb_t *)w->cb, w->arg, signo))
-			return -1;
+	if (signo <= 0 || signo >= _NSIG) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	sigemptyset(&mask);
-	sigaddset(&mask, signo);
-
-	/* Block signals so that they aren't handled
-	   according to their default dispositions */
-	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
-		return -1;
+	/* Ignore any errors, only to clean up anything lingering ... */
+	ml_signal_stop(w);
 
-	if (signalfd(w->fd, &mask, SFD_NONBLOCK) < 0)
-		return -1;
+	/* Remember for callbacks and start/stop */
+	w->signo = signo;
 
-	return _ml_watcher_start(w);
+	return ml_signal_start(w);
 }
 
-
 /**
  * Start a stopped signal watcher
  * @param w  Watcher to start (again)
@@ -117,15 +250,60 @@ int ml_signal_set(ml_t *w, int signo)
  */
 int ml_signal_start(ml_t *w)
 {
-	if (!w) {
+	struct ml_signal_tab *tab;
+	int signo;
+
+	if (!w || !w->ctx || w->type != MINILOOP_SIGNAL_TYPE) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (-1 != w->fd)
-		ml_signal_stop(w);
+	if (_ml_watcher_active(w))
+		return 0;
 
-	return ml_signal_set(w, w->signo);
+	signo = w->signo;
+	if (signo <= 0 || signo >= _NSIG) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	tab = signal_tab(w->ctx);
+	if (!tab)
+		return -1;
+
+	/* First watcher for this signal, update the signalfd in place */
+	if (!tab->watchers[signo]) {
+		sigset_t mask;
+
+		sigemptyset(&mask);
+		sigaddset(&mask, signo);
+
+		/* Block signals so that they aren't handled
+		   according to their default dispositions */
+		if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+			return -1;
+
+		sigaddset(&tab->mask, signo);
+		if (signalfd(tab->w.fd, &tab->mask, 0) < 0) {
+			sigdelset(&tab->mask, signo);
+			return -1;
+		}
+	}
+
+	if (!tab->count && _ml_watcher_start(&tab->w)) {
+		if (!tab->watchers[signo]) {
+			sigdelset(&tab->mask, signo);
+			signalfd(tab->w.fd, &tab->mask, 0);
+		}
+		return -1;
+	}
+
+	w->u.s.pending = 0;
+	w->u.s.snext = tab->watchers[signo];
+	tab->watchers[signo] = w;
+	tab->count++;
+
+	return _ml_watcher_attach(w);
 }
 
 /**
@@ -136,16 +314,42 @@ int ml_signal_start(ml_t *w)
  */
 int ml_signal_stop(ml_t *w)
 {
+	struct ml_signal_tab *tab;
+
+	if (!w || !w->ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	if (!_ml_watcher_active(w))
 		return 0;
 
-	if (_ml_watcher_stop(w))
-		return -1;
+	tab = w->ctx->signal;
+	if (tab) {
+		ml_t **pp;
 
-	close(w->fd);
-	w->fd = -1;
+		unmark(tab, w);
 
-	return 0;
+		for (pp = &tab->watchers[w->signo]; *pp; pp = &(*pp)->u.s.snext) {
+			if (*pp == w) {
+				*pp = w->u.s.snext;
+				w->u.s.snext = NULL;
+				tab->count--;
+				break;
+			}
+		}
+
+		/* Last watcher for this signal, still blocked but not read */
+		if (!tab->watchers[w->signo]) {
+			sigdelset(&tab->mask, w->signo);
+			signalfd(tab->w.fd, &tab->mask, 0);
+		}
+
+		if (!tab->count)
+			_ml_watcher_stop(&tab->w);
+	}
+
+	return _ml_watcher_detach(w);
 }
 
 /**
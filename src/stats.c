@@ -0,0 +1,319 @@
+/* miniloop - Optional event loop instrumentation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Only built with -DMINILOOP_STATS, e.g. `make STATS=1`, otherwise the
+ * hooks in private.h are empty and ml_stats_*() fail with ENOSYS.  The
+ * context only carries a pointer, so its layout does not depend on the
+ * build option.  Callback durations go in a log-linear histogram, eight
+ * buckets per power of two, i.e., within 12.5% of the real value.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "miniloop.h"
+
+#ifdef MINILOOP_STATS
+struct ml_stats_ctx {
+	ml_stats_t      st;
+
+	/* Slow callback hook */
+	uint64_t        slow_ns;
+	ml_slow_cb_t   *slow_cb;
+	void           *slow_arg;
+};
+
+/* Exact below 16 ns, then eight sub-buckets per power of two */
+static int bucket(uint64_t ns)
+{
+	int msb, idx;
+
+	if (ns < 16)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	idx = 16 + (msb - 4) * 8 + ((ns >> (msb - 3)) & 7);
+	if (idx >= MINILOOP_STATS_BUCKETS)
+		idx = MINILOOP_STATS_BUCKETS - 1;
+
+	return idx;
+}
+
+/* Largest value in a bucket */
+static uint64_t bucket_max(int idx)
+{
+	int msb;
+
+	if (idx < 16)
+		return idx;
+
+	msb = (idx - 16) / 8 + 4;
+
+	return ((uint64_t)(8 + (idx - 16) % 8 + 1) << (msb - 3)) - 1;
+}
+
+/* Events per wakeup: 0, 1, 2-3, 4-7, ... */
+static int wakeup_bucket(int nfds)
+{
+	int idx = nfds > 0 ? 32 - __builtin_clz(nfds) : 0;
+
+	if (idx >= MINILOOP_STATS_WAKEUPS)
+		idx = MINILOOP_STATS_WAKEUPS - 1;
+
+	return idx;
+}
+
+/* Private to miniloop, do not use directly! */
+uint64_t _ml_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Private to miniloop, do not use directly! */
+int _ml_stats_init(ml_ctx_t *ctx)
+{
+	ctx->stats = calloc(1, sizeof(struct ml_stats_ctx));
+	if (!ctx->stats)
+		return -1;
+
+	return 0;
+}
+
+/* Private to miniloop, do not use directly! */
+void _ml_stats_exit(ml_ctx_t *ctx)
+{
+	free(ctx->stats);
+	ctx->stats = NULL;
+}
+
+/* Private to miniloop, do not use directly!  After the wait for events */
+void _ml_stats_wait(ml_ctx_t *ctx, uint64_t t0, int nfds)
+{
+	ml_stats_t *st;
+
+	if (!ctx->stats)
+		return;
+
+	st = &ctx->stats->st;
+	st->iterations++;
+	st->blocked_ns += _ml_stats_now() - t0;
+	if (nfds > 0) {
+		st->events += nfds;
+		st->wakeups[wakeup_bucket(nfds)]++;
+	} else {
+		st->wakeups[0]++;
+	}
+}
+
+/* Private to miniloop, do not use directly!  After the iteration */
+void _ml_stats_dispatch(ml_ctx_t *ctx, uint64_t t0)
+{
+	if (ctx->stats)
+		ctx->stats->st.dispatch_ns += _ml_stats_now() - t0;
+}
+
+/* Private to miniloop, do not use directly!  After a callback, @w may be freed */
+void _ml_stats_cb(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, uint64_t t0)
+{
+	struct ml_stats_ctx *sc = ctx->stats;
+	uint64_t ns;
+
+	if (!sc)
+		return;
+
+	ns = _ml_stats_now() - t0;
+	sc->st.callbacks++;
+	sc->st.cb_hist[bucket(ns)]++;
+
+	if (sc->slow_cb && ns >= sc->slow_ns) {
+		sc->st.slow++;
+		sc->slow_cb(ctx, w, cb, ns, sc->slow_arg);
+	}
+}
+
+/* Private to miniloop, do not use directly!  Always ready I/O callback */
+void _ml_stats_always(ml_ctx_t *ctx, uint64_t t0)
+{
+	if (!ctx->stats)
+		return;
+
+	ctx->stats->st.always_calls++;
+	ctx->stats->st.always_ns += _ml_stats_now() - t0;
+}
+
+/* Private to miniloop, do not use directly!  After spinning, @nfds zero if it blocks */
+void _ml_stats_spin(ml_ctx_t *ctx, uint64_t t0, int nfds)
+{
+	if (!ctx->stats)
+		return;
+
+	if (nfds)
+		ctx->stats->st.spin_events++;
+	else
+		ctx->stats->st.spin_timeouts++;
+	ctx->stats->st.spin_ns += _ml_stats_now() - t0;
+}
+
+/* Private to miniloop, do not use directly!  Start, stop or rearm in the kernel */
+void _ml_stats_ctl(ml_t *w, int op)
+{
+	if (!w->ctx->stats || w->type >= MINILOOP_STATS_TYPES)
+		return;
+
+	w->ctx->stats->st.ctl[w->type][op]++;
+}
+#endif /* MINILOOP_STATS */
+
+/**
+ * Get event loop statistics
+ * @param ctx  A valid miniloop context
+ * @param st   Pointer to an ml_stats_t to fill in
+ *
+ * Counters are cumulative since ml_init() or ml_stats_reset().  Only
+ * available when miniloop is built with %MINILOOP_STATS defined.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error,
+ * %ENOSYS when built without %MINILOOP_STATS.
+ */
+int ml_stats_get(ml_ctx_t *ctx, ml_stats_t *st)
+{
+	if (!ctx || !st) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifdef MINILOOP_STATS
+	if (!ctx->stats) {
+		errno = ENOMEM;
+		return -1;
+	}
+	*st = ctx->stats->st;
+
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * Clear all event loop statistics
+ * @param ctx  A valid miniloop context
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_stats_reset(ml_ctx_t *ctx)
+{
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifdef MINILOOP_STATS
+	if (ctx->stats)
+		memset(&ctx->stats->st, 0, sizeof(ctx->stats->st));
+
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * Set a hook for slow callbacks
+ * @param ctx  A valid miniloop context
+ * @param ns   Threshold in nanoseconds
+ * @param cb   Called after each watcher callback that ran for @param ns or more, or %NULL
+ * @param arg  Optional argument to @param cb
+ *
+ * The hook gets the watcher and the callback that was run.  The watcher
+ * may have been freed by its own callback, so only use it as an id.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_stats_slow(ml_ctx_t *ctx, uint64_t ns, ml_slow_cb_t *cb, void *arg)
+{
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifdef MINILOOP_STATS
+	if (!ctx->stats) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ctx->stats->slow_ns  = ns;
+	ctx->stats->slow_cb  = cb;
+	ctx->stats->slow_arg = arg;
+
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * Get a percentile of callback durations
+ * @param st  Statistics from ml_stats_get()
+ * @param p   Percentile, 0 - 100
+ *
+ * @return Upper bound of the percentile in nanoseconds, or zero if no
+ * callbacks have run.
+ */
+uint64_t ml_stats_percentile(const ml_stats_t *st, double p)
+{
+#ifdef MINILOOP_STATS
+	uint64_t sum = 0, rank;
+	int i;
+
+	if (!st || !st->callbacks)
+		return 0;
+
+	rank = (uint64_t)(p / 100.0 * st->callbacks + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < MINILOOP_STATS_BUCKETS; i++) {
+		sum += st->cb_hist[i];
+		if (sum >= rank)
+			return bucket_max(i);
+	}
+#endif
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
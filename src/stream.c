@@ -0,0 +1,591 @@
+/* miniloop - Buffered streams and pooled buffers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * A stream is an edge tracked I/O watcher, see ml_io_edge_init(), so
+ * turning write interest on and off costs no system call.  Output is
+ * never written from ml_stream_write(), only queued: enabling write
+ * interest on a socket that is already writable puts the watcher on
+ * the pending list, run after the current batch of events, so all
+ * output queued by callbacks in the same iteration goes out in one
+ * writev().  Reads fill a few pooled buffers with one readv(), a full
+ * read is continued after the other watchers in the batch have run.
+ *
+ * User callbacks must be the last thing done with a stream, unless it
+ * is still active afterwards.  That is why it may only be freed from
+ * the callback of ml_stream_close(), or when the loop is not running.
+ */
+
+#include <errno.h>
+#include <limits.h>		/* IOV_MAX */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "miniloop.h"
+
+#define READ_BUFS  4		/* Buffers per readv() */
+#define WRITE_BUFS 64		/* Buffers per writev() */
+#define POOL_KEEP  256		/* Free buffers kept in the pool */
+
+struct ml_buf_pool {
+	ml_buf_t       *free;
+	unsigned int    nfree;
+};
+
+/* Private to miniloop, do not use directly!  Called by ml_exit() */
+int _ml_buf_exit(ml_ctx_t *ctx)
+{
+	struct ml_buf_pool *pool = ctx->bufs;
+
+	if (!pool)
+		return 0;
+
+	while (pool->free) {
+		ml_buf_t *b = pool->free;
+
+		pool->free = b->next;
+		free(b);
+	}
+	free(pool);
+	ctx->bufs = NULL;
+
+	return 0;
+}
+
+/**
+ * Get a buffer from the context's pool
+ * @param ctx  A valid miniloop context
+ *
+ * Buffers are %MINILOOP_BUF_SIZE bytes, returned empty with @off and
+ * @len zero.  Freed buffers are kept for reuse, up to a limit.
+ *
+ * @return A buffer, or %NULL with @param errno set on error.
+ */
+ml_buf_t *ml_buf_alloc(ml_ctx_t *ctx)
+{
+	struct ml_buf_pool *pool;
+	ml_buf_t *b;
+
+	if (!ctx) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool = ctx->bufs;
+	if (!pool) {
+		pool = calloc(1, sizeof(*pool));
+		if (!pool)
+			return NULL;
+		ctx->bufs = pool;
+	}
+
+	b = pool->free;
+	if (b) {
+		pool->free = b->next;
+		pool->nfree--;
+	} else {
+		b = malloc(sizeof(*b));
+		if (!b)
+			return NULL;
+	}
+
+	b->next = NULL;
+	b->off  = 0;
+	b->len  = 0;
+
+	return b;
+}
+
+/**
+ * Return a chain of buffers to the context's pool
+ * @param ctx   The context the buffers were allocated from
+ * @param bufs  First buffer of the chain, or %NULL
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_buf_free(ml_ctx_t *ctx, ml_buf_t *bufs)
+{
+	struct ml_buf_pool *pool;
+
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pool = ctx->bufs;
+	while (bufs) {
+		ml_buf_t *b = bufs;
+
+		bufs = b->next;
+		if (!pool || pool->nfree >= POOL_KEEP) {
+			free(b);
+			continue;
+		}
+
+		b->next = pool->free;
+		pool->free = b;
+		pool->nfree++;
+	}
+
+	return 0;
+}
+
+static int interest(ml_stream_t *s)
+{
+	return (s->reading ? MINILOOP_READ : 0) | (s->whead ? MINILOOP_WRITE : 0);
+}
+
+static int update(ml_stream_t *s)
+{
+	if (!ml_stream_active(s))
+		return 0;
+
+	return ml_io_set(&s->w, s->w.fd, interest(s));
+}
+
+/* Write queued output until done or %EAGAIN */
+static int flush(ml_stream_t *s)
+{
+	struct iovec iov[WRITE_BUFS < IOV_MAX ? WRITE_BUFS : IOV_MAX];
+
+	while (s->whead) {
+		size_t i = 0;
+		ml_buf_t *b;
+		ssize_t num;
+
+		for (b = s->whead; b && i < sizeof(iov) / sizeof(iov[0]); b = b->next, i++) {
+			iov[i].iov_base = b->data + b->off;
+			iov[i].iov_len  = b->len;
+		}
+
+		num = writev(s->w.fd, iov, i);
+		if (num < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				ml_io_clear(&s->w, MINILOOP_WRITE);
+				return 0;
+			}
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		/* Empty buffers in front are done too, even when nothing was written */
+		s->queued -= num;
+		while (s->whead && (num > 0 || !s->whead->len)) {
+			b = s->whead;
+			if ((size_t)num < b->len) {
+				b->off += num;
+				b->len -= num;
+				break;
+			}
+
+			num -= b->len;
+			s->whead = b->next;
+			b->next = NULL;
+			ml_buf_free(s->ctx, b);
+		}
+		if (!s->whead)
+			s->wtail = NULL;
+	}
+
+	return 0;
+}
+
+static void error(ml_stream_t *s)
+{
+	if (s->cb)
+		s->cb(s, s->arg, NULL, -1);
+}
+
+/* One readv(), returns 1 if it filled all buffers, -1 if done */
+static int fill(ml_stream_t *s)
+{
+	ml_buf_t *bufs[READ_BUFS], *head = NULL, **tail = &head;
+	struct iovec iov[READ_BUFS];
+	ssize_t num, left;
+	int i, full;
+
+	for (i = 0; i < READ_BUFS; i++) {
+		bufs[i] = ml_buf_alloc(s->ctx);
+		if (!bufs[i]) {
+			while (i-- > 0)
+				ml_buf_free(s->ctx, bufs[i]);
+			error(s);
+			return -1;
+		}
+		iov[i].iov_base = bufs[i]->data;
+		iov[i].iov_len  = MINILOOP_BUF_SIZE;
+	}
+
+	do
+		num = readv(s->w.fd, iov, READ_BUFS);
+	while (num < 0 && errno == EINTR);
+
+	left = num;
+	for (i = 0; i < READ_BUFS; i++) {
+		if (left <= 0) {
+			ml_buf_free(s->ctx, bufs[i]);
+			continue;
+		}
+
+		bufs[i]->len = left < MINILOOP_BUF_SIZE ? left : MINILOOP_BUF_SIZE;
+		left -= bufs[i]->len;
+		*tail = bufs[i];
+		tail = &bufs[i]->next;
+	}
+
+	if (num < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			ml_io_clear(&s->w, MINILOOP_READ);
+			return -1;
+		}
+
+		error(s);
+		return -1;
+	}
+
+	/* End of file, nothing more to read */
+	if (num == 0) {
+		s->reading = 0;
+		update(s);
+	}
+
+	full = num == READ_BUFS * MINILOOP_BUF_SIZE;
+	if (full)
+		_ml_io_again(&s->w);
+
+	if (s->cb)
+		s->cb(s, s->arg, head, num);
+	else
+		ml_buf_free(s->ctx, head);
+
+	return num ? full : -1;
+}
+
+static void stream_cb(ml_t *w, void *arg, int events)
+{
+	ml_stream_t *s = arg;
+
+	if (events & MINILOOP_ERROR) {
+		socklen_t len = sizeof(errno);
+		int err = 0;
+
+		if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len) || !err)
+			err = EIO;
+		errno = err;
+		error(s);
+		return;
+	}
+
+	if ((events & MINILOOP_WRITE) && s->whead) {
+		if (flush(s)) {
+			error(s);
+			return;
+		}
+		update(s);
+
+		if (s->above && s->queued <= s->low) {
+			s->above = 0;
+			if (s->drain_cb) {
+				s->drain_cb(s, s->arg);
+				if (!ml_stream_active(s))
+					return;
+			}
+		}
+	}
+
+	if (!(events & (MINILOOP_READ | MINILOOP_RDHUP | MINILOOP_HUP)) || !s->reading)
+		return;
+
+	/* After a hang-up the watcher is stopped, read what is left */
+	if (!(events & MINILOOP_HUP)) {
+		fill(s);
+		return;
+	}
+
+	while (s->reading && fill(s) > 0)
+		;
+}
+
+/**
+ * Create a buffered stream
+ * @param ctx  A valid miniloop context
+ * @param s    Pointer to an ml_stream_t
+ * @param cb   Callback with data read, end of file, or errors
+ * @param arg  Optional callback argument
+ * @param fd   Non-blocking stream socket, pipe or tty to use
+ *
+ * Data read is handed to @param cb in buffers from the context's pool,
+ * up to four at a time, with a single readv().  Output is queued with
+ * ml_stream_write() or ml_stream_send() and written, also from many
+ * calls in the same loop iteration, with one writev().  When more than
+ * the high watermark is queued ml_stream_writable() is false, until
+ * the drain callback of ml_stream_watermark() says it has fallen back
+ * to below the low watermark.  Use ml_stream_pause() to stop reading,
+ * e.g., while the peer we forward to is not writable.
+ *
+ * The stream does not own @param fd, it is not closed by miniloop.
+ * Writes use writev(), so ignore %SIGPIPE to get %EPIPE errors.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_stream_init(ml_ctx_t *ctx, ml_stream_t *s, ml_stream_cb_t *cb, void *arg, int fd)
+{
+	if (!ctx || !s) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	s->whead    = s->wtail = NULL;
+	s->low      = MINILOOP_STREAM_LOW;
+	s->high     = MINILOOP_STREAM_HIGH;
+	s->above    = 0;
+	s->reading  = 1;
+	s->drain_cb = NULL;
+	s->queued   = 0;
+	s->ctx      = ctx;
+	s->cb       = cb;
+	s->arg      = arg;
+
+	return ml_io_edge_init(ctx, &s->w, stream_cb, s, fd, MINILOOP_READ);
+}
+
+/**
+ * Set the watermarks of a stream
+ * @param s     A stream from ml_stream_init()
+ * @param low   Queued bytes at which @param cb is called, after @param high was reached
+ * @param high  Queued bytes at which ml_stream_writable() turns false
+ * @param cb    Drain callback, or %NULL
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_stream_watermark(ml_stream_t *s, size_t low, size_t high, ml_drain_cb_t *cb)
+{
+	if (!s || low > high || !high) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	s->low      = low;
+	s->high     = high;
+	s->drain_cb = cb;
+	if (s->queued >= high)
+		s->above = 1;
+
+	return 0;
+}
+
+/**
+ * Queue a chain of buffers to write
+ * @param s     An active stream
+ * @param bufs  Chain of buffers from ml_buf_alloc(), or a stream read
+ *
+ * The stream takes over the buffers, also on error.  They are written
+ * from the event loop, in order, and returned to the pool when done.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_stream_write(ml_stream_t *s, ml_buf_t *bufs)
+{
+	ml_buf_t *b, *last = NULL;
+	size_t len = 0;
+
+	if (!s || !ml_stream_active(s)) {
+		if (s)
+			ml_buf_free(s->ctx, bufs);
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (b = bufs; b; b = b->next) {
+		len += b->len;
+		last = b;
+	}
+	if (!last)
+		return 0;
+
+	if (s->wtail)
+		s->wtail->next = bufs;
+	else
+		s->whead = bufs;
+	s->wtail   = last;
+	s->queued += len;
+	if (s->queued >= s->high)
+		s->above = 1;
+
+	return update(s);
+}
+
+/**
+ * Queue a copy of data to write
+ * @param s     An active stream
+ * @param data  Data to write
+ * @param len   Length of @param data
+ *
+ * Copies @param data into pooled buffers, filling up the last queued
+ * buffer first, and queues them with ml_stream_write().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_stream_send(ml_stream_t *s, const void *data, size_t len)
+{
+	ml_buf_t *head = NULL, **tail = &head;
+	const char *ptr = data;
+
+	if (!s || (!data && len) || !ml_stream_active(s)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Fill up room left in the last buffer first */
+	if (s->wtail) {
+		ml_buf_t *b = s->wtail;
+		size_t room = MINILOOP_BUF_SIZE - b->off - b->len;
+
+		if (room > len)
+			room = len;
+		memcpy(b->data + b->off + b->len, ptr, room);
+		b->len    += room;
+		s->queued += room;
+		ptr += room;
+		len -= room;
+	}
+
+	while (len) {
+		ml_buf_t *b = ml_buf_alloc(s->ctx);
+		size_t num = len < MINILOOP_BUF_SIZE ? len : MINILOOP_BUF_SIZE;
+
+		if (!b) {
+			ml_buf_free(s->ctx, head);
+			return -1;
+		}
+
+		memcpy(b->data, ptr, num);
+		b->len = num;
+		*tail = b;
+		tail = &b->next;
+		ptr += num;
+		len -= num;
+	}
+
+	if (!head) {
+		if (s->queued >= s->high)
+			s->above = 1;
+		return 0;
+	}
+
+	return ml_stream_write(s, head);
+}
+
+/**
+ * Stop reading from a stream
+ * @param s  An active stream
+ *
+ * Queued output is still written.  No system call.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_stream_pause(ml_stream_t *s)
+{
+	if (!s) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	s->reading = 0;
+
+	return update(s);
+}
+
+/**
+ * Resume reading from a paused stream
+ * @param s  An active stream
+ *
+ * Data that arrived while paused is read on the next loop iteration.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_stream_resume(ml_stream_t *s)
+{
+	if (!s) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	s->reading = 1;
+
+	return update(s);
+}
+
+/**
+ * Stop a stream and drop queued output
+ * @param s  Stream to stop
+ *
+ * Also call it after ml_exit(), to return queued buffers.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_stream_stop(ml_stream_t *s)
+{
+	if (!s) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	s->reading = 0;
+	ml_buf_free(s->ctx, s->whead);
+	s->whead  = s->wtail = NULL;
+	s->queued = 0;
+
+	return ml_io_stop(&s->w);
+}
+
+/**
+ * Stop a stream, and free it later
+ * @param s   Stream to close
+ * @param cb  Called when the stream may be freed, with &s->w, or %NULL
+ *
+ * Like ml_close() for the stream's watcher, queued output is dropped.
+ * The descriptor is not closed.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_stream_close(ml_stream_t *s, ml_close_cb_t *cb)
+{
+	if (!s) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ml_stream_stop(s);
+
+	return ml_close(&s->w, cb);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -22,22 +22,405 @@
  * THE SOFTWARE.
  */
 
+/*
+ * Timers keep time in nanoseconds.  Monotonic timers in a context with
+ * %MINILOOP_TIMER_HEAP live in the heap, all others have a timerfd on
+ * their clock, also in a heap context.  With slack the expiry is moved
+ * to the next multiple of the slack on the timer's clock, a grid shared
+ * by all timers, so nearby deadlines expire together in one wakeup.
+ *
+ * Inside ml_run() the monotonic time is that of the context, read once
+ * after each wait, so all timers set by the callbacks of an iteration
+ * count from the same point and no callback pays for a clock read.
+ * The wait timeout is computed on a fresh reading, callbacks may have
+ * taken a while since.
+ */
+
 #include <errno.h>
+#include <limits.h>		/* INT_MAX */
+#include <stdlib.h>		/* realloc() */
 #include <sys/timerfd.h>
+#include <time.h>		/* clock_gettime() */
 #include <unistd.h>		/* close(), read() */
 
 #include "miniloop.h"
 
+/* Arity of the timer heap, 4 children share one or two cache lines */
+#define HEAP_D 4
+
+/* Timers in one heap, the index is a 24-bit field in ml_t */
+#define HEAP_MAX ((1 << 23) - 1)
+
+#define MSEC 1000000ULL
+#define NSEC 1000000000ULL
+
+static int is_heap(ml_ctx_t *ctx, clockid_t clock)
+{
+	return (ctx->flags & MINILOOP_TIMER_HEAP) && clock == CLOCK_MONOTONIC;
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/* Now on the timer's clock, the context's cached time if monotonic */
+static uint64_t timer_now(ml_t *w)
+{
+	if (w->u.t.clock == CLOCK_MONOTONIC)
+		return ml_now_ns(w->ctx);
+
+	return clock_ns(w->u.t.clock);
+}
+
+/* Latest expiry within the timer's slack */
+static uint64_t expiry(ml_t *w, uint64_t deadline)
+{
+	uint64_t slack = w->u.t.slack;
+
+	if (!slack)
+		return deadline;
+
+	return (deadline + slack - 1) / slack * slack;
+}
+
+static void heap_up(ml_ctx_t *ctx, int i)
+{
+	ml_tnode_t node = ctx->timers[i];
+
+	while (i > 0) {
+		int parent = (i - 1) / HEAP_D;
+
+		if (ctx->timers[parent].key <= node.key)
+			break;
+
+		ctx->timers[i] = ctx->timers[parent];
+		ctx->timers[i].w->u.t.heap = i;
+		i = parent;
+	}
+
+	ctx->timers[i] = node;
+	node.w->u.t.heap = i;
+}
 
-static void msec2tspec(int msec, struct timespec *ts)
+static void heap_down(ml_ctx_t *ctx, int i)
 {
-	if (msec) {
-		ts->tv_sec  =  msec / 1000;
-		ts->tv_nsec = (msec % 1000) * 1000000;
-	} else {
-		ts->tv_sec  = 0;
-		ts->tv_nsec = 0;
+	ml_tnode_t node = ctx->timers[i];
+
+	while (1) {
+		int child = i * HEAP_D + 1;
+		int min, end;
+
+		if (child >= ctx->ntimers)
+			break;
+
+		end = child + HEAP_D;
+		if (end > ctx->ntimers)
+			end = ctx->ntimers;
+
+		for (min = child++; child < end; child++) {
+			if (ctx->timers[child].key < ctx->timers[min].key)
+				min = child;
+		}
+
+		if (ctx->timers[min].key >= node.key)
+			break;
+
+		ctx->timers[i] = ctx->timers[min];
+		ctx->timers[i].w->u.t.heap = i;
+		i = min;
 	}
+
+	ctx->timers[i] = node;
+	node.w->u.t.heap = i;
+}
+
+static int heap_insert(ml_ctx_t *ctx, ml_t *w, uint64_t key)
+{
+	if (ctx->ntimers == ctx->timers_max) {
+		int max = ctx->timers_max ? ctx->timers_max * 2 : 64;
+		ml_tnode_t *timers;
+
+		if (ctx->ntimers == HEAP_MAX) {
+			errno = ENOMEM;
+			return -1;
+		}
+		if (max > HEAP_MAX)
+			max = HEAP_MAX;
+
+		timers = realloc(ctx->timers, max * sizeof(*timers));
+		if (!timers)
+			return -1;
+
+		ctx->timers     = timers;
+		ctx->timers_max = max;
+	}
+
+	ctx->timers[ctx->ntimers].key = key;
+	ctx->timers[ctx->ntimers].w   = w;
+	heap_up(ctx, ctx->ntimers++);
+
+	return 0;
+}
+
+static void heap_remove(ml_ctx_t *ctx, ml_t *w)
+{
+	int i = w->u.t.heap;
+
+	if (i < 0)
+		return;
+
+	w->u.t.heap = -1;
+	if (i == --ctx->ntimers)
+		return;
+
+	ctx->timers[i] = ctx->timers[ctx->ntimers];
+	ctx->timers[i].w->u.t.heap = i;
+	heap_up(ctx, i);
+	heap_down(ctx, ctx->timers[i].w->u.t.heap);
+}
+
+/*
+ * Arm a timer in the heap.  Each node's key never lies after the
+ * watcher's expiry, so a deadline pushed further out is only
+ * recorded in the watcher and the node is re-keyed when the old
+ * key expires.  This keeps re-arming idle timeouts O(1).
+ */
+static int heap_set(ml_t *w)
+{
+	ml_ctx_t *ctx = w->ctx;
+	uint64_t deadline, key;
+
+	if (_ml_watcher_attach(w))
+		return -1;
+
+	/* Armed by ml_run() when the event loop starts */
+	if (!ctx->running)
+		return 0;
+
+	/* Same as timerfd_settime(), a zero timeout disarms the timer */
+	if (!w->u.t.timeout) {
+		heap_remove(ctx, w);
+		return 0;
+	}
+
+	deadline = w->u.t.timeout;
+	if (!(w->u.t.flags & MINILOOP_TIMER_ABSTIME))
+		deadline += ml_now_ns(ctx);
+	w->u.t.deadline = deadline;
+
+	key = expiry(w, deadline);
+	if (w->u.t.heap < 0)
+		return heap_insert(ctx, w, key);
+
+	if (key < ctx->timers[w->u.t.heap].key) {
+		ctx->timers[w->u.t.heap].key = key;
+		heap_up(ctx, w->u.t.heap);
+	}
+
+	return 0;
+}
+
+/* Private to miniloop, milliseconds until the first timer in the heap */
+int _ml_timer_timeout(ml_ctx_t *ctx)
+{
+	uint64_t now, key, msec;
+
+	if (!ctx->ntimers)
+		return -1;
+
+	ml_now_update(ctx);
+	now = ctx->now;
+	key = ctx->timers[0].key;
+	if (key <= now)
+		return 0;
+
+	/* Round up, waking up early only causes another epoll_wait() */
+	msec = (key - now + MSEC - 1) / MSEC;
+	if (msec > INT_MAX)
+		return INT_MAX;
+
+	return (int)msec;
+}
+
+/* Private to miniloop, call all expired timers in the heap */
+int _ml_timer_run(ml_ctx_t *ctx)
+{
+	uint64_t now = ml_now_ns(ctx);
+	int num = 0;
+
+	while (ctx->running && ctx->ntimers && ctx->timers[0].key <= now) {
+		ml_t *w = ctx->timers[0].w;
+
+		/* Deadline was pushed out after the node was keyed */
+		if (expiry(w, w->u.t.deadline) > now) {
+			ctx->timers[0].key = expiry(w, w->u.t.deadline);
+			heap_down(ctx, 0);
+			continue;
+		}
+
+		if (w->u.t.period) {
+			uint64_t period = w->u.t.period;
+
+			/* Keep periodic timers in phase, unless we lag behind */
+			w->u.t.deadline += period;
+			if (w->u.t.deadline <= now)
+				w->u.t.deadline = now + period;
+
+			ctx->timers[0].key = expiry(w, w->u.t.deadline);
+			heap_down(ctx, 0);
+		} else {
+			w->u.t.timeout = 0;
+			ml_timer_stop(w);
+		}
+
+		num++;
+
+		/*
+		 * NOTE: Must be last action for watcher, the
+		 *       callback may delete itself.
+		 */
+		if (w->cb)
+			_ML_CALL(w, MINILOOP_READ);
+	}
+
+	return num;
+}
+
+static void ns2tspec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec  = ns / NSEC;
+	ts->tv_nsec = ns % NSEC;
+}
+
+/*
+ * Arm a timerfd.  Relative timeouts without slack are given as is, the
+ * others as a deadline.  From a callback a relative monotonic timeout
+ * is also a deadline, from ml_now_ns() like the timer heap, so timers
+ * set in one batch are consistent.  A realtime deadline is cancelled
+ * when the clock is set, see _ml_timer_expired().
+ */
+static int tfd_set(ml_t *w)
+{
+	struct itimerspec time;
+	uint64_t value = w->u.t.timeout;
+	int flags = 0, cached;
+
+	cached = w->ctx->batch && w->u.t.clock == CLOCK_MONOTONIC;
+	if (value && (cached || w->u.t.slack || (w->u.t.flags & MINILOOP_TIMER_ABSTIME))) {
+		if (w->u.t.flags & MINILOOP_TIMER_ABSTIME) {
+			if (w->u.t.clock == CLOCK_REALTIME)
+				flags |= TFD_TIMER_CANCEL_ON_SET;
+		} else {
+			value += timer_now(w);
+		}
+
+		value  = expiry(w, value);
+		flags |= TFD_TIMER_ABSTIME;
+	}
+
+	ns2tspec(value, &time.it_value);
+	ns2tspec(w->u.t.period, &time.it_interval);
+
+	return timerfd_settime(w->fd, flags, &time, NULL);
+}
+
+/*
+ * Private to miniloop, a timerfd is readable, returns the events for
+ * the callback.  When the realtime clock is set a deadline on it is
+ * re-armed and the callback gets %MINILOOP_ERROR with errno set to
+ * %ECANCELED, the deadline may need to be recalculated.
+ */
+uint32_t _ml_timer_expired(ml_t *w)
+{
+	uint64_t exp;
+
+	if (read(w->fd, &exp, sizeof(exp)) != sizeof(exp)) {
+		/* Re-armed by an earlier callback in this batch */
+		if (errno == EAGAIN)
+			return 0;
+
+		if (errno == ECANCELED && !tfd_set(w)) {
+			errno = ECANCELED;
+			return MINILOOP_ERROR;
+		}
+
+		ml_timer_stop(w);
+		return MINILOOP_ERROR;
+	}
+
+	if (!w->u.t.period)
+		w->u.t.timeout = 0;
+	if (!w->u.t.timeout)
+		ml_timer_stop(w);
+
+	return MINILOOP_READ;
+}
+
+/**
+ * Read the monotonic clock for a context
+ * @param ctx  A valid miniloop context
+ *
+ * Updates the time returned by ml_now_ns() and ml_now(), e.g. for a
+ * callback that has been busy for a while and is about to set timers.
+ * Done by ml_run() after each wait.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_now_update(ml_ctx_t *ctx)
+{
+	if (!ctx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ctx->now = clock_ns(CLOCK_MONOTONIC);
+
+	return 0;
+}
+
+/**
+ * Current time of a context, in nanoseconds
+ * @param ctx  A valid miniloop context
+ *
+ * In callbacks this is %CLOCK_MONOTONIC as read once when ml_run() woke
+ * up, the same for all callbacks of an iteration, without a system
+ * call or vDSO clock read.  Relative timeouts of timers set in the
+ * callbacks count from it, see ml_now_update().  Outside of ml_run()
+ * the clock is read anew.
+ *
+ * @return Nanoseconds on %CLOCK_MONOTONIC, or zero with @param errno
+ * set on error.
+ */
+uint64_t ml_now_ns(ml_ctx_t *ctx)
+{
+	if (!ctx) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	if (!ctx->batch)
+		ml_now_update(ctx);
+
+	return ctx->now;
+}
+
+/**
+ * Current time of a context, in milliseconds
+ * @param ctx  A valid miniloop context
+ *
+ * Same as ml_now_ns(), in milliseconds.
+ *
+ * @return Milliseconds on %CLOCK_MONOTONIC, or zero with @param errno
+ * set on error.
+ */
+uint64_t ml_now(ml_ctx_t *ctx)
+{
+	return ml_now_ns(ctx) / MSEC;
 }
 
 /**
@@ -59,31 +442,79 @@ static void msec2tspec(int msec, struct timespec *ts)
  *
  * A timer is automatically started if the event loop is already
  * running, otherwise it is kept on hold until triggered by calling
- * ml_run().
+ * ml_run(), or ml_fd() or ml_timeout() for a context run from another
+ * event loop.
  *
  * @return POSIX OK(0) or non-zero with @param errno set on error.
  */
 int ml_timer_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int timeout, int period)
 {
-	int fd;
-
 	if (timeout < 0 || period < 0) {
 		errno = ERANGE;
 		return -1;
 	}
 
-	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	if (fd < 0)
+	return ml_timer_init_ns(ctx, w, cb, arg, CLOCK_MONOTONIC, timeout * MSEC, period * MSEC, 0);
+}
+
+/**
+ * Create and start a timer watcher, with nanosecond resolution
+ * @param ctx      A valid miniloop context
+ * @param w        Pointer to an ml_t watcher
+ * @param cb       Callback function
+ * @param arg      Optional callback argument
+ * @param clock    %CLOCK_MONOTONIC, %CLOCK_BOOTTIME, or %CLOCK_REALTIME
+ * @param timeout  Nanoseconds before @param cb is called, or a deadline on @param clock
+ * @param period   For periodic timers, the period in nanoseconds
+ * @param flags    %MINILOOP_TIMER_ABSTIME for a deadline, or zero
+ *
+ * Like ml_timer_init(), but on any of the clocks timerfd supports.
+ * %CLOCK_BOOTTIME also counts time suspended.  With
+ * %MINILOOP_TIMER_ABSTIME @param timeout is a point in time on
+ * @param clock, periods are counted from it, so a schedule does not
+ * drift with the time it takes to re-arm.  A deadline on
+ * %CLOCK_REALTIME follows the wall clock: when it is set the callback
+ * is called with %MINILOOP_ERROR and errno %ECANCELED, and the timer
+ * stays armed on the old deadline, which may have passed already.
+ *
+ * With %MINILOOP_TIMER_HEAP only monotonic timers are in the heap, the
+ * wait for them is in milliseconds.  Use the default timerfd based
+ * timers, or another clock, for sub-millisecond pacing.  The heap
+ * holds up to 8388607 armed timers, more fail with %ENOMEM.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_timer_init_ns(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, clockid_t clock, uint64_t timeout, uint64_t period, int flags)
+{
+	int fd = -1;
+
+	if (clock != CLOCK_MONOTONIC && clock != CLOCK_BOOTTIME && clock != CLOCK_REALTIME) {
+		errno = EINVAL;
 		return -1;
+	}
+
+	if (!ctx || !is_heap(ctx, clock)) {
+		fd = timerfd_create(clock, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd < 0)
+			return -1;
+	}
 
 	if (_ml_watcher_init(ctx, w, MINILOOP_TIMER_TYPE, cb, arg, fd, MINILOOP_READ))
 		goto exit;
 
-	if (ml_timer_set(w, timeout, period)) {
+	w->u.t.clock = clock;
+	w->u.t.slack = 0;
+	w->u.t.heap  = -1;
+	if (fd < 0)
+		return ml_timer_set_ns(w, timeout, period, flags);
+
+	if (ml_timer_set_ns(w, timeout, period, flags)) {
 		_ml_watcher_stop(w);
 	exit:
-		close(fd);
-		w->fd = -1;
+		if (fd > -1)
+			close(fd);
+		if (w)
+			w->fd = -1;
 		return -1;
 	}
 
@@ -103,6 +534,30 @@ int ml_timer_init(ml_ctx_t *ctx, ml_t *w, ml_cb_t *cb, void *arg, int timeout, i
  * @return POSIX OK(0) or non-zero with @param errno set on error.
  */
 int ml_timer_set(ml_t *w, int timeout, int period)
+{
+	if (timeout < 0 || period < 0) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	return ml_timer_set_ns(w, timeout * MSEC, period * MSEC, 0);
+}
+
+/**
+ * Reset a timer, with nanosecond resolution
+ * @param w        Watcher to reset
+ * @param timeout  Nanoseconds before the callback, or a deadline, zero disarms timer
+ * @param period   For periodic timers, the period in nanoseconds
+ * @param flags    %MINILOOP_TIMER_ABSTIME for a deadline, or zero
+ *
+ * The timer keeps the clock it was created with, see ml_timer_init_ns().
+ * From a callback, a relative monotonic @param timeout counts from
+ * ml_now_ns(), when the event loop woke up, also with timerfd based
+ * timers.  Elsewhere it counts from the current time.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_timer_set_ns(ml_t *w, uint64_t timeout, uint64_t period, int flags)
 {
 	/* Every watcher must be registered to a context */
 	if (!w || !w->ctx) {
@@ -110,34 +565,65 @@ int ml_timer_set(ml_t *w, int timeout, int period)
 		return -1;
 	}
 
-	if (timeout < 0 || period < 0) {
-		errno = ERANGE;
+	if (flags & ~MINILOOP_TIMER_ABSTIME) {
+		errno = EINVAL;
 		return -1;
 	}
 
+	w->u.t.timeout = timeout;
+	w->u.t.period  = period;
+	w->u.t.flags   = flags;
+
+	if (is_heap(w->ctx, w->u.t.clock))
+		return heap_set(w);
+
 	/* Handle stopped timers */
 	if (w->fd < 0) {
 		/* Timer already stopped */
 		if (!timeout && !period)
 			return 0;
 
-		if (ml_timer_init(w->ctx, w, (ml_cb_t *)w->cb, w->arg, timeout, period))
+		w->fd = timerfd_create(w->u.t.clock, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (w->fd < 0)
 			return -1;
 	}
 
-	w->u.t.timeout = timeout;
-	w->u.t.period  = period;
+	if (w->ctx->running && tfd_set(w) < 0)
+		return 1;
 
-	if (w->ctx->running) {
-		struct itimerspec time;
+	return _ml_watcher_start(w);
+}
+
+/**
+ * Let a timer expire late, together with others
+ * @param w      Timer watcher
+ * @param slack  Nanoseconds the timer may expire late, zero for none
+ *
+ * The timer expires at the first multiple of @param slack on its clock
+ * after its deadline.  Timers with the same slack and nearby deadlines
+ * then expire together, in one wakeup.  Periods that are a multiple of
+ * @param slack stay coalesced.  Takes effect when the timer is next
+ * set, or started.  The slack is at most %UINT32_MAX nanoseconds, a
+ * little over four seconds.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error,
+ * %ERANGE for a slack over %UINT32_MAX.
+ */
+int ml_timer_slack(ml_t *w, uint64_t slack)
+{
+	if (!w || w->type != MINILOOP_TIMER_TYPE) {
+		errno = EINVAL;
+		return -1;
+	}
 
-		msec2tspec(timeout, &time.it_value);
-		msec2tspec(period, &time.it_interval);
-		if (timerfd_settime(w->fd, 0, &time, NULL) < 0)
-			return 1;
+	if (slack > UINT32_MAX) {
+		errno = ERANGE;
+		return -1;
 	}
 
-	return _ml_watcher_start(w);
+	w->u.t.slack = slack;
+
+	return 0;
 }
 
 /**
@@ -148,15 +634,15 @@ int ml_timer_set(ml_t *w, int timeout, int period)
  */
 int ml_timer_start(ml_t *w)
 {
-	if (!w) {
+	if (!w || !w->ctx) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (-1 != w->fd)
+	if (!is_heap(w->ctx, w->u.t.clock) && -1 != w->fd)
 		_ml_watcher_stop(w);
 
-	return ml_timer_set(w, w->u.t.timeout, w->u.t.period);
+	return ml_timer_set_ns(w, w->u.t.timeout, w->u.t.period, w->u.t.flags);
 }
 
 /**
@@ -170,6 +656,11 @@ int ml_timer_stop(ml_t *w)
 	if (!_ml_watcher_active(w))
 		return 0;
 
+	if (is_heap(w->ctx, w->u.t.clock)) {
+		heap_remove(w->ctx, w);
+		return _ml_watcher_detach(w);
+	}
+
 	if (_ml_watcher_stop(w))
 		return -1;
 
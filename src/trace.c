@@ -0,0 +1,300 @@
+/* miniloop - Tracing, static probes and a ring of recent dispatches
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * The static probes are in private.h, from <sys/sdt.h> when it is
+ * installed, a nop each until a tracer attaches.  This file is the
+ * ring: one writer, the loop thread, fills a slot and then publishes
+ * it by moving the head with a release store.  A reader copies after
+ * an acquire load of the head and loads it again afterwards, slots the
+ * writer may have reached meanwhile are dropped, so no lock is needed
+ * to look at a loop that is stuck from another thread.  Disabled, the
+ * cost is one test of ctx->trace per callback and per wait.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "miniloop.h"
+
+struct ml_trace {
+	uint64_t        head;		/* Records written, the next is at head & mask */
+	uint64_t        mask;
+	uint64_t        wait_start;	/* Of the wait in progress */
+	ml_trace_rec_t  rec[];
+};
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(struct ml_trace *t, uint64_t start, const void *w, ml_cb_t *cb, int fd, int events, int type)
+{
+	uint64_t head = t->head;
+	ml_trace_rec_t *r = &t->rec[head & t->mask];
+
+	r->start  = start;
+	r->ns     = now() - start;
+	r->w      = w;
+	r->cb     = cb;
+	r->fd     = fd;
+	r->events = events;
+	r->type   = type;
+
+	__atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Private to miniloop, do not use directly!  Before the wait for events */
+void _ml_trace_wait_enter(ml_ctx_t *ctx)
+{
+	ctx->trace->wait_start = now();
+}
+
+/* Private to miniloop, do not use directly!  After the wait, @nfds or -1 */
+void _ml_trace_wait_exit(ml_ctx_t *ctx, int timeout, int nfds)
+{
+	record(ctx->trace, ctx->trace->wait_start, NULL, NULL, timeout, nfds, 0);
+}
+
+/* Private to miniloop, do not use directly!  Runs the callback, @w may be freed */
+void _ml_trace_cb(ml_ctx_t *ctx, ml_t *w, int type, ml_cb_t *cb, int events)
+{
+	uint64_t start = now();
+	int fd = w->fd;
+
+	cb(w, w->arg, events);
+
+	/* Disabled by the callback */
+	if (ctx->trace)
+		record(ctx->trace, start, w, cb, fd, events, type);
+}
+
+/**
+ * Record recent dispatches of a context
+ * @param ctx  A valid miniloop context
+ * @param num  Records to keep, at least, zero to disable
+ *
+ * Each callback run by ml_run(), and each wait for events, is recorded
+ * with its start time and duration in a ring of the last @param num,
+ * see ml_trace_read() and ml_trace_dump().  Costs two clock reads per
+ * callback while enabled.  Calling it again starts over with an empty
+ * ring, this and ml_exit() free the old one, so not while another thread
+ * reads it.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_trace_init(ml_ctx_t *ctx, unsigned int num)
+{
+	struct ml_trace *t = NULL;
+	uint64_t size = 1;
+
+	if (!ctx || num > MINILOOP_TRACE_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Two spare slots for the ones ml_trace_read() may drop */
+	if (num) {
+		while (size < (uint64_t)num + 2)
+			size <<= 1;
+
+		t = calloc(1, sizeof(*t) + size * sizeof(ml_trace_rec_t));
+		if (!t)
+			return -1;
+		t->mask = size - 1;
+	}
+
+	free(ctx->trace);
+	ctx->trace = t;
+
+	return 0;
+}
+
+/**
+ * Copy the most recent records
+ * @param ctx  A valid miniloop context
+ * @param rec  Array of @param num records to fill in, oldest first
+ * @param num  Size of @param rec
+ *
+ * Safe from any thread while ml_run() is running, e.g. from a watchdog
+ * when the loop is stuck in a callback, which is then not recorded yet.
+ * Records the loop overwrites while they are copied are dropped.
+ *
+ * @return Number of records copied, or -1 with @param errno set on error,
+ * %ENOENT when not enabled with ml_trace_init().
+ */
+int ml_trace_read(ml_ctx_t *ctx, ml_trace_rec_t *rec, unsigned int num)
+{
+	uint64_t head, first, last, size, i;
+	struct ml_trace *t;
+
+	if (!ctx || (!rec && num)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	t = ctx->trace;
+	if (!t) {
+		errno = ENOENT;
+		return -1;
+	}
+	size = t->mask + 1;
+
+	head  = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+	first = head > size ? head - size : 0;
+	if (head - first > num)
+		first = head - num;
+
+	for (i = first; i < head; i++)
+		rec[i - first] = t->rec[i & t->mask];
+
+	/*
+	 * The loop may be writing the slots of the next two records, its
+	 * stores can pass the release of the head, those are dropped.
+	 */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	last = __atomic_load_n(&t->head, __ATOMIC_RELAXED) + 2;
+	if (last > first + size) {
+		uint64_t lost = last - first - size;
+
+		if (lost >= head - first)
+			return 0;
+		memmove(rec, rec + lost, (head - first - lost) * sizeof(*rec));
+		first += lost;
+	}
+
+	return head - first;
+}
+
+static const char *type_name(int type)
+{
+	static const char *names[] = {
+		[0]                     = "wait",
+		[MINILOOP_IO_TYPE]      = "io",
+		[MINILOOP_SIGNAL_TYPE]  = "signal",
+		[MINILOOP_TIMER_TYPE]   = "timer",
+		[MINILOOP_FS_TYPE]      = "fs",
+		[MINILOOP_EVENT_TYPE]   = "event",
+		[MINILOOP_FSWATCH_TYPE] = "fswatch",
+		[MINILOOP_PREPARE_TYPE] = "prepare",
+		[MINILOOP_CHECK_TYPE]   = "check",
+		[MINILOOP_IDLE_TYPE]    = "idle",
+	};
+
+	if (type < 0 || type >= (int)(sizeof(names) / sizeof(names[0])) || !names[type])
+		return "?";
+
+	return names[type];
+}
+
+/**
+ * Write the recorded dispatches as text, oldest first
+ * @param ctx  A valid miniloop context
+ * @param fp   Stream to write to, e.g. %stderr
+ *
+ * One line per record: start in seconds on %CLOCK_MONOTONIC, duration
+ * in microseconds, then for a wait its timeout in milliseconds and the
+ * number of events, for a callback the watcher type, watcher, fd, events
+ * and the callback's address, for `addr2line -f`.  Like ml_trace_read(),
+ * safe from another thread.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_trace_dump(ml_ctx_t *ctx, FILE *fp)
+{
+	ml_trace_rec_t *rec;
+	int i, num;
+
+	if (!ctx || !fp) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!ctx->trace) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* Not on the stack of a watchdog, the ring may be large */
+	rec = malloc((ctx->trace->mask + 1) * sizeof(*rec));
+	if (!rec)
+		return -1;
+
+	num = ml_trace_read(ctx, rec, ctx->trace->mask + 1);
+	for (i = 0; i < num; i++) {
+		ml_trace_rec_t *r = &rec[i];
+
+		fprintf(fp, "%" PRIu64 ".%06" PRIu64 " %10.1f us  %-7s ",
+			r->start / 1000000000, r->start / 1000 % 1000000,
+			r->ns / 1000.0, type_name(r->type));
+		if (!r->type)
+			fprintf(fp, "timeout %d ms, %d events\n", r->fd, r->events);
+		else
+			fprintf(fp, "%p fd %d events 0x%x cb %p\n",
+				r->w, r->fd, r->events, (void *)r->cb);
+	}
+	free(rec);
+
+	return fflush(fp) ? -1 : 0;
+}
+
+static void dump_cb(ml_t *w, void *arg, int events)
+{
+	ml_trace_dump(w->ctx, arg);
+}
+
+/**
+ * Dump the recorded dispatches on a signal
+ * @param ctx    A valid miniloop context, with ml_trace_init()
+ * @param w      Pointer to an ml_t, a signal watcher
+ * @param signo  Signal, e.g. %SIGUSR1
+ * @param fp     Stream to write to, e.g. %stderr
+ *
+ * Same as an ml_signal_init() watcher calling ml_trace_dump(), so the
+ * dump is written from the loop between callbacks, after a slow one
+ * has returned and is in the ring.  Stop it with ml_signal_stop().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_trace_signal(ml_ctx_t *ctx, ml_t *w, int signo, FILE *fp)
+{
+	if (!fp) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return ml_signal_init(ctx, w, dump_cb, fp, signo);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,606 @@
+/* miniloop - Batched datagram sockets
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Both directions use a ring of preallocated slots, each with its own
+ * mmsghdr, iovec, address and control buffer, set up once in init, so
+ * a batch is one recvmmsg() or sendmmsg() with no other work than the
+ * lengths.  The send ring is circular, every flush sends the run up to
+ * the end of the array, then the run from the start.  Like streams the
+ * watcher is edge tracked, queueing a datagram turns on write interest
+ * and the queue is flushed after the current batch of events.
+ *
+ * With UDP_GRO a received slot may hold many datagrams of the same
+ * size, they are split up again before calling back, and with
+ * UDP_SEGMENT runs of equal sized datagrams to the same peer are
+ * appended to one slot and sent as one.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>	/* UDP_GRO, UDP_SEGMENT */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "miniloop.h"
+
+#define MAX_PAYLOAD  65507	/* Largest UDP datagram over IPv4 */
+#define MAX_SEGMENTS 64		/* Kernel limit for both GRO and GSO */
+#define CMSG_SIZE    CMSG_SPACE(sizeof(int))
+
+struct ml_udp_ring {
+	unsigned int             slots;
+	unsigned int             head, count;	/* Send ring only */
+	size_t                   size;		/* Of each slot */
+	size_t                   max;		/* Of each datagram */
+	struct mmsghdr          *msgs;
+	struct iovec            *iov;
+	struct sockaddr_storage *addrs;
+	char                    *cmsgs;
+	char                    *data;
+
+	/* Receive ring: datagrams to call back with.  Send ring: GSO runs */
+	ml_udp_msg_t            *out;
+	uint16_t                *segsz;
+	uint8_t                 *nsegs;
+};
+
+static void ring_free(struct ml_udp_ring *r)
+{
+	if (!r)
+		return;
+
+	free(r->msgs);
+	free(r->iov);
+	free(r->addrs);
+	free(r->cmsgs);
+	free(r->data);
+	free(r->out);
+	free(r->segsz);
+	free(r->nsegs);
+	free(r);
+}
+
+static struct ml_udp_ring *ring_alloc(unsigned int slots, size_t size, unsigned int nout)
+{
+	struct ml_udp_ring *r;
+	unsigned int i;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	r->slots = slots;
+	r->size  = size;
+	r->msgs  = calloc(slots, sizeof(*r->msgs));
+	r->iov   = calloc(slots, sizeof(*r->iov));
+	r->addrs = calloc(slots, sizeof(*r->addrs));
+	r->cmsgs = calloc(slots, CMSG_SIZE);
+	r->data  = malloc(slots * size);
+	r->segsz = calloc(slots, sizeof(*r->segsz));
+	r->nsegs = calloc(slots, sizeof(*r->nsegs));
+	if (nout)
+		r->out = calloc(nout, sizeof(*r->out));
+	if (!r->msgs || !r->iov || !r->addrs || !r->cmsgs || !r->data ||
+	    !r->segsz || !r->nsegs || (nout && !r->out)) {
+		ring_free(r);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < slots; i++) {
+		struct msghdr *hdr = &r->msgs[i].msg_hdr;
+
+		r->iov[i].iov_base = r->data + i * size;
+		hdr->msg_name      = &r->addrs[i];
+		hdr->msg_iov       = &r->iov[i];
+		hdr->msg_iovlen    = 1;
+		hdr->msg_control   = r->cmsgs + i * CMSG_SIZE;
+	}
+
+	return r;
+}
+
+static void error(ml_udp_t *u)
+{
+	if (u->cb)
+		u->cb(u, u->arg, NULL, -1);
+}
+
+static int update(ml_udp_t *u)
+{
+	if (!ml_udp_active(u))
+		return 0;
+
+	return ml_io_set(&u->w, u->w.fd, MINILOOP_READ | (u->tx->count ? MINILOOP_WRITE : 0));
+}
+
+/* Size of each datagram coalesced by GRO, or zero */
+static size_t gro_size(struct msghdr *hdr)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		int val;
+
+		if (cmsg->cmsg_level != SOL_UDP || cmsg->cmsg_type != UDP_GRO)
+			continue;
+
+		memcpy(&val, CMSG_DATA(cmsg), sizeof(val));
+		return val > 0 ? (size_t)val : 0;
+	}
+
+	return 0;
+}
+
+/* Call back with what is collected, returns -1 if the watcher was stopped */
+static int deliver(ml_udp_t *u, unsigned int *nout)
+{
+	unsigned int num = *nout;
+
+	*nout = 0;
+	if (!num)
+		return 0;
+
+	if (u->cb)
+		u->cb(u, u->arg, u->rx->out, num);
+
+	return ml_udp_active(u) ? 0 : -1;
+}
+
+/* One recvmmsg(), returns 1 if all slots were filled, -1 if done */
+static int receive(ml_udp_t *u)
+{
+	struct ml_udp_ring *r = u->rx;
+	unsigned int i, nout = 0, max;
+	int num;
+
+	for (i = 0; i < r->slots; i++) {
+		struct msghdr *hdr = &r->msgs[i].msg_hdr;
+
+		r->iov[i].iov_len     = r->size;
+		hdr->msg_namelen      = sizeof(r->addrs[i]);
+		hdr->msg_controllen   = (u->flags & MINILOOP_UDP_GRO) ? CMSG_SIZE : 0;
+		hdr->msg_flags        = 0;
+	}
+
+	do
+		num = recvmmsg(u->w.fd, r->msgs, r->slots, MSG_DONTWAIT, NULL);
+	while (num < 0 && errno == EINTR);
+
+	if (num < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			ml_io_clear(&u->w, MINILOOP_READ);
+			return -1;
+		}
+
+		error(u);
+		return -1;
+	}
+
+	/* Fewer than asked for, the socket is empty, next datagram is an edge */
+	if ((unsigned int)num < r->slots)
+		ml_io_clear(&u->w, MINILOOP_READ);
+
+	max = r->slots * ((u->flags & MINILOOP_UDP_GRO) ? MAX_SEGMENTS : 1);
+	for (i = 0; i < (unsigned int)num; i++) {
+		struct msghdr *hdr = &r->msgs[i].msg_hdr;
+		char *data = r->iov[i].iov_base;
+		size_t len = r->msgs[i].msg_len;
+		size_t seg = 0;
+
+		if (u->flags & MINILOOP_UDP_GRO)
+			seg = gro_size(hdr);
+		if (!seg || seg > len)
+			seg = len;
+
+		do {
+			ml_udp_msg_t *m;
+
+			if (nout == max && deliver(u, &nout))
+				return -1;
+
+			m = &r->out[nout++];
+			m->data    = data;
+			m->len     = len < seg ? len : seg;
+			m->addr    = hdr->msg_name;
+			m->addrlen = hdr->msg_namelen;
+			data += m->len;
+			len  -= m->len;
+		} while (len);
+	}
+
+	if ((unsigned int)num == r->slots)
+		_ml_io_again(&u->w);
+
+	if (deliver(u, &nout))
+		return -1;
+
+	return (unsigned int)num == r->slots;
+}
+
+/*
+ * Send queued datagrams until done or %EAGAIN.  A datagram the kernel
+ * refuses is dropped, the error is returned after the ones behind it
+ * have been sent.
+ */
+static int flush(ml_udp_t *u)
+{
+	struct ml_udp_ring *r = u->tx;
+	int err = 0;
+
+	while (r->count) {
+		unsigned int i, run = r->slots - r->head;
+		int num;
+
+		if (run > r->count)
+			run = r->count;
+
+		for (i = r->head; i < r->head + run; i++) {
+			struct msghdr *hdr = &r->msgs[i].msg_hdr;
+			struct cmsghdr *cmsg;
+
+			if (r->nsegs[i] < 2) {
+				hdr->msg_controllen = 0;
+				continue;
+			}
+
+			hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+			cmsg = CMSG_FIRSTHDR(hdr);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type  = UDP_SEGMENT;
+			cmsg->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+			memcpy(CMSG_DATA(cmsg), &r->segsz[i], sizeof(uint16_t));
+		}
+
+		num = sendmmsg(u->w.fd, &r->msgs[r->head], run, MSG_DONTWAIT);
+		if (num < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				ml_io_clear(&u->w, MINILOOP_WRITE);
+				break;
+			}
+			if (errno == EINTR)
+				continue;
+
+			err = errno;
+			num = 1;
+		}
+
+		r->head   = (r->head + num) % r->slots;
+		r->count -= num;
+	}
+
+	if (!r->count)
+		r->head = 0;
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void udp_cb(ml_t *w, void *arg, int events)
+{
+	ml_udp_t *u = arg;
+
+	/* E.g. an ICMP port unreachable, soft error, keep going */
+	if (events & MINILOOP_ERROR) {
+		socklen_t len = sizeof(int);
+		int err = 0;
+
+		if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len) || !err)
+			err = EIO;
+		if (!(events & MINILOOP_HUP))
+			ml_udp_start(u);
+		errno = err;
+		error(u);
+		return;
+	}
+
+	if ((events & MINILOOP_WRITE) && u->tx->count) {
+		int rc = flush(u);
+
+		update(u);
+		if (rc) {
+			error(u);
+			if (!ml_udp_active(u))
+				return;
+		}
+	}
+
+	if (!(events & (MINILOOP_READ | MINILOOP_HUP)))
+		return;
+
+	if (!(events & MINILOOP_HUP)) {
+		receive(u);
+		return;
+	}
+
+	/* After a hang-up the watcher is stopped, read what is left */
+	while (receive(u) > 0)
+		;
+	if (u->cb)
+		u->cb(u, u->arg, NULL, 0);
+}
+
+/**
+ * Create a batched datagram watcher
+ * @param ctx    A valid miniloop context
+ * @param u      Pointer to an ml_udp_t
+ * @param cb     Callback with received datagrams and errors
+ * @param arg    Optional callback argument
+ * @param fd     Non-blocking datagram socket
+ * @param slots  Datagrams per recvmmsg() and in the send queue, zero for %MINILOOP_UDP_SLOTS
+ * @param size   Max. datagram size, zero for %MINILOOP_UDP_SIZE
+ * @param flags  A mask of %MINILOOP_UDP_GRO and %MINILOOP_UDP_GSO, or zero
+ *
+ * Each wakeup receives up to @param slots datagrams with one call and
+ * hands them, as an array, to @param cb.  A full batch is continued
+ * after the other watchers in the same iteration have run.  Longer
+ * datagrams than @param size are truncated.
+ *
+ * With %MINILOOP_UDP_GRO the kernel, if it supports it, coalesces
+ * datagrams from one peer into slots of %MAX_PAYLOAD bytes, they are
+ * split up again before calling back.  With %MINILOOP_UDP_GSO, if the
+ * kernel supports it, runs of datagrams of the same size to the same
+ * peer are sent as one, and segmented by the kernel or the NIC.  Flags
+ * the kernel does not support are cleared from @param u->flags.  These use more memory for the
+ * rings, @param slots times 64 KiB.
+ *
+ * The socket is not closed by miniloop.  All memory is released with
+ * ml_udp_close().
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_udp_init(ml_ctx_t *ctx, ml_udp_t *u, ml_udp_cb_t *cb, void *arg, int fd, unsigned int slots, size_t size, int flags)
+{
+	socklen_t len = sizeof(int);
+	size_t rxsize, txsize;
+	int val = 1;
+
+	if (!ctx || !u || fd < 0 || size > MAX_PAYLOAD) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!slots)
+		slots = MINILOOP_UDP_SLOTS;
+	if (!size)
+		size = MINILOOP_UDP_SIZE;
+
+	if ((flags & MINILOOP_UDP_GRO) &&
+	    setsockopt(fd, SOL_UDP, UDP_GRO, &val, sizeof(val)))
+		flags &= ~MINILOOP_UDP_GRO;
+
+	/* Older kernels ignore the cmsg, and would send one huge datagram */
+	if ((flags & MINILOOP_UDP_GSO) &&
+	    getsockopt(fd, SOL_UDP, UDP_SEGMENT, &val, &len))
+		flags &= ~MINILOOP_UDP_GSO;
+
+	rxsize = (flags & MINILOOP_UDP_GRO) ? MAX_PAYLOAD : size;
+	txsize = (flags & MINILOOP_UDP_GSO) ? MAX_PAYLOAD : size;
+
+	u->ctx   = ctx;
+	u->cb    = cb;
+	u->arg   = arg;
+	u->flags = flags;
+	u->rx    = ring_alloc(slots, rxsize, slots * ((flags & MINILOOP_UDP_GRO) ? MAX_SEGMENTS : 1));
+	u->tx    = ring_alloc(slots, txsize, 0);
+	if (!u->rx || !u->tx)
+		goto fail;
+	u->rx->max = size;
+	u->tx->max = size;
+
+	if (ml_io_edge_init(ctx, &u->w, udp_cb, u, fd, MINILOOP_READ))
+		goto fail;
+
+	return 0;
+fail:
+	ring_free(u->rx);
+	ring_free(u->tx);
+	u->rx = u->tx = NULL;
+
+	return -1;
+}
+
+/* Append to the last queued datagram, sent as segments of one with UDP_SEGMENT */
+static int append(ml_udp_t *u, const void *data, size_t len, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct ml_udp_ring *r = u->tx;
+	struct msghdr *hdr;
+	unsigned int i;
+
+	if (!(u->flags & MINILOOP_UDP_GSO) || !r->count || !len)
+		return 0;
+
+	i = (r->head + r->count - 1) % r->slots;
+	hdr = &r->msgs[i].msg_hdr;
+	if (hdr->msg_namelen != addrlen || (addrlen && memcmp(hdr->msg_name, addr, addrlen)))
+		return 0;
+
+	/* Only the last segment may be shorter, and it ends the run */
+	if (!r->segsz[i] || r->iov[i].iov_len % r->segsz[i] || len > r->segsz[i])
+		return 0;
+	if (r->nsegs[i] >= MAX_SEGMENTS || r->iov[i].iov_len + len > r->size)
+		return 0;
+
+	memcpy((char *)r->iov[i].iov_base + r->iov[i].iov_len, data, len);
+	r->iov[i].iov_len += len;
+	r->nsegs[i]++;
+
+	return 1;
+}
+
+/**
+ * Queue a copy of a datagram to send
+ * @param u        An active datagram watcher
+ * @param data     Datagram to send
+ * @param len      Length of @param data, at most the size given to ml_udp_init()
+ * @param addr     Destination, or %NULL on a connected socket
+ * @param addrlen  Length of @param addr
+ *
+ * Datagrams queued are sent from the event loop, in one sendmmsg() per
+ * iteration.  When the queue is full it is sent right away, if the
+ * socket buffer is full too this fails with %EAGAIN.  Errors from the
+ * kernel for a datagram are reported to the callback, or returned here
+ * if sent right away, the datagram is dropped.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_udp_send(ml_udp_t *u, const void *data, size_t len, const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct ml_udp_ring *r;
+	struct msghdr *hdr;
+	unsigned int i;
+
+	if (!u || !ml_udp_active(u) || (!data && len) || (!addr && addrlen) ||
+	    addrlen > sizeof(struct sockaddr_storage)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	r = u->tx;
+	if (len > r->max) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (append(u, data, len, addr, addrlen))
+		return 0;
+
+	if (r->count == r->slots) {
+		if (flush(u))
+			return -1;
+		if (r->count == r->slots) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	i = (r->head + r->count++) % r->slots;
+	hdr = &r->msgs[i].msg_hdr;
+	hdr->msg_namelen = addrlen;
+	if (addrlen)
+		memcpy(hdr->msg_name, addr, addrlen);
+	memcpy(r->iov[i].iov_base, data, len);
+	r->iov[i].iov_len = len;
+	r->segsz[i] = len;
+	r->nsegs[i] = 1;
+
+	if (r->count > 1)
+		return 0;
+
+	return update(u);
+}
+
+/**
+ * Send queued datagrams now
+ * @param u  An active datagram watcher
+ *
+ * Not needed normally, the queue is sent once per loop iteration.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_udp_flush(ml_udp_t *u)
+{
+	int rc;
+
+	if (!u || !ml_udp_active(u)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	rc = flush(u);
+	update(u);
+
+	return rc;
+}
+
+/**
+ * Start a datagram watcher (again)
+ * @param u  Watcher to start
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_udp_start(ml_udp_t *u)
+{
+	if (!u || !u->rx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return ml_io_set(&u->w, u->w.fd, MINILOOP_READ | (u->tx->count ? MINILOOP_WRITE : 0));
+}
+
+/**
+ * Stop a datagram watcher and drop queued datagrams
+ * @param u  Watcher to stop
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_udp_stop(ml_udp_t *u)
+{
+	if (!u || !u->rx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	u->tx->head  = 0;
+	u->tx->count = 0;
+
+	return ml_io_stop(&u->w);
+}
+
+/**
+ * Stop a datagram watcher, release its rings, and free it later
+ * @param u   Watcher to close
+ * @param cb  Called when @param u may be freed, with &u->w, or %NULL
+ *
+ * Like ml_close() for the watcher, also after ml_exit() to release the
+ * memory of the rings.  The socket is not closed.
+ *
+ * @return POSIX OK(0) or non-zero with @param errno set on error.
+ */
+int ml_udp_close(ml_udp_t *u, ml_close_cb_t *cb)
+{
+	if (!u || !u->rx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ml_udp_stop(u);
+	ring_free(u->rx);
+	ring_free(u->tx);
+	u->rx = u->tx = NULL;
+
+	return ml_close(&u->w, cb);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
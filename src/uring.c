@@ -0,0 +1,536 @@
+/* miniloop - io_uring backend
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Each started watcher has a one-shot IORING_OP_POLL_ADD in flight.
+ * Arming and disarming only queue SQEs, which are submitted together
+ * with the wait for completions, one io_uring_enter() per iteration.
+ * After a poll has completed and its callback has run, the poll is
+ * queued again, which gives the same level-triggered semantics as
+ * epoll.  Polls reference a slot, owned by the ring, instead of the
+ * watcher, so a completion for a stopped, possibly freed, watcher is
+ * safely dropped.
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>		/* calloc(), free() */
+#include <string.h>		/* memset() */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>		/* close(), syscall() */
+
+#include "miniloop.h"
+
+/* Size of submission queue, the completion queue is twice as large */
+#define RING_ENTRIES 256
+
+/* Number of slots allocated at a time */
+#define SLOT_CHUNK   64
+
+/* Events we can ask of IORING_OP_POLL_ADD */
+#define POLL_MASK    (EPOLLIN | EPOLLOUT | EPOLLPRI | EPOLLRDHUP | EPOLLERR | EPOLLHUP)
+
+struct slot {
+	struct ml      *w;	/* NULL when the watcher has been stopped */
+	struct slot    *next;	/* Free list, or list of polls to queue up */
+	int             armed;	/* POLL_ADD in flight */
+	int             queued;	/* On the list of polls to queue up */
+};
+
+struct chunk {
+	struct chunk   *next;
+	struct slot     slots[SLOT_CHUNK];
+};
+
+struct ml_uring {
+	int             fd;
+
+	/* Submission queue */
+	unsigned       *sq_head;
+	unsigned       *sq_tail;
+	unsigned       *sq_mask;
+	unsigned       *sq_flags;
+	unsigned       *sq_array;
+	unsigned        sq_entries;
+	struct io_uring_sqe *sqes;
+
+	/* Completion queue */
+	unsigned       *cq_head;
+	unsigned       *cq_tail;
+	unsigned       *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* Mappings, cq_ring == sq_ring with IORING_FEAT_SINGLE_MMAP */
+	void           *sq_ring;
+	void           *cq_ring;
+	size_t          sq_len;
+	size_t          cq_len;
+	size_t          sqes_len;
+
+	/* Must outlive the IORING_OP_TIMEOUT until it is submitted */
+	struct __kernel_timespec ts;
+
+	struct slot    *free;
+	struct slot    *queue;
+	struct chunk   *chunks;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned min, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, submit, min, flags, NULL, 0);
+}
+
+static unsigned unsubmitted(struct ml_uring *r)
+{
+	return *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static unsigned completed(struct ml_uring *r)
+{
+	return __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+}
+
+static struct io_uring_sqe *get_sqe(struct ml_uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	/* Full, make room by submitting what we have so far */
+	if (unsubmitted(r) >= r->sq_entries) {
+		if (uring_enter(r->fd, unsubmitted(r), 0, 0) < 0)
+			return NULL;
+	}
+
+	idx = *r->sq_tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+static void put_sqe(struct ml_uring *r)
+{
+	__atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static struct slot *get_slot(struct ml_uring *r)
+{
+	struct slot *s;
+
+	if (!r->free) {
+		struct chunk *c;
+		int i;
+
+		c = calloc(1, sizeof(*c));
+		if (!c)
+			return NULL;
+
+		c->next   = r->chunks;
+		r->chunks = c;
+		for (i = 0; i < SLOT_CHUNK; i++) {
+			c->slots[i].next = r->free;
+			r->free = &c->slots[i];
+		}
+	}
+
+	s = r->free;
+	r->free = s->next;
+	memset(s, 0, sizeof(*s));
+
+	return s;
+}
+
+static void put_slot(struct ml_uring *r, struct slot *s)
+{
+	s->w    = NULL;
+	s->next = r->free;
+	r->free = s;
+}
+
+/* Queue up a new poll for the slot after the current dispatch */
+static void requeue(struct ml_uring *r, struct slot *s)
+{
+	if (s->queued)
+		return;
+
+	s->queued = 1;
+	s->next   = r->queue;
+	r->queue  = s;
+}
+
+static int poll_add(struct ml_uring *r, struct slot *s)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(r);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode        = IORING_OP_POLL_ADD;
+	sqe->fd            = s->w->fd;
+	sqe->poll32_events = (s->w->events | EPOLLRDHUP) & POLL_MASK;
+	sqe->user_data     = (uintptr_t)s;
+	put_sqe(r);
+	s->armed = 1;
+
+	return 0;
+}
+
+static int poll_remove(struct ml_uring *r, struct slot *s)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(r);
+	if (!sqe)
+		return -1;
+
+	/* The completion of the remove itself has no slot */
+	sqe->opcode    = IORING_OP_POLL_REMOVE;
+	sqe->addr      = (uintptr_t)s;
+	sqe->user_data = 0;
+	put_sqe(r);
+
+	return 0;
+}
+
+static int timeout_add(struct ml_uring *r, int msec)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(r);
+	if (!sqe)
+		return -1;
+
+	r->ts.tv_sec  = msec / 1000;
+	r->ts.tv_nsec = (msec % 1000) * 1000000;
+
+	/* Also completes on the next completion, so they never pile up */
+	sqe->opcode    = IORING_OP_TIMEOUT;
+	sqe->addr      = (uintptr_t)&r->ts;
+	sqe->len       = 1;
+	sqe->off       = 1;
+	sqe->user_data = 0;
+	put_sqe(r);
+
+	return 0;
+}
+
+/* Polls that completed in the last iteration are armed again */
+static int requeue_all(struct ml_uring *r)
+{
+	struct slot *s;
+
+	while ((s = r->queue)) {
+		r->queue  = s->next;
+		s->queued = 0;
+
+		if (!s->w) {
+			if (!s->armed)
+				put_slot(r, s);
+			continue;
+		}
+
+		if (!s->armed && poll_add(r, s))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int reap(struct ml_uring *r, struct epoll_event *ee, int maxevents)
+{
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	int num = 0;
+
+	while (head != tail && num < maxevents) {
+		struct io_uring_cqe *cqe = &r->cqes[head++ & *r->cq_mask];
+		struct slot *s = (struct slot *)(uintptr_t)cqe->user_data;
+		struct ml *w;
+
+		/* Timeouts and poll removals */
+		if (!s)
+			continue;
+
+		s->armed = 0;
+		w = s->w;
+		if (!w) {
+			if (!s->queued)
+				put_slot(r, s);
+			continue;
+		}
+
+		/* A stale remove may hit a recycled slot, just poll again */
+		if (cqe->res == -ECANCELED) {
+			requeue(r, s);
+			continue;
+		}
+
+		ee[num].events   = cqe->res < 0 ? EPOLLERR : (uint32_t)cqe->res;
+		ee[num].data.ptr = w;
+		num++;
+
+		if (!(w->events & EPOLLONESHOT))
+			requeue(r, s);
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+	return num;
+}
+
+/* Private to miniloop, do not use directly! */
+int _ml_uring_init(ml_ctx_t *ctx)
+{
+	struct io_uring_params p;
+	struct ml_uring *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return -1;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = uring_setup(RING_ENTRIES, &p);
+	if (r->fd < 0) {
+		free(r);
+		return -1;
+	}
+
+	/* Without it a full completion queue would lose events */
+	if (!(p.features & IORING_FEAT_NODROP)) {
+		errno = ENOSYS;
+		goto fail;
+	}
+
+	r->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				  r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto unmap_sq;
+	}
+
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	r->sq_head    = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail    = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask    = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_flags   = (unsigned *)((char *)r->sq_ring + p.sq_off.flags);
+	r->sq_array   = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+
+	r->cq_head    = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail    = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask    = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes       = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+	ctx->ring = r;
+
+	return r->fd;
+
+unmap_cq:
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_len);
+unmap_sq:
+	munmap(r->sq_ring, r->sq_len);
+fail:
+	close(r->fd);
+	free(r);
+
+	return -1;
+}
+
+/* Private to miniloop, do not use directly! */
+int _ml_uring_exit(ml_ctx_t *ctx)
+{
+	struct ml_uring *r = ctx->ring;
+
+	if (!r)
+		return 0;
+
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_len);
+	munmap(r->sq_ring, r->sq_len);
+	close(r->fd);
+
+	while (r->chunks) {
+		struct chunk *c = r->chunks;
+
+		r->chunks = c->next;
+		free(c);
+	}
+	free(r);
+	ctx->ring = NULL;
+
+	return 0;
+}
+
+/* Private to miniloop, do not use directly! */
+int _ml_uring_start(ml_t *w)
+{
+	struct ml_uring *r = w->ctx->ring;
+	struct slot *s;
+
+	s = get_slot(r);
+	if (!s)
+		return -1;
+
+	s->w = w;
+	if (poll_add(r, s)) {
+		put_slot(r, s);
+		return -1;
+	}
+	_ML_NODE(w)->slot = s;
+
+	return 0;
+}
+
+/* Private to miniloop, do not use directly! */
+int _ml_uring_stop(ml_t *w)
+{
+	struct ml_uring *r = w->ctx->ring;
+	struct slot *s = _ML_NODE(w)->slot;
+
+	if (!s)
+		return 0;
+
+	_ML_NODE(w)->slot = NULL;
+	s->w    = NULL;
+
+	/* Slot is recycled when the poll completes, or is dequeued */
+	if (s->armed)
+		return poll_remove(r, s);
+	if (!s->queued)
+		put_slot(r, s);
+
+	return 0;
+}
+
+/* Private to miniloop, do not use directly! */
+int _ml_uring_rearm(ml_t *w)
+{
+	struct slot *s = _ML_NODE(w)->slot;
+
+	/* Disabled %MINILOOP_ONESHOT watcher, or already queued up */
+	if (s && !s->armed) {
+		if (s->queued)
+			return 0;
+
+		return poll_add(w->ctx->ring, s);
+	}
+
+	/* Replace poll in flight, the new one may have other events */
+	if (_ml_uring_stop(w))
+		return -1;
+
+	return _ml_uring_start(w);
+}
+
+/*
+ * Private to miniloop, do not use directly!
+ *
+ * Submit queued up changes, and polls to arm again, without waiting.
+ * For ml_dispatch(), when another loop waits on the ring fd.
+ */
+int _ml_uring_submit(ml_ctx_t *ctx)
+{
+	struct ml_uring *r = ctx->ring;
+
+	if (requeue_all(r))
+		return -1;
+
+	if (unsubmitted(r) && uring_enter(r->fd, unsubmitted(r), 0, 0) < 0) {
+		if (errno != EBUSY && errno != EAGAIN)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Private to miniloop, do not use directly!
+ *
+ * Same semantics as epoll_wait(), but submits all queued up changes
+ * in the same system call as it waits for completions.
+ */
+int _ml_uring_wait(ml_ctx_t *ctx, struct epoll_event *ee, int maxevents, int timeout)
+{
+	struct ml_uring *r = ctx->ring;
+	unsigned min = 0, flags = 0;
+
+	if (requeue_all(r))
+		return -1;
+
+	/* Events left over from last time, or lost to a full queue */
+	if (completed(r) || (*r->sq_flags & IORING_SQ_CQ_OVERFLOW)) {
+		flags   = IORING_ENTER_GETEVENTS;
+		timeout = 0;
+	}
+
+	if (timeout) {
+		if (timeout > 0 && timeout_add(r, timeout))
+			return -1;
+
+		flags = IORING_ENTER_GETEVENTS;
+		min   = 1;
+	}
+
+	if ((unsubmitted(r) || flags) && uring_enter(r->fd, unsubmitted(r), min, flags) < 0) {
+		/* Not fatal, only means the queue is congested */
+		if (errno != EBUSY && errno != EAGAIN)
+			return -1;
+	}
+
+	return reap(r, ee, maxevents);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,118 @@
+/* Verifies async watchers, messages from other threads
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define NPRODUCERS 2
+#define NMSGS      500000	/* Per producer */
+
+static ml_async_t async;
+static long       last[NPRODUCERS];
+static long       received, wakeups, total;
+
+static void *producer(void *arg)
+{
+	long id = (long)arg, i;
+
+	for (i = 1; i <= NMSGS; i++) {
+		/* Producer in the high bits, sequence number in the low */
+		void *msg = (void *)((id << 32) | i);
+
+		while (ml_async_send(&async, msg)) {
+			fail_unless(errno == EAGAIN);
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static void cb(ml_async_t *a, void *arg)
+{
+	void *msg;
+
+	fail_unless(arg == &async);
+	wakeups++;
+
+	while ((msg = ml_async_recv(a))) {
+		long id  = (long)msg >> 32;
+		long seq = (long)msg & 0xffffffff;
+
+		fail_unless(id >= 0 && id < NPRODUCERS);
+		fail_unless(seq == last[id] + 1);
+		last[id] = seq;
+
+		if (++received == total)
+			ml_async_stop(a);
+	}
+}
+
+int main(void)
+{
+	pthread_t tid[NPRODUCERS];
+	ml_ctx_t ctx;
+	long i;
+
+	fail_unless(!ml_init(&ctx, 10));
+	fail_unless(!ml_async_init(&ctx, &async, cb, &async, 1000));
+	fail_unless(async.mask + 1 == 1024);
+	fail_unless(ml_async_recv(&async) == NULL);
+	fail_unless(ml_async_send(&async, NULL) && errno == EINVAL);
+
+	/* A batch queued while the loop is busy is a single wakeup */
+	for (i = 1; i <= 100; i++)
+		fail_unless(!ml_async_send(&async, (void *)i));
+	fail_unless(ml_run(&ctx, MINILOOP_ONCE) == 0);
+	fail_unless(wakeups == 1 && received == 100);
+
+	/* Until the queue is full */
+	for (i = 1; i <= 1024; i++)
+		fail_unless(!ml_async_send(&async, (void *)i));
+	fail_unless(ml_async_send(&async, (void *)i) && errno == EAGAIN);
+	while (ml_async_recv(&async))
+		;
+
+	last[0]  = 0;
+	received = 0;
+	total    = NPRODUCERS * NMSGS;
+	for (i = 0; i < NPRODUCERS; i++)
+		pthread_create(&tid[i], NULL, producer, (void *)i);
+
+	fail_unless(ml_run(&ctx, 0) == 0);
+
+	for (i = 0; i < NPRODUCERS; i++) {
+		pthread_join(tid[i], NULL);
+		fail_unless(last[i] == NMSGS);
+	}
+	fail_unless(received == total);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,118 @@
+/* Verifies busy polling in ml_run() with MINILOOP_BUSYPOLL
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <pthread.h>
+
+#define DELAY_MS 50
+
+static ml_t io, timer;
+static int fd[2], io_calls, timer_calls;
+
+static void io_cb(ml_t *w, void *arg, int events)
+{
+	char c;
+
+	if (read(w->fd, &c, 1) == 1)
+		io_calls++;
+}
+
+static void timer_cb(ml_t *w, void *arg, int events)
+{
+	timer_calls++;
+}
+
+static void *writer(void *arg)
+{
+	usleep(DELAY_MS * 1000);
+	if (write(fd[1], "x", 1) != 1)
+		return NULL;
+
+	return NULL;
+}
+
+static uint64_t cpu_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int main(void)
+{
+	ml_stats_t st;
+	pthread_t tid;
+	ml_ctx_t ctx;
+	uint64_t cpu;
+	int rc, stats;
+
+	fail_unless(ml_busypoll(NULL, 0, 0) && errno == EINVAL);
+
+	fail_unless(!pipe(fd));
+	fail_unless(!ml_init(&ctx, 64));
+	fail_unless(!ml_io_init(&ctx, &io, io_cb, NULL, fd[0], MINILOOP_READ));
+	stats = !ml_stats_get(&ctx, &st);
+
+	/* Spins through the delay, the event ends the spin */
+	fail_unless(!ml_busypoll(&ctx, 10 * DELAY_MS * 1000, 0));
+	fail_unless(!pthread_create(&tid, NULL, writer, NULL));
+	cpu = cpu_ms();
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE | MINILOOP_BUSYPOLL));
+	fail_unless(io_calls == 1);
+	fail_unless(cpu_ms() - cpu >= DELAY_MS / 2);
+	pthread_join(tid, NULL);
+	if (stats) {
+		fail_unless(!ml_stats_get(&ctx, &st));
+		fail_unless(st.spin_events == 1 && st.spin_timeouts == 0);
+	}
+
+	/* Short spin, then blocks until the timer */
+	fail_unless(!ml_busypoll(&ctx, 1000, 0));
+	fail_unless(!ml_timer_init(&ctx, &timer, timer_cb, NULL, DELAY_MS, 0));
+	cpu = cpu_ms();
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE | MINILOOP_BUSYPOLL));
+	fail_unless(timer_calls == 1 && io_calls == 1);
+	fail_unless(cpu_ms() - cpu < DELAY_MS / 2);
+	if (stats) {
+		fail_unless(!ml_stats_get(&ctx, &st));
+		fail_unless(st.spin_timeouts == 1 && st.spin_ns > 0);
+	}
+
+	/* Kernel busy polling, where supported */
+	rc = ml_busypoll(&ctx, 0, 50);
+	fail_unless(!rc || errno == EOPNOTSUPP);
+
+	fail_unless(!ml_io_stop(&io));
+	close(fd[0]);
+	close(fd[1]);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
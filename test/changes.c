@@ -0,0 +1,154 @@
+/* Verifies the changelist, watcher changes batched from callbacks
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <sys/socket.h>
+
+#define STEP (MINILOOP_ONCE | MINILOOP_NONBLOCK)
+
+static ml_t ev, io, bad;
+static int sd[2], step, io_calls, io_events, bad_events;
+
+static void io_cb(ml_t *w, void *arg, int events)
+{
+	io_calls++;
+	io_events = events;
+}
+
+static void bad_cb(ml_t *w, void *arg, int events)
+{
+	bad_events = events;
+}
+
+static void ev_cb(ml_t *w, void *arg, int events)
+{
+	int i;
+
+	switch (step) {
+	case 0:
+		/* Cancels out, never seen by the kernel */
+		fail_unless(!ml_io_init(w->ctx, &io, io_cb, NULL, sd[0], MINILOOP_WRITE));
+		fail_unless(ml_io_active(&io));
+		fail_unless(!ml_io_stop(&io));
+		break;
+
+	case 1:
+		/* Started, then flipped back and forth */
+		fail_unless(!ml_io_init(w->ctx, &io, io_cb, NULL, sd[0], MINILOOP_READ));
+		for (i = 0; i < 10; i++) {
+			fail_unless(!ml_io_set(&io, sd[0], MINILOOP_READ | MINILOOP_WRITE));
+			fail_unless(!ml_io_set(&io, sd[0], MINILOOP_READ));
+		}
+		fail_unless(!ml_io_set(&io, sd[0], MINILOOP_WRITE));
+		break;
+
+	case 2:
+		/* Rearmed many times, sent once */
+		for (i = 0; i < 10; i++) {
+			fail_unless(!ml_io_set(&io, sd[0], MINILOOP_READ | MINILOOP_WRITE));
+			fail_unless(!ml_io_set(&io, sd[0], MINILOOP_READ));
+		}
+		break;
+
+	case 3:
+		/* Refused by the kernel, reported to the callback */
+		fail_unless(!ml_io_init(w->ctx, &bad, bad_cb, NULL, 1000, MINILOOP_READ));
+		break;
+	}
+}
+
+static long ctl(ml_ctx_t *ctx, int op)
+{
+	ml_stats_t st;
+
+	if (ml_stats_get(ctx, &st))
+		return -1;
+
+	return st.ctl[MINILOOP_IO_TYPE][op];
+}
+
+static void run(ml_ctx_t *ctx, int n)
+{
+	step = n;
+	fail_unless(!ml_event_post(&ev));
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(!ml_run(ctx, STEP));
+}
+
+int main(void)
+{
+	int stats, mod;
+	ml_ctx_t ctx;
+
+	fail_unless(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sd));
+	fail_unless(!ml_init(&ctx, 64));
+	fail_unless(!ml_event_init(&ctx, &ev, ev_cb, NULL));
+	stats = ctl(&ctx, MINILOOP_STATS_ADD) >= 0;
+
+	run(&ctx, 0);
+	fail_unless(!ml_io_active(&io) && io_calls == 0);
+	fail_unless(ctx.nchanges == 0);
+	if (stats) {
+		fail_unless(ctl(&ctx, MINILOOP_STATS_ADD) == 0);
+		fail_unless(ctl(&ctx, MINILOOP_STATS_DEL) == 0);
+	}
+
+	/* One ADD with the final mask */
+	run(&ctx, 1);
+	fail_unless(ml_io_active(&io));
+	fail_unless(io_calls >= 1 && io_events == MINILOOP_WRITE);
+	if (stats) {
+		fail_unless(ctl(&ctx, MINILOOP_STATS_ADD) == 1);
+		fail_unless(ctl(&ctx, MINILOOP_STATS_MOD) == 0);
+	}
+
+	/* Net change is WRITE off, no more callbacks */
+	mod = ctl(&ctx, MINILOOP_STATS_MOD);
+	run(&ctx, 2);
+	io_calls = 0;
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(io_calls == 0);
+	if (stats)
+		fail_unless(ctl(&ctx, MINILOOP_STATS_MOD) == mod + 1);
+
+	/* Not an open descriptor, stopped before the next wait */
+	close(1000);
+	run(&ctx, 3);
+	fail_unless(bad_events == MINILOOP_ERROR);
+	fail_unless(!ml_io_active(&bad));
+
+	/* Outside of ml_run() changes still go straight to the kernel */
+	fail_unless(ml_io_init(&ctx, &bad, bad_cb, NULL, 1000, MINILOOP_READ) && errno == EBADF);
+
+	fail_unless(!ml_io_stop(&io));
+	close(sd[0]);
+	close(sd[1]);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -7,7 +7,7 @@
 #include <time.h>
 #include <unistd.h>
 
-#include "../src/uev.h"
+#include "../src/miniloop.h"
 
 #define fail_unless(test)						\
   do {									\
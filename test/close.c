@@ -0,0 +1,173 @@
+/* Verifies that callbacks can stop, free, and close other watchers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <stdlib.h>
+
+#define NWATCHERS 100
+
+static ml_t *w[NWATCHERS];
+static int   calls, closed;
+static int   idle[2], spare[NWATCHERS];
+
+/* First callback frees all other watchers, also those with cached events */
+static void free_cb(ml_t *self, void *arg, int events)
+{
+	int i;
+
+	calls++;
+	for (i = 0; i < NWATCHERS; i++) {
+		if (!w[i] || w[i] == self)
+			continue;
+
+		ml_event_stop(w[i]);
+		free(w[i]);
+		w[i] = NULL;
+	}
+	ml_event_stop(self);
+}
+
+/* First callback moves all others to an idle fd, their old events are stale */
+static void move_cb(ml_t *self, void *arg, int events)
+{
+	int i;
+
+	calls++;
+	for (i = 0; i < NWATCHERS; i++) {
+		if (w[i] != self)
+			fail_unless(!ml_io_set(w[i], spare[i], MINILOOP_READ));
+	}
+	ml_io_stop(self);
+}
+
+static void close_done(ml_t *self, void *arg)
+{
+	fail_unless(arg == self);
+	closed++;
+	free(self);
+}
+
+static void close_cb(ml_t *self, void *arg, int events)
+{
+	int i;
+
+	calls++;
+	for (i = 0; i < NWATCHERS; i++) {
+		fail_unless(!ml_close(w[i], close_done));
+		fail_unless(w[i]->cb == close_cb);
+	}
+	fail_unless(closed == 0);
+}
+
+/* Counts its calls, and stops the watcher in its argument, if any */
+static void count_cb(ml_t *self, void *arg, int events)
+{
+	calls++;
+	if (arg)
+		ml_event_stop(arg);
+}
+
+static void setup(ml_ctx_t *ctx, ml_cb_t *cb)
+{
+	int i;
+
+	for (i = 0; i < NWATCHERS; i++) {
+		w[i] = malloc(sizeof(ml_t));
+		fail_unless(!ml_event_init(ctx, w[i], cb, w[i]));
+		fail_unless(!ml_event_post(w[i]));
+	}
+}
+
+int main(void)
+{
+	int i, p[NWATCHERS][2];
+	ml_ctx_t ctx;
+
+	fail_unless(!ml_init(&ctx, 256));
+
+	calls = 0;
+	setup(&ctx, free_cb);
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(calls == 1);
+	for (i = 0; i < NWATCHERS; i++)
+		free(w[i]);
+
+	/* Stale events for a watcher restarted on another fd */
+	calls = 0;
+	fail_unless(!pipe(idle));
+	for (i = 0; i < NWATCHERS; i++) {
+		fail_unless(!pipe(p[i]));
+		spare[i] = dup(idle[0]);
+		fail_unless(write(p[i][1], "x", 1) == 1);
+		w[i] = malloc(sizeof(ml_t));
+		fail_unless(!ml_io_init(&ctx, w[i], move_cb, NULL, p[i][0], MINILOOP_READ));
+	}
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(calls == 1);
+	for (i = 0; i < NWATCHERS; i++) {
+		ml_io_stop(w[i]);
+		free(w[i]);
+		close(p[i][0]);
+		close(p[i][1]);
+		close(spare[i]);
+	}
+
+	/* Stopping a watcher left over from an earlier batch keeps what is there */
+	calls = 0;
+	for (i = 0; i < 4; i++)
+		w[i] = malloc(sizeof(ml_t));
+	fail_unless(!ml_event_init(&ctx, w[0], count_cb, NULL));
+	fail_unless(!ml_event_init(&ctx, w[1], count_cb, NULL));
+	fail_unless(!ml_event_init(&ctx, w[2], count_cb, w[1]));
+	fail_unless(!ml_event_init(&ctx, w[3], count_cb, NULL));
+	fail_unless(!ml_event_post(w[0]) && !ml_event_post(w[1]));
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(calls == 2);
+	fail_unless(!ml_event_post(w[2]) && !ml_event_post(w[3]));
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(calls == 4);
+	for (i = 0; i < 4; i++) {
+		ml_event_stop(w[i]);
+		free(w[i]);
+	}
+
+	/* Close callbacks run when the iteration is done */
+	calls = 0;
+	setup(&ctx, close_cb);
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(calls == 1 && closed == NWATCHERS);
+
+	/* After ml_run() the close callback is called at once */
+	closed = 0;
+	w[0] = malloc(sizeof(ml_t));
+	fail_unless(!ml_event_init(&ctx, w[0], close_cb, w[0]));
+	fail_unless(!ml_close(w[0], close_done));
+	fail_unless(closed == 1);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
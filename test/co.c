@@ -0,0 +1,286 @@
+/* Verifies coroutines on I/O, timer and event watchers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#define LENGTH (1024 * 1024 + 17)
+#define SPAWNS 100
+
+static ml_co_t echo, writer, reader, sleeper, waiter, child, parent, stuck, quick, clash;
+static ml_t event, poster, taken, spawn;
+static int sv[2], wfd, clash_fd;
+static int echoed, received, bad, naps, posted, user_calls, order[4], norder, clashed;
+
+static unsigned char pattern(size_t i)
+{
+	return (i * 13 + i / 509) & 0xff;
+}
+
+static void nonblock(int fd)
+{
+	fail_unless(!fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK));
+}
+
+/* Sequential echo server, until end of file */
+static void echo_fn(ml_co_t *co, void *arg)
+{
+	char buf[4096];
+	ssize_t len;
+
+	while ((len = ml_co_read(co, sv[0], buf, sizeof(buf))) > 0) {
+		if (ml_co_write(co, sv[0], buf, len) != len)
+			bad++;
+		echoed += len;
+	}
+	if (len < 0)
+		bad++;
+
+	fail_unless(!ml_co_close(co, sv[0]));
+}
+
+/* Writes much more than the socket buffers hold, on a dup() of sv[1] */
+static void writer_fn(ml_co_t *co, void *arg)
+{
+	static unsigned char buf[LENGTH];
+	size_t i;
+
+	for (i = 0; i < LENGTH; i++)
+		buf[i] = pattern(i);
+
+	if (ml_co_write(co, wfd, buf, LENGTH) != LENGTH)
+		bad++;
+	shutdown(wfd, SHUT_WR);
+	fail_unless(!ml_co_close(co, wfd));
+}
+
+static void reader_fn(ml_co_t *co, void *arg)
+{
+	unsigned char buf[8192];
+	ssize_t len, i;
+
+	while ((len = ml_co_read(co, sv[1], buf, sizeof(buf))) > 0) {
+		for (i = 0; i < len; i++) {
+			if (buf[i] != pattern(received + i))
+				bad++;
+		}
+		received += len;
+	}
+	if (len < 0)
+		bad++;
+
+	fail_unless(!ml_co_close(co, sv[1]));
+}
+
+static void sleeper_fn(ml_co_t *co, void *arg)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		fail_unless(!ml_co_sleep(co, 10));
+		naps++;
+	}
+	fail_unless(!ml_co_sleep(co, 0));
+	naps++;
+}
+
+static void user_cb(ml_t *w, void *arg, int events)
+{
+	user_calls++;
+}
+
+static void waiter_fn(ml_co_t *co, void *arg)
+{
+	fail_unless(!ml_co_wait_event(co, &event));
+	posted++;
+
+	/* Only one waiter at a time, and only a started event watcher */
+	fail_unless(ml_co_wait_event(co, &poster) && errno == EINVAL);
+}
+
+static void poster_cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(!ml_event_post(&event));
+}
+
+static void child_fn(ml_co_t *co, void *arg)
+{
+	order[norder++] = 1;
+	fail_unless(!ml_co_sleep(co, 1));
+	order[norder++] = 3;
+}
+
+/* Starts another, which runs until it waits */
+static void parent_fn(ml_co_t *co, void *arg)
+{
+	order[norder++] = 0;
+	fail_unless(!ml_co_init(co->ctx, &child, child_fn, NULL, 0));
+	order[norder++] = 2;
+
+	/* Cannot cancel itself */
+	fail_unless(ml_co_cancel(co) && errno == EBUSY);
+}
+
+static void stuck_fn(ml_co_t *co, void *arg)
+{
+	char c;
+
+	ml_co_read(co, *(int *)arg, &c, 1);
+	bad++;
+}
+
+static void quick_fn(ml_co_t *co, void *arg)
+{
+	(*(int *)arg)++;
+}
+
+static void nop_cb(ml_t *w, void *arg, int events)
+{
+}
+
+/* The descriptor has a watcher already, the deferred ADD fails */
+static void clash_fn(ml_co_t *co, void *arg)
+{
+	char c;
+
+	if (ml_co_read(co, clash_fd, &c, 1) < 0 && errno == EEXIST)
+		clashed = 1;
+	else
+		bad++;
+}
+
+static void spawn_cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(!ml_co_init(w->ctx, &clash, clash_fn, NULL, 0));
+}
+
+static void run(int flags)
+{
+	ml_ctx_t ctx;
+	uint64_t t0;
+	int p[2], i, free, num = 0;
+	char c;
+
+	echoed = received = bad = naps = posted = user_calls = norder = 0;
+	fail_unless(!ml_init1(&ctx, 64, flags));
+
+	/* Three coroutines copying through a socket pair */
+	fail_unless(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	nonblock(sv[0]);
+	nonblock(sv[1]);
+	wfd = dup(sv[1]);
+	fail_unless(wfd > -1);
+	fail_unless(!ml_co_init(&ctx, &echo, echo_fn, NULL, 0));
+	fail_unless(!ml_co_init(&ctx, &reader, reader_fn, NULL, 0));
+	fail_unless(!ml_co_init(&ctx, &writer, writer_fn, NULL, 128 * 1024));
+	fail_unless(ml_co_active(&echo) && ml_co_active(&reader) && ml_co_active(&writer));
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(echoed == LENGTH && received == LENGTH && bad == 0);
+	fail_unless(!ml_co_active(&echo) && !ml_co_active(&reader) && !ml_co_active(&writer));
+
+	/* Sleeping, with the cached clock */
+	t0 = ml_now_ns(&ctx);
+	fail_unless(!ml_co_init(&ctx, &sleeper, sleeper_fn, NULL, 0));
+	fail_unless(naps == 0);
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(naps == 4 && ml_now_ns(&ctx) >= t0 + 30 * 1000000ULL);
+
+	/* Waiting on an event, which then gets back its own callback */
+	fail_unless(!ml_event_init(&ctx, &event, user_cb, NULL));
+	fail_unless(!ml_timer_init(&ctx, &poster, poster_cb, NULL, 5, 0));
+	fail_unless(!ml_co_init(&ctx, &waiter, waiter_fn, NULL, 0));
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	while (!posted)
+		fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(user_calls == 0 && !ml_co_active(&waiter));
+	fail_unless(!ml_event_post(&event));
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(user_calls == 1);
+	fail_unless(!ml_event_stop(&event));
+
+	/* Started from another coroutine */
+	fail_unless(!ml_co_init(&ctx, &parent, parent_fn, NULL, 0));
+	fail_unless(norder == 3 && !ml_co_active(&parent) && ml_co_active(&child));
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(norder == 4 && order[0] == 0 && order[1] == 1 && order[2] == 2 && order[3] == 3);
+
+	/* Cancelled while waiting, never resumed */
+	fail_unless(!pipe(p));
+	nonblock(p[0]);
+	fail_unless(!ml_co_init(&ctx, &stuck, stuck_fn, &p[0], 0));
+	fail_unless(ml_co_active(&stuck));
+	fail_unless(!ml_co_cancel(&stuck));
+	fail_unless(!ml_co_active(&stuck) && !ml_co_cancel(&stuck));
+	fail_unless(write(p[1], "x", 1) == 1);
+	fail_unless(!ml_run(&ctx, MINILOOP_NONBLOCK));
+	fail_unless(bad == 0 && read(p[0], &c, 1) == 1);
+
+	/* Waiting fails, not again every iteration, when the ADD does */
+	if (!(flags & MINILOOP_IO_URING)) {
+		clash_fd = p[0];
+		clashed  = 0;
+		fail_unless(!ml_io_init(&ctx, &taken, nop_cb, NULL, p[0], MINILOOP_READ));
+		fail_unless(!ml_timer_init(&ctx, &spawn, spawn_cb, NULL, 1, 0));
+		for (i = 0; i < 1000 && !clashed; i++) {
+			fail_unless(!ml_run(&ctx, MINILOOP_ONCE | MINILOOP_NONBLOCK));
+			usleep(100);
+		}
+		fail_unless(clashed && bad == 0 && !ml_co_active(&clash));
+		fail_unless(!ml_io_stop(&taken));
+	}
+
+	/* Stacks are reused */
+	free = ctx.co_nstacks;
+	fail_unless(free > 0);
+	for (i = 0; i < SPAWNS; i++)
+		fail_unless(!ml_co_init(&ctx, &quick, quick_fn, &num, 0));
+	fail_unless(num == SPAWNS && ctx.co_nstacks == free);
+
+	/* Only from the coroutine itself */
+	fail_unless(ml_co_read(&quick, p[0], &c, 1) < 0 && errno == EINVAL);
+	fail_unless(ml_co_sleep(&quick, 1) && errno == EINVAL);
+	fail_unless(ml_co_init(&ctx, &quick, NULL, NULL, 0) && errno == EINVAL);
+
+	/* Dropped by ml_exit() */
+	fail_unless(!ml_co_init(&ctx, &stuck, stuck_fn, &p[0], 0));
+	fail_unless(!ml_exit(&ctx));
+	fail_unless(!ml_co_active(&stuck) && ctx.co == NULL && ctx.co_stacks == NULL);
+	close(p[0]);
+	close(p[1]);
+}
+
+int main(void)
+{
+	run(0);
+	run(MINILOOP_TIMER_HEAP);
+	run(MINILOOP_IO_URING);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,155 @@
+/* Verifies running a context from another event loop
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <poll.h>
+
+#define PERIOD 10
+#define LAPS   5
+
+static ml_ctx_t inner, outer;
+static ml_t timer, io, shard, kick, hook, wake;
+static int fd[2], laps, reads, dispatched;
+
+static void timer_cb(ml_t *w, void *arg, int events)
+{
+	if (++laps == LAPS)
+		ml_timer_stop(w);
+}
+
+static void io_cb(ml_t *w, void *arg, int events)
+{
+	char c;
+
+	if (read(w->fd, &c, 1) == 1)
+		reads++;
+}
+
+/* Outer loop watcher for the inner context */
+static void shard_cb(ml_t *w, void *arg, int events)
+{
+	dispatched++;
+	fail_unless(!ml_dispatch(&inner));
+}
+
+/* Heap timers of the inner context wake up the outer loop */
+static void wake_cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(!ml_dispatch(&inner));
+}
+
+static void prepare_cb(ml_t *w, void *arg, int events)
+{
+	int msec;
+
+	fail_unless(!ml_timeout(&inner, &msec));
+	if (msec < 0)
+		fail_unless(!ml_timer_stop(&wake));
+	else
+		fail_unless(!ml_timer_set_ns(&wake, msec ? msec * 1000000ULL : 1, 0, 0));
+}
+
+/* From the outer loop, starts watchers in the inner context */
+static void kick_cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(!ml_io_init(&inner, &io, io_cb, NULL, fd[0], MINILOOP_READ));
+	fail_unless(!ml_timer_init(&inner, &timer, timer_cb, NULL, PERIOD, 0));
+}
+
+static void run(int flags)
+{
+	struct pollfd pfd;
+	int msec, polls = 0;
+
+	laps = reads = dispatched = 0;
+	fail_unless(!pipe(fd));
+	fail_unless(!ml_init1(&inner, 64, flags));
+
+	/* Started by ml_timeout(), and not pushed out by each ml_dispatch() */
+	fail_unless(!ml_timer_init(&inner, &timer, timer_cb, NULL, PERIOD, PERIOD));
+	pfd.fd = ml_fd(&inner);
+	pfd.events = POLLIN;
+	fail_unless(pfd.fd > -1);
+	while (laps < LAPS) {
+		fail_unless(!ml_timeout(&inner, &msec));
+		if (flags & (MINILOOP_TIMER_HEAP | MINILOOP_IO_URING))
+			fail_unless(msec > 0 && msec <= PERIOD);
+		else
+			fail_unless(msec == -1);
+		fail_unless(poll(&pfd, 1, msec) >= 0);
+		fail_unless(!ml_dispatch(&inner));
+		fail_unless(++polls < 10 * LAPS);
+	}
+
+	/* Nothing left to do, wait forever */
+	fail_unless(!ml_timeout(&inner, &msec));
+	fail_unless(msec == -1);
+
+	/* Nested in another context, only run when it has events */
+	fail_unless(!ml_init(&outer, 64));
+	fail_unless(!ml_io_init(&outer, &shard, shard_cb, NULL, ml_fd(&inner), MINILOOP_READ));
+	fail_unless(!ml_timer_init(&outer, &kick, kick_cb, NULL, PERIOD, 0));
+	fail_unless(!ml_timer_init(&outer, &wake, wake_cb, NULL, 0, 0));
+	fail_unless(!ml_prepare_init(&outer, &hook, prepare_cb, NULL));
+	fail_unless(write(fd[1], "x", 1) == 1);
+	fail_unless(!ml_run(&outer, MINILOOP_ONCE));
+	fail_unless(dispatched == 0 && reads == 0);
+	fail_unless(!ml_run(&outer, MINILOOP_ONCE));
+	fail_unless(dispatched == 1 && reads == 1);
+
+	/* Another event, after a watcher change from a callback */
+	fail_unless(write(fd[1], "x", 1) == 1);
+	fail_unless(!ml_run(&outer, MINILOOP_ONCE));
+	fail_unless(dispatched == 2 && reads == 2);
+
+	/* And the inner timer, by whichever way it wakes us up */
+	while (laps == LAPS)
+		fail_unless(!ml_run(&outer, MINILOOP_ONCE));
+	fail_unless(laps == LAPS + 1 && reads == 2);
+
+	fail_unless(ml_fd(NULL) == -1 && errno == EINVAL);
+	fail_unless(ml_timeout(&inner, NULL) && errno == EINVAL);
+
+	fail_unless(!ml_io_stop(&shard));
+	fail_unless(!ml_prepare_stop(&hook));
+	fail_unless(!ml_exit(&outer));
+	fail_unless(!ml_io_stop(&io));
+	fail_unless(!ml_exit(&inner));
+	close(fd[0]);
+	close(fd[1]);
+}
+
+int main(void)
+{
+	run(0);
+	run(MINILOOP_TIMER_HEAP);
+	run(MINILOOP_IO_URING);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,195 @@
+/* Verifies always ready regular files and the chunked file reader
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <fcntl.h>
+
+#define CHUNK  (64 * 1024)
+#define LENGTH (16 * CHUNK + 123)
+#define CHUNKS (LENGTH / CHUNK + 1)
+
+static ml_file_t file;
+static ml_t pipe_w, raw, resume;
+static size_t pos;
+static int chunks, eofs, bad, piped, pipe_early, closed, pause_at;
+
+static unsigned char pattern(size_t i)
+{
+	return (i * 7 + i / 251) & 0xff;
+}
+
+static int make_file(void)
+{
+	char tmpl[] = "/tmp/miniloop-file-XXXXXX";
+	unsigned char *buf;
+	size_t i;
+	int fd;
+
+	fd = mkstemp(tmpl);
+	fail_unless(fd >= 0);
+	unlink(tmpl);
+
+	buf = malloc(LENGTH);
+	fail_unless(buf != NULL);
+	for (i = 0; i < LENGTH; i++)
+		buf[i] = pattern(i);
+	fail_unless(write(fd, buf, LENGTH) == LENGTH);
+	free(buf);
+
+	return fd;
+}
+
+static void file_cb(ml_file_t *f, void *arg, const char *buf, ssize_t len)
+{
+	ssize_t i;
+
+	if (len <= 0) {
+		if (len < 0 || pos != LENGTH)
+			bad++;
+		eofs++;
+		if (!piped)
+			pipe_early++;
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		if ((unsigned char)buf[i] != pattern(pos + i))
+			bad++;
+	}
+	pos += len;
+
+	if (++chunks == pause_at) {
+		fail_unless(!ml_file_stop(f));
+		fail_unless(!ml_file_active(f));
+		fail_unless(!ml_timer_init(f->ctx, &resume, (ml_cb_t *)arg, f, 5, 0));
+	}
+}
+
+static void resume_cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(!ml_file_start(arg));
+}
+
+/* Not starved by a file that is always ready */
+static void pipe_cb(ml_t *w, void *arg, int events)
+{
+	char c;
+
+	if (read(w->fd, &c, 1) == 1)
+		piped++;
+	ml_io_stop(w);
+}
+
+static void raw_cb(ml_t *w, void *arg, int events)
+{
+	char buf[CHUNK];
+	ssize_t len;
+
+	fail_unless(events == MINILOOP_READ);
+	len = read(w->fd, buf, sizeof(buf));
+	if (len <= 0) {
+		ml_io_stop(w);
+		eofs++;
+		return;
+	}
+	chunks++;
+}
+
+static void close_cb(ml_t *w, void *arg)
+{
+	closed++;
+}
+
+static void run(int ctx_flags, int flags)
+{
+	ml_ctx_t ctx;
+	int fd, p[2], in;
+
+	pos = chunks = eofs = bad = piped = pipe_early = closed = 0;
+	fd = make_file();
+	fail_unless(!pipe(p));
+	fail_unless(!ml_init1(&ctx, 64, ctx_flags));
+
+	/* `application < file.txt` */
+	fail_unless(lseek(fd, 0, SEEK_SET) == 0);
+	in = dup(STDIN_FILENO);
+	fail_unless(dup2(fd, STDIN_FILENO) == STDIN_FILENO);
+	fail_unless(!ml_file_init(&ctx, &file, file_cb, resume_cb, STDIN_FILENO, CHUNK, flags));
+	fail_unless(ml_file_active(&file));
+	fail_unless(!ml_io_init(&ctx, &pipe_w, pipe_cb, NULL, p[0], MINILOOP_READ));
+	fail_unless(write(p[1], "x", 1) == 1);
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(pos == LENGTH && chunks == CHUNKS && eofs == 1 && bad == 0);
+	fail_unless(piped == 1 && pipe_early == 0);
+	fail_unless(!ml_file_active(&file));
+	fail_unless(!ml_file_close(&file, close_cb));
+	fail_unless(closed == 1);
+	fail_unless(dup2(in, STDIN_FILENO) == STDIN_FILENO);
+	close(in);
+
+	/* Stopped and started again, nothing lost */
+	pos = chunks = eofs = 0;
+	pause_at = 3;
+	fail_unless(lseek(fd, 0, SEEK_SET) == 0);
+	fail_unless(!ml_file_init(&ctx, &file, file_cb, resume_cb, fd, CHUNK, flags));
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(pos == LENGTH && chunks == CHUNKS && eofs == 1 && bad == 0);
+	fail_unless(!ml_file_close(&file, NULL));
+	pause_at = 0;
+
+	/* Closed right away, with any read in flight */
+	fail_unless(!ml_file_init(&ctx, &file, file_cb, resume_cb, fd, CHUNK, flags));
+	fail_unless(!ml_file_close(&file, close_cb));
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(closed == 2);
+
+	/* A plain I/O watcher on a regular file, any descriptor */
+	pos = chunks = eofs = 0;
+	fail_unless(lseek(fd, 0, SEEK_SET) == 0);
+	fail_unless(!ml_io_init(&ctx, &raw, raw_cb, NULL, fd, MINILOOP_READ));
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(chunks == CHUNKS && eofs == 1);
+
+	fail_unless(ml_file_init(&ctx, &file, NULL, NULL, fd, 0, 0) && errno == EINVAL);
+	fail_unless(ml_file_init(&ctx, &file, file_cb, NULL, fd, 0, 0x100) && errno == EINVAL);
+
+	fail_unless(!ml_exit(&ctx));
+	close(p[0]);
+	close(p[1]);
+	close(fd);
+}
+
+int main(void)
+{
+	run(0, 0);
+	run(0, MINILOOP_FILE_READAHEAD);
+	run(MINILOOP_IO_URING, 0);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
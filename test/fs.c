@@ -0,0 +1,110 @@
+/* Verifies ml_fs_*() requests on the worker pool
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+
+#define NUM_STAT 100
+#define MESSAGE  "Hello, world!"
+
+static ml_fs_t stats[NUM_STAT];
+static ml_fs_t req;
+static int     nstat, fd = -1, done;
+static char    buf[64];
+
+static void stat_cb(ml_fs_t *r)
+{
+	fail_unless(r->result == 0);
+	fail_unless(S_ISDIR(r->statbuf.st_mode));
+	ml_fs_cleanup(r);
+	nstat++;
+}
+
+/* Sequence of requests, each one submitted from the previous callback */
+static void chain_cb(ml_fs_t *r)
+{
+	switch (r->type) {
+	case ML_FS_MKSTEMP:
+		fail_unless(r->result >= 0);
+		fd = r->result;
+		unlink(r->path);
+		ml_fs_cleanup(r);
+		ml_fs_write(r->ctx, r, fd, MESSAGE, sizeof(MESSAGE), 0, chain_cb, NULL);
+		break;
+
+	case ML_FS_WRITE:
+		fail_unless(r->result == sizeof(MESSAGE));
+		ml_fs_fstat(r->ctx, r, fd, chain_cb, NULL);
+		break;
+
+	case ML_FS_FSTAT:
+		fail_unless(r->result == 0);
+		fail_unless(r->statbuf.st_size == sizeof(MESSAGE));
+		ml_fs_read(r->ctx, r, fd, buf, sizeof(buf), 0, chain_cb, NULL);
+		break;
+
+	case ML_FS_READ:
+		fail_unless(r->result == sizeof(MESSAGE));
+		fail_unless(!strcmp(buf, MESSAGE));
+		ml_fs_close(r->ctx, r, fd, chain_cb, NULL);
+		break;
+
+	case ML_FS_CLOSE:
+		fail_unless(r->result == 0);
+		ml_fs_stat(r->ctx, r, "/nonexistent/file", chain_cb, NULL);
+		break;
+
+	case ML_FS_STAT:
+		fail_unless(r->result == -1 && r->error == ENOENT);
+		ml_fs_cleanup(r);
+		done = 1;
+		break;
+
+	default:
+		fail_unless(0);
+	}
+}
+
+int main(void)
+{
+	ml_ctx_t ctx;
+	int i;
+
+	ml_init(&ctx, 10);
+
+	for (i = 0; i < NUM_STAT; i++)
+		fail_unless(ml_fs_stat(&ctx, &stats[i], "/", stat_cb, NULL) == 0);
+	fail_unless(ml_fs_mkstemp(&ctx, &req, "/tmp/miniloop-XXXXXX", chain_cb, NULL) == 0);
+
+	/* Returns when all requests have completed */
+	fail_unless(ml_run(&ctx, 0) == 0);
+	fail_unless(nstat == NUM_STAT);
+	fail_unless(done);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,128 @@
+/* Verifies file watchers on the shared inotify descriptor
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <fcntl.h>
+#include <sys/inotify.h>
+
+#define NFILES 100
+
+static char   path[NFILES][64];
+static ml_t   watch[NFILES], twin;
+static int    calls[NFILES], twin_calls, ignored;
+
+static void cb(ml_t *w, void *arg, int events)
+{
+	int i = (int)(long)arg;
+
+	fail_unless(events == MINILOOP_READ);
+
+	if (ml_fswatch_mask(w) & IN_IGNORED) {
+		fail_unless(!ml_fswatch_active(w));
+		ignored++;
+		return;
+	}
+
+	fail_unless(ml_fswatch_mask(w) & IN_MODIFY);
+	calls[i]++;
+
+	/* All writes above are merged into one callback */
+	unlink(path[i]);
+}
+
+static void twin_cb(ml_t *w, void *arg, int events)
+{
+	if (ml_fswatch_mask(w) & IN_MODIFY)
+		twin_calls++;
+	ml_fswatch_stop(w);
+}
+
+static void modify(int i)
+{
+	int fd, j;
+
+	fd = open(path[i], O_WRONLY | O_APPEND);
+	fail_unless(fd >= 0);
+	for (j = 0; j < 50; j++)
+		fail_unless(write(fd, "x", 1) == 1);
+	close(fd);
+}
+
+static int run(int flags)
+{
+	ml_ctx_t ctx;
+	int i;
+
+	memset(calls, 0, sizeof(calls));
+	twin_calls = ignored = 0;
+
+	fail_unless(!ml_init1(&ctx, 10, flags));
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path[i], sizeof(path[i]), "/tmp/miniloop-fswatch-%d-%d", getpid(), i);
+		close(open(path[i], O_CREAT | O_WRONLY | O_TRUNC, 0644));
+		fail_unless(!ml_fswatch_init(&ctx, &watch[i], cb, (void *)(long)i, path[i], IN_MODIFY));
+	}
+
+	/* Same file, different watcher, must not steal events */
+	fail_unless(!ml_fswatch_init(&ctx, &twin, twin_cb, NULL, path[0], IN_MODIFY | IN_ATTRIB));
+
+	for (i = 0; i < NFILES; i++)
+		modify(i);
+
+	fail_unless(ml_run(&ctx, 0) == 0);
+
+	for (i = 0; i < NFILES; i++)
+		fail_unless(calls[i] == 1);
+	fail_unless(twin_calls == 1);
+	fail_unless(ignored == NFILES);
+
+	return ml_exit(&ctx);
+}
+
+int main(void)
+{
+	int fd, i;
+
+	fail_unless(!run(0));
+	fail_unless(!run(MINILOOP_IO_URING));
+
+	/* No descriptors left behind by ml_init() .. ml_exit() */
+	fd = dup(0);
+	close(fd);
+	for (i = 0; i < 100; i++) {
+		ml_ctx_t ctx;
+
+		fail_unless(!ml_init(&ctx, 1));
+		fail_unless(!ml_exit(&ctx));
+	}
+	i = dup(0);
+	close(i);
+	fail_unless(fd == i);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
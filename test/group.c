@@ -0,0 +1,196 @@
+/* Verifies loop groups, listener sharding and messages between loops
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+
+#define NLOOPS   3
+#define NCONN    30
+#define NMSGS    10000
+
+static ml_group_t group;
+static int        handled, counted, order_ok = 1;
+static ml_ctx_t  *expect;
+static int        no_reuseport;
+
+/* Overrides the C library, to fall back to one shared socket */
+int setsockopt(int sd, int level, int name, const void *val, socklen_t len)
+{
+	if (no_reuseport && level == SOL_SOCKET && name == SO_REUSEPORT) {
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+
+	return syscall(SYS_setsockopt, sd, level, name, val, len);
+}
+
+static int loop_id(ml_ctx_t *ctx)
+{
+	int i;
+
+	for (i = 0; i < group.nloops; i++) {
+		if (ml_group_ctx(&group, i) == ctx)
+			return i;
+	}
+
+	return -1;
+}
+
+/* On the next loop, reply and hang up */
+static void handoff_cb(ml_ctx_t *ctx, ml_msg_t *msg)
+{
+	fail_unless(ctx == msg->arg);
+	fail_unless(write(msg->fd, "ok", 2) == 2);
+	close(msg->fd);
+	free(msg);
+
+	__atomic_add_fetch(&handled, 1, __ATOMIC_RELAXED);
+}
+
+static void accept_cb(ml_t *w, void *arg, int events)
+{
+	int fd, id = loop_id(w->ctx);
+
+	fail_unless(id >= 0);
+	while ((fd = accept4(w->fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		ml_msg_t *msg = calloc(1, sizeof(*msg));
+
+		id = (id + 1) % group.nloops;
+		msg->cb  = handoff_cb;
+		msg->fd  = fd;
+		msg->arg = ml_group_ctx(&group, id);
+		fail_unless(!ml_group_send(&group, id, msg));
+	}
+}
+
+static void count_cb(ml_ctx_t *ctx, ml_msg_t *msg)
+{
+	fail_unless(ctx == expect);
+
+	/* Messages from one thread run in order */
+	if (msg->fd != counted)
+		order_ok = 0;
+	__atomic_store_n(&counted, counted + 1, __ATOMIC_RELEASE);
+}
+
+/* Connections spread over the loops, handed off to the next one */
+static void serve(struct sockaddr_in *sin, int port)
+{
+	int i, sd;
+
+	handled = 0;
+	fail_unless(!ml_group_init(&group, NLOOPS, 10, 0));
+	fail_unless(!ml_group_listen(&group, (struct sockaddr *)sin, sizeof(*sin), accept_cb, NULL));
+	fail_unless(!ml_group_start(&group));
+
+	for (i = 0; i < NCONN; i++) {
+		char buf[3] = { 0 };
+
+		sd = socket(AF_INET, SOCK_STREAM, 0);
+		sin->sin_port = port;
+		fail_unless(!connect(sd, (struct sockaddr *)sin, sizeof(*sin)));
+		fail_unless(read(sd, buf, sizeof(buf)) == 2);
+		fail_unless(!strcmp(buf, "ok"));
+		close(sd);
+	}
+
+	fail_unless(!ml_group_exit(&group));
+	fail_unless(handled == NCONN);
+}
+
+int main(void)
+{
+	static ml_msg_t msgs[NMSGS];
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int i, sd, port;
+
+	/* Find a free port */
+	sd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family      = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fail_unless(!bind(sd, (struct sockaddr *)&sin, sizeof(sin)));
+	fail_unless(!getsockname(sd, (struct sockaddr *)&sin, &len));
+	port = sin.sin_port;
+	close(sd);
+
+	fail_unless(!ml_group_init(&group, NLOOPS, 10, 0));
+	fail_unless(group.nloops == NLOOPS);
+	fail_unless(!ml_group_listen(&group, (struct sockaddr *)&sin, sizeof(sin), accept_cb, NULL));
+	fail_unless(!ml_group_start(&group));
+	fail_unless(ml_group_listen(&group, (struct sockaddr *)&sin, sizeof(sin), accept_cb, NULL) && errno == EBUSY);
+
+	expect = ml_group_ctx(&group, 1);
+	for (i = 0; i < NMSGS; i++) {
+		msgs[i].cb = count_cb;
+		msgs[i].fd = i;
+		fail_unless(!ml_group_send(&group, 1, &msgs[i]));
+	}
+
+	for (i = 0; i < NCONN; i++) {
+		char buf[3] = { 0 };
+
+		sd = socket(AF_INET, SOCK_STREAM, 0);
+		sin.sin_port = port;
+		fail_unless(!connect(sd, (struct sockaddr *)&sin, sizeof(sin)));
+		fail_unless(read(sd, buf, sizeof(buf)) == 2);
+		fail_unless(!strcmp(buf, "ok"));
+		close(sd);
+	}
+
+	while (__atomic_load_n(&counted, __ATOMIC_ACQUIRE) < NMSGS)
+		usleep(1000);
+
+	fail_unless(!ml_group_exit(&group));
+	fail_unless(handled == NCONN);
+	fail_unless(counted == NMSGS && order_ok);
+
+	/* Again, and without SO_REUSEPORT on one socket with EPOLLEXCLUSIVE */
+	serve(&sin, port);
+	no_reuseport = 1;
+	serve(&sin, port);
+	no_reuseport = 0;
+
+	/* Group on the io_uring backend, zero means one loop per CPU */
+	fail_unless(!ml_group_init(&group, 0, 10, MINILOOP_IO_URING));
+	fail_unless(group.nloops >= 1);
+	fail_unless(!ml_group_start(&group));
+	counted = 0;
+	expect = ml_group_ctx(&group, 0);
+	for (i = 0; i < NMSGS; i++)
+		fail_unless(!ml_group_send(&group, 0, &msgs[i]));
+	while (__atomic_load_n(&counted, __ATOMIC_ACQUIRE) < NMSGS)
+		usleep(1000);
+	fail_unless(order_ok);
+
+	return ml_group_exit(&group);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,101 @@
+/* Verifies the userspace timer heap, %MINILOOP_TIMER_HEAP
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+
+#define NUM_TIMERS 500
+
+static ml_t timers[NUM_TIMERS];
+static ml_t periodic, idle, deadline;
+static int  last = -1, fired, laps, resets;
+
+static void cb(ml_t *w, void *arg, int events)
+{
+	int idx = (int)(intptr_t)arg;
+
+	/* Timers must expire in order of their timeout */
+	fail_unless(idx >= last);
+	fail_unless(!ml_timer_active(w));
+	last = idx;
+	fired++;
+}
+
+static void periodic_cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(ml_timer_active(w));
+
+	/* Keep pushing the idle timeout out, it must never fire */
+	if (resets < 10) {
+		ml_timer_set(&idle, 100, 0);
+		resets++;
+	}
+
+	if (++laps == 20)
+		ml_timer_stop(w);
+}
+
+static void idle_cb(ml_t *w, void *arg, int events)
+{
+	/* Only once the periodic timer has stopped resetting us */
+	fail_unless(resets == 10);
+}
+
+static void deadline_cb(ml_t *w, void *arg, int events)
+{
+	ml_exit(w->ctx);
+}
+
+int main(void)
+{
+	ml_ctx_t ctx;
+	int i;
+
+	ml_init1(&ctx, 10, MINILOOP_TIMER_HEAP);
+
+	/* Insert in reverse order, timeouts 1..NUM_TIMERS / 5 ms */
+	for (i = NUM_TIMERS - 1; i >= 0; i--) {
+		ml_timer_init(&ctx, &timers[i], cb, (void *)(intptr_t)(i / 5), i / 5 + 1, 0);
+		fail_unless(timers[i].fd == -1);
+	}
+
+	/* Stopped timers must not fire */
+	for (i = 0; i < NUM_TIMERS; i += 50)
+		ml_timer_stop(&timers[i]);
+
+	ml_timer_init(&ctx, &periodic, periodic_cb, NULL, 10, 10);
+	ml_timer_init(&ctx, &idle, idle_cb, NULL, 100, 0);
+	ml_timer_init(&ctx, &deadline, deadline_cb, NULL, 500, 0);
+
+	fail_unless(ml_run(&ctx, 0) == 0);
+
+	fail_unless(fired == NUM_TIMERS - NUM_TIMERS / 50);
+	fail_unless(laps == 20);
+	fail_unless(!ml_timer_active(&idle));
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,126 @@
+/* Verifies prepare, check and idle watchers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+
+#define IDLE_RUNS 5
+
+static ml_t idle, prepare, check[2], ev, timer;
+static char seq[64];
+static int len, idle_runs, check_runs[2];
+
+static void log_cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(events == MINILOOP_READ);
+	if (len < (int)sizeof(seq) - 1)
+		seq[len++] = *(char *)arg;
+}
+
+static void idle_cb(ml_t *w, void *arg, int events)
+{
+	log_cb(w, arg, events);
+	if (++idle_runs == IDLE_RUNS)
+		ml_idle_stop(w);
+}
+
+/* Newest first, so check[1] runs before check[0] and stops it */
+static void check_cb(ml_t *w, void *arg, int events)
+{
+	int id = w == &check[1];
+
+	check_runs[id]++;
+	if (id)
+		ml_check_stop(&check[0]);
+}
+
+static void timer_cb(ml_t *w, void *arg, int events)
+{
+	ml_timer_stop(w);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int main(void)
+{
+	ml_ctx_t ctx;
+	uint64_t start;
+
+	fail_unless(!ml_init(&ctx, 64));
+
+	/* Same error return as other watchers */
+	fail_unless(ml_prepare_init(&ctx, &prepare, NULL, NULL) == -1 && errno == EINVAL);
+	fail_unless(ml_check_init(&ctx, &check[0], NULL, NULL) == -1 && errno == EINVAL);
+	fail_unless(ml_idle_init(&ctx, &idle, NULL, NULL) == -1 && errno == EINVAL);
+
+	/* One iteration, in order */
+	fail_unless(!ml_idle_init(&ctx, &idle, idle_cb, "I"));
+	fail_unless(!ml_prepare_init(&ctx, &prepare, log_cb, "P"));
+	fail_unless(!ml_check_init(&ctx, &check[0], log_cb, "C"));
+	fail_unless(!ml_event_init(&ctx, &ev, log_cb, "E"));
+	fail_unless(!ml_event_post(&ev));
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(!strcmp(seq, "IPEC"));
+	fail_unless(idle.fd == -1 && ml_idle_active(&idle));
+
+	/* Active idle watcher, nothing else to do, never blocks */
+	fail_unless(!ml_event_stop(&ev));
+	fail_unless(!ml_timer_init(&ctx, &timer, timer_cb, NULL, 1000, 0));
+	start = now_ms();
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(now_ms() - start < 500);
+	fail_unless(!strcmp(seq, "IPECIPCIPC"));
+
+	/* Check watcher stopping the next one in line */
+	fail_unless(!ml_check_stop(&check[0]));
+	fail_unless(!ml_check_init(&ctx, &check[0], check_cb, NULL));
+	fail_unless(!ml_check_init(&ctx, &check[1], check_cb, NULL));
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(check_runs[1] == 1 && check_runs[0] == 0);
+	fail_unless(!ml_check_active(&check[0]) && ml_check_active(&check[1]));
+
+	/* Idle watcher stops itself, then the loop waits for the timer */
+	fail_unless(!ml_prepare_stop(&prepare));
+	fail_unless(!ml_check_stop(&check[1]));
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(idle_runs == IDLE_RUNS && !ml_idle_active(&idle));
+	fail_unless(!ml_timer_active(&timer));
+	fail_unless(now_ms() - start >= 900);
+
+	fail_unless(ml_idle_start(&prepare) && errno == EINVAL);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,155 @@
+/* Verifies nanosecond and absolute timers, clocks and slack
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+
+#define USEC     1000ULL
+#define MSEC     1000000ULL
+#define PACE     (200 * USEC)
+#define LAPS     50
+#define NTIMERS  10
+#define SLACK    (5 * MSEC)
+
+static ml_t pace, abs_timer, real, boot, hook, timers[NTIMERS];
+static uint64_t deadlines[NTIMERS], fired_at, wakeups;
+static int laps, fired, early, real_fired, boot_fired;
+static uint64_t woken[NTIMERS];
+
+static uint64_t now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pace_cb(ml_t *w, void *arg, int events)
+{
+	if (++laps == LAPS)
+		ml_timer_stop(w);
+}
+
+static void abs_cb(ml_t *w, void *arg, int events)
+{
+	fired_at = now(CLOCK_MONOTONIC);
+}
+
+static void clock_cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(events == MINILOOP_READ);
+	(*(int *)arg)++;
+}
+
+static void prepare_cb(ml_t *w, void *arg, int events)
+{
+	wakeups++;
+}
+
+static void slack_cb(ml_t *w, void *arg, int events)
+{
+	int i = (intptr_t)arg;
+
+	if (now(CLOCK_MONOTONIC) < deadlines[i])
+		early++;
+	woken[i] = wakeups;
+	fired++;
+}
+
+static void run(int flags)
+{
+	uint64_t start, deadline;
+	ml_ctx_t ctx;
+	int i, distinct;
+
+	laps = fired = early = real_fired = boot_fired = 0;
+	fail_unless(!ml_init1(&ctx, 64, flags));
+
+	/* Sub-millisecond period, on a timerfd even in a heap context */
+	fail_unless(!ml_timer_init_ns(&ctx, &pace, pace_cb, NULL, flags ? CLOCK_BOOTTIME : CLOCK_MONOTONIC, PACE, PACE, 0));
+	start = now(CLOCK_MONOTONIC);
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(laps == LAPS);
+	fail_unless(now(CLOCK_MONOTONIC) - start >= LAPS * PACE);
+	fail_unless(now(CLOCK_MONOTONIC) - start < 20 * LAPS * PACE);
+
+	/* Absolute deadline, never early */
+	deadline = now(CLOCK_MONOTONIC) + 20 * MSEC;
+	fail_unless(!ml_timer_init_ns(&ctx, &abs_timer, abs_cb, NULL, CLOCK_MONOTONIC, deadline, 0, MINILOOP_TIMER_ABSTIME));
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(fired_at >= deadline);
+	fail_unless(!ml_timer_active(&abs_timer));
+
+	/* Deadline in the past expires right away */
+	fail_unless(!ml_timer_set_ns(&abs_timer, 1, 0, MINILOOP_TIMER_ABSTIME));
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(!ml_timer_active(&abs_timer));
+
+	/* Wall clock and boot time clocks */
+	fail_unless(!ml_timer_init_ns(&ctx, &real, clock_cb, &real_fired, CLOCK_REALTIME,
+				      now(CLOCK_REALTIME) + 5 * MSEC, 0, MINILOOP_TIMER_ABSTIME));
+	fail_unless(!ml_timer_init_ns(&ctx, &boot, clock_cb, &boot_fired, CLOCK_BOOTTIME, 5 * MSEC, 0, 0));
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(real_fired == 1 && boot_fired == 1);
+
+	/* Nearby deadlines with slack expire together */
+	fail_unless(!ml_prepare_init(&ctx, &hook, prepare_cb, NULL));
+	start = now(CLOCK_MONOTONIC) + 10 * MSEC;
+	for (i = 0; i < NTIMERS; i++) {
+		deadlines[i] = start + i * 100 * USEC;
+		fail_unless(!ml_timer_init_ns(&ctx, &timers[i], slack_cb, (void *)(intptr_t)i, CLOCK_MONOTONIC, 0, 0, 0));
+		fail_unless(!ml_timer_slack(&timers[i], SLACK));
+		fail_unless(!ml_timer_set_ns(&timers[i], deadlines[i], 0, MINILOOP_TIMER_ABSTIME));
+	}
+	while (fired < NTIMERS)
+		fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(early == 0);
+	for (i = 1, distinct = 1; i < NTIMERS; i++) {
+		if (woken[i] != woken[i - 1])
+			distinct++;
+	}
+	fail_unless(distinct <= 2);
+	fail_unless(!ml_prepare_stop(&hook));
+
+	/* Bad arguments */
+	fail_unless(ml_timer_init_ns(&ctx, &abs_timer, abs_cb, NULL, CLOCK_PROCESS_CPUTIME_ID, 1, 0, 0) && errno == EINVAL);
+	fail_unless(ml_timer_set_ns(&real, 1, 0, 0x100) && errno == EINVAL);
+	fail_unless(ml_timer_slack(&real, 1ULL << 40) && errno == ERANGE);
+	fail_unless(ml_timer_slack(&hook, 1) && errno == EINVAL);
+
+	fail_unless(!ml_exit(&ctx));
+}
+
+int main(void)
+{
+	run(0);
+	run(MINILOOP_TIMER_HEAP);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,198 @@
+/* Verifies in place I/O watcher changes and edge tracked watchers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <sys/socket.h>
+
+#define STEP (MINILOOP_ONCE | MINILOOP_NONBLOCK)
+
+static int calls, last, drain, nread;
+
+static void cb(ml_t *w, void *arg, int events)
+{
+	char buf[8];
+	ssize_t num;
+
+	calls++;
+	last = events;
+
+	if (!(events & MINILOOP_READ))
+		return;
+
+	/* Either read it all, until EAGAIN, or just a little */
+	do {
+		num = ml_io_read(w, buf, sizeof(buf));
+		if (num > 0)
+			nread += num;
+	} while (drain && num > 0);
+}
+
+/* Count of EPOLL_CTL_* calls for I/O watchers, -1 without MINILOOP_STATS */
+static long ctl(ml_ctx_t *ctx, int op)
+{
+	ml_stats_t st;
+
+	if (ml_stats_get(ctx, &st))
+		return -1;
+
+	return st.ctl[MINILOOP_IO_TYPE][op];
+}
+
+static void check_ctl(ml_ctx_t *ctx, long add, long del, long mod)
+{
+	if (ctl(ctx, MINILOOP_STATS_ADD) < 0)
+		return;
+
+	fail_unless(ctl(ctx, MINILOOP_STATS_ADD) == add);
+	fail_unless(ctl(ctx, MINILOOP_STATS_DEL) == del);
+	fail_unless(ctl(ctx, MINILOOP_STATS_MOD) == mod);
+}
+
+static void test_set(ml_ctx_t *ctx, int sd[2])
+{
+	ml_t w;
+
+	fail_unless(!ml_io_init(ctx, &w, cb, NULL, sd[0], MINILOOP_READ));
+	check_ctl(ctx, 1, 0, 0);
+
+	/* Unchanged, nothing to do */
+	fail_unless(!ml_io_set(&w, sd[0], MINILOOP_READ));
+	check_ctl(ctx, 1, 0, 0);
+
+	/* New mask, modified in place */
+	calls = 0;
+	fail_unless(!ml_io_set(&w, sd[0], MINILOOP_READ | MINILOOP_WRITE));
+	check_ctl(ctx, 1, 0, 1);
+	fail_unless(ml_io_active(&w));
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 1 && (last & MINILOOP_WRITE));
+
+	fail_unless(!ml_io_set(&w, sd[0], MINILOOP_READ));
+	check_ctl(ctx, 1, 0, 2);
+	calls = 0;
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 0);
+
+	fail_unless(!ml_io_stop(&w));
+	check_ctl(ctx, 1, 1, 2);
+}
+
+static void test_edge(ml_ctx_t *ctx, int sd[2])
+{
+	long mod;
+	ml_t w;
+
+	ml_stats_reset(ctx);
+	fail_unless(!ml_io_edge_init(ctx, &w, cb, NULL, sd[0], MINILOOP_READ));
+	mod = ctl(ctx, MINILOOP_STATS_MOD);
+
+	/* Writable from the start, but only interested in reading */
+	calls = 0;
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 0);
+
+	/* Read it all, then no more callbacks */
+	drain = 1;
+	nread = 0;
+	fail_unless(write(sd[1], "0123456789abcdef0123", 20) == 20);
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 1 && (last & MINILOOP_READ) && nread == 20);
+	calls = 0;
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 0);
+
+	/* Already writable, no new edge but called back anyway */
+	fail_unless(!ml_io_set(&w, sd[0], MINILOOP_READ | MINILOOP_WRITE));
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 1 && last == MINILOOP_WRITE);
+
+	/* Unchanged, not called again */
+	calls = 0;
+	fail_unless(!ml_io_set(&w, sd[0], MINILOOP_READ | MINILOOP_WRITE));
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 0);
+	fail_unless(!ml_io_set(&w, sd[0], MINILOOP_READ));
+
+	/* Partial read, data left is still ready, but only one edge */
+	drain = 0;
+	nread = 0;
+	fail_unless(write(sd[1], "0123456789abcdef0123", 20) == 20);
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 1 && nread == 8);
+	calls = 0;
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 0);
+
+	/* Re-enabled reading picks up where it left off */
+	drain = 1;
+	fail_unless(!ml_io_set(&w, sd[0], MINILOOP_NONE));
+	fail_unless(!ml_io_set(&w, sd[0], MINILOOP_READ));
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 1 && nread == 20);
+
+	/* Interest changes never reach epoll */
+	if (!ctx->ring && mod >= 0)
+		fail_unless(ctl(ctx, MINILOOP_STATS_MOD) == mod);
+
+	/* Stopped watchers are dropped from the pending list */
+	calls = 0;
+	fail_unless(!ml_io_set(&w, sd[0], MINILOOP_READ | MINILOOP_WRITE));
+	fail_unless(!ml_io_stop(&w));
+	fail_unless(ctx->io_pending == NULL);
+
+	/* Restarted with the same interest */
+	fail_unless(!ml_io_start(&w));
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls == 1 && last == MINILOOP_WRITE);
+
+	/* Hang-up is reported, and stops the watcher */
+	calls = 0;
+	close(sd[1]);
+	fail_unless(!ml_run(ctx, STEP));
+	fail_unless(calls >= 1 && (last & MINILOOP_RDHUP));
+
+	fail_unless(!ml_io_stop(&w));
+	fail_unless(ml_io_clear(NULL, MINILOOP_READ) && errno == EINVAL);
+}
+
+int main(void)
+{
+	ml_ctx_t ctx;
+	int sd[2];
+
+	fail_unless(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sd));
+	fail_unless(!ml_init(&ctx, 64));
+
+	test_set(&ctx, sd);
+	test_edge(&ctx, sd);
+
+	close(sd[0]);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
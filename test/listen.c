@@ -0,0 +1,180 @@
+/* Verifies listening sockets with batched accept
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define STEP    (MINILOOP_ONCE | MINILOOP_NONBLOCK)
+#define CLIENTS (2 * MINILOOP_LISTEN_BATCH + 10)
+
+static ml_listen_t srv, srv2;
+static ml_t *conns[CLIENTS];
+static int clients[CLIENTS];
+static int accepted, reads, errors, bad;
+
+static void io_cb(ml_t *w, void *arg, int events)
+{
+	char c;
+
+	if (arg != &srv)
+		bad++;
+	if (read(w->fd, &c, 1) == 1)
+		reads++;
+}
+
+static void accept_cb(ml_listen_t *l, void *arg, ml_t *w, const struct sockaddr *addr, socklen_t addrlen)
+{
+	if (!w) {
+		errors++;
+		return;
+	}
+
+	if (!ml_io_active(w) || !(fcntl(w->fd, F_GETFL) & O_NONBLOCK))
+		bad++;
+	if (addrlen != sizeof(struct sockaddr_in) || addr->sa_family != AF_INET)
+		bad++;
+	if (accepted < CLIENTS)
+		conns[accepted] = w;
+	accepted++;
+}
+
+static int open_listener(struct sockaddr_in *sin)
+{
+	socklen_t len = sizeof(*sin);
+	int sd;
+
+	sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	fail_unless(sd >= 0);
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fail_unless(!bind(sd, (struct sockaddr *)sin, sizeof(*sin)));
+	fail_unless(!getsockname(sd, (struct sockaddr *)sin, &len));
+	fail_unless(!listen(sd, 4 * CLIENTS));
+
+	return sd;
+}
+
+static void connect_all(struct sockaddr_in *sin, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+		fail_unless(clients[i] >= 0);
+		fail_unless(!connect(clients[i], (struct sockaddr *)sin, sizeof(*sin)));
+	}
+}
+
+static void close_all(int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		close(clients[i]);
+		if (i < accepted) {
+			close(conns[i]->fd);
+			fail_unless(!ml_free(conns[i]));
+		}
+	}
+	accepted = 0;
+}
+
+static void run(int flags)
+{
+	struct sockaddr_in sin;
+	ml_ctx_t ctx, ctx2;
+	int sd, i, tries = 0;
+
+	reads = errors = bad = 0;
+	sd = open_listener(&sin);
+	fail_unless(!ml_init1(&ctx, 64, flags));
+	fail_unless(!ml_listen_init(&ctx, &srv, accept_cb, &srv, sd, io_cb, MINILOOP_READ, 0));
+
+	/* A storm, drained in bounded batches */
+	connect_all(&sin, CLIENTS);
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(accepted == MINILOOP_LISTEN_BATCH);
+	while (accepted < CLIENTS && tries++ < 100)
+		fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(accepted == CLIENTS && errors == 0);
+
+	/* New connections are registered and served */
+	for (i = 0; i < CLIENTS; i++)
+		fail_unless(write(clients[i], "x", 1) == 1);
+	for (tries = 0; reads < CLIENTS && tries < 100; tries++)
+		fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(reads == CLIENTS && bad == 0);
+	close_all(CLIENTS);
+
+	/* Stopped, connections wait in the backlog */
+	fail_unless(!ml_listen_stop(&srv));
+	connect_all(&sin, 1);
+	usleep(10000);
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(accepted == 0);
+	fail_unless(!ml_listen_start(&srv));
+	for (tries = 0; !accepted && tries < 100; tries++)
+		fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(accepted == 1);
+	close_all(1);
+
+	/* Shared by two contexts, one connection is accepted once */
+	fail_unless(!ml_listen_stop(&srv));
+	fail_unless(!ml_listen_init(&ctx, &srv, accept_cb, &srv, sd, io_cb, MINILOOP_READ, MINILOOP_LISTEN_SHARED));
+	fail_unless(!ml_init1(&ctx2, 64, flags));
+	fail_unless(!ml_listen_init(&ctx2, &srv2, accept_cb, &srv, sd, io_cb, MINILOOP_READ, MINILOOP_LISTEN_SHARED));
+	connect_all(&sin, 1);
+	for (tries = 0; !accepted && tries < 100; tries++) {
+		fail_unless(!ml_run(&ctx, STEP));
+		fail_unless(!ml_run(&ctx2, STEP));
+	}
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(!ml_run(&ctx2, STEP));
+	fail_unless(accepted == 1 && errors == 0 && bad == 0);
+	close_all(1);
+
+	fail_unless(ml_listen_init(&ctx, &srv, NULL, NULL, sd, io_cb, MINILOOP_READ, 0) && errno == EINVAL);
+	fail_unless(ml_listen_init(&ctx, &srv, accept_cb, NULL, sd, io_cb, MINILOOP_READ, 0x100) && errno == EINVAL);
+
+	fail_unless(!ml_exit(&ctx2));
+	fail_unless(!ml_exit(&ctx));
+	close(sd);
+}
+
+int main(void)
+{
+	run(0);
+	run(MINILOOP_IO_URING);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
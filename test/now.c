@@ -0,0 +1,133 @@
+/* Verifies the cached monotonic time of a context
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+
+#define MSEC 1000000ULL
+
+static ml_t a, b, timer;
+static int fd[2], fd2[2];
+static uint64_t seen[2], armed, fired;
+static int calls, bad;
+
+static uint64_t clock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void timer_cb(ml_t *w, void *arg, int events)
+{
+	fired = ml_now_ns(w->ctx);
+
+	/* Updated on demand */
+	usleep(1000);
+	if (ml_now_ns(w->ctx) != fired)
+		bad++;
+	fail_unless(!ml_now_update(w->ctx));
+	if (ml_now_ns(w->ctx) < fired + MSEC)
+		bad++;
+}
+
+/* Both called in one batch, the first one is slow */
+static void io_cb(ml_t *w, void *arg, int events)
+{
+	uint64_t now = ml_now_ns(w->ctx);
+	char c;
+
+	if (read(w->fd, &c, 1) != 1)
+		bad++;
+	if (now > clock_now() || ml_now(w->ctx) != now / MSEC)
+		bad++;
+	seen[calls++] = now;
+
+	if (calls == 1) {
+		usleep(20000);
+		if (ml_now_ns(w->ctx) != now)
+			bad++;
+
+		/* Counts from the wakeup, not from the end of the sleep */
+		armed = now;
+		fail_unless(!ml_timer_init(w->ctx, &timer, timer_cb, NULL, 10, 0));
+	}
+	ml_io_stop(w);
+}
+
+static void run(int flags)
+{
+	uint64_t t0, t1;
+	ml_ctx_t ctx;
+
+	calls = bad = 0;
+	fired = 0;
+	fail_unless(!ml_init1(&ctx, 64, flags));
+
+	/* Outside of ml_run() the clock is read anew */
+	t0 = ml_now_ns(&ctx);
+	fail_unless(t0 > 0);
+	usleep(5000);
+	t1 = ml_now_ns(&ctx);
+	fail_unless(t1 >= t0 + 5 * MSEC && t1 <= clock_now());
+
+	fail_unless(!pipe(fd) && !pipe(fd2));
+	fail_unless(!ml_io_init(&ctx, &a, io_cb, NULL, fd[0], MINILOOP_READ));
+	fail_unless(!ml_io_init(&ctx, &b, io_cb, NULL, fd2[0], MINILOOP_READ));
+	fail_unless(write(fd[1], "x", 1) == 1);
+	fail_unless(write(fd2[1], "x", 1) == 1);
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(calls == 2 && bad == 0);
+	fail_unless(seen[0] == seen[1] && seen[0] > t1);
+
+	/* Read anew when the loop wakes up again */
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(fired >= armed + 10 * MSEC && fired >= seen[0] + 20 * MSEC);
+	fail_unless(fired < armed + 30 * MSEC);
+	fail_unless(bad == 0);
+
+	fail_unless(ml_now_update(NULL) && errno == EINVAL);
+	fail_unless(ml_now_ns(NULL) == 0 && errno == EINVAL);
+
+	fail_unless(!ml_exit(&ctx));
+	close(fd[0]);
+	close(fd[1]);
+	close(fd2[0]);
+	close(fd2[1]);
+}
+
+int main(void)
+{
+	run(0);
+	run(MINILOOP_TIMER_HEAP);
+	run(MINILOOP_IO_URING);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,397 @@
+/* Latency and throughput checks of the loop core, see perf -h
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#define USEC 1000ULL
+#define MSEC 1000000ULL
+
+/* Thresholds, in microseconds unless noted, loose enough for a busy CI box */
+static long max_event_us  = 200;	/* p99 event post round trip */
+static long max_late_us   = 2000;	/* Mean timer lateness */
+static long max_jitter_us = 5000;	/* p99 deviation from the timer period */
+static long max_wakeup_us = 500;	/* p99 wakeup to callback, with idle fds */
+static long min_sets      = 100000;	/* ml_io_set() calls per second */
+static int  idle_fds      = 1000;
+static int  samples       = 1000;
+static int  flags;
+
+static uint64_t *lat;
+static int nlat;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile, sorts the samples */
+static uint64_t pct(uint64_t *v, int n, double p)
+{
+	int rank = (int)ceil(p / 100.0 * n);
+
+	qsort(v, n, sizeof(*v), cmp);
+	if (rank < 1)
+		rank = 1;
+
+	return v[rank - 1];
+}
+
+/*
+ * Event post round trip, ping and pong watchers post each other, each
+ * sample is post to callback and back again.
+ */
+static ml_t ping, pong;
+static uint64_t sent;
+
+static void ping_cb(ml_t *w, void *arg, int events)
+{
+	lat[nlat++] = now_ns() - sent;
+	if (nlat == samples) {
+		ml_event_stop(&ping);
+		ml_event_stop(&pong);
+		return;
+	}
+
+	sent = now_ns();
+	ml_event_post(&pong);
+}
+
+static void pong_cb(ml_t *w, void *arg, int events)
+{
+	ml_event_post(&ping);
+}
+
+static int check_event(void)
+{
+	ml_ctx_t ctx;
+	uint64_t p50, p99;
+
+	nlat = 0;
+	if (ml_init1(&ctx, 64, flags) ||
+	    ml_event_init(&ctx, &ping, ping_cb, NULL) ||
+	    ml_event_init(&ctx, &pong, pong_cb, NULL))
+		return -1;
+
+	sent = now_ns();
+	ml_event_post(&pong);
+	ml_run(&ctx, 0);
+	ml_exit(&ctx);
+
+	p50 = pct(lat, nlat, 50);
+	p99 = pct(lat, nlat, 99);
+
+	return test(p99 > max_event_us * USEC, "Event round trip p50 %llu us, p99 %llu us",
+		    (unsigned long long)(p50 / USEC), (unsigned long long)(p99 / USEC));
+}
+
+/* Timer accuracy, lateness of each tick against the ideal schedule */
+static ml_t timer;
+static uint64_t start, period;
+static int64_t late_sum;
+
+static void timer_cb(ml_t *w, void *arg, int events)
+{
+	uint64_t now = now_ns();
+	uint64_t due = start + (nlat + 1) * period;
+
+	late_sum += (int64_t)(now - due);
+	lat[nlat] = now;
+	if (++nlat == samples)
+		ml_timer_stop(w);
+}
+
+static int check_timer(int msec, int ticks)
+{
+	int i, saved = samples, rc;
+	uint64_t p99;
+	ml_ctx_t ctx;
+	long late;
+
+	nlat = 0;
+	late_sum = 0;
+	period = msec * MSEC;
+	samples = ticks;
+	if (ml_init1(&ctx, 64, flags))
+		return -1;
+
+	start = now_ns();
+	if (ml_timer_init_ns(&ctx, &timer, timer_cb, NULL, CLOCK_MONOTONIC, period, period, 0))
+		return -1;
+	ml_run(&ctx, 0);
+	ml_exit(&ctx);
+	samples = saved;
+
+	/* Deviation of each interval from the period */
+	for (i = nlat - 1; i > 0; i--) {
+		int64_t d = (int64_t)(lat[i] - lat[i - 1]) - (int64_t)period;
+
+		lat[i] = d < 0 ? -d : d;
+	}
+	lat[0] = 0;
+	p99  = pct(lat, nlat, 99);
+	late = late_sum / nlat / (int64_t)USEC;
+
+	rc = test(late > max_late_us || p99 > max_jitter_us * USEC,
+		  "Timer %3d ms, late %ld us, jitter p99 %llu us", msec, late,
+		  (unsigned long long)(p99 / USEC));
+
+	return rc;
+}
+
+/*
+ * Wakeup to callback, a thread writes to one pipe at a time while the
+ * loop sleeps, with many idle descriptors in the same context.
+ */
+static int wfd;
+static volatile uint64_t written;
+
+static void *writer(void *arg)
+{
+	int i;
+
+	for (i = 0; i < samples; i++) {
+		usleep(200);
+		written = now_ns();
+		if (write(wfd, "x", 1) != 1)
+			break;
+	}
+
+	return NULL;
+}
+
+static void wakeup_cb(ml_t *w, void *arg, int events)
+{
+	char c;
+
+	lat[nlat++] = now_ns() - written;
+	if (read(w->fd, &c, 1) != 1 || nlat == samples)
+		ml_io_stop(w);
+}
+
+static void idle_cb(ml_t *w, void *arg, int events)
+{
+}
+
+static int check_wakeup(void)
+{
+	int i, fd[2], *fds, rc = -1;
+	ml_t *idle, active;
+	pthread_t tid;
+	uint64_t p50, p99;
+	ml_ctx_t ctx;
+
+	nlat = 0;
+	fds  = calloc(idle_fds * 2, sizeof(int));
+	idle = calloc(idle_fds, sizeof(ml_t));
+	if (!fds || !idle || ml_init1(&ctx, 64, flags))
+		goto done;
+
+	for (i = 0; i < idle_fds; i++) {
+		if (pipe2(&fds[2 * i], O_NONBLOCK) ||
+		    ml_io_init(&ctx, &idle[i], idle_cb, NULL, fds[2 * i], MINILOOP_READ))
+			goto done;
+	}
+
+	if (pipe2(fd, O_NONBLOCK) || ml_io_init(&ctx, &active, wakeup_cb, NULL, fd[0], MINILOOP_READ))
+		goto done;
+	wfd = fd[1];
+
+	/* Loop ends when the active watcher is done, idle ones are stopped */
+	if (pthread_create(&tid, NULL, writer, NULL))
+		goto done;
+	while (ml_io_active(&active))
+		ml_run(&ctx, MINILOOP_ONCE);
+	pthread_join(tid, NULL);
+
+	p50 = pct(lat, nlat, 50);
+	p99 = pct(lat, nlat, 99);
+	rc  = test(p99 > max_wakeup_us * USEC, "Wakeup, %d idle fds, p50 %llu us, p99 %llu us",
+		   idle_fds, (unsigned long long)(p50 / USEC), (unsigned long long)(p99 / USEC));
+
+	close(fd[0]);
+	close(fd[1]);
+done:
+	ml_exit(&ctx);
+	if (fds) {
+		for (i = 0; i < idle_fds * 2; i++) {
+			if (fds[i] > 0)
+				close(fds[i]);
+		}
+	}
+	free(fds);
+	free(idle);
+
+	return rc;
+}
+
+/* Rate of ml_io_set() between two event masks, each one a kernel update */
+static int check_churn(void)
+{
+	int i, fd[2], n = samples * 100;
+	uint64_t t0, ns;
+	ml_ctx_t ctx;
+	ml_t w;
+	long rate;
+
+	if (ml_init1(&ctx, 64, flags) || pipe2(fd, O_NONBLOCK) ||
+	    ml_io_init(&ctx, &w, idle_cb, NULL, fd[1], MINILOOP_READ))
+		return -1;
+
+	t0 = now_ns();
+	for (i = 0; i < n; i++) {
+		if (ml_io_set(&w, fd[1], i & 1 ? MINILOOP_READ : MINILOOP_READ | MINILOOP_WRITE))
+			return -1;
+	}
+	ns = now_ns() - t0;
+	ml_exit(&ctx);
+	close(fd[0]);
+	close(fd[1]);
+
+	rate = ns ? (long)(n * 1000000000ULL / ns) : n;
+
+	return test(rate < min_sets, "ml_io_set() churn, %ld calls/s", rate);
+}
+
+static int usage(int rc)
+{
+	fprintf(stderr,
+		"Usage: perf [-hHu] [-c NUM] [-e US] [-l US] [-j US] [-n NUM] [-s NUM] [-w US]\n"
+		"  -c NUM   Min. ml_io_set() calls per second, default %ld\n"
+		"  -e US    Max. p99 event post round trip, default %ld\n"
+		"  -H       Userspace timer heap, MINILOOP_TIMER_HEAP\n"
+		"  -j US    Max. p99 timer jitter, deviation from the period, default %ld\n"
+		"  -l US    Max. mean timer lateness, default %ld\n"
+		"  -n NUM   Idle descriptors in the wakeup check, default %d\n"
+		"  -s NUM   Samples per latency check, default %d\n"
+		"  -u       io_uring backend, MINILOOP_IO_URING\n"
+		"  -w US    Max. p99 wakeup to callback latency, default %ld\n"
+		"\n"
+		"Exits non-zero if any check is over its threshold.  With -H and -u timers\n"
+		"wait in whole milliseconds, the 1 ms timer falls behind, raise -l for it.\n",
+		min_sets, max_event_us, max_jitter_us, max_late_us, idle_fds, samples, max_wakeup_us);
+
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct rlimit rl;
+	int c, rc = 0;
+
+	while ((c = getopt(argc, argv, "c:e:hHj:l:n:s:uw:")) != -1) {
+		switch (c) {
+		case 'c':
+			min_sets = atol(optarg);
+			break;
+
+		case 'e':
+			max_event_us = atol(optarg);
+			break;
+
+		case 'h':
+			return usage(0);
+
+		case 'H':
+			flags |= MINILOOP_TIMER_HEAP;
+			break;
+
+		case 'j':
+			max_jitter_us = atol(optarg);
+			break;
+
+		case 'l':
+			max_late_us = atol(optarg);
+			break;
+
+		case 'n':
+			idle_fds = atoi(optarg);
+			break;
+
+		case 's':
+			samples = atoi(optarg);
+			break;
+
+		case 'u':
+			flags |= MINILOOP_IO_URING;
+			break;
+
+		case 'w':
+			max_wakeup_us = atol(optarg);
+			break;
+
+		default:
+			return usage(1);
+		}
+	}
+
+	if (samples < 1 || idle_fds < 0)
+		return usage(1);
+
+	/* Two per idle pipe, raising the hard limit needs privileges */
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < (rlim_t)idle_fds * 2 + 64) {
+		rl.rlim_cur = idle_fds * 2 + 64;
+		if (rl.rlim_max < rl.rlim_cur)
+			rl.rlim_max = rl.rlim_cur;
+		if (setrlimit(RLIMIT_NOFILE, &rl)) {
+			perror("setrlimit");
+			return 1;
+		}
+	}
+
+	lat = calloc(samples > 100 ? samples : 100, sizeof(*lat));
+	if (!lat) {
+		perror("calloc");
+		return 1;
+	}
+
+	rc |= check_event();
+	rc |= check_timer(1, 200);
+	rc |= check_timer(10, 50);
+	rc |= check_timer(100, 10);
+	rc |= check_wakeup();
+	rc |= check_churn();
+	free(lat);
+
+	return rc ? 1 : 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,107 @@
+/* Verifies context owned watchers, ml_alloc() and handles
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <stdint.h>
+
+#define NWATCHERS 200
+
+static ml_handle_t handle[NWATCHERS];
+static ml_t       *pooled[NWATCHERS];
+static ml_t       *in_cb[NWATCHERS];
+static int         calls;
+
+/* First one to run frees all watchers, their cached events are dropped */
+static void cb(ml_t *w, void *arg, int events)
+{
+	ml_ctx_t *ctx = w->ctx;
+	int i, j;
+
+	calls++;
+	for (i = 0; i < NWATCHERS; i++) {
+		ml_t *iter = ml_lookup(ctx, handle[i]);
+
+		fail_unless(iter != NULL);
+		fail_unless(!ml_free(iter));
+		fail_unless(ml_lookup(ctx, handle[i]) == NULL && errno == ESTALE);
+	}
+
+	/* Not reused while the event cache may still refer to them */
+	for (i = 0; i < NWATCHERS; i++) {
+
+		in_cb[i] = ml_alloc(ctx);
+		fail_unless(in_cb[i] != NULL);
+		fail_unless(ml_lookup(ctx, handle[i]) == NULL);
+		for (j = 0; j < NWATCHERS; j++)
+			fail_unless(in_cb[i] != pooled[j]);
+	}
+}
+
+int main(void)
+{
+	ml_t **w = pooled, *again;
+	ml_ctx_t ctx;
+	int i;
+
+	fail_unless(!ml_init(&ctx, 256));
+
+	for (i = 0; i < NWATCHERS; i++) {
+		w[i] = ml_alloc(&ctx);
+		fail_unless(w[i] != NULL);
+		fail_unless(((uintptr_t)w[i] & 63) == 0);
+		fail_unless(!ml_event_init(&ctx, w[i], cb, NULL));
+		handle[i] = ml_handle(w[i]);
+		fail_unless(handle[i] != 0);
+		fail_unless(ml_lookup(&ctx, handle[i]) == w[i]);
+		fail_unless(!ml_event_post(w[i]));
+	}
+
+	/* All events are in the cache, only one callback may run */
+	fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(calls == 1);
+
+	for (i = 0; i < NWATCHERS; i++)
+		fail_unless(!ml_free(in_cb[i]));
+
+	/* After ml_run(), a freed slot is reused at once */
+	again = ml_alloc(&ctx);
+	fail_unless(again != NULL && !ml_free(again));
+	fail_unless(ml_alloc(&ctx) == again && !ml_free(again));
+
+	/* Now the slots are reused, with new handles */
+	for (i = 0; i < NWATCHERS; i++) {
+		again = ml_alloc(&ctx);
+		fail_unless(again != NULL);
+		fail_unless(ml_handle(again) != handle[i]);
+	}
+
+	fail_unless(ml_lookup(&ctx, 0) == NULL && errno == EINVAL);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,162 @@
+/* Verifies watcher priorities and the low priority budget
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#define STEP   (MINILOOP_ONCE | MINILOOP_NONBLOCK)
+#define FLOOD  10
+#define BUDGET 3
+
+static ml_t flood[FLOOD], high, def, sig;
+static int fds[FLOOD][2], hfd[2], dfd[2];
+static char seq[64];
+static int len, calls, called[FLOOD];
+
+static void note(void *arg)
+{
+	if (len < (int)sizeof(seq) - 1)
+		seq[len++] = *(char *)arg;
+	calls++;
+}
+
+static void log_cb(ml_t *w, void *arg, int events)
+{
+	int got = 0;
+	char c;
+
+	/* Edge triggered, read it all */
+	while (read(w->fd, &c, 1) == 1)
+		got++;
+
+	/* Level triggered backends may report a drained fd once more */
+	if (!got)
+		return;
+
+	if (w >= flood && w < flood + FLOOD)
+		called[w - flood]++;
+	note(arg);
+}
+
+static void sig_cb(ml_t *w, void *arg, int events)
+{
+	note(arg);
+}
+
+static void nonblock_pipe(int fd[2])
+{
+	fail_unless(!pipe2(fd, O_NONBLOCK));
+}
+
+static int step(ml_ctx_t *ctx)
+{
+	calls = 0;
+	fail_unless(!ml_run(ctx, STEP));
+
+	return calls;
+}
+
+int main(void)
+{
+	ml_ctx_t ctx;
+	int i, n;
+
+	fail_unless(!ml_init(&ctx, 64));
+
+	nonblock_pipe(hfd);
+	nonblock_pipe(dfd);
+	fail_unless(!ml_io_init(&ctx, &def, log_cb, "D", dfd[0], MINILOOP_READ));
+	fail_unless(!ml_io_init(&ctx, &high, log_cb, "H", hfd[0], MINILOOP_READ));
+	fail_unless(!ml_priority_set(&high, MINILOOP_PRIO_MAX));
+	for (i = 0; i < FLOOD; i++) {
+		nonblock_pipe(fds[i]);
+		fail_unless(!ml_io_init(&ctx, &flood[i], log_cb, "L", fds[i][0], MINILOOP_READ | MINILOOP_EDGE));
+		fail_unless(!ml_priority_set(&flood[i], -1));
+		fail_unless(ml_priority(&flood[i]) == -1);
+	}
+	fail_unless(!ml_signal_init(&ctx, &sig, sig_cb, "S", SIGUSR1));
+
+	fail_unless(ml_priority_set(&high, MINILOOP_PRIO_MAX + 1) && errno == EINVAL);
+	fail_unless(ml_budget(&ctx, -1) && errno == EINVAL);
+
+	/* Highest first, whatever order the kernel reports them in */
+	for (i = 0; i < FLOOD; i++)
+		fail_unless(write(fds[i][1], "x", 1) == 1);
+	fail_unless(write(dfd[1], "x", 1) == 1);
+	fail_unless(write(hfd[1], "x", 1) == 1);
+	raise(SIGUSR1);
+	fail_unless(step(&ctx) == FLOOD + 3);
+	fail_unless(!strncmp(seq, "HSD", 3) || !strncmp(seq, "SHD", 3));
+	fail_unless(!strcmp(seq + 3, "LLLLLLLLLL"));
+
+	/* A budget for the flood, edges held back are not lost */
+	fail_unless(!ml_budget(&ctx, BUDGET));
+	memset(called, 0, sizeof(called));
+	for (i = 0; i < FLOOD; i++)
+		fail_unless(write(fds[i][1], "x", 1) == 1);
+	fail_unless(step(&ctx) == BUDGET);
+
+	/* Control traffic goes first, also ahead of the backlog */
+	len = 0;
+	fail_unless(write(hfd[1], "x", 1) == 1);
+	fail_unless(step(&ctx) == BUDGET + 1);
+	fail_unless(seq[0] == 'H');
+
+	/* Stopped while held back, never called */
+	for (i = 0; called[i]; i++)
+		;
+	fail_unless(!ml_io_stop(&flood[i]));
+	for (n = 0; n < FLOOD; n++)
+		fail_unless(step(&ctx) <= BUDGET);
+	fail_unless(!called[i]);
+	for (n = 0, i = 0; i < FLOOD; i++)
+		n += called[i];
+	fail_unless(n == FLOOD - 1);
+
+	fail_unless(!ml_budget(&ctx, 0));
+	for (i = 0; i < FLOOD; i++)
+		fail_unless(write(fds[i][1], "x", 1) == 1);
+	fail_unless(step(&ctx) == FLOOD - 1);
+
+	/* Signals first, also when no priority has been set */
+	fail_unless(!ml_exit(&ctx));
+	fail_unless(!ml_init(&ctx, 64));
+	for (i = 0; i < FLOOD; i++) {
+		fail_unless(!ml_io_init(&ctx, &flood[i], log_cb, "L", fds[i][0], MINILOOP_READ));
+		fail_unless(write(fds[i][1], "x", 1) == 1);
+	}
+	fail_unless(!ml_signal_init(&ctx, &sig, sig_cb, "S", SIGUSR1));
+	raise(SIGUSR1);
+	len = 0;
+	fail_unless(step(&ctx) == FLOOD + 1);
+	fail_unless(seq[0] == 'S');
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,209 @@
+/* Verifies ml_fs_sendfile() and ml_fs_copyfile()
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#define FILE_SIZE (3 * 1024 * 1024 + 17)
+#define OFFSET    1000
+#define PIPED     (32 * 1024)
+
+static char    src[] = "/tmp/miniloop-src-XXXXXX";
+static char    dst[] = "/tmp/miniloop-dst-XXXXXX";
+static ml_fs_t send_req, copy_req, excl_req, pipe_req;
+static ml_t    sock, peer, timer, producer, prep;
+static size_t  received, base, expect;
+static int     sent, copied, iterations, src_fd, pipe_fd;
+
+static char pattern(size_t pos)
+{
+	return 'a' + pos % 23;
+}
+
+/* Already watching the socket, ml_fs_sendfile() must cope with that */
+static void sock_cb(ml_t *w, void *arg, int events)
+{
+}
+
+static void peer_cb(ml_t *w, void *arg, int events)
+{
+	char buf[4096];
+	ssize_t i, n;
+
+	n = read(w->fd, buf, sizeof(buf));
+	if (n <= 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		fail_unless(buf[i] == pattern(base + received + i));
+	received += n;
+
+	if (received == expect) {
+		ml_io_stop(w);
+		ml_io_stop(&sock);
+	}
+}
+
+static void send_cb(ml_fs_t *req)
+{
+	fail_unless(req->error == 0);
+	fail_unless(req->result == (ssize_t)expect);
+	sent = 1;
+}
+
+/* From a callback, the socket's watcher is still there */
+static void timer_cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(!ml_fs_sendfile(w->ctx, &send_req, sock.fd, src_fd, OFFSET, 0, send_cb, NULL));
+}
+
+/* Fills the pipe late, the request waits for it without spinning */
+static void producer_cb(ml_t *w, void *arg, int events)
+{
+	char buf[PIPED];
+	size_t i;
+
+	for (i = 0; i < PIPED; i++)
+		buf[i] = pattern(i);
+	fail_unless(write(pipe_fd, buf, PIPED) == PIPED);
+	close(pipe_fd);
+}
+
+static void prep_cb(ml_t *w, void *arg, int events)
+{
+	iterations++;
+}
+
+static void pipe_cb(ml_fs_t *req)
+{
+	fail_unless(req->error == 0 && req->result == PIPED);
+	sent = 1;
+}
+
+static void copy_cb(ml_fs_t *req)
+{
+	struct stat st;
+
+	fail_unless(req->result == FILE_SIZE);
+	fail_unless(!stat(dst, &st) && st.st_size == FILE_SIZE);
+	ml_fs_cleanup(req);
+	copied = 1;
+}
+
+static void excl_cb(ml_fs_t *req)
+{
+	fail_unless(req->result == -1 && req->error == EEXIST);
+	ml_fs_cleanup(req);
+}
+
+int main(void)
+{
+	char buf[4096];
+	ml_ctx_t ctx;
+	int sv[2], p[2], fd, out, sz = 4096;
+	struct stat st;
+	size_t i;
+
+	fd = mkstemp(src);
+	fail_unless(fd >= 0);
+	for (i = 0; i < FILE_SIZE; i++) {
+		buf[i % sizeof(buf)] = pattern(i);
+		if (i % sizeof(buf) == sizeof(buf) - 1 || i == FILE_SIZE - 1)
+			fail_unless(write(fd, buf, i % sizeof(buf) + 1) > 0);
+	}
+
+	close(mkstemp(dst));
+	base   = OFFSET;
+	expect = FILE_SIZE - OFFSET;
+
+	/* Small send buffer to force partial writes */
+	fail_unless(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sz, sizeof(sz));
+
+	ml_init(&ctx, 10);
+	fail_unless(!ml_io_init(&ctx, &sock, sock_cb, NULL, sv[0], MINILOOP_READ));
+	fail_unless(!ml_io_init(&ctx, &peer, peer_cb, NULL, sv[1], MINILOOP_READ));
+	fail_unless(!ml_fs_sendfile(&ctx, &send_req, sv[0], fd, OFFSET, 0, send_cb, NULL));
+	fail_unless(!ml_fs_copyfile(&ctx, &copy_req, src, dst, 0, copy_cb, NULL));
+
+	/* Must not overwrite an existing file */
+	fail_unless(!ml_fs_copyfile(&ctx, &excl_req, src, dst, ML_FS_COPYFILE_EXCL, excl_cb, NULL));
+
+	fail_unless(ml_run(&ctx, 0) == 0);
+	fail_unless(sent && copied);
+	fail_unless(received == FILE_SIZE - OFFSET);
+
+	/* Started from a callback, with the socket's watcher active */
+	received = sent = 0;
+	src_fd = fd;
+	fail_unless(!ml_io_init(&ctx, &sock, sock_cb, NULL, sv[0], MINILOOP_READ));
+	fail_unless(!ml_io_init(&ctx, &peer, peer_cb, NULL, sv[1], MINILOOP_READ));
+	fail_unless(!ml_timer_init(&ctx, &timer, timer_cb, NULL, 1, 0));
+	fail_unless(ml_run(&ctx, 0) == 0);
+	fail_unless(sent && received == FILE_SIZE - OFFSET);
+
+	/* An empty pipe as source waits for data, not for the socket */
+	received = sent = iterations = base = 0;
+	expect = PIPED;
+	fail_unless(!pipe(p));
+	pipe_fd = p[1];
+	fail_unless(!ml_io_init(&ctx, &sock, sock_cb, NULL, sv[0], MINILOOP_READ));
+	fail_unless(!ml_io_init(&ctx, &peer, peer_cb, NULL, sv[1], MINILOOP_READ));
+	fail_unless(!ml_prepare_init(&ctx, &prep, prep_cb, NULL));
+	fail_unless(!ml_timer_init(&ctx, &producer, producer_cb, NULL, 50, 0));
+	fail_unless(!ml_fs_sendfile(&ctx, &pipe_req, sv[0], p[0], -1, PIPED, pipe_cb, NULL));
+	while (!sent || received < PIPED)
+		fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(iterations < 100);
+	fail_unless(!ml_prepare_stop(&prep));
+	close(p[0]);
+
+	/* A pipe as source, a regular file as destination */
+	sent = 0;
+	fail_unless(!pipe(p));
+	for (i = 0; i < PIPED; i++)
+		buf[i % sizeof(buf)] = pattern(i);
+	for (i = 0; i < PIPED; i += sizeof(buf))
+		fail_unless(write(p[1], buf, sizeof(buf)) == sizeof(buf));
+	close(p[1]);
+	out = open(dst, O_WRONLY | O_TRUNC);
+	fail_unless(out >= 0);
+	fail_unless(!ml_fs_sendfile(&ctx, &pipe_req, out, p[0], -1, 0, pipe_cb, NULL));
+	while (!sent)
+		fail_unless(!ml_run(&ctx, MINILOOP_ONCE));
+	fail_unless(!stat(dst, &st) && st.st_size == PIPED);
+	close(out);
+	close(p[0]);
+
+	unlink(src);
+	unlink(dst);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,121 @@
+/* Verifies signal watchers sharing one signalfd, and coalesced signals
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define STEP      (MINILOOP_ONCE | MINILOOP_NONBLOCK)
+#define NCHILDREN 20
+#define NQUEUED   5
+
+static ml_t usr1[2], usr2, chld, rt, bad;
+static int calls[5], count, reaped;
+
+static void cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(events == MINILOOP_READ);
+	calls[(intptr_t)arg]++;
+	count = ml_signal_count(w);
+}
+
+static void chld_cb(ml_t *w, void *arg, int events)
+{
+	calls[3]++;
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		reaped++;
+}
+
+int main(void)
+{
+	union sigval val = { 0 };
+	ml_ctx_t ctx;
+	int i;
+
+	fail_unless(!ml_init(&ctx, 64));
+	fail_unless(!ml_signal_init(&ctx, &usr1[0], cb, (void *)0, SIGUSR1));
+	fail_unless(!ml_signal_init(&ctx, &usr1[1], cb, (void *)1, SIGUSR1));
+	fail_unless(!ml_signal_init(&ctx, &usr2, cb, (void *)2, SIGUSR2));
+	fail_unless(!ml_signal_init(&ctx, &chld, chld_cb, NULL, SIGCHLD));
+	fail_unless(!ml_signal_init(&ctx, &rt, cb, (void *)4, SIGRTMIN));
+	fail_unless(ml_signal_init(&ctx, &bad, cb, NULL, 0) && errno == EINVAL);
+
+	/* No descriptor per watcher */
+	fail_unless(usr1[0].fd == -1 && usr2.fd == -1);
+	fail_unless(ctx.signal != NULL);
+
+	/* Every watcher of a signal is called */
+	raise(SIGUSR1);
+	raise(SIGUSR2);
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(calls[0] == 1 && calls[1] == 1 && calls[2] == 1);
+
+	/* Queued real-time signals, one callback */
+	for (i = 0; i < NQUEUED; i++)
+		fail_unless(!sigqueue(getpid(), SIGRTMIN, val));
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(calls[4] == 1 && count == NQUEUED);
+
+	/* A storm of SIGCHLD, one pass reaps them all */
+	for (i = 0; i < NCHILDREN; i++) {
+		pid_t pid = fork();
+
+		fail_unless(pid >= 0);
+		if (!pid)
+			_exit(0);
+	}
+	while (reaped < NCHILDREN) {
+		usleep(10000);
+		fail_unless(!ml_run(&ctx, STEP));
+	}
+	fail_unless(calls[3] >= 1 && calls[3] < NCHILDREN);
+
+	/* Stopped watcher is not called, the other one is */
+	fail_unless(!ml_signal_stop(&usr1[0]));
+	raise(SIGUSR1);
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(calls[0] == 1 && calls[1] == 2);
+
+	/* No watchers left, the signal stays pending until one is started */
+	fail_unless(!ml_signal_stop(&usr1[1]));
+	raise(SIGUSR1);
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(calls[0] == 1 && calls[1] == 2);
+	fail_unless(!ml_signal_start(&usr1[0]));
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(calls[0] == 2);
+
+	/* Moved to another signal */
+	fail_unless(!ml_signal_set(&usr2, SIGUSR1));
+	raise(SIGUSR1);
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(calls[0] == 3 && calls[2] == 2);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,104 @@
+/* Verifies event loop statistics, when built with MINILOOP_STATS
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+
+#define NEVENTS 10
+
+static ml_t ev[NEVENTS], slow_w;
+static int  slow_calls;
+static ml_t *slow_seen;
+static ml_cb_t *slow_cb_seen;
+
+static void cb(ml_t *w, void *arg, int events)
+{
+	ml_event_stop(w);
+}
+
+static void slow_cb(ml_t *w, void *arg, int events)
+{
+	usleep(5000);
+	ml_event_stop(w);
+}
+
+static void hook(ml_ctx_t *ctx, ml_t *w, ml_cb_t *fn, uint64_t ns, void *arg)
+{
+	fail_unless(arg == &slow_calls);
+	fail_unless(ns >= 1000000);
+	slow_seen = w;
+	slow_cb_seen = fn;
+	slow_calls++;
+}
+
+int main(void)
+{
+	ml_stats_t st;
+	ml_ctx_t ctx;
+	int i;
+
+	fail_unless(!ml_init(&ctx, 64));
+	if (ml_stats_get(&ctx, &st)) {
+		/* Not built with MINILOOP_STATS */
+		fail_unless(errno == ENOSYS);
+		fail_unless(ml_stats_slow(&ctx, 1, hook, NULL) && errno == ENOSYS);
+		return ml_exit(&ctx);
+	}
+
+	fail_unless(st.iterations == 0 && st.callbacks == 0);
+	fail_unless(!ml_stats_slow(&ctx, 1000000, hook, &slow_calls));
+
+	for (i = 0; i < NEVENTS; i++) {
+		fail_unless(!ml_event_init(&ctx, &ev[i], cb, NULL));
+		fail_unless(!ml_event_post(&ev[i]));
+	}
+	fail_unless(!ml_event_init(&ctx, &slow_w, slow_cb, NULL));
+	fail_unless(!ml_event_post(&slow_w));
+
+	fail_unless(!ml_run(&ctx, 0));
+	fail_unless(!ml_stats_get(&ctx, &st));
+
+	fail_unless(st.iterations >= 1);
+	fail_unless(st.events == NEVENTS + 1);
+	fail_unless(st.callbacks == NEVENTS + 1);
+	fail_unless(st.ctl[MINILOOP_EVENT_TYPE][MINILOOP_STATS_ADD] == NEVENTS + 1);
+	fail_unless(st.ctl[MINILOOP_EVENT_TYPE][MINILOOP_STATS_DEL] == NEVENTS + 1);
+	fail_unless(st.dispatch_ns >= 5000000);
+
+	/* Only the slow one is reported, and it is the slowest */
+	fail_unless(slow_calls == 1 && st.slow == 1);
+	fail_unless(slow_seen == &slow_w && slow_cb_seen == slow_cb);
+	fail_unless(ml_stats_percentile(&st, 100) >= 5000000);
+	fail_unless(ml_stats_percentile(&st, 50) < 1000000);
+
+	fail_unless(!ml_stats_reset(&ctx));
+	fail_unless(!ml_stats_get(&ctx, &st));
+	fail_unless(st.callbacks == 0 && ml_stats_percentile(&st, 50) == 0);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,165 @@
+/* Verifies buffered streams, watermarks and the buffer pool
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#define STEP   (MINILOOP_ONCE | MINILOOP_NONBLOCK)
+#define LENGTH (1024 * 1024 + 123)
+
+static ml_stream_t out, in;
+static size_t received;
+static int bad, eof, drained, chunks;
+
+static char pattern(size_t pos)
+{
+	return 'a' + pos % 23;
+}
+
+static void in_cb(ml_stream_t *s, void *arg, ml_buf_t *bufs, ssize_t len)
+{
+	ml_buf_t *b;
+	size_t i;
+
+	fail_unless(len >= 0);
+	if (!len) {
+		eof = 1;
+		return;
+	}
+
+	chunks++;
+	for (b = bufs; b; b = b->next) {
+		for (i = 0; i < b->len; i++) {
+			if (b->data[b->off + i] != pattern(received + i))
+				bad++;
+		}
+		received += b->len;
+		len -= b->len;
+	}
+	fail_unless(len == 0);
+	ml_buf_free(s->ctx, bufs);
+}
+
+static void out_cb(ml_stream_t *s, void *arg, ml_buf_t *bufs, ssize_t len)
+{
+	fail_unless(len == 0 || len == -1);
+}
+
+static void drain_cb(ml_stream_t *s, void *arg)
+{
+	fail_unless(ml_stream_writable(s));
+	drained++;
+}
+
+int main(void)
+{
+	static char data[LENGTH];
+	ml_buf_t *b, *c;
+	ml_ctx_t ctx;
+	size_t i;
+	int sd[2];
+
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < LENGTH; i++)
+		data[i] = pattern(i);
+
+	fail_unless(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sd));
+	fail_unless(!ml_init(&ctx, 64));
+
+	/* Freed buffers are reused */
+	b = ml_buf_alloc(&ctx);
+	fail_unless(b && b->len == 0 && b->off == 0);
+	fail_unless(!ml_buf_free(&ctx, b));
+	c = ml_buf_alloc(&ctx);
+	fail_unless(c == b);
+	fail_unless(!ml_buf_free(&ctx, c));
+
+	fail_unless(!ml_stream_init(&ctx, &out, out_cb, NULL, sd[0]));
+	fail_unless(!ml_stream_init(&ctx, &in, in_cb, NULL, sd[1]));
+	fail_unless(ml_stream_watermark(&out, 2, 1, drain_cb) && errno == EINVAL);
+	fail_unless(!ml_stream_watermark(&out, 64 * 1024, 256 * 1024, drain_cb));
+
+	/* Nothing is written until the loop runs */
+	fail_unless(!ml_stream_send(&out, data, LENGTH));
+	fail_unless(out.queued == LENGTH);
+	fail_unless(!ml_stream_writable(&out));
+
+	/* No reading while paused, output keeps flowing into the socket */
+	fail_unless(!ml_stream_pause(&in));
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(received == 0 && out.queued < LENGTH);
+
+	fail_unless(!ml_stream_resume(&in));
+	while (received < LENGTH)
+		fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(bad == 0 && received == LENGTH);
+	fail_unless(out.queued == 0 && ml_stream_writable(&out));
+	fail_unless(drained == 1);
+
+	/* Reads are batched into buffer chains */
+	fail_unless(chunks < LENGTH / MINILOOP_BUF_SIZE);
+
+	/* Small writes in one iteration are coalesced */
+	received = chunks = 0;
+	for (i = 0; i < 100; i++)
+		fail_unless(!ml_stream_send(&out, &data[i * 10], 10));
+	fail_unless(out.queued == 1000 && out.whead == out.wtail);
+	while (received < 1000)
+		fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(bad == 0 && chunks == 1);
+
+	/* Empty buffers are dropped, alone or in a chain */
+	received = 0;
+	fail_unless(!ml_stream_write(&out, ml_buf_alloc(&ctx)));
+	fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(out.whead == NULL && out.queued == 0);
+	b = ml_buf_alloc(&ctx);
+	c = ml_buf_alloc(&ctx);
+	memcpy(c->data, data, 10);
+	c->len = 10;
+	b->next = c;
+	c->next = ml_buf_alloc(&ctx);
+	fail_unless(!ml_stream_write(&out, b));
+	while (received < 10)
+		fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(bad == 0 && out.whead == NULL && out.queued == 0);
+
+	/* End of file from the peer */
+	fail_unless(!ml_stream_stop(&out));
+	close(sd[0]);
+	while (!eof)
+		fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(ml_stream_send(&out, "x", 1) && errno == EINVAL);
+
+	fail_unless(!ml_stream_stop(&in));
+	close(sd[1]);
+
+	return ml_exit(&ctx);
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
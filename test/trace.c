@@ -0,0 +1,156 @@
+/* Verifies the ring of recent dispatches, and its dump on a signal
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#define STEP   (MINILOOP_ONCE | MINILOOP_NONBLOCK)
+#define ROUNDS 20000
+
+static ml_trace_rec_t rec[64];
+static ml_t io, sig;
+static volatile int done;
+static int reads, bad;
+
+static void io_cb(ml_t *w, void *arg, int events)
+{
+	char c;
+
+	if (read(w->fd, &c, 1) == 1)
+		reads++;
+	if (arg)
+		usleep(20000);
+}
+
+/* Records are never torn, and come in order */
+static void *reader(void *arg)
+{
+	ml_ctx_t *ctx = arg;
+	int i, num;
+
+	while (!done) {
+		num = ml_trace_read(ctx, rec, 64);
+		if (num < 0)
+			bad++;
+		for (i = 0; i < num; i++) {
+			if (rec[i].type == MINILOOP_IO_TYPE && (rec[i].w != &io || rec[i].cb != io_cb))
+				bad++;
+			if (i && rec[i].start < rec[i - 1].start)
+				bad++;
+		}
+	}
+
+	return NULL;
+}
+
+static void run(int flags)
+{
+	char buf[4096] = { 0 };
+	ml_ctx_t ctx;
+	pthread_t tid;
+	int p[2], i, num;
+	FILE *fp;
+
+	reads = bad = done = 0;
+	fail_unless(!pipe(p));
+	fail_unless(!ml_init1(&ctx, 64, flags));
+	fail_unless(ml_trace_read(&ctx, rec, 64) < 0 && errno == ENOENT);
+	fail_unless(ml_trace_init(&ctx, MINILOOP_TRACE_MAX + 1) && errno == EINVAL);
+
+	/* A wait, then the callback */
+	fail_unless(!ml_trace_init(&ctx, 8));
+	fail_unless(!ml_io_init(&ctx, &io, io_cb, NULL, p[0], MINILOOP_READ));
+	fail_unless(write(p[1], "x", 1) == 1);
+	fail_unless(!ml_run(&ctx, STEP));
+	num = ml_trace_read(&ctx, rec, 64);
+	fail_unless(num == 2);
+	fail_unless(rec[0].type == 0 && rec[0].w == NULL && rec[0].events == 1 && rec[0].fd == 0);
+	fail_unless(rec[1].type == MINILOOP_IO_TYPE && rec[1].w == &io && rec[1].cb == io_cb);
+	fail_unless(rec[1].fd == p[0] && rec[1].events == MINILOOP_READ);
+	fail_unless(rec[1].start >= rec[0].start + rec[0].ns);
+
+	/* Full, the most recent ones are kept */
+	for (i = 0; i < 100; i++) {
+		fail_unless(write(p[1], "x", 1) == 1);
+		fail_unless(!ml_run(&ctx, STEP));
+	}
+	num = ml_trace_read(&ctx, rec, 64);
+	fail_unless(num >= 8 && num < 64);
+	fail_unless(rec[num - 1].type == MINILOOP_IO_TYPE && reads == 101);
+	fail_unless(ml_trace_read(&ctx, rec, 3) == 3);
+	fail_unless(rec[2].type == MINILOOP_IO_TYPE);
+
+	/* A slow callback stands out */
+	io.arg = &io;
+	fail_unless(write(p[1], "x", 1) == 1);
+	fail_unless(!ml_run(&ctx, STEP));
+	num = ml_trace_read(&ctx, rec, 64);
+	fail_unless(rec[num - 1].ns >= 20000000);
+	io.arg = NULL;
+
+	/* Dumped on a signal, from the loop */
+	fp = fmemopen(buf, sizeof(buf) - 1, "w");
+	fail_unless(fp != NULL);
+	fail_unless(!ml_trace_signal(&ctx, &sig, SIGUSR1, fp));
+	raise(SIGUSR1);
+	for (i = 0; i < 100 && !buf[0]; i++)
+		fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(strstr(buf, " io ") && strstr(buf, "wait"));
+	fail_unless(!ml_signal_stop(&sig));
+	fclose(fp);
+
+	/* Read by another thread while the loop writes */
+	fail_unless(!ml_trace_init(&ctx, 16));
+	fail_unless(!pthread_create(&tid, NULL, reader, &ctx));
+	for (i = 0; i < ROUNDS; i++) {
+		fail_unless(write(p[1], "x", 1) == 1);
+		fail_unless(!ml_run(&ctx, STEP));
+	}
+	done = 1;
+	pthread_join(tid, NULL);
+	fail_unless(bad == 0);
+
+	/* Disabled */
+	fail_unless(!ml_trace_init(&ctx, 0));
+	fail_unless(ml_trace_read(&ctx, rec, 64) < 0 && errno == ENOENT);
+	fail_unless(ml_trace_dump(&ctx, stderr) && errno == ENOENT);
+
+	fail_unless(!ml_exit(&ctx));
+	close(p[0]);
+	close(p[1]);
+}
+
+int main(void)
+{
+	run(0);
+	run(MINILOOP_IO_URING);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,162 @@
+/* Verifies batched datagram sockets, with and without GRO/GSO
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define STEP  (MINILOOP_ONCE | MINILOOP_NONBLOCK)
+#define COUNT 200
+#define SIZE  1000
+
+static ml_udp_t tx, rx;
+static int received, calls, bad, errors, err, no_gso;
+
+/* Overrides the C library, as a kernel without UDP_SEGMENT */
+int getsockopt(int sd, int level, int name, void *val, socklen_t *len)
+{
+	if (no_gso && level == SOL_UDP && name == UDP_SEGMENT) {
+		errno = ENOPROTOOPT;
+		return -1;
+	}
+
+	return syscall(SYS_getsockopt, sd, level, name, val, len);
+}
+
+static void rx_cb(ml_udp_t *u, void *arg, ml_udp_msg_t *msgs, int num)
+{
+	int i;
+
+	fail_unless(num > 0);
+	calls++;
+	for (i = 0; i < num; i++) {
+		unsigned char *p = msgs[i].data;
+
+		if (msgs[i].len != SIZE || p[0] != received % 256 || p[SIZE - 1] != received % 256)
+			bad++;
+		if (msgs[i].addrlen != sizeof(struct sockaddr_in))
+			bad++;
+		received++;
+	}
+}
+
+static void tx_cb(ml_udp_t *u, void *arg, ml_udp_msg_t *msgs, int num)
+{
+	fail_unless(num == -1);
+	errors++;
+	err = errno;
+}
+
+static int open_udp(struct sockaddr_in *sin)
+{
+	socklen_t len = sizeof(*sin);
+	int sd, val = 1024 * 1024;
+
+	sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	fail_unless(sd >= 0);
+	setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fail_unless(!bind(sd, (struct sockaddr *)sin, sizeof(*sin)));
+	fail_unless(!getsockname(sd, (struct sockaddr *)sin, &len));
+
+	return sd;
+}
+
+static void burst(ml_ctx_t *ctx, struct sockaddr_in *to)
+{
+	unsigned char buf[SIZE];
+	int i, tries = 0;
+
+	received = calls = 0;
+	for (i = 0; i < COUNT; i++) {
+		memset(buf, i % 256, sizeof(buf));
+		fail_unless(!ml_udp_send(&tx, buf, sizeof(buf), (struct sockaddr *)to, sizeof(*to)));
+	}
+
+	while (received < COUNT && tries++ < 1000)
+		fail_unless(!ml_run(ctx, STEP));
+	fail_unless(received == COUNT && bad == 0);
+
+	/* Batched, not one callback per datagram */
+	fail_unless(calls < COUNT / 4);
+}
+
+static void run(int flags)
+{
+	struct sockaddr_in a, b;
+	ml_ctx_t ctx;
+	char buf[SIZE + 1] = { 0 };
+	int sa, sb, tries = 0;
+
+	sa = open_udp(&a);
+	sb = open_udp(&b);
+
+	errors = bad = 0;
+	fail_unless(!ml_init(&ctx, 64));
+	fail_unless(!ml_udp_init(&ctx, &tx, tx_cb, NULL, sa, 0, SIZE, flags));
+	fail_unless(!ml_udp_init(&ctx, &rx, rx_cb, NULL, sb, 0, SIZE, flags));
+	fail_unless(!(tx.flags & MINILOOP_UDP_GSO) == (no_gso || !(flags & MINILOOP_UDP_GSO)));
+
+	/* More than fits in the queue, partly sent right away */
+	burst(&ctx, &b);
+	fail_unless(errors == 0);
+
+	fail_unless(ml_udp_send(&tx, buf, sizeof(buf), (struct sockaddr *)&b, sizeof(b)) && errno == EMSGSIZE);
+
+	/* Refused by the peer, reported, and the watcher keeps going */
+	fail_unless(!ml_udp_close(&rx, NULL));
+	close(sb);
+	fail_unless(!connect(sa, (struct sockaddr *)&b, sizeof(b)));
+	fail_unless(!ml_udp_send(&tx, buf, 10, NULL, 0));
+	while (!errors && tries++ < 1000)
+		fail_unless(!ml_run(&ctx, STEP));
+	fail_unless(err == ECONNREFUSED);
+	fail_unless(ml_udp_active(&tx));
+
+	fail_unless(!ml_udp_close(&tx, NULL));
+	close(sa);
+	fail_unless(!ml_exit(&ctx));
+}
+
+int main(void)
+{
+	run(0);
+	run(MINILOOP_UDP_GRO | MINILOOP_UDP_GSO);
+
+	/* Not supported, sent one datagram at a time */
+	no_gso = 1;
+	run(MINILOOP_UDP_GRO | MINILOOP_UDP_GSO);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
@@ -0,0 +1,106 @@
+/* Verifies the io_uring backend, %MINILOOP_IO_URING
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "check.h"
+#include <errno.h>
+
+#define LAPS 5
+
+static int level[2], oneshot[2];
+static int reads, shots, posts, laps;
+static ml_t reader, shooter, writer, event, deadline;
+
+/* Read one byte at a time, level triggered polls must keep firing */
+static void reader_cb(ml_t *w, void *arg, int events)
+{
+	char ch;
+
+	fail_unless(events & MINILOOP_READ);
+	fail_unless(read(w->fd, &ch, 1) == 1);
+	reads++;
+}
+
+/* Only fires again after being rearmed */
+static void shooter_cb(ml_t *w, void *arg, int events)
+{
+	shots++;
+}
+
+static void writer_cb(ml_t *w, void *arg, int events)
+{
+	fail_unless(write(level[1], "abc", 3) == 3);
+	fail_unless(write(oneshot[1], "x", 1) == 1);
+	fail_unless(ml_event_post(&event) == 0);
+
+	/* Reenable the oneshot watcher, from the second lap on */
+	if (laps++)
+		ml_io_set(&shooter, oneshot[0], MINILOOP_READ | MINILOOP_ONESHOT);
+
+	if (laps == LAPS)
+		ml_timer_stop(w);
+}
+
+static void event_cb(ml_t *w, void *arg, int events)
+{
+	posts++;
+}
+
+static void deadline_cb(ml_t *w, void *arg, int events)
+{
+	ml_exit(w->ctx);
+}
+
+int main(void)
+{
+	ml_ctx_t ctx;
+
+	if (ml_init1(&ctx, 10, MINILOOP_IO_URING)) {
+		fprintf(stderr, "io_uring not available (%s), skipping.\n", strerror(errno));
+		return 0;
+	}
+
+	if (pipe(level) || pipe(oneshot))
+		return 1;
+
+	fail_unless(ml_io_init(&ctx, &reader, reader_cb, NULL, level[0], MINILOOP_READ) == 0);
+	fail_unless(ml_io_init(&ctx, &shooter, shooter_cb, NULL, oneshot[0], MINILOOP_READ | MINILOOP_ONESHOT) == 0);
+	fail_unless(ml_event_init(&ctx, &event, event_cb, NULL) == 0);
+	fail_unless(ml_timer_init(&ctx, &writer, writer_cb, NULL, 10, 10) == 0);
+	fail_unless(ml_timer_init(&ctx, &deadline, deadline_cb, NULL, 200, 0) == 0);
+
+	/* Implied %MINILOOP_TIMER_HEAP */
+	fail_unless(writer.fd == -1);
+
+	fail_unless(ml_run(&ctx, 0) == 0);
+
+	fail_unless(reads == 3 * LAPS);
+	fail_unless(shots == LAPS);
+	fail_unless(posts == LAPS);
+
+	return 0;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */